@@ -180,6 +180,23 @@ bool char_needs_shift(char c)
     }
 }
 
+// Wait for the endpoint and retry: a dropped release leaves the key held down
+#define HID_REPORT_TRIES 3
+#define HID_REPORT_WAIT_MS 20
+
+static bool hid_send_report(uint8_t modifier, uint8_t *keycode_array)
+{
+    for (int attempt = 0; attempt < HID_REPORT_TRIES && tud_mounted(); attempt++) {
+        for (int waited = 0; waited < HID_REPORT_WAIT_MS && !tud_hid_ready(); waited++) {
+            vTaskDelay(pdMS_TO_TICKS(1));
+        }
+        if (tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, modifier, keycode_array)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 // Send HID keycode (for special keys that don't need character mapping)
 void send_keycode(uint8_t keycode)
 {
@@ -188,11 +205,11 @@ void send_keycode(uint8_t keycode)
         keycode_array[0] = keycode;
 
         // Send key press
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, keycode_array);
+        hid_send_report(0, keycode_array);
         vTaskDelay(pdMS_TO_TICKS(50));
 
         // Send key release
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, NULL);
+        hid_send_report(0, NULL);
         vTaskDelay(pdMS_TO_TICKS(10));
     }
 }
@@ -235,9 +252,9 @@ void send_key(char c)
             // Send the [ character first - send it directly without recursion
             uint8_t keycode_array[6] = {0};
             keycode_array[0] = char_to_hid_keycode('[');
-            tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, keycode_array);
+            hid_send_report(0, keycode_array);
             vTaskDelay(pdMS_TO_TICKS(50));
-            tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, NULL);
+            hid_send_report(0, NULL);
             vTaskDelay(pdMS_TO_TICKS(10));
             prev_char = 0;
         }
@@ -260,11 +277,11 @@ void send_key(char c)
         }
 
         // Send key press
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, modifier, keycode_array);
+        hid_send_report(modifier, keycode_array);
         vTaskDelay(pdMS_TO_TICKS(50));
 
         // Send key release
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, NULL);
+        hid_send_report(0, NULL);
         vTaskDelay(pdMS_TO_TICKS(10));
     }
 }
@@ -0,0 +1,261 @@
+/*
+ * FAT16 volume generator, see fat_volume.h.
+ *
+ * Layout: boot sector, FAT 1, FAT 2, a 512-entry root directory, then the
+ * data area. Every sector before the data area is rebuilt into a scratch
+ * buffer when it is read: a FAT sector by walking the (at most 16) files'
+ * cluster runs, a directory sector from the file list. Hosts read these a
+ * few times per mount, so the cost does not matter next to file data,
+ * which goes straight from the read callback to the USB buffer.
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include "fat_volume.h"
+
+#define FV_CLUSTER_BYTES (FV_CLUSTER_SECTORS * FV_SECTOR_SIZE)
+#define FV_ROOT_SECTORS (FV_ROOT_ENTRIES * 32 / FV_SECTOR_SIZE)
+#define FV_FAT_START 1                  // After the boot sector
+#define FV_DATE ((2024 - 1980) << 9 | 1 << 5 | 1)   // No wall clock: 2024-01-01 00:00
+
+#define FV_ATTR_READ_ONLY 0x01
+#define FV_ATTR_VOLUME_ID 0x08
+#define FV_ATTR_ARCHIVE 0x20
+#define FV_LOWER_BASE 0x08
+#define FV_LOWER_EXT 0x10
+
+static void put16(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static uint32_t fv_clusters(uint32_t size)
+{
+    return (size + FV_CLUSTER_BYTES - 1) / FV_CLUSTER_BYTES;
+}
+
+bool fv_init(fat_volume_t *v, uint32_t sectors, const char *label, uint32_t serial, fv_read_fn read)
+{
+    memset(v, 0, sizeof(*v));
+    if (sectors <= FV_FAT_START + FV_ROOT_SECTORS) {
+        return false;
+    }
+    // Size the FATs for the clusters there would be without them; a few
+    // entries at the end go unused
+    uint32_t most = (sectors - FV_FAT_START - FV_ROOT_SECTORS) / FV_CLUSTER_SECTORS;
+    v->fat_sectors = ((most + 2) * 2 + FV_SECTOR_SIZE - 1) / FV_SECTOR_SIZE;
+    v->data_start = FV_FAT_START + 2 * v->fat_sectors + FV_ROOT_SECTORS;
+    if (sectors <= v->data_start) {
+        return false;
+    }
+    v->clusters = (sectors - v->data_start) / FV_CLUSTER_SECTORS;
+    if (v->clusters < 4085 || v->clusters >= 65525) {
+        return false;                   // Hosts would take it for FAT12 or FAT32
+    }
+    v->sectors = sectors;
+    v->serial = serial;
+    v->read = read;
+    v->next_cluster = 2;
+    memset(v->label, ' ', sizeof(v->label));
+    for (int i = 0; i < sizeof(v->label) && label[i]; i++) {
+        v->label[i] = toupper((unsigned char)label[i]);
+    }
+    return true;
+}
+
+bool fv_name(const char *name, uint8_t out[11], uint8_t *case_bits)
+{
+    const char *dot = strchr(name, '.');
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    if (base == 0 || base > 8 || ext > 3 || (dot && ext == 0)) {
+        return false;
+    }
+
+    memset(out, ' ', 11);
+    *case_bits = 0;
+    for (int part = 0; part < 2; part++) {
+        const char *s = part == 0 ? name : dot + 1;
+        size_t len = part == 0 ? base : ext;
+        bool lower = false, upper = false;
+        for (size_t i = 0; i < len; i++) {
+            unsigned char c = s[i];
+            if (!isalnum(c) && c != '_' && c != '-') {
+                return false;
+            }
+            lower |= islower(c) != 0;
+            upper |= isupper(c) != 0;
+            out[(part == 0 ? 0 : 8) + i] = toupper(c);
+        }
+        if (lower && !upper) {
+            *case_bits |= part == 0 ? FV_LOWER_BASE : FV_LOWER_EXT;
+        }
+    }
+    return true;
+}
+
+fv_error_t fv_add(fat_volume_t *v, const char *name, uint32_t size, void *ctx)
+{
+    fv_file_t f = { .size = size, .ctx = ctx };
+    if (!fv_name(name, f.name, &f.case_bits)) {
+        return FV_BAD_NAME;
+    }
+    for (int i = 0; i < v->count; i++) {
+        if (memcmp(v->files[i].name, f.name, sizeof(f.name)) == 0) {
+            return FV_DUPLICATE;
+        }
+    }
+    if (v->count == FV_FILES_MAX) {
+        return FV_TOO_MANY;
+    }
+    uint32_t need = fv_clusters(size);
+    if (v->next_cluster - 2 + need > v->clusters) {
+        return FV_FULL;
+    }
+    f.cluster = need ? v->next_cluster : 0;
+    v->next_cluster += need;
+    v->files[v->count++] = f;
+    return FV_OK;
+}
+
+uint32_t fv_used(const fat_volume_t *v)
+{
+    return (v->next_cluster - 2) * FV_CLUSTER_BYTES;
+}
+
+static void fv_boot_sector(const fat_volume_t *v, uint8_t *s)
+{
+    memcpy(s, "\xEB\x3C\x90" "MSWIN4.1", 11);
+    put16(s + 11, FV_SECTOR_SIZE);
+    s[13] = FV_CLUSTER_SECTORS;
+    put16(s + 14, FV_FAT_START);        // Reserved sectors
+    s[16] = 2;                          // FATs
+    put16(s + 17, FV_ROOT_ENTRIES);
+    if (v->sectors < 0x10000) {
+        put16(s + 19, v->sectors);
+    } else {
+        put32(s + 32, v->sectors);
+    }
+    s[21] = 0xF8;                       // Fixed disk
+    put16(s + 22, v->fat_sectors);
+    put16(s + 24, 63);                  // Sectors per track and heads, for BIOS CHS only
+    put16(s + 26, 255);
+    s[36] = 0x80;                       // Drive number
+    s[38] = 0x29;                       // Serial, label and type follow
+    put32(s + 39, v->serial);
+    memcpy(s + 43, v->label, sizeof(v->label));
+    memcpy(s + 54, "FAT16   ", 8);
+    s[510] = 0x55;
+    s[511] = 0xAA;
+}
+
+// Sector n of a FAT: entries n * 256 up to the next sector's
+static void fv_fat_sector(const fat_volume_t *v, uint32_t n, uint8_t *s)
+{
+    uint32_t first = n * (FV_SECTOR_SIZE / 2);
+    uint32_t last = first + FV_SECTOR_SIZE / 2;
+
+    if (n == 0) {
+        put16(s, 0xFFF8);               // Media byte, then the reserved entry
+        put16(s + 2, 0xFFFF);
+    }
+    for (int i = 0; i < v->count; i++) {
+        const fv_file_t *f = &v->files[i];
+        uint32_t end = f->cluster + fv_clusters(f->size);
+        uint32_t c = f->cluster > first ? f->cluster : first;
+        for (; f->cluster && c < end && c < last; c++) {
+            put16(s + (c - first) * 2, c + 1 == end ? 0xFFFF : c + 1);
+        }
+    }
+}
+
+static void fv_dir_entry(uint8_t *e, const uint8_t name[11], uint8_t attr, uint8_t case_bits,
+                         uint32_t cluster, uint32_t size)
+{
+    memcpy(e, name, 11);
+    e[11] = attr;
+    e[12] = case_bits;
+    put16(e + 16, FV_DATE);             // Created
+    put16(e + 18, FV_DATE);             // Accessed
+    put16(e + 24, FV_DATE);             // Modified
+    put16(e + 26, cluster);
+    put32(e + 28, size);
+}
+
+// Sector n of the root directory: the volume label, then one entry per file
+static void fv_dir_sector(const fat_volume_t *v, uint32_t n, uint8_t *s)
+{
+    for (int i = 0; i < FV_SECTOR_SIZE / 32; i++) {
+        int entry = n * (FV_SECTOR_SIZE / 32) + i;
+        uint8_t *e = s + i * 32;
+        if (entry == 0) {
+            fv_dir_entry(e, v->label, FV_ATTR_VOLUME_ID, 0, 0, 0);
+        } else if (entry <= v->count) {
+            const fv_file_t *f = &v->files[entry - 1];
+            fv_dir_entry(e, f->name, FV_ATTR_READ_ONLY | FV_ATTR_ARCHIVE, f->case_bits, f->cluster, f->size);
+        }
+    }
+}
+
+// File data, or zeros for clusters no file uses and the slack after a file
+static bool fv_data(fat_volume_t *v, uint32_t lba, uint32_t offset, uint8_t *dst, uint32_t size)
+{
+    uint32_t cluster = (lba - v->data_start) / FV_CLUSTER_SECTORS + 2;
+    uint32_t in_cluster = (lba - v->data_start) % FV_CLUSTER_SECTORS * FV_SECTOR_SIZE + offset;
+
+    for (int i = 0; i < v->count; i++) {
+        const fv_file_t *f = &v->files[i];
+        if (!f->cluster || cluster < f->cluster || cluster >= f->cluster + fv_clusters(f->size)) {
+            continue;
+        }
+        uint32_t at = (cluster - f->cluster) * FV_CLUSTER_BYTES + in_cluster;
+        uint32_t n = at >= f->size ? 0 : f->size - at < size ? f->size - at : size;
+        if (n && !v->read(f->ctx, at, dst, n)) {
+            return false;
+        }
+        memset(dst + n, 0, size - n);
+        return true;
+    }
+    memset(dst, 0, size);
+    return true;
+}
+
+bool fv_read(fat_volume_t *v, uint32_t lba, uint32_t offset, uint8_t *dst, uint32_t size)
+{
+    lba += offset / FV_SECTOR_SIZE;
+    offset %= FV_SECTOR_SIZE;
+    while (size > 0) {
+        uint32_t n = FV_SECTOR_SIZE - offset < size ? FV_SECTOR_SIZE - offset : size;
+        if (lba >= v->sectors) {
+            return false;
+        }
+        if (lba >= v->data_start) {
+            if (!fv_data(v, lba, offset, dst, n)) {
+                return false;
+            }
+        } else {
+            uint32_t fat_end = FV_FAT_START + 2 * v->fat_sectors;
+            memset(v->scratch, 0, sizeof(v->scratch));
+            if (lba < FV_FAT_START) {
+                fv_boot_sector(v, v->scratch);
+            } else if (lba < fat_end) {
+                fv_fat_sector(v, (lba - FV_FAT_START) % v->fat_sectors, v->scratch);
+            } else {
+                fv_dir_sector(v, lba - fat_end, v->scratch);
+            }
+            memcpy(dst, v->scratch + offset, n);
+        }
+        dst += n;
+        size -= n;
+        lba++;
+        offset = 0;
+    }
+    return true;
+}
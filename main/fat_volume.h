@@ -0,0 +1,71 @@
+/*
+ * Read-only FAT16 volume for the USB payload drive, generated as the host
+ * reads it. The boot sector, both FATs and the root directory are computed
+ * from the file list sector by sector; file sectors come from a read
+ * callback. Files take contiguous clusters in the order they are added, so
+ * no metadata is ever stored.
+ *
+ * Plain C with no ESP-IDF dependencies, so tools/fat_check can run it on the
+ * host.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FV_SECTOR_SIZE 512
+#define FV_CLUSTER_SECTORS 8            // 4 KB clusters
+#define FV_ROOT_ENTRIES 512
+#define FV_FILES_MAX 16
+#define FV_NAME_MAX 13                  // "NAME.EXT" and the NUL
+
+// Copy size bytes of a file, starting at offset, to dst; false on a read error
+typedef bool (*fv_read_fn)(void *ctx, uint32_t offset, uint8_t *dst, uint32_t size);
+
+typedef enum {
+    FV_OK = 0,
+    FV_BAD_NAME,                        // Not an 8.3 name
+    FV_DUPLICATE,
+    FV_TOO_MANY,                        // FV_FILES_MAX files already
+    FV_FULL,                            // Not enough clusters left
+} fv_error_t;
+
+typedef struct {
+    uint8_t name[11];                   // Directory entry form: "NAME    EXT"
+    uint8_t case_bits;                  // Base and/or extension shown in lower case
+    uint32_t size;
+    uint32_t cluster;                   // First cluster, 0 for an empty file
+    void *ctx;                          // Passed to the read callback
+} fv_file_t;
+
+typedef struct {
+    uint32_t sectors;
+    uint32_t fat_sectors;               // Per FAT
+    uint32_t clusters;                  // Data clusters
+    uint32_t data_start;                // First sector of cluster 2
+    uint32_t serial;
+    uint8_t label[11];
+    fv_read_fn read;
+    fv_file_t files[FV_FILES_MAX];
+    int count;
+    uint32_t next_cluster;
+    uint8_t scratch[FV_SECTOR_SIZE];    // The metadata sector being read
+} fat_volume_t;
+
+// Lay out an empty volume of `sectors` sectors. False when that gives fewer
+// or more clusters than FAT16 allows (about 16 MB to 2 GB).
+bool fv_init(fat_volume_t *v, uint32_t sectors, const char *label, uint32_t serial, fv_read_fn read);
+
+// Directory entry form of an 8.3 name; false if it is not one. Letters are
+// stored in upper case; a base or extension given all in lower case keeps
+// showing that way through the NT case bits Windows and Linux honour.
+bool fv_name(const char *name, uint8_t out[11], uint8_t *case_bits);
+
+fv_error_t fv_add(fat_volume_t *v, const char *name, uint32_t size, void *ctx);
+
+// Bytes the files occupy, cluster slack included
+uint32_t fv_used(const fat_volume_t *v);
+
+// Copy size bytes from byte `offset` of sector lba onwards (sectors may be
+// crossed). False past the end of the volume or on a file read error.
+bool fv_read(fat_volume_t *v, uint32_t lba, uint32_t offset, uint8_t *dst, uint32_t size);
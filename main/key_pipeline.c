@@ -0,0 +1,175 @@
+/*
+ * Input-to-report pipeline, see key_pipeline.h.
+ *
+ * The stages keep no state between calls except the parser (decode) and the
+ * held keys (pack), so a batch can be split anywhere. The layout is a table
+ * filled once, so map is one lookup per character instead of the switch in
+ * char_to_hid_keycode().
+ */
+
+#include <string.h>
+#ifdef ESP_PLATFORM
+#include "tinyusb.h"
+#include "class/hid/hid.h"
+#else
+#include "hid_usage.h"
+#endif
+#include "key_pipeline.h"
+
+void kp_layout_us(kp_layout_t *layout)
+{
+    layout->name = "us";
+    for (int c = 0; c < KP_LAYOUT_CHARS; c++) {
+        bool printable = c >= 0x20 && c < 0x7f;
+        layout->keycode[c] = printable ? char_to_hid_keycode(c) : 0;
+        layout->modifier[c] = printable && char_needs_shift(c) ? KEYBOARD_MODIFIER_LEFTSHIFT : 0;
+    }
+}
+
+size_t kp_decode(vt_parser_t *p, const char *in, size_t len, uint32_t at_ms, key_event_t *out)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        n += vt_feed(p, in[i], at_ms, out + n);
+    }
+    return n;
+}
+
+size_t kp_normalize(const key_event_t *in, size_t n, key_event_t *out)
+{
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        key_event_t ev = in[i];
+        if (!ev.keycode && !ev.mod_key) {
+            switch (ev.c) {
+                case '\r':
+                case '\n': ev.keycode = HID_KEY_ENTER; break;
+                case '\t': ev.keycode = HID_KEY_TAB; break;
+                case '\b':
+                case 0x7F: ev.keycode = HID_KEY_BACKSPACE; break;
+                case 0x1B: ev.keycode = HID_KEY_ESCAPE; break;
+                default:
+                    if ((unsigned char)ev.c < 0x20) {
+                        continue;
+                    }
+                    break;
+            }
+        }
+        out[written++] = ev;
+    }
+    return written;
+}
+
+size_t kp_map(const kp_layout_t *layout, const key_event_t *in, size_t n, key_event_t *out)
+{
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        key_event_t ev = in[i];
+        if (!ev.keycode && !ev.mod_key) {
+            unsigned char c = ev.c;
+            if (c >= KP_LAYOUT_CHARS || !layout->keycode[c]) {
+                continue;
+            }
+            ev.keycode = layout->keycode[c];
+            ev.modifier |= layout->modifier[c];
+        }
+        out[written++] = ev;
+    }
+    return written;
+}
+
+size_t kp_plan(const key_event_t *in, size_t n, kp_stroke_t *out)
+{
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        const key_event_t *ev = &in[i];
+        uint8_t action = ev->type == KEY_TAP ? KP_TAP : ev->type == KEY_RELEASE ? KP_RELEASE : KP_PRESS;
+        if (ev->mod_key) {
+            out[written++] = (kp_stroke_t){ .modifier = ev->mod_key, .action = action };
+        } else if (ev->keycode) {
+            out[written++] = (kp_stroke_t){ .keycode = ev->keycode, .modifier = ev->modifier, .action = action };
+        }
+    }
+    return written;
+}
+
+static int kp_held_slot(const kp_packer_t *packer, uint8_t keycode)
+{
+    for (int i = 0; i < sizeof(packer->keys); i++) {
+        if (packer->keys[i] == keycode) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The held state, plus `key` with `modifier` when key is not 0
+static kp_report_t kp_state(const kp_packer_t *packer, uint8_t key, uint8_t modifier, uint8_t kind)
+{
+    kp_report_t r = { .modifier = packer->modifier | packer->key_modifier, .kind = kind };
+    memcpy(r.keys, packer->keys, sizeof(r.keys));
+    if (key) {
+        int slot = kp_held_slot(packer, 0);
+        r.keys[slot >= 0 ? slot : sizeof(r.keys) - 1] = key;
+        r.modifier |= modifier;
+    }
+    return r;
+}
+
+size_t kp_pack(kp_packer_t *packer, const kp_stroke_t *in, size_t n, kp_report_t *out)
+{
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        const kp_stroke_t *s = &in[i];
+        if (s->action == KP_TAP && !packer->keys[0] && !packer->modifier) {
+            // Typed text: nothing else is down
+            out[written++] = (kp_report_t){ .modifier = s->modifier, .keys = { s->keycode }, .kind = KP_REPORT_DOWN };
+            out[written++] = (kp_report_t){ .kind = KP_REPORT_UP };
+            continue;
+        }
+        if (s->action == KP_TAP) {
+            out[written++] = kp_state(packer, s->keycode, s->modifier, KP_REPORT_DOWN);
+            out[written++] = kp_state(packer, 0, 0, KP_REPORT_UP);
+            continue;
+        }
+
+        bool changed = false;
+        if (!s->keycode) {
+            uint8_t modifier = s->action == KP_PRESS ? packer->modifier | s->modifier : packer->modifier & ~s->modifier;
+            changed = modifier != packer->modifier;
+            packer->modifier = modifier;
+        } else if (s->action == KP_PRESS) {
+            int free_slot = kp_held_slot(packer, 0);
+            changed = packer->key_modifier != s->modifier;
+            if (kp_held_slot(packer, s->keycode) < 0 && free_slot >= 0) {
+                packer->keys[free_slot] = s->keycode;
+                changed = true;
+            }
+            packer->key_modifier = s->modifier;
+        } else {
+            int slot = kp_held_slot(packer, s->keycode);
+            if (slot >= 0) {
+                memmove(&packer->keys[slot], &packer->keys[slot + 1], sizeof(packer->keys) - slot - 1);
+                packer->keys[sizeof(packer->keys) - 1] = 0;
+                changed = true;
+            }
+            if (!packer->keys[0]) {
+                packer->key_modifier = 0;
+            }
+        }
+        if (changed) {
+            out[written++] = kp_state(packer, 0, 0, KP_REPORT_CHANGE);
+        }
+    }
+    return written;
+}
+
+size_t kp_schedule(const kp_timing_t *timing, const kp_report_t *in, size_t n, kp_report_t *out)
+{
+    for (size_t i = 0; i < n; i++) {
+        out[i] = in[i];
+        out[i].delay_ms = in[i].kind == KP_REPORT_DOWN ? timing->hold_ms :
+                          in[i].kind == KP_REPORT_UP ? timing->gap_ms : 0;
+    }
+    return n;
+}
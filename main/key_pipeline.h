@@ -0,0 +1,89 @@
+/*
+ * Input-to-report pipeline: the stages between the bytes a session or job
+ * sends and the HID reports that type them.
+ *
+ *   decode     bytes -> key_event_t              (vt_input.c)
+ *   normalize  key_event_t -> key_event_t        control characters become keys
+ *   map        key_event_t -> key_event_t        characters become keycode + modifier
+ *   plan       key_event_t -> kp_stroke_t        taps, presses and releases of keys and modifiers
+ *   pack       kp_stroke_t -> kp_report_t        the report states that carry them out
+ *   schedule   kp_report_t -> kp_report_t        how long each report stays before the next
+ *
+ * Every stage takes a batch and returns how many items it wrote. normalize,
+ * map and schedule may work in place. Plain C with no ESP-IDF dependencies,
+ * so tools/pipeline_check can check and time each stage on the host.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "vt_input.h"
+
+#define KP_LAYOUT_CHARS 128
+#define KP_REPORTS_PER_STROKE 2     // Most reports pack writes for one stroke
+
+// Printable ASCII to key and modifier; keycode 0 where the layout has no key
+typedef struct {
+    const char *name;
+    uint8_t keycode[KP_LAYOUT_CHARS];
+    uint8_t modifier[KP_LAYOUT_CHARS];
+} kp_layout_t;
+
+typedef enum {
+    KP_TAP = 0,                     // Press and release
+    KP_PRESS,                       // Goes down and stays down
+    KP_RELEASE,
+} kp_action_t;
+
+typedef struct {
+    uint8_t keycode;                // 0 for a modifier on its own
+    uint8_t modifier;
+    uint8_t action;                 // kp_action_t
+} kp_stroke_t;
+
+typedef enum {
+    KP_REPORT_DOWN = 0,             // A tap's key went down; held for hold_ms
+    KP_REPORT_UP,                   // A tap's key came up; gap_ms before the next
+    KP_REPORT_CHANGE,               // Held keys changed; sent at once
+} kp_report_kind_t;
+
+typedef struct {
+    uint8_t modifier;
+    uint8_t keys[6];
+    uint8_t kind;                   // kp_report_kind_t
+    uint16_t delay_ms;              // Set by kp_schedule()
+} kp_report_t;
+
+// Keys and modifiers pack has left down
+typedef struct {
+    uint8_t keys[6];
+    uint8_t modifier;               // Modifier keys pressed on their own
+    uint8_t key_modifier;           // Modifiers that came with the last key pressed
+} kp_packer_t;
+
+typedef struct {
+    uint16_t hold_ms;
+    uint16_t gap_ms;
+} kp_timing_t;
+
+// US layout, from char_to_hid_keycode() and char_needs_shift()
+void kp_layout_us(kp_layout_t *layout);
+
+// out needs room for len * VT_EVENTS_MAX events
+size_t kp_decode(vt_parser_t *p, const char *in, size_t len, uint32_t at_ms, key_event_t *out);
+
+// Characters with a key of their own (Enter, Tab, Backspace, Escape) become
+// that key; other control characters are dropped
+size_t kp_normalize(const key_event_t *in, size_t n, key_event_t *out);
+
+// Characters become their layout's key; those it cannot type are dropped
+size_t kp_map(const kp_layout_t *layout, const key_event_t *in, size_t n, key_event_t *out);
+
+// Mapped events to strokes; repeats of a held key are folded into its press
+size_t kp_plan(const key_event_t *in, size_t n, kp_stroke_t *out);
+
+// out needs room for n * KP_REPORTS_PER_STROKE reports
+size_t kp_pack(kp_packer_t *packer, const kp_stroke_t *in, size_t n, kp_report_t *out);
+
+size_t kp_schedule(const kp_timing_t *timing, const kp_report_t *in, size_t n, kp_report_t *out);
@@ -0,0 +1,304 @@
+/*
+ * Line editor, see line_edit.h.
+ *
+ * Typing at the end of the line and single steps of the cursor echo one or
+ * three bytes, cursor jumps a few bytes of movement; anything else redraws
+ * the line from the prompt, which is a few hundred bytes at most. Positions
+ * are worked out in rows and columns of the terminal width, so a line that
+ * wraps is redrawn from its first row. The keys are the usual readline ones:
+ * arrows, Home/End, Backspace/Delete, Ctrl-A/E/B/F, Alt-B/F by word,
+ * Ctrl-U/K/W to cut and Ctrl-Y to paste back, Up/Down and Ctrl-P/N for
+ * history, Ctrl-L to clear the screen.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#ifdef ESP_PLATFORM
+#include "tinyusb.h"
+#include "class/hid/hid.h"
+#else
+#include "hid_usage.h"
+#endif
+#include "line_edit.h"
+
+#define LE_CTRL (KEYBOARD_MODIFIER_LEFTCTRL | KEYBOARD_MODIFIER_RIGHTCTRL)
+#define LE_ALT (KEYBOARD_MODIFIER_LEFTALT | KEYBOARD_MODIFIER_RIGHTALT)
+#define LE_LETTER(c) (HID_KEY_A + ((c) - 'a'))
+
+void le_init(line_edit_t *le, const char *prompt, unsigned cols)
+{
+    memset(le, 0, sizeof(*le));
+    snprintf(le->prompt, sizeof(le->prompt), "%s", prompt);
+    le->cols = cols ? cols : LE_COLS_DEFAULT;
+}
+
+// Terminal column count from the start of the prompt to line position `at`
+static unsigned le_pos(const line_edit_t *le, uint16_t at)
+{
+    return (unsigned)strlen(le->prompt) + at;
+}
+
+// After output that left the cursor at line position `at`. A terminal that
+// has just filled its last column only wraps with the next character, so
+// move on to the next row now; the row count then always holds.
+static size_t le_wrapped(line_edit_t *le, uint16_t at, char *out)
+{
+    unsigned pos = le_pos(le, at);
+    le->row = pos / le->cols;
+    return pos > 0 && pos % le->cols == 0 ? (size_t)sprintf(out, "\r\n") : 0;
+}
+
+// Put the cursor at line position `to`, rows first
+static size_t le_move(line_edit_t *le, uint16_t to, char *out)
+{
+    unsigned row = le_pos(le, to) / le->cols;
+    unsigned col = le_pos(le, to) % le->cols;
+    size_t n = 0;
+    if (row < le->row) {
+        n += (size_t)sprintf(out + n, "\x1b[%uA", le->row - row);
+    } else if (row > le->row) {
+        n += (size_t)sprintf(out + n, "\x1b[%uB", row - le->row);
+    }
+    out[n++] = '\r';
+    if (col > 0) {
+        n += (size_t)sprintf(out + n, "\x1b[%uC", col);
+    }
+    le->row = row;
+    le->cursor = to;
+    return n;
+}
+
+size_t le_start(line_edit_t *le, char *out)
+{
+    le->line[0] = '\0';
+    le->len = 0;
+    le->cursor = 0;
+    le->browse = le->committed;
+    size_t n = (size_t)sprintf(out, "%s", le->prompt);
+    return n + le_wrapped(le, 0, out + n);
+}
+
+// Prompt and line from the first row they take, anything below cleared,
+// cursor put back in place
+static size_t le_redraw(line_edit_t *le, char *out)
+{
+    size_t n = 0;
+    if (le->row > 0) {
+        n += (size_t)sprintf(out, "\x1b[%uA", (unsigned)le->row);
+    }
+    n += (size_t)sprintf(out + n, "\r%s%s", le->prompt, le->line);
+    n += le_wrapped(le, le->len, out + n);
+    n += (size_t)sprintf(out + n, "\x1b[J");
+    if (le->cursor < le->len) {
+        n += le_move(le, le->cursor, out + n);
+    }
+    return n;
+}
+
+static void le_set(line_edit_t *le, const char *text)
+{
+    snprintf(le->line, sizeof(le->line), "%s", text);
+    le->len = (uint16_t)strlen(le->line);
+    le->cursor = le->len;
+}
+
+// Remove [from, to) and keep it for Ctrl-Y
+static void le_cut(line_edit_t *le, uint16_t from, uint16_t to)
+{
+    memcpy(le->kill, le->line + from, to - from);
+    le->kill[to - from] = '\0';
+    memmove(le->line + from, le->line + to, le->len - to + 1);
+    le->len -= to - from;
+    le->cursor = from;
+}
+
+static void le_insert(line_edit_t *le, const char *text, size_t n)
+{
+    if (n > sizeof(le->line) - 1 - le->len) {
+        n = sizeof(le->line) - 1 - le->len;
+    }
+    memmove(le->line + le->cursor + n, le->line + le->cursor, le->len - le->cursor + 1);
+    memcpy(le->line + le->cursor, text, n);
+    le->len += n;
+    le->cursor += n;
+}
+
+static uint16_t le_word_left(const line_edit_t *le)
+{
+    uint16_t i = le->cursor;
+    while (i > 0 && le->line[i - 1] == ' ') {
+        i--;
+    }
+    while (i > 0 && le->line[i - 1] != ' ') {
+        i--;
+    }
+    return i;
+}
+
+static uint16_t le_word_right(const line_edit_t *le)
+{
+    uint16_t i = le->cursor;
+    while (i < le->len && le->line[i] == ' ') {
+        i++;
+    }
+    while (i < le->len && le->line[i] != ' ') {
+        i++;
+    }
+    return i;
+}
+
+// Show history line `to`, or the draft when to == committed
+static bool le_recall(line_edit_t *le, uint32_t to)
+{
+    uint32_t oldest = le->committed > LE_HISTORY ? le->committed - LE_HISTORY : 0;
+    if (to < oldest || to > le->committed || to == le->browse) {
+        return false;
+    }
+    if (le->browse == le->committed) {
+        memcpy(le->draft, le->line, sizeof(le->draft));
+    }
+    le->browse = to;
+    le_set(le, to == le->committed ? le->draft : le->history[to % LE_HISTORY]);
+    return true;
+}
+
+static void le_remember(line_edit_t *le)
+{
+    const char *last = le->committed ? le->history[(le->committed - 1) % LE_HISTORY] : "";
+    if (le->len > 0 && strcmp(last, le->line) != 0) {
+        memcpy(le->history[le->committed % LE_HISTORY], le->line, sizeof(le->line));
+        le->committed++;
+    }
+}
+
+le_result_t le_key(line_edit_t *le, const key_event_t *key, char *out, size_t *out_len)
+{
+    bool ctrl = key->modifier & LE_CTRL;
+    bool alt = key->modifier & LE_ALT;
+    uint8_t k = key->keycode;
+    char c = key->c;
+    size_t n = 0;
+    bool redraw = false;
+    bool edit = true;
+    le_result_t result = LE_EDITING;
+
+    if (!k && c == '\n' && le->after_cr) {
+        // CR LF from one Enter
+        le->after_cr = false;
+        *out_len = 0;
+        return LE_EDITING;
+    }
+    le->after_cr = !k && c == '\r';
+    le->keys++;
+
+    if (!k && (c == '\r' || c == '\n')) {
+        le_remember(le);
+        if (le->cursor < le->len) {
+            n = le_move(le, le->len, out);  // Below the whole line
+        }
+        n += (size_t)sprintf(out + n, "\r\n");
+        result = LE_COMMIT;
+        edit = false;
+    } else if (!k && c >= 0x20 && c < 0x7f) {
+        if (le->len + 1 >= sizeof(le->line)) {
+            out[n++] = '\a';
+        } else if (le->cursor == le->len) {
+            le_insert(le, &c, 1);
+            out[n++] = c;
+            n += le_wrapped(le, le->cursor, out + n);
+        } else {
+            le_insert(le, &c, 1);
+            redraw = true;
+        }
+        edit = false;
+    } else if (k == HID_KEY_BACKSPACE || (ctrl && k == LE_LETTER('h'))) {
+        if (le->cursor == 0) {
+            out[n++] = '\a';
+        } else if (le->cursor == le->len) {
+            le->line[--le->len] = '\0';
+            if (le_pos(le, le->cursor) % le->cols != 0) {
+                le->cursor--;
+                n = (size_t)sprintf(out, "\b \b");
+            } else {
+                // Back over a row boundary, where \b does not go
+                n = le_move(le, le->cursor - 1, out);
+                n += (size_t)sprintf(out + n, "\x1b[K");
+            }
+        } else {
+            memmove(le->line + le->cursor - 1, le->line + le->cursor, le->len - le->cursor + 1);
+            le->len--;
+            le->cursor--;
+            redraw = true;
+        }
+    } else if (ctrl && k == LE_LETTER('d') && le->len == 0) {
+        n = (size_t)sprintf(out, "\r\n");
+        result = LE_EOF;
+        edit = false;
+    } else if (k == HID_KEY_DELETE || (ctrl && k == LE_LETTER('d'))) {
+        if (le->cursor < le->len) {
+            memmove(le->line + le->cursor, le->line + le->cursor + 1, le->len - le->cursor);
+            le->len--;
+            redraw = true;
+        }
+    } else if (ctrl && k == LE_LETTER('c')) {
+        if (le->cursor < le->len) {
+            n = le_move(le, le->len, out);
+        }
+        n += (size_t)sprintf(out + n, "^C\r\n");
+        result = LE_CANCEL;
+    } else if (k == HID_KEY_ARROW_LEFT || (ctrl && k == LE_LETTER('b'))) {
+        if (le->cursor > 0 && le_pos(le, le->cursor) % le->cols != 0) {
+            le->cursor--;
+            out[n++] = '\b';
+        } else if (le->cursor > 0) {
+            n = le_move(le, le->cursor - 1, out);
+        }
+    } else if (k == HID_KEY_ARROW_RIGHT || (ctrl && k == LE_LETTER('f'))) {
+        if (le->cursor < le->len) {
+            out[n++] = le->line[le->cursor++];
+            n += le_wrapped(le, le->cursor, out + n);
+        }
+    } else if (k == HID_KEY_HOME || (ctrl && k == LE_LETTER('a'))) {
+        n = le_move(le, 0, out);
+    } else if (k == HID_KEY_END || (ctrl && k == LE_LETTER('e'))) {
+        n = le_move(le, le->len, out);
+    } else if (alt && k == LE_LETTER('b')) {
+        n = le_move(le, le_word_left(le), out);
+    } else if (alt && k == LE_LETTER('f')) {
+        n = le_move(le, le_word_right(le), out);
+    } else if (ctrl && k == LE_LETTER('u')) {
+        le_cut(le, 0, le->cursor);
+        redraw = true;
+    } else if (ctrl && k == LE_LETTER('k')) {
+        le_cut(le, le->cursor, le->len);
+        redraw = true;
+    } else if (ctrl && k == LE_LETTER('w')) {
+        le_cut(le, le_word_left(le), le->cursor);
+        redraw = true;
+    } else if (ctrl && k == LE_LETTER('y')) {
+        le_insert(le, le->kill, strlen(le->kill));
+        redraw = true;
+    } else if (k == HID_KEY_ARROW_UP || (ctrl && k == LE_LETTER('p'))) {
+        redraw = le->browse > 0 && le_recall(le, le->browse - 1);
+    } else if (k == HID_KEY_ARROW_DOWN || (ctrl && k == LE_LETTER('n'))) {
+        redraw = le_recall(le, le->browse + 1);
+    } else if (ctrl && k == LE_LETTER('l')) {
+        n = (size_t)sprintf(out, "\x1b[H\x1b[2J");
+        le->row = 0;
+        redraw = true;
+        edit = false;
+    } else {
+        // Tab, function keys and other chords have no meaning in a line
+        out[n++] = '\a';
+        edit = false;
+    }
+
+    if (redraw) {
+        n += le_redraw(le, out + n);
+    }
+    if (edit) {
+        le->edits++;
+    }
+    *out_len = n;
+    return result;
+}
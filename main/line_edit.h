@@ -0,0 +1,56 @@
+/*
+ * Line editor for `line` sessions: readline-style editing of one line on the
+ * device, echoed to the SSH client only. Nothing reaches USB until the line
+ * is committed with Enter, so corrections made over a slow link cost no
+ * keystrokes on the target.
+ *
+ * Takes key events from vt_input.c and writes the terminal output that shows
+ * the edit. A line longer than the terminal is wide wraps onto further rows,
+ * and the editor keeps track of the row the cursor is on. Plain C with no
+ * ESP-IDF dependencies, so tools/line_check can run it on the host.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "vt_input.h"
+
+#define LE_LINE_MAX 256                 // Including the terminating NUL
+#define LE_HISTORY 16
+#define LE_PROMPT_MAX 16
+#define LE_COLS_DEFAULT 80              // When the client did not say how wide it is
+#define LE_OUT_MAX (LE_PROMPT_MAX + LE_LINE_MAX + 48)   // Most output one key writes
+
+typedef enum {
+    LE_EDITING = 0,
+    LE_COMMIT,                          // Enter: the line is in le->line
+    LE_CANCEL,                          // Ctrl-C: the line was dropped
+    LE_EOF,                             // Ctrl-D on an empty line
+} le_result_t;
+
+typedef struct {
+    char prompt[LE_PROMPT_MAX];
+    char line[LE_LINE_MAX];
+    uint16_t len;
+    uint16_t cursor;
+    uint16_t cols;                      // Terminal width
+    uint16_t row;                       // Terminal row of the cursor, 0 for the prompt's
+    bool after_cr;                      // The last key was CR, so an LF is part of it
+    char history[LE_HISTORY][LE_LINE_MAX];
+    uint32_t committed;                 // Lines ever added to history; the last LE_HISTORY are kept
+    uint32_t browse;                    // History line shown, == committed while editing a new one
+    char draft[LE_LINE_MAX];            // The new line, while browsing history
+    char kill[LE_LINE_MAX];             // Text the last Ctrl-U/K/W removed, for Ctrl-Y
+    uint32_t keys;                      // Key events taken, Enter included
+    uint32_t edits;                     // Of those, ones that deleted, moved or recalled
+} line_edit_t;
+
+// cols is the terminal width from the client's pty request, 0 if unknown
+void le_init(line_edit_t *le, const char *prompt, unsigned cols);
+
+// Start an empty line; writes the prompt to out and returns its length
+size_t le_start(line_edit_t *le, char *out);
+
+// Take one key; out (room for LE_OUT_MAX) gets the echo, *out_len its length
+le_result_t le_key(line_edit_t *le, const key_event_t *key, char *out, size_t *out_len);
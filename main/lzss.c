@@ -0,0 +1,197 @@
+/*
+ * LZSS codec, see lzss.h.
+ *
+ * The encoder is greedy, with hash chains over three-byte prefixes cut off
+ * after LZ_MAX_CHAIN candidates. It runs once per upload, so it favours a
+ * small, bounded workspace over the last few percent of ratio.
+ */
+
+#include <string.h>
+#include "lzss.h"
+
+#define LZ_WINDOW_MASK (LZ_WINDOW_SIZE - 1)
+#define LZ_MAX_CHAIN 32
+
+typedef struct {
+    uint8_t *out;
+    uint32_t size;
+    uint32_t pos;
+    uint32_t bits;
+    int count;
+    bool full;
+} lz_writer_t;
+
+static void lz_put(lz_writer_t *w, uint32_t value, int count)
+{
+    w->bits = w->bits << count | value;
+    w->count += count;
+    while (w->count >= 8) {
+        w->count -= 8;
+        if (w->pos >= w->size) {
+            w->full = true;
+            return;
+        }
+        w->out[w->pos++] = w->bits >> w->count;
+    }
+}
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u >> (32 - LZ_HASH_BITS);
+}
+
+static void lz_insert(lz_encoder_t *enc, const uint8_t *in, uint32_t pos, uint32_t size)
+{
+    if (pos + LZ_MIN_MATCH > size) {
+        return;
+    }
+    uint32_t h = lz_hash(in + pos);
+    int32_t last = enc->head[h];
+    enc->prev[pos & LZ_WINDOW_MASK] = last >= 0 && pos - last <= LZ_WINDOW_SIZE ? pos - last : 0;
+    enc->head[h] = pos;
+}
+
+uint32_t lz_compress(lz_encoder_t *enc, const uint8_t *in, uint32_t size, uint8_t *out, uint32_t out_size)
+{
+    lz_writer_t w = { .out = out, .size = out_size };
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) {
+        enc->head[i] = -1;
+    }
+
+    uint32_t pos = 0;
+    while (pos < size && !w.full) {
+        uint32_t best_len = 0, best_dist = 0;
+        if (pos + LZ_MIN_MATCH <= size) {
+            uint32_t limit = size - pos < LZ_MAX_MATCH ? size - pos : LZ_MAX_MATCH;
+            int32_t cand = enc->head[lz_hash(in + pos)];
+            for (int chain = 0; cand >= 0 && pos - cand <= LZ_WINDOW_SIZE && chain < LZ_MAX_CHAIN; chain++) {
+                uint32_t len = 0;
+                while (len < limit && in[cand + len] == in[pos + len]) {
+                    len++;
+                }
+                if (len > best_len) {
+                    best_len = len;
+                    best_dist = pos - cand;
+                    if (len == limit) {
+                        break;
+                    }
+                }
+                uint16_t back = enc->prev[cand & LZ_WINDOW_MASK];
+                if (back == 0) {
+                    break;
+                }
+                cand -= back;
+            }
+        }
+
+        if (best_len >= LZ_MIN_MATCH) {
+            lz_put(&w, 0, 1);
+            lz_put(&w, best_dist - 1, LZ_WINDOW_BITS);
+            lz_put(&w, best_len - LZ_MIN_MATCH, LZ_LENGTH_BITS);
+        } else {
+            best_len = 1;
+            lz_put(&w, 0x100 | in[pos], 9);
+        }
+        for (uint32_t end = pos + best_len; pos < end; pos++) {
+            lz_insert(enc, in, pos, size);
+        }
+    }
+
+    if (w.count > 0) {
+        lz_put(&w, 0, 8 - w.count);
+    }
+    return w.full ? 0 : w.pos;
+}
+
+void lz_decoder_init(lz_decoder_t *d, const uint8_t *in, uint32_t in_size, uint32_t size)
+{
+    d->in = in;
+    d->in_size = in_size;
+    d->in_pos = 0;
+    d->size = size;
+    d->out_pos = 0;
+    d->copy_dist = 0;
+    d->copy_left = 0;
+    d->bits = 0;
+    d->bit_count = 0;
+}
+
+static int lz_get(lz_decoder_t *d, int count)
+{
+    int value = 0;
+    while (count--) {
+        if (d->bit_count == 0) {
+            if (d->in_pos >= d->in_size) {
+                return -1;
+            }
+            d->bits = d->in[d->in_pos++];
+            d->bit_count = 8;
+        }
+        d->bit_count--;
+        value = value << 1 | (d->bits >> d->bit_count & 1);
+    }
+    return value;
+}
+
+int lz_decode(lz_decoder_t *d)
+{
+    if (d->out_pos >= d->size) {
+        return -1;
+    }
+
+    int c;
+    if (d->copy_left == 0) {
+        int tag = lz_get(d, 1);
+        if (tag < 0) {
+            return -1;
+        }
+        if (tag) {
+            c = lz_get(d, 8);
+            if (c < 0) {
+                return -1;
+            }
+            d->window[d->out_pos++ & LZ_WINDOW_MASK] = c;
+            return c;
+        }
+        int dist = lz_get(d, LZ_WINDOW_BITS);
+        int len = lz_get(d, LZ_LENGTH_BITS);
+        if (dist < 0 || len < 0 || (uint32_t)dist >= d->out_pos) {
+            return -1;
+        }
+        d->copy_dist = dist + 1;
+        d->copy_left = len + LZ_MIN_MATCH;
+    }
+    c = d->window[(d->out_pos - d->copy_dist) & LZ_WINDOW_MASK];
+    d->copy_left--;
+    d->window[d->out_pos++ & LZ_WINDOW_MASK] = c;
+    return c;
+}
+
+int lz_byte_at(lz_decoder_t *d, uint32_t offset)
+{
+    if (offset >= d->size) {
+        return -1;
+    }
+    if (offset < d->out_pos) {
+        if (d->out_pos - offset <= LZ_WINDOW_SIZE) {
+            return d->window[offset & LZ_WINDOW_MASK];
+        }
+        lz_decoder_init(d, d->in, d->in_size, d->size);
+    }
+    int c = -1;
+    while (d->out_pos <= offset) {
+        c = lz_decode(d);
+        if (c < 0) {
+            break;
+        }
+    }
+    return c;
+}
+
+bool lz_check(const uint8_t *in, uint32_t in_size, uint32_t size, lz_decoder_t *scratch)
+{
+    lz_decoder_init(scratch, in, in_size, size);
+    while (lz_decode(scratch) >= 0) {
+    }
+    return scratch->out_pos == size;
+}
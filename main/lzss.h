@@ -0,0 +1,67 @@
+/*
+ * LZSS codec for payloads kept on flash and in memory until they are typed:
+ * spooled jobs and stored templates.
+ *
+ * The stream is a sequence of bits, most significant first. A 1 bit and
+ * 8 bits is a literal byte. A 0 bit, LZ_WINDOW_BITS of distance - 1 and
+ * LZ_LENGTH_BITS of length - LZ_MIN_MATCH copies from the bytes already
+ * decoded. The plain size is stored next to the stream, not in it.
+ *
+ * The decoder needs the window and a few bytes of state, whatever the
+ * payload size, and produces one byte at a time. Plain C with no ESP-IDF
+ * dependencies.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LZ_WINDOW_BITS 12
+#define LZ_WINDOW_SIZE (1 << LZ_WINDOW_BITS)           // 4 KB
+#define LZ_LENGTH_BITS 4
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + (1 << LZ_LENGTH_BITS) - 1)
+#define LZ_HASH_BITS 10
+
+// Files that start with this header hold a stream; anything else is plain
+#define LZ_MAGIC 0x315a4c53                            // "SLZ1"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;                  // Plain size
+} lz_header_t;
+
+typedef struct {
+    const uint8_t *in;
+    uint32_t in_size;
+    uint32_t in_pos;
+    uint32_t size;                  // Plain size
+    uint32_t out_pos;               // Plain bytes decoded so far
+    uint16_t copy_dist;
+    uint8_t copy_left;              // Bytes of the current match still to copy
+    uint8_t bits;
+    uint8_t bit_count;
+    uint8_t window[LZ_WINDOW_SIZE]; // The last LZ_WINDOW_SIZE bytes, at out_pos % LZ_WINDOW_SIZE
+} lz_decoder_t;
+
+// Match finder tables, only needed while compressing
+typedef struct {
+    int32_t head[1 << LZ_HASH_BITS];
+    uint16_t prev[LZ_WINDOW_SIZE];  // Distance back to the previous position with the same hash
+} lz_encoder_t;
+
+// Compress `size` bytes into out. Returns the stream size, or 0 when it
+// would not fit in `out_size` bytes.
+uint32_t lz_compress(lz_encoder_t *enc, const uint8_t *in, uint32_t size, uint8_t *out, uint32_t out_size);
+
+void lz_decoder_init(lz_decoder_t *d, const uint8_t *in, uint32_t in_size, uint32_t size);
+
+// Next plain byte, or -1 at the end or on a corrupt stream
+int lz_decode(lz_decoder_t *d);
+
+// Plain byte at `offset`. Reading forward or up to LZ_WINDOW_SIZE bytes
+// back is cheap; further back decodes again from the start.
+int lz_byte_at(lz_decoder_t *d, uint32_t offset);
+
+// True when the whole stream decodes to exactly `size` bytes
+bool lz_check(const uint8_t *in, uint32_t in_size, uint32_t size, lz_decoder_t *scratch);
@@ -10,14 +10,28 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "tinyusb.h"
 #include "tinyusb_default_config.h"
 #include "class/hid/hid_device.h"
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+#include "class/cdc/cdc_device.h"
+#include "esp_rom_crc.h"
+#endif
+#if CONFIG_SSH_KEYBOARD_MSC
+#include "class/msc/msc_device.h"
+#if !CFG_TUD_MSC
+#error "CONFIG_SSH_KEYBOARD_MSC needs TinyUSB's MSC class (CONFIG_TINYUSB_MSC_ENABLED)"
+#endif
+#endif
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "nvs_flash.h"
@@ -33,6 +47,26 @@
 #include <libssh/callbacks.h>
 #include "nvs.h"
 #include "nvs_flash.h"
+#include "esp_attr.h"
+#include <unistd.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "esp_spiffs.h"
+#include "esp_random.h"
+#include "esp_heap_caps.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+#include "mbedtls/md.h"
+#include "mbedtls/ecp.h"
+#ifdef MBEDTLS_CHACHAPOLY_C
+#include "mbedtls/chachapoly.h"
+#endif
+#include "vt_input.h"
+#include "lzss.h"
+#include "key_pipeline.h"
+#include "line_edit.h"
+#include "fat_volume.h"
 
 #define APP_BUTTON (GPIO_NUM_0)
 static const char *TAG = "prov_keyboard";
@@ -48,24 +82,467 @@ static EventGroupHandle_t wifi_event_group;
 #define RD_BUF_SIZE (BUF_SIZE)
 static QueueHandle_t uart0_queue;
 
-// USB HID Configuration
-#define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN)
+// Trace ring: the most recent pipeline events, kept in RTC memory that a
+// panic, watchdog or software reset leaves alone. Recording claims a slot with
+// one atomic increment and three word stores, without a lock, so any task or
+// ISR can trace. At startup the previous boot's ring is copied out for 'trace'.
+#define TRACE_EVENTS CONFIG_SSH_TRACE_EVENTS
+#define TRACE_RTC_MAGIC 0x54524331
+#define TRACE_HEAP_LOW_BYTES (24 * 1024)
+#define TRACE_SRC_LOCAL 0xff    // src of events from the UART console
+
+typedef enum {
+    TRACE_BOOT = 1,         // arg: reset reason
+    TRACE_SESSION_OPEN,     // src: client slot, arg: free heap (KB)
+    TRACE_SESSION_CLOSE,    // src: client slot, arg: free heap (KB)
+    TRACE_RECEIVE,          // src: client slot, arg: bytes read from the channel
+    TRACE_ENQUEUE,          // src: client slot, arg: bytes queued
+    TRACE_REJECT,           // src: client slot, arg: bytes dropped by a limit
+    TRACE_DEQUEUE,          // src: core, arg: events still queued (typing task took one)
+    TRACE_REPORT,           // arg: modifier << 8 | keycode, 0 for all keys up
+    TRACE_REPORT_FAIL,      // arg: modifier << 8 | keycode; host not listening
+    TRACE_JOB,              // arg: job id, started typing
+    TRACE_HEAP_LOW,         // arg: free heap (KB)
+    TRACE_ALLOC_FAIL,       // arg: requested bytes
+    TRACE_ESTOP,            // arg: 1 stopped, 0 intake resumed
+    TRACE_MEM_LEVEL,        // src: new memory level, arg: free internal heap (KB)
+    TRACE_TYPE_COUNT
+} trace_type_t;
+
+// Three words per event, so recording one is three stores
+typedef struct {
+    uint32_t seq;           // 0: slot never written
+    uint32_t at_us;         // esp_timer time, wraps after 71 minutes
+    uint32_t word;          // type << 24 | src << 16 | arg
+} trace_event_t;
+
+#if TRACE_EVENTS > 0
+typedef struct {
+    uint32_t magic;
+    trace_event_t events[TRACE_EVENTS];
+} trace_ring_t;
+
+static RTC_NOINIT_ATTR trace_ring_t trace_rtc;
+static uint32_t trace_seq = 0;          // In DRAM, where atomics work
+static trace_ring_t *trace_prev = NULL; // Previous boot's ring
+static esp_reset_reason_t trace_prev_reason;
+static int trace_prev_readers = 0;      // 'trace' commands printing trace_prev
+static bool trace_prev_evicted = false;
+static portMUX_TYPE trace_prev_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+static inline void trace(trace_type_t type, uint8_t src, uint32_t arg)
+{
+#if TRACE_EVENTS > 0
+    uint32_t seq = __atomic_add_fetch(&trace_seq, 1, __ATOMIC_RELAXED);
+    trace_event_t *e = &trace_rtc.events[seq % TRACE_EVENTS];
+    e->at_us = (uint32_t)esp_timer_get_time();
+    e->word = (uint32_t)type << 24 | (uint32_t)src << 16 | (arg > 0xffff ? 0xffff : arg);
+    e->seq = seq;
+#endif
+}
+
+static void trace_heap_check(void)
+{
+    size_t free_bytes = esp_get_free_heap_size();
+    if (free_bytes < TRACE_HEAP_LOW_BYTES) {
+        trace(TRACE_HEAP_LOW, 0, free_bytes / 1024);
+    }
+}
+
+#if TRACE_EVENTS > 0
+static void trace_alloc_failed(size_t size, uint32_t caps, const char *function_name)
+{
+    trace(TRACE_ALLOC_FAIL, 0, size);
+}
+#endif
+
+#if TRACE_EVENTS > 0
+// Free the previous boot's ring for the memory governor, unless 'trace' is
+// printing it. Returns the bytes freed.
+static size_t trace_prev_evict(void)
+{
+    trace_ring_t *ring = NULL;
+    portENTER_CRITICAL(&trace_prev_mux);
+    if (trace_prev && trace_prev_readers == 0) {
+        ring = trace_prev;
+        trace_prev = NULL;
+        trace_prev_evicted = true;
+    }
+    portEXIT_CRITICAL(&trace_prev_mux);
+    free(ring);
+    return ring ? sizeof(*ring) : 0;
+}
+#endif
+
+static void trace_init(void)
+{
+#if TRACE_EVENTS > 0
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (trace_rtc.magic == TRACE_RTC_MAGIC && reason != ESP_RST_POWERON) {
+        trace_prev = malloc(sizeof(trace_rtc));
+        if (trace_prev) {
+            memcpy(trace_prev, &trace_rtc, sizeof(trace_rtc));
+            trace_prev_reason = reason;
+        }
+    }
+    memset(&trace_rtc, 0, sizeof(trace_rtc));
+    trace_rtc.magic = TRACE_RTC_MAGIC;
+    trace(TRACE_BOOT, 0, reason);
+    heap_caps_register_failed_alloc_callback(trace_alloc_failed);
+#endif
+}
+
+// Memory governor: watches free internal heap, and PSRAM when fitted, and
+// sheds load in a fixed order as it runs short, so a big paste or one session
+// too many slows the device down instead of failing an allocation somewhere
+// inside libssh. Each level keeps the policies of the levels below it:
+//   tight     bulk channels (job uploads, sink) are read in small, paced steps
+//   low       new job uploads wait for memory; the previous boot's trace is freed
+//   critical  new connections are turned away; events and job spooling stop
+// Interactive sessions and typing are never held back. A level is left only
+// once free memory is MEM_HYSTERESIS_KB above its threshold, so it cannot flap.
+#define MEM_POLL_MS 250
+#define MEM_HYSTERESIS_KB 8
+#define MEM_HISTORY 8               // Transitions kept for 'stats'
+#define MEM_BULK_READ 64            // Bulk channel read size from tight up
+#define MEM_BULK_DELAY_MS 20        // Pause before each of those reads
+#define MEM_INTAKE_WAIT_MS 10000    // How long an upload waits for low to clear
+
+typedef enum {
+    MEM_NORMAL = 0,
+    MEM_TIGHT,
+    MEM_LOW,
+    MEM_CRITICAL,
+    MEM_LEVEL_COUNT
+} mem_level_t;
+
+static const char *const mem_level_names[MEM_LEVEL_COUNT] = { "normal", "tight", "low", "critical" };
+
+// Free internal heap below which each level applies
+static const uint32_t mem_threshold_kb[MEM_LEVEL_COUNT] = {
+    0, CONFIG_SSH_MEM_TIGHT_KB, CONFIG_SSH_MEM_LOW_KB, CONFIG_SSH_MEM_CRITICAL_KB,
+};
+
+typedef struct {
+    uint32_t at_ms;
+    uint32_t free_kb;
+    uint8_t from;
+    uint8_t to;
+} mem_transition_t;
+
+typedef struct {
+    uint32_t transitions;
+    uint32_t throttled_reads;
+    uint32_t paused_uploads;        // Uploads that had to wait for memory
+    uint32_t refused_uploads;       // ... and gave up after MEM_INTAKE_WAIT_MS
+    uint32_t refused_sessions;
+    uint32_t evicted_bytes;
+    uint32_t dropped_events;
+    mem_transition_t history[MEM_HISTORY];
+} mem_gov_t;
+
+static volatile uint8_t mem_level = MEM_NORMAL;    // mem_level_t, set by mem_gov_task()
+static mem_gov_t mem_gov;
+static portMUX_TYPE mem_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static inline void mem_count(uint32_t *counter, uint32_t n)
+{
+    portENTER_CRITICAL(&mem_mux);
+    *counter += n;
+    portEXIT_CRITICAL(&mem_mux);
+}
+
+// Event stream for `events` subscribers: job progress and USB, LED and stop
+// state changes as they happen. A producer formats its record into a small
+// ring and wakes the subscribed sessions, which send it from their own task,
+// so nothing that types or handles USB ever waits on the network. With no
+// subscriber attached, event_emit() returns before formatting anything.
+#define EVENT_RING 32
+#define EVENT_SUBSCRIBERS 3
+#define EVENT_POLL_MS 250
+#define EVENT_STALL_MS 1000     // A typing job this long without a key is stalled
+#define EVENT_PROGRESS_PCT 10   // job-progress every this many percent
+
+typedef enum {
+    EVENT_JOB_ACCEPTED = 0,
+    EVENT_JOB_STARTED,
+    EVENT_JOB_PROGRESS,
+    EVENT_JOB_STALLED,
+    EVENT_JOB_FLOWING,
+    EVENT_JOB_PAUSED,
+    EVENT_JOB_RESUMED,
+    EVENT_JOB_INTERRUPTED,
+    EVENT_JOB_DONE,
+    EVENT_JOB_ABORTED,
+    EVENT_USB,
+    EVENT_LEDS,
+    EVENT_ESTOP,
+    EVENT_MEMORY,
+    EVENT_DRIVE,
+    EVENT_TYPE_COUNT
+} event_type_t;
+
+static const char *const event_type_names[EVENT_TYPE_COUNT] = {
+    "job-accepted", "job-started", "job-progress", "job-stalled", "job-flowing", "job-paused",
+    "job-resumed", "job-interrupted", "job-done", "job-aborted", "usb", "leds", "estop",
+    "memory", "drive",
+};
+
+typedef struct {
+    uint32_t seq;
+    uint32_t at_ms;
+    uint32_t job;           // Job id, 0 for device events
+    uint8_t type;
+    char args[80];          // "key=value ..."
+} event_record_t;
+
+static event_record_t event_ring[EVENT_RING];
+static uint32_t event_seq = 0;          // Last record written
+static uint32_t event_count = 0;
+static portMUX_TYPE event_mux = portMUX_INITIALIZER_UNLOCKED;     // The ring
+static SemaphoreHandle_t event_task_lock;                           // event_tasks
+static TaskHandle_t event_tasks[EVENT_SUBSCRIBERS];
+static volatile int event_subscribers = 0;
+
+static inline bool events_on(void)
+{
+    return event_subscribers > 0;
+}
+
+static void event_emit(event_type_t type, uint32_t job, const char *fmt, ...)
+{
+    if (!events_on()) {
+        return;
+    }
+    if (mem_level >= MEM_CRITICAL && type != EVENT_MEMORY) {
+        // Sending records costs subscribers' sessions heap; keep only the level changes
+        mem_count(&mem_gov.dropped_events, 1);
+        return;
+    }
+    event_record_t rec = { .at_ms = (uint32_t)(esp_timer_get_time() / 1000), .job = job, .type = type };
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(rec.args, sizeof(rec.args), fmt, args);
+    va_end(args);
+
+    portENTER_CRITICAL(&event_mux);
+    rec.seq = ++event_seq;
+    event_ring[rec.seq % EVENT_RING] = rec;
+    event_count++;
+    portEXIT_CRITICAL(&event_mux);
+
+    // Not from inside event_mux: a notify may switch to the woken task. A
+    // subscriber takes event_task_lock to unsubscribe, so one still listed
+    // here has not been deleted.
+    xSemaphoreTake(event_task_lock, portMAX_DELAY);
+    for (int i = 0; i < EVENT_SUBSCRIBERS; i++) {
+        if (event_tasks[i]) {
+            xTaskNotifyGive(event_tasks[i]);
+        }
+    }
+    xSemaphoreGive(event_task_lock);
+}
+
+// Register the calling task for wake-ups. Returns its slot, or -1 when all
+// are taken; *next is the first record it will see.
+static int event_subscribe(uint32_t *next)
+{
+    int slot = -1;
+    xSemaphoreTake(event_task_lock, portMAX_DELAY);
+    for (int i = 0; i < EVENT_SUBSCRIBERS && slot < 0; i++) {
+        if (!event_tasks[i]) {
+            event_tasks[i] = xTaskGetCurrentTaskHandle();
+            event_subscribers++;
+            slot = i;
+        }
+    }
+    portENTER_CRITICAL(&event_mux);
+    *next = event_seq + 1;
+    portEXIT_CRITICAL(&event_mux);
+    xSemaphoreGive(event_task_lock);
+    return slot;
+}
+
+static void event_unsubscribe(int slot)
+{
+    xSemaphoreTake(event_task_lock, portMAX_DELAY);
+    event_tasks[slot] = NULL;
+    event_subscribers--;
+    xSemaphoreGive(event_task_lock);
+}
+
+// Copy out record *next and advance past it. Returns false when there is
+// nothing new; records the ring overwrote before they were read are added to *lost.
+static bool event_read(uint32_t *next, event_record_t *rec, uint32_t *lost)
+{
+    bool found = false;
+    portENTER_CRITICAL(&event_mux);
+    if (event_seq + 1 - *next > EVENT_RING) {
+        *lost += event_seq + 1 - *next - EVENT_RING;
+        *next = event_seq + 1 - EVENT_RING;
+    }
+    if (*next <= event_seq) {
+        *rec = event_ring[*next % EVENT_RING];
+        (*next)++;
+        found = true;
+    }
+    portEXIT_CRITICAL(&event_mux);
+    return found;
+}
+
+// Level for `free_kb` of internal heap when the governor is at `current`
+static mem_level_t mem_level_for(uint32_t free_kb, mem_level_t current)
+{
+    mem_level_t level = MEM_NORMAL;
+    for (int l = MEM_CRITICAL; l > MEM_NORMAL && level == MEM_NORMAL; l--) {
+        uint32_t limit = mem_threshold_kb[l] + (l <= current ? MEM_HYSTERESIS_KB : 0);
+        if (free_kb < limit) {
+            level = l;
+        }
+    }
+#if CONFIG_SPIRAM
+    // Uploads are what lands in PSRAM, so running out of it only pauses intake
+    if (level < MEM_LOW && heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0) {
+        uint32_t psram_kb = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 1024;
+        if (psram_kb < CONFIG_SSH_MEM_PSRAM_LOW_KB + (current >= MEM_LOW ? MEM_HYSTERESIS_KB : 0)) {
+            level = MEM_LOW;
+        }
+    }
+#endif
+    return level;
+}
+
+static void mem_transition(mem_level_t from, mem_level_t to, uint32_t free_kb)
+{
+    mem_transition_t t = { .at_ms = (uint32_t)(esp_timer_get_time() / 1000), .free_kb = free_kb,
+                           .from = from, .to = to };
+    portENTER_CRITICAL(&mem_mux);
+    mem_gov.history[mem_gov.transitions % MEM_HISTORY] = t;
+    mem_gov.transitions++;
+    portEXIT_CRITICAL(&mem_mux);
+    mem_level = to;
+
+    trace(TRACE_MEM_LEVEL, to, free_kb);
+    event_emit(EVENT_MEMORY, 0, "level=%s from=%s heap_kb=%lu", mem_level_names[to],
+               mem_level_names[from], (unsigned long)free_kb);
+    if (to > from) {
+        ESP_LOGW(TAG, "Memory %s (%lu KB free): shedding load", mem_level_names[to], (unsigned long)free_kb);
+    } else {
+        ESP_LOGI(TAG, "Memory %s (%lu KB free)", mem_level_names[to], (unsigned long)free_kb);
+    }
+}
+
+static void mem_gov_task(void *pvParameters)
+{
+    while (1) {
+        uint32_t free_kb = heap_caps_get_free_size(MALLOC_CAP_INTERNAL) / 1024;
+        mem_level_t from = mem_level;
+        mem_level_t to = mem_level_for(free_kb, from);
+        if (to != from) {
+            mem_transition(from, to, free_kb);
+        }
+#if TRACE_EVENTS > 0
+        // Retried each poll: 'trace' may have been printing it
+        if (mem_level >= MEM_LOW && trace_prev) {
+            mem_count(&mem_gov.evicted_bytes, trace_prev_evict());
+        }
+#endif
+        vTaskDelay(pdMS_TO_TICKS(MEM_POLL_MS));
+    }
+}
+
+static void mem_gov_init(void)
+{
+    xTaskCreate(mem_gov_task, "mem_gov", 3072, NULL, 4, NULL);
+}
+
+// Read size for the next read of a bulk channel: `size` normally, a small step
+// after a short pause from tight up. libssh re-opens the channel window only
+// as data is read, so the sender is held back instead of filling our heap.
+static int mem_bulk_read_size(int size)
+{
+    if (mem_level < MEM_TIGHT) {
+        return size;
+    }
+    mem_count(&mem_gov.throttled_reads, 1);
+    vTaskDelay(pdMS_TO_TICKS(MEM_BULK_DELAY_MS));
+    return size < MEM_BULK_READ ? size : MEM_BULK_READ;
+}
+
+// Hold a new upload until memory is no longer low. False when it still is
+// after MEM_INTAKE_WAIT_MS.
+static bool mem_intake_wait(void)
+{
+    if (mem_level < MEM_LOW) {
+        return true;
+    }
+    mem_count(&mem_gov.paused_uploads, 1);
+    int64_t deadline = esp_timer_get_time() + (int64_t)MEM_INTAKE_WAIT_MS * 1000;
+    while (mem_level >= MEM_LOW) {
+        if (esp_timer_get_time() >= deadline) {
+            mem_count(&mem_gov.refused_uploads, 1);
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(MEM_POLL_MS));
+    }
+    return true;
+}
+
+// USB HID Configuration, plus a CDC-ACM port for the delivery ack agent and
+// a mass-storage interface for the payload drive. With both, the four IN
+// endpoints (0x81-0x84) are all the S3's OTG controller has besides EP0's.
+#define HID_POLL_INTERVAL_MS 10
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+#define USB_CDC_ITF_COUNT 2
+#define USB_CDC_DESC_LEN TUD_CDC_DESC_LEN
+#else
+#define USB_CDC_ITF_COUNT 0
+#define USB_CDC_DESC_LEN 0
+#endif
+#if CONFIG_SSH_KEYBOARD_MSC
+#define USB_MSC_ITF_COUNT 1
+#define USB_MSC_DESC_LEN TUD_MSC_DESC_LEN
+#define USB_MSC_ITF (1 + USB_CDC_ITF_COUNT)
+#define USB_MSC_STR (5 + USB_CDC_ITF_COUNT / 2)
+#else
+#define USB_MSC_ITF_COUNT 0
+#define USB_MSC_DESC_LEN 0
+#endif
+#define USB_ITF_COUNT (1 + USB_CDC_ITF_COUNT + USB_MSC_ITF_COUNT)
+#define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN + USB_CDC_DESC_LEN + USB_MSC_DESC_LEN)
+
+// Boot-compatible keyboard: no report ID, so the same 8-byte report works in
+// the boot protocol BIOS/UEFI setup screens use and in report protocol
+#define HID_KBD_REPORT_ID 0
 
 const uint8_t hid_report_descriptor[] = {
-    TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(HID_ITF_PROTOCOL_KEYBOARD))
+    TUD_HID_REPORT_DESC_KEYBOARD()
 };
 
-const char *hid_string_descriptor[5] = {
+const char *hid_string_descriptor[] = {
     (char[]){0x09, 0x04},
     "ESP32-S3",
     "Provisioned Keyboard",
     "123456",
     "ESP32 Provisioned Keyboard",
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+    "ESP32 Keyboard Delivery Ack",
+#endif
+#if CONFIG_SSH_KEYBOARD_MSC
+    "ESP32 Keyboard Payload Drive",
+#endif
 };
 
 static const uint8_t hid_configuration_descriptor[] = {
-    TUD_CONFIG_DESCRIPTOR(1, 1, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
-    TUD_HID_DESCRIPTOR(0, 4, false, sizeof(hid_report_descriptor), 0x81, 16, 10),
+    TUD_CONFIG_DESCRIPTOR(1, USB_ITF_COUNT, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
+    TUD_HID_DESCRIPTOR(0, 4, HID_ITF_PROTOCOL_KEYBOARD, sizeof(hid_report_descriptor), 0x81, 16, HID_POLL_INTERVAL_MS),
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+    TUD_CDC_DESCRIPTOR(1, 5, 0x82, 8, 0x03, 0x83, 64),
+#endif
+#if CONFIG_SSH_KEYBOARD_MSC
+    TUD_MSC_DESCRIPTOR(USB_MSC_ITF, USB_MSC_STR, 0x04, 0x84, 64),
+#endif
 };
 
 // TinyUSB callbacks
@@ -79,515 +556,6279 @@ uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_t
     return 0;
 }
 
+// LED output reports from the host; the boot key watches them to tell when
+// the host's OS has taken the keyboard over
+static volatile uint32_t hid_led_reports = 0;
+static volatile uint8_t hid_leds = 0;
+
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const *buffer, uint16_t bufsize)
 {
+    if (report_type != HID_REPORT_TYPE_FEATURE && bufsize >= 1) {
+        if (buffer[0] != hid_leds) {
+            event_emit(EVENT_LEDS, 0, "num=%d caps=%d scroll=%d", !!(buffer[0] & KEYBOARD_LED_NUMLOCK),
+                       !!(buffer[0] & KEYBOARD_LED_CAPSLOCK), !!(buffer[0] & KEYBOARD_LED_SCROLLLOCK));
+        }
+        hid_leds = buffer[0];
+        hid_led_reports++;
+    }
 }
 
-// Character mapping and keyboard functions (same as before)
-uint8_t char_to_hid_keycode(char c)
-{
-    if (c >= 'a' && c <= 'z') {
-        return HID_KEY_A + (c - 'a');
-    }
-    if (c >= 'A' && c <= 'Z') {
-        return HID_KEY_A + (c - 'A');
-    }
-    if (c >= '1' && c <= '9') {
-        return HID_KEY_1 + (c - '1');
-    }
-    if (c == '0') {
-        return HID_KEY_0;
-    }
-
-    switch (c) {
-        case ' ': return HID_KEY_SPACE;
-        case '\r':
-        case '\n': return HID_KEY_ENTER;
-        case '\t': return HID_KEY_TAB;
-        case '\b':
-        case 0x7F: return HID_KEY_BACKSPACE;
-        case 0x1B: return 0;
-        case '!': return HID_KEY_1;
-        case '@': return HID_KEY_2;
-        case '#': return HID_KEY_3;
-        case '$': return HID_KEY_4;
-        case '%': return HID_KEY_5;
-        case '^': return HID_KEY_6;
-        case '&': return HID_KEY_7;
-        case '*': return HID_KEY_8;
-        case '(': return HID_KEY_9;
-        case ')': return HID_KEY_0;
-        case '-': return HID_KEY_MINUS;
-        case '=': return HID_KEY_EQUAL;
-        case '[': return HID_KEY_BRACKET_LEFT;
-        case ']': return HID_KEY_BRACKET_RIGHT;
-        case '\\': return HID_KEY_BACKSLASH;
-        case ';': return HID_KEY_SEMICOLON;
-        case '\'': return HID_KEY_APOSTROPHE;
-        case '`': return HID_KEY_GRAVE;
-        case ',': return HID_KEY_COMMA;
-        case '.': return HID_KEY_PERIOD;
-        case '/': return HID_KEY_SLASH;
-        default: return 0;
+// Key timing used by send_key(): how long a key is held and the gap after
+// its release. Set with the 'pacing' command; see pacing_for_rate().
+typedef struct {
+    const char *profile;
+    uint16_t cps;            // 0: fixed default timing
+    uint16_t hold_ms;
+    uint16_t gap_ms;
+} key_pacing_t;
+
+static const key_pacing_t key_pacing_default = { "default", 0, 50, 10 };
+static key_pacing_t key_pacing = { "default", 0, 50, 10 };
+
+// Emergency stop state; see estop_engage(). While engaged, only all-keys-up
+// reports reach the host and no input is taken.
+typedef struct {
+    volatile bool engaged;
+    volatile uint32_t press_us;     // Set by the ISR at the press, cleared once handled
+    uint32_t count;                 // Stops since boot
+    uint32_t dropped;               // Queued input bytes discarded
+    uint32_t latency_us;            // Press to all-keys-up report queued, last stop
+    uint32_t latency_max_us;
+} estop_t;
+
+static estop_t estop;
+
+// One-way latency probes: keys stamped by a client whose clock offset the
+// `latency` session measured, followed from the client's keypress through the
+// network, the input queue and the pipeline to the moment the host takes the
+// key-down report off the endpoint. The typing task arms a probe as it takes
+// the key from the queue, hid_submit() hands it to the report it sends, and
+// that report's completion ends it. Slots carry a generation, so an input
+// event left behind by a probe that timed out cannot end its successor.
+#define LAT_PROBES 16
+#define LAT_BUCKETS 104         // 128 us steps to 1 ms, then 8 per doubling to 4 s
+
+typedef enum {
+    LAT_TOTAL = 0,              // Client keypress to host read
+    LAT_NET,                    // ... to the line arriving on the device
+    LAT_QUEUE,                  // ... to the typing task taking it
+    LAT_USB,                    // ... to the host reading the key-down report
+    LAT_STAGE_COUNT
+} lat_stage_t;
+
+static const char *const lat_stage_names[LAT_STAGE_COUNT] = { "total", "net", "queue", "usb" };
+
+typedef struct {
+    bool in_use;
+    bool done;
+    uint8_t gen;                // 1..15
+    uint32_t seq;               // The client's key number
+    TaskHandle_t owner;         // Session task that reports it
+    int64_t sent_us;            // Client's stamp on the device clock
+    int64_t arrived_us;
+    int64_t dequeued_us;
+    int64_t read_us;            // Host read the key-down report; 0: no report went out
+} lat_probe_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t hist[LAT_BUCKETS];
+} lat_hist_t;
+
+static lat_probe_t lat_probes[LAT_PROBES];
+static lat_hist_t lat_hist[LAT_STAGE_COUNT];
+static uint32_t lat_unmatched = 0;      // Probes that produced no report or timed out
+static portMUX_TYPE lat_mux = portMUX_INITIALIZER_UNLOCKED;
+static volatile uint8_t lat_armed = 0;      // Probe of the key being typed
+static volatile uint8_t lat_in_flight = 0;  // Probe of the report on the endpoint
+static volatile uint16_t lat_in_flight_key; // Its modifier << 8 | first key
+
+static int lat_bucket(uint32_t us)
+{
+    if (us < 1024) {
+        return us >> 7;
     }
+    int e = 31 - __builtin_clz(us);
+    int i = 8 + (e - 10) * 8 + ((us >> (e - 3)) & 7);
+    return i < LAT_BUCKETS ? i : LAT_BUCKETS - 1;
 }
 
-void send_keycode(uint8_t keycode)
+// Largest value bucket i holds
+static uint32_t lat_bucket_top(int i)
 {
-    if (tud_mounted()) {
-        uint8_t keycode_array[6] = {0};
-        keycode_array[0] = keycode;
-
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, keycode_array);
-        vTaskDelay(pdMS_TO_TICKS(50));
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, NULL);
-        vTaskDelay(pdMS_TO_TICKS(10));
+    if (i < 8) {
+        return ((i + 1) << 7) - 1;
     }
+    int e = 10 + (i - 8) / 8;
+    return ((9 + (i - 8) % 8) << (e - 3)) - 1;
 }
 
-void send_key(char c)
+static uint32_t lat_percentile(const lat_hist_t *h, int pct)
 {
-    if (tud_mounted()) {
-        uint8_t keycode_array[6] = {0};
-        uint8_t modifier = 0;
+    uint32_t rank = (h->count * pct + 99) / 100;
+    uint32_t seen = 0;
+    for (int i = 0; i < LAT_BUCKETS && h->count; i++) {
+        seen += h->hist[i];
+        if (seen >= rank) {
+            uint32_t top = lat_bucket_top(i);
+            return top < h->max_us ? top : h->max_us;
+        }
+    }
+    return 0;
+}
 
-        keycode_array[0] = char_to_hid_keycode(c);
+static lat_probe_t *lat_lookup(uint8_t probe)
+{
+    lat_probe_t *p = &lat_probes[probe & 0x0f];
+    return probe && p->in_use && p->gen == probe >> 4 ? p : NULL;
+}
 
-        if (c >= 'A' && c <= 'Z') {
-            modifier = KEYBOARD_MODIFIER_LEFTSHIFT;
+// Claim a slot for a stamped key. Returns the probe to tag its input with,
+// 0 when all are in flight.
+static uint8_t lat_probe_start(uint32_t seq, int64_t sent_us, int64_t arrived_us)
+{
+    uint8_t probe = 0;
+    portENTER_CRITICAL(&lat_mux);
+    for (int i = 0; i < LAT_PROBES && !probe; i++) {
+        lat_probe_t *p = &lat_probes[i];
+        if (!p->in_use) {
+            uint8_t gen = p->gen % 15 + 1;
+            *p = (lat_probe_t){ .in_use = true, .gen = gen, .seq = seq, .owner = xTaskGetCurrentTaskHandle(),
+                                .sent_us = sent_us, .arrived_us = arrived_us };
+            probe = gen << 4 | i;
         }
-
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, modifier, keycode_array);
-        vTaskDelay(pdMS_TO_TICKS(50));
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, NULL);
-        vTaskDelay(pdMS_TO_TICKS(10));
     }
+    portEXIT_CRITICAL(&lat_mux);
+    return probe;
 }
 
-// QR code generation function (using correct ESP32 QR code API)
-static void wifi_prov_print_qr(const char *name, const char *username, const char *pop, const char *transport)
+static void lat_record(lat_stage_t stage, int64_t us)
 {
-    if (!name || !transport) {
-        ESP_LOGW(TAG, "Cannot generate QR code payload. Data missing.");
-        return;
+    lat_hist_t *h = &lat_hist[stage];
+    uint32_t v = us < 0 ? 0 : us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    h->hist[lat_bucket(v)]++;
+    h->count++;
+    if (v > h->max_us) {
+        h->max_us = v;
     }
+}
 
-    char payload[200];
-    if (pop) {
-        snprintf(payload, sizeof(payload), "{\"ver\":\"%s\",\"name\":\"%s\"" \
-                 ",\"pop\":\"%s\",\"transport\":\"%s\"}",
-                 "v1", name, pop, transport);
-    } else {
-        snprintf(payload, sizeof(payload), "{\"ver\":\"%s\",\"name\":\"%s\"" \
-                 ",\"transport\":\"%s\",\"network\":\"wifi\"}",
-                 "v1", name, transport);
+// End a probe: read_us is when the host read its key-down report, 0 if none went out
+static void lat_probe_end(uint8_t probe, int64_t read_us)
+{
+    portENTER_CRITICAL(&lat_mux);
+    lat_probe_t *p = lat_lookup(probe);
+    if (p && !p->done) {
+        p->done = true;
+        p->read_us = read_us;
+        if (read_us) {
+            lat_record(LAT_TOTAL, read_us - p->sent_us);
+            lat_record(LAT_NET, p->arrived_us - p->sent_us);
+            lat_record(LAT_QUEUE, p->dequeued_us - p->arrived_us);
+            lat_record(LAT_USB, read_us - p->dequeued_us);
+        } else {
+            lat_unmatched++;
+        }
     }
+    portEXIT_CRITICAL(&lat_mux);
+}
 
-    ESP_LOGI(TAG, "Scan this QR code from the ESP Provisioning mobile app for Provisioning.");
-
-    // Use default QR code configuration with console display
-    esp_qrcode_config_t cfg = ESP_QRCODE_CONFIG_DEFAULT();
-    cfg.display_func = esp_qrcode_print_console;
-
-    esp_err_t ret = esp_qrcode_generate(&cfg, payload);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to generate QR code: %s", esp_err_to_name(ret));
+// Typing task: the tagged key comes off the queue and its reports follow
+static void lat_dequeued(uint8_t probe)
+{
+    portENTER_CRITICAL(&lat_mux);
+    lat_probe_t *p = lat_lookup(probe);
+    if (p) {
+        p->dequeued_us = esp_timer_get_time();
     }
-
-    ESP_LOGI(TAG, "If QR code is not visible, copy paste the below URL in a browser.\nhttps://espressif.github.io/esp-jumpstart/qrcode.html?data=%s", payload);
+    portEXIT_CRITICAL(&lat_mux);
+    lat_armed = p ? probe : 0;
 }
 
-// WiFi event handler
-static void wifi_event_handler(void* arg, esp_event_base_t event_base,
-                             int32_t event_id, void* event_data)
+// Typing task, once the key is handled: a probe still armed sent no key down
+// (a repeat folded into a held key, or nothing the layout can type)
+static void lat_typed(uint8_t probe)
 {
-    if (event_base == WIFI_EVENT) {
-        switch (event_id) {
-            case WIFI_EVENT_STA_START:
-                esp_wifi_connect();
-                break;
-            case WIFI_EVENT_STA_CONNECTED:
-                ESP_LOGI(TAG, "Connected to AP");
-                break;
-            case WIFI_EVENT_STA_DISCONNECTED:
-                ESP_LOGI(TAG, "Disconnected from AP");
-                xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
-                break;
-            default:
-                break;
-        }
-    } else if (event_base == IP_EVENT) {
-        if (event_id == IP_EVENT_STA_GOT_IP) {
-            ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-            ESP_LOGI(TAG, "Got IP address: " IPSTR, IP2STR(&event->ip_info.ip));
-            xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+    if (probe && lat_armed == probe) {
+        lat_armed = 0;
+        lat_probe_end(probe, 0);
+    }
+}
 
-            // Type the IP address via USB keyboard
-            char ip_str[64];
-            snprintf(ip_str, sizeof(ip_str), "ESP32-S3 IP: " IPSTR "\n", IP2STR(&event->ip_info.ip));
-            for (int i = 0; ip_str[i] != '\0'; i++) {
-                send_key(ip_str[i]);
-                vTaskDelay(pdMS_TO_TICKS(80));
+// Session task: copy out and free one of its finished probes, or one that
+// has waited longer than timeout_us (read_us 0). Returns false when there is none.
+static bool lat_probe_collect(int64_t timeout_us, lat_probe_t *out)
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    int64_t now = esp_timer_get_time();
+    bool found = false;
+    portENTER_CRITICAL(&lat_mux);
+    for (int i = 0; i < LAT_PROBES && !found; i++) {
+        lat_probe_t *p = &lat_probes[i];
+        if (p->in_use && p->owner == self && (p->done || now - p->arrived_us > timeout_us)) {
+            if (!p->done) {
+                p->read_us = 0;
+                lat_unmatched++;
             }
+            *out = *p;
+            p->in_use = false;
+            found = true;
         }
     }
+    portEXIT_CRITICAL(&lat_mux);
+    return found;
 }
 
-// Global variables for provisioning retry logic
-static int provisioning_retry_count = 0;
-static const int MAX_PROVISIONING_RETRIES = 3;
-
-// Provisioning event handler
-static void prov_event_handler(void* arg, esp_event_base_t event_base,
-                              int32_t event_id, void* event_data)
+// Session task, on leaving: free its probes; events still queued for them are ignored
+static void lat_probe_release_all(void)
 {
-    if (event_base == NETWORK_PROV_EVENT) {
-        switch (event_id) {
-            case NETWORK_PROV_START:
-                ESP_LOGI(TAG, "Provisioning started");
-                break;
-            case NETWORK_PROV_WIFI_CRED_RECV:
-                ESP_LOGI(TAG, "Received Wi-Fi credentials");
-                provisioning_retry_count = 0; // Reset retry count on new credentials
-                break;
-            case NETWORK_PROV_WIFI_CRED_FAIL: {
-                ESP_LOGE(TAG, "Provisioning failed");
-
-                // Get the disconnect reason for detailed error reporting
-                network_prov_wifi_sta_fail_reason_t *reason = (network_prov_wifi_sta_fail_reason_t *)event_data;
-                if (reason != NULL) {
-                    switch (*reason) {
-                        case NETWORK_PROV_WIFI_STA_AUTH_ERROR:
-                            ESP_LOGE(TAG, "Authentication failed - Wrong password or security settings");
-                            break;
-                        case NETWORK_PROV_WIFI_STA_AP_NOT_FOUND:
-                            ESP_LOGE(TAG, "Access point not found - SSID not available");
-                            break;
-                        default:
-                            ESP_LOGE(TAG, "Connection failed - Unknown reason: %d", *reason);
-                            break;
-                    }
-                }
-                break;
-            }
-            case NETWORK_PROV_WIFI_CRED_SUCCESS:
-                ESP_LOGI(TAG, "Provisioning successful");
-                provisioning_retry_count = 0; // Reset on success
-                break;
-            case NETWORK_PROV_END:
-                ESP_LOGI(TAG, "Provisioning ended");
-                break;
-            default:
-                break;
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&lat_mux);
+    for (int i = 0; i < LAT_PROBES; i++) {
+        if (lat_probes[i].in_use && lat_probes[i].owner == self) {
+            lat_probes[i].in_use = false;
         }
     }
+    portEXIT_CRITICAL(&lat_mux);
 }
 
-// Application callback for provisioning
-void wifi_prov_app_callback(void *user_data, network_prov_cb_event_t event, void *event_data)
+// Report accounting: every report goes through hid_submit(), which waits for
+// the endpoint, tries again when the stack refuses a report, and counts the
+// outcome. Reports come from the typing task, the stop, the boot key and the
+// watchdog; hid_lock lets one of them at a time check the endpoint is free
+// and submit, so one report is in flight and completions pair off with
+// submissions in order. A key down is planned with its hold time in the same
+// step; if it is still down HID_HOLD_GRACE_MS after that, the watchdog
+// releases it. Only the task that pressed the keys may push the deadline back.
+#define HID_SUBMIT_TRIES 3
+#define HID_HOLD_GRACE_MS 200
+#define HID_HOLD_KEEP UINT32_MAX        // Leave the deadline as it is
+
+typedef struct {
+    uint32_t submitted;
+    uint32_t completed;             // Taken by the host (tud_hid_report_complete_cb)
+    uint32_t retried;               // Refused by the stack and tried again
+    uint32_t dropped;               // Never went out: host gone, or the endpoint stayed busy
+    uint32_t lost;                  // Submitted, but the bus went away before completion
+    uint32_t forced;                // Releases sent by the watchdog
+    bool keys_down;                 // The last report submitted held a key or modifier
+    TaskHandle_t holder;            // The task that submitted it
+    int64_t hold_until_us;          // Watchdog deadline, 0 when none
+} hid_acct_t;
+
+static hid_acct_t hid_acct;
+static portMUX_TYPE hid_acct_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t hid_lock;      // Submission and the hold deadline
+static esp_timer_handle_t hid_watchdog;
+
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report, uint16_t len)
 {
-    switch (event) {
-    case NETWORK_PROV_SET_WIFI_STA_CONFIG: {
-        wifi_config_t *wifi_config = (wifi_config_t *)event_data;
-        ESP_LOGI(TAG, "Setting WiFi SSID: %s", wifi_config->sta.ssid);
-        break;
-    }
-    default:
-        break;
+    portENTER_CRITICAL(&hid_acct_mux);
+    hid_acct.completed++;
+    portEXIT_CRITICAL(&hid_acct_mux);
+    // The endpoint frees up just before this runs for the previous report, so
+    // match the report itself; len 8 is modifier, reserved, keys[6]
+    uint8_t probe = lat_in_flight;
+    if (probe && len >= 3 && (report[0] << 8 | report[2]) == lat_in_flight_key) {
+        lat_in_flight = 0;
+        lat_probe_end(probe, esp_timer_get_time());
     }
 }
 
-const network_prov_event_handler_t wifi_prov_event_handler = {
-    .event_cb = wifi_prov_app_callback,
-    .user_data = NULL
-};
-
-// Check if WiFi credentials are already stored in NVS
-static bool wifi_credentials_available(void)
+// Arm the watchdog for keys meant to come up within hold_ms, or disarm it
+// for 0; the caller holds hid_lock
+static void hid_hold_set(uint32_t hold_ms)
 {
-    wifi_config_t wifi_config;
-    esp_err_t ret = esp_wifi_get_config(WIFI_IF_STA, &wifi_config);
+    esp_timer_stop(hid_watchdog);
+    portENTER_CRITICAL(&hid_acct_mux);
+    hid_acct.hold_until_us = hold_ms ? esp_timer_get_time() + (hold_ms + HID_HOLD_GRACE_MS) * 1000LL : 0;
+    portEXIT_CRITICAL(&hid_acct_mux);
+    if (hold_ms) {
+        esp_timer_start_once(hid_watchdog, (hold_ms + HID_HOLD_GRACE_MS) * 1000ULL);
+    }
+}
 
-    if (ret == ESP_OK && strlen((char*)wifi_config.sta.ssid) > 0) {
-        ESP_LOGI(TAG, "Found stored WiFi credentials for SSID: %s", wifi_config.sta.ssid);
-        return true;
+// Submit one report, giving the endpoint up to two poll intervals to free up
+// on each try. Keys it presses are meant to come up within hold_ms (0: no
+// deadline, HID_HOLD_KEEP: the one already set). Returns false if the report
+// never went out, or if it holds a key and the emergency stop engaged while
+// it waited.
+static bool hid_submit(uint8_t modifier, const uint8_t keys[6], uint32_t hold_ms)
+{
+    uint8_t report[6] = { 0 };
+    if (keys) {
+        memcpy(report, keys, sizeof(report));
+    }
+    bool down = modifier || report[0];
+
+    for (int attempt = 0; attempt < HID_SUBMIT_TRIES && tud_ready(); attempt++) {
+        int64_t deadline = esp_timer_get_time() + 2 * HID_POLL_INTERVAL_MS * 1000;
+        xSemaphoreTake(hid_lock, portMAX_DELAY);
+        while (tud_ready() && !tud_hid_ready() && esp_timer_get_time() < deadline) {
+            // Not held while waiting, so the stop's release never queues behind it
+            xSemaphoreGive(hid_lock);
+            vTaskDelay(1);
+            xSemaphoreTake(hid_lock, portMAX_DELAY);
+        }
+        // estop_engage() sets the flag under hid_lock: a key down checked
+        // here cannot reach the host after the stop's release
+        if (down && estop.engaged) {
+            xSemaphoreGive(hid_lock);
+            trace(TRACE_REPORT_FAIL, 0, modifier << 8 | report[0]);
+            return false;
+        }
+        // A probe's report can complete before the call returns
+        uint8_t probe = down ? lat_armed : 0;
+        if (probe) {
+            lat_in_flight_key = modifier << 8 | report[0];
+            lat_in_flight = probe;
+        }
+        bool sent = tud_hid_keyboard_report(HID_KBD_REPORT_ID, modifier, report);
+        if (probe && sent) {
+            lat_armed = 0;
+        } else if (probe) {
+            lat_in_flight = 0;
+        }
+        portENTER_CRITICAL(&hid_acct_mux);
+        if (sent) {
+            hid_acct.submitted++;
+            hid_acct.keys_down = down;
+            hid_acct.holder = down ? xTaskGetCurrentTaskHandle() : NULL;
+            if (!down) {
+                hid_acct.hold_until_us = 0;
+            }
+        } else if (attempt + 1 < HID_SUBMIT_TRIES) {
+            hid_acct.retried++;
+        }
+        portEXIT_CRITICAL(&hid_acct_mux);
+        if (sent && down && hold_ms != HID_HOLD_KEEP) {
+            hid_hold_set(hold_ms);
+        }
+        xSemaphoreGive(hid_lock);
+        if (sent) {
+            trace(TRACE_REPORT, 0, modifier << 8 | report[0]);
+            return true;
+        }
     }
 
-    ESP_LOGI(TAG, "No stored WiFi credentials found");
+    portENTER_CRITICAL(&hid_acct_mux);
+    hid_acct.dropped++;
+    portEXIT_CRITICAL(&hid_acct_mux);
+    trace(TRACE_REPORT_FAIL, 0, modifier << 8 | report[0]);
     return false;
 }
 
-// Initialize WiFi and attempt connection with stored credentials
-static esp_err_t wifi_connect_with_stored_credentials(void)
+// Keys the calling task pressed are now meant to be released within hold_ms
+// (0: no deadline). Keys another task pressed since keep their own deadline.
+static void hid_hold_plan(uint32_t hold_ms)
 {
-    ESP_LOGI(TAG, "Connecting to stored WiFi credentials...");
-
-    // Get netif handle
-    esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
-    if (netif == NULL) {
-        ESP_LOGE(TAG, "WiFi netif not available");
-        return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(hid_lock, portMAX_DELAY);
+    if (hid_acct.keys_down && hid_acct.holder == xTaskGetCurrentTaskHandle()) {
+        hid_hold_set(hold_ms);
     }
+    xSemaphoreGive(hid_lock);
+}
 
-    // Start WiFi
-    ESP_ERROR_CHECK(esp_wifi_start());
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+// esp_timer callback: must not block, so a busy endpoint or a submission in
+// progress is tried again one poll interval later
+static void hid_watchdog_fire(void *arg)
+{
+    if (xSemaphoreTake(hid_lock, 0) != pdTRUE) {
+        esp_timer_start_once(hid_watchdog, HID_POLL_INTERVAL_MS * 1000);
+        return;
+    }
+    portENTER_CRITICAL(&hid_acct_mux);
+    bool stuck = hid_acct.keys_down && hid_acct.hold_until_us &&
+                 esp_timer_get_time() >= hid_acct.hold_until_us;
+    portEXIT_CRITICAL(&hid_acct_mux);
+    if (!stuck || !tud_ready()) {
+        xSemaphoreGive(hid_lock);
+        return;
+    }
+    if (!tud_hid_ready() || !tud_hid_keyboard_report(HID_KBD_REPORT_ID, 0, NULL)) {
+        xSemaphoreGive(hid_lock);
+        esp_timer_start_once(hid_watchdog, HID_POLL_INTERVAL_MS * 1000);
+        return;
+    }
+    portENTER_CRITICAL(&hid_acct_mux);
+    hid_acct.submitted++;
+    hid_acct.forced++;
+    hid_acct.keys_down = false;
+    hid_acct.holder = NULL;
+    hid_acct.hold_until_us = 0;
+    portEXIT_CRITICAL(&hid_acct_mux);
+    xSemaphoreGive(hid_lock);
+    trace(TRACE_REPORT, 0, 0);
+    ESP_LOGW(TAG, "Released a key held past its planned time");
+}
+
+// Reports in flight when the bus goes away never complete
+static void hid_acct_unmounted(void)
+{
+    portENTER_CRITICAL(&hid_acct_mux);
+    hid_acct.lost = hid_acct.submitted - hid_acct.completed;
+    hid_acct.keys_down = false;
+    hid_acct.holder = NULL;
+    hid_acct.hold_until_us = 0;
+    portEXIT_CRITICAL(&hid_acct_mux);
+}
+
+static void hid_init(void)
+{
+    hid_lock = xSemaphoreCreateMutex();
+    assert(hid_lock);
+    const esp_timer_create_args_t args = { .callback = hid_watchdog_fire, .name = "hid_watchdog" };
+    ESP_ERROR_CHECK(esp_timer_create(&args, &hid_watchdog));
+}
+
+void send_keycode(uint8_t keycode)
+{
+    if (tud_mounted() && !estop.engaged) {
+        uint8_t keycode_array[6] = {0};
+        keycode_array[0] = keycode;
+
+        if (hid_submit(0, keycode_array, 50)) {
+            vTaskDelay(pdMS_TO_TICKS(50));
+            hid_submit(0, NULL, 0);
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+}
+
+// Press keys and leave them down for about hold_ms (0: until hid_keys_up(),
+// however long; the host's typematic repeat runs meanwhile). Returns false if
+// the host is not listening.
+static bool hid_press(uint8_t modifier, const uint8_t keys[6], uint32_t hold_ms)
+{
+    if (estop.engaged) {
+        return false;
+    }
+    if (!tud_ready()) {
+        trace(TRACE_REPORT_FAIL, 0, modifier << 8 | keys[0]);
+        return false;
+    }
+    return hid_submit(modifier, keys, hold_ms);
+}
+
+static bool hid_key_down(uint8_t keycode, uint8_t modifier, uint32_t hold_ms)
+{
+    uint8_t keycode_array[6] = { keycode };
+    return hid_press(modifier, keycode_array, hold_ms);
+}
+
+static void hid_keys_up(void)
+{
+    hid_submit(0, NULL, 0);
+}
+
+// Send a full report, waiting out one still in flight; for mirrored key state.
+// Keys it holds are planned as hid_submit() does.
+static bool hid_report(uint8_t modifier, const uint8_t keys[6], uint32_t hold_ms)
+{
+    if (estop.engaged && (modifier || keys[0])) {
+        return false;
+    }
+    if (!tud_ready()) {
+        trace(TRACE_REPORT_FAIL, 0, modifier << 8 | keys[0]);
+        return false;
+    }
+    return hid_submit(modifier, keys, hold_ms);
+}
+
+// Typed keys go through the report pipeline (key_pipeline.h): normalize,
+// map, plan, pack and schedule, then hid_play(). Decoding runs earlier, as
+// session input arrives.
+static kp_layout_t hid_layout;
+
+// Send scheduled reports, waiting each one's delay. Returns false if the host
+// was not there to receive a key (unplugged or suspended).
+static bool hid_play(const kp_report_t *reports, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        const kp_report_t *r = &reports[i];
+        if (r->kind == KP_REPORT_DOWN) {
+            if (!hid_press(r->modifier, r->keys, r->delay_ms)) {
+                return false;
+            }
+        } else {
+            hid_report(r->modifier, r->keys, HID_HOLD_KEEP);
+        }
+        vTaskDelay(pdMS_TO_TICKS(r->delay_ms));
+    }
+    return true;
+}
+
+static bool send_key_event(const key_event_t *ev, uint32_t hold_ms, uint32_t gap_ms)
+{
+    key_event_t keys[1];
+    kp_stroke_t strokes[1];
+    kp_report_t reports[KP_REPORTS_PER_STROKE];
+    kp_packer_t packer = { 0 };
+    const kp_timing_t timing = { hold_ms, gap_ms };
+
+    size_t n = kp_normalize(ev, 1, keys);
+    n = kp_map(&hid_layout, keys, n, keys);
+    n = kp_plan(keys, n, strokes);
+    n = kp_pack(&packer, strokes, n, reports);
+    n = kp_schedule(&timing, reports, n, reports);
+    return hid_play(reports, n);
+}
+
+static bool send_hid_key(uint8_t keycode, uint8_t modifier, uint32_t hold_ms, uint32_t gap_ms)
+{
+    const key_event_t ev = { .keycode = keycode, .modifier = modifier };
+    return send_key_event(&ev, hold_ms, gap_ms);
+}
+
+static bool send_key_timed(char c, uint32_t hold_ms, uint32_t gap_ms)
+{
+    const key_event_t ev = { .c = c };
+    return send_key_event(&ev, hold_ms, gap_ms);
+}
+
+bool send_key(char c)
+{
+    return send_key_timed(c, key_pacing.hold_ms, key_pacing.gap_ms);
+}
+
+// Named non-printing keys, for commands that take a key by name
+typedef struct {
+    const char *name;
+    uint8_t keycode;
+} key_name_t;
+
+static const key_name_t key_names[] = {
+    { "f1", HID_KEY_F1 }, { "f2", HID_KEY_F2 }, { "f3", HID_KEY_F3 }, { "f4", HID_KEY_F4 },
+    { "f5", HID_KEY_F5 }, { "f6", HID_KEY_F6 }, { "f7", HID_KEY_F7 }, { "f8", HID_KEY_F8 },
+    { "f9", HID_KEY_F9 }, { "f10", HID_KEY_F10 }, { "f11", HID_KEY_F11 }, { "f12", HID_KEY_F12 },
+    { "del", HID_KEY_DELETE }, { "esc", HID_KEY_ESCAPE }, { "enter", HID_KEY_ENTER },
+    { "tab", HID_KEY_TAB }, { "space", HID_KEY_SPACE }, { "insert", HID_KEY_INSERT },
+    { "home", HID_KEY_HOME }, { "end", HID_KEY_END }, { "pgup", HID_KEY_PAGE_UP },
+    { "pgdn", HID_KEY_PAGE_DOWN }, { "up", HID_KEY_ARROW_UP }, { "down", HID_KEY_ARROW_DOWN },
+    { "left", HID_KEY_ARROW_LEFT }, { "right", HID_KEY_ARROW_RIGHT },
+};
+
+static uint8_t key_name_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+        if (strcasecmp(key_names[i].name, name) == 0) {
+            return key_names[i].keycode;
+        }
+    }
+    return 0;
+}
+
+static const char *key_name_of(uint8_t keycode)
+{
+    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+        if (key_names[i].keycode == keycode) {
+            return key_names[i].name;
+        }
+    }
+    return "?";
+}
+
+// Boot key: hit a key repeatedly from the moment the host enumerates the
+// keyboard, to catch the short BIOS/boot menu window after power-on. The
+// arming is kept in NVS until the run ends, so it survives the target
+// power-cycling the keyboard along with itself. Keys go straight to the HID
+// endpoint from a high-priority task, so network latency plays no part.
+#define BOOT_KEY_NVS_NAMESPACE "bootkey"
+#define BOOT_KEY_HOLD_MS (2 * HID_POLL_INTERVAL_MS)
+#define BOOT_KEY_SETTLE_MS 1000     // Host setup traffic right after enumeration is ignored
+
+typedef enum {
+    BOOT_KEY_UNTIL_TIMEOUT = 0,
+    BOOT_KEY_UNTIL_LED,             // Stop at the first LED report after the settle time
+    BOOT_KEY_UNTIL_PROTOCOL,        // Stop when the host leaves the boot protocol
+    BOOT_KEY_UNTIL_COUNT,
+} boot_key_until_t;
+
+static const char *const boot_key_until_names[] = { "timeout", "led", "protocol" };
+
+typedef struct {
+    uint8_t keycode;                // 0 = disarmed
+    uint8_t until;
+    uint16_t every_ms;
+    uint16_t timeout_s;
+} boot_key_config_t;
+
+static boot_key_config_t boot_key = { 0 };
+static SemaphoreHandle_t boot_key_lock;
+static TaskHandle_t boot_key_task_handle;
+static int64_t boot_key_start_us = 0;      // First enumeration of this run, 0 before
+static uint32_t boot_key_fired = 0;
+static const char *boot_key_result = "idle";
+
+static void boot_key_save(const boot_key_config_t *cfg)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(BOOT_KEY_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGW(TAG, "Boot key: cannot open NVS, arming lasts until reset");
+        return;
+    }
+    if (cfg->keycode) {
+        nvs_set_blob(nvs, "armed", cfg, sizeof(*cfg));
+    } else {
+        nvs_erase_key(nvs, "armed");
+    }
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+// Arm (keycode != 0) or disarm; the next enumeration starts a new run
+static void boot_key_set(const boot_key_config_t *cfg, const char *result)
+{
+    xSemaphoreTake(boot_key_lock, portMAX_DELAY);
+    boot_key = *cfg;
+    boot_key_start_us = 0;
+    boot_key_result = result;
+    if (cfg->keycode) {
+        boot_key_fired = 0;
+    }
+    xSemaphoreGive(boot_key_lock);
+    boot_key_save(cfg);
+}
+
+// Fire the armed key until the run ends (true) or the host goes away (false)
+static bool boot_key_run(const boot_key_config_t *cfg)
+{
+    uint32_t led_base = hid_led_reports;
+    uint8_t protocol_base = tud_hid_get_protocol();
+
+    while (1) {
+        int64_t now = esp_timer_get_time();
+        int64_t since = now - boot_key_start_us;
+        const char *stop = NULL;
+
+        if (since >= (int64_t)cfg->timeout_s * 1000000) {
+            stop = "timeout";
+        } else if (since < BOOT_KEY_SETTLE_MS * 1000LL) {
+            led_base = hid_led_reports;
+            protocol_base = tud_hid_get_protocol();
+        } else if (cfg->until == BOOT_KEY_UNTIL_LED && hid_led_reports != led_base) {
+            stop = "led";
+        } else if (cfg->until == BOOT_KEY_UNTIL_PROTOCOL && tud_hid_get_protocol() != protocol_base) {
+            stop = "protocol";
+        }
+
+        xSemaphoreTake(boot_key_lock, portMAX_DELAY);
+        bool armed = boot_key.keycode == cfg->keycode && boot_key_start_us != 0;
+        if (armed && stop) {
+            boot_key.keycode = 0;
+            boot_key_result = stop;
+        }
+        xSemaphoreGive(boot_key_lock);
+        if (!armed) {
+            return true;            // Disarmed or re-armed over SSH
+        }
+        if (stop) {
+            ESP_LOGI(TAG, "Boot key %s stopped (%s) after %lu presses", key_name_of(cfg->keycode),
+                     stop, (unsigned long)boot_key_fired);
+            boot_key_config_t off = { 0 };
+            boot_key_save(&off);
+            return true;
+        }
+        if (!tud_mounted()) {
+            return false;
+        }
+
+        if (tud_hid_ready() && hid_key_down(cfg->keycode, 0, BOOT_KEY_HOLD_MS)) {
+            vTaskDelay(pdMS_TO_TICKS(BOOT_KEY_HOLD_MS));
+            hid_keys_up();
+            boot_key_fired++;
+        }
+        vTaskDelay(pdMS_TO_TICKS(cfg->every_ms > BOOT_KEY_HOLD_MS ? cfg->every_ms - BOOT_KEY_HOLD_MS : 1));
+    }
+}
+
+static void boot_key_task(void *pvParameters)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        xSemaphoreTake(boot_key_lock, portMAX_DELAY);
+        boot_key_config_t cfg = boot_key;
+        if (cfg.keycode && boot_key_start_us == 0) {
+            boot_key_start_us = esp_timer_get_time();
+            boot_key_result = "firing";
+        }
+        xSemaphoreGive(boot_key_lock);
+
+        // A run keeps its window across re-enumeration (BIOS handing over to
+        // a boot loader, or an OS resetting the controller)
+        if (cfg.keycode && !boot_key_run(&cfg)) {
+            ESP_LOGI(TAG, "Boot key: host detached, waiting for next enumeration");
+        }
+    }
+}
+
+// Mount and unmount come through esp_tinyusb, which implements TinyUSB's
+// tud_mount_cb/tud_umount_cb itself to raise these
+static void usb_event_cb(tinyusb_event_t *event, void *arg)
+{
+    switch (event->id) {
+    case TINYUSB_EVENT_ATTACHED:
+        event_emit(EVENT_USB, 0, "state=mounted");
+        if (boot_key_task_handle) {
+            xTaskNotifyGive(boot_key_task_handle);
+        }
+        break;
+    case TINYUSB_EVENT_DETACHED:
+        hid_acct_unmounted();
+        event_emit(EVENT_USB, 0, "state=unmounted");
+        break;
+    default:
+        break;
+    }
+}
+
+void tud_suspend_cb(bool remote_wakeup_en)
+{
+    event_emit(EVENT_USB, 0, "state=suspended");
+}
+
+void tud_resume_cb(void)
+{
+    event_emit(EVENT_USB, 0, "state=resumed");
+}
+
+// Load a pending arming before USB starts, so the first enumeration after
+// power-on is not missed. Needs NVS initialized.
+static void boot_key_init(void)
+{
+    boot_key_lock = xSemaphoreCreateMutex();
+    assert(boot_key_lock);
+
+    nvs_handle_t nvs;
+    if (nvs_open(BOOT_KEY_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        size_t len = sizeof(boot_key);
+        if (nvs_get_blob(nvs, "armed", &boot_key, &len) != ESP_OK || len != sizeof(boot_key) ||
+            boot_key.until >= BOOT_KEY_UNTIL_COUNT) {
+            memset(&boot_key, 0, sizeof(boot_key));
+        }
+        nvs_close(nvs);
+    }
+    if (boot_key.keycode) {
+        boot_key_result = "armed";
+        ESP_LOGI(TAG, "Boot key %s armed: every %ums for %us until %s", key_name_of(boot_key.keycode),
+                 boot_key.every_ms, boot_key.timeout_s, boot_key_until_names[boot_key.until]);
+    }
+
+    xTaskCreate(boot_key_task, "boot_key", 3072, NULL, 13, &boot_key_task_handle);
+}
+
+// QR code generation function (using correct ESP32 QR code API)
+static void wifi_prov_print_qr(const char *name, const char *username, const char *pop, const char *transport)
+{
+    if (!name || !transport) {
+        ESP_LOGW(TAG, "Cannot generate QR code payload. Data missing.");
+        return;
+    }
+
+    char payload[200];
+    if (pop) {
+        snprintf(payload, sizeof(payload), "{\"ver\":\"%s\",\"name\":\"%s\"" \
+                 ",\"pop\":\"%s\",\"transport\":\"%s\"}",
+                 "v1", name, pop, transport);
+    } else {
+        snprintf(payload, sizeof(payload), "{\"ver\":\"%s\",\"name\":\"%s\"" \
+                 ",\"transport\":\"%s\",\"network\":\"wifi\"}",
+                 "v1", name, transport);
+    }
+
+    ESP_LOGI(TAG, "Scan this QR code from the ESP Provisioning mobile app for Provisioning.");
+
+    // Use default QR code configuration with console display
+    esp_qrcode_config_t cfg = ESP_QRCODE_CONFIG_DEFAULT();
+    cfg.display_func = esp_qrcode_print_console;
+
+    esp_err_t ret = esp_qrcode_generate(&cfg, payload);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to generate QR code: %s", esp_err_to_name(ret));
+    }
+
+    ESP_LOGI(TAG, "If QR code is not visible, copy paste the below URL in a browser.\nhttps://espressif.github.io/esp-jumpstart/qrcode.html?data=%s", payload);
+}
+
+static void input_enqueue_local(const uint8_t *data, int len);
+
+// Type a status line through input_queue, as UART input is: the typing task
+// sends it between other keys instead of this task sending reports alongside
+static void type_status(const char *text)
+{
+    input_enqueue_local((const uint8_t *)text, strlen(text));
+}
+
+// WiFi event handler
+static void wifi_event_handler(void* arg, esp_event_base_t event_base,
+                             int32_t event_id, void* event_data)
+{
+    if (event_base == WIFI_EVENT) {
+        switch (event_id) {
+            case WIFI_EVENT_STA_START:
+                esp_wifi_connect();
+                break;
+            case WIFI_EVENT_STA_CONNECTED:
+                ESP_LOGI(TAG, "Connected to AP");
+                break;
+            case WIFI_EVENT_STA_DISCONNECTED:
+                ESP_LOGI(TAG, "Disconnected from AP");
+                xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
+                break;
+            default:
+                break;
+        }
+    } else if (event_base == IP_EVENT) {
+        if (event_id == IP_EVENT_STA_GOT_IP) {
+            ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+            ESP_LOGI(TAG, "Got IP address: " IPSTR, IP2STR(&event->ip_info.ip));
+            xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+
+            // Type the IP address via USB keyboard
+            char ip_str[64];
+            snprintf(ip_str, sizeof(ip_str), "ESP32-S3 IP: " IPSTR "\n", IP2STR(&event->ip_info.ip));
+            type_status(ip_str);
+        }
+    }
+}
+
+// Global variables for provisioning retry logic
+static int provisioning_retry_count = 0;
+static const int MAX_PROVISIONING_RETRIES = 3;
+
+// Provisioning event handler
+static void prov_event_handler(void* arg, esp_event_base_t event_base,
+                              int32_t event_id, void* event_data)
+{
+    if (event_base == NETWORK_PROV_EVENT) {
+        switch (event_id) {
+            case NETWORK_PROV_START:
+                ESP_LOGI(TAG, "Provisioning started");
+                break;
+            case NETWORK_PROV_WIFI_CRED_RECV:
+                ESP_LOGI(TAG, "Received Wi-Fi credentials");
+                provisioning_retry_count = 0; // Reset retry count on new credentials
+                break;
+            case NETWORK_PROV_WIFI_CRED_FAIL: {
+                ESP_LOGE(TAG, "Provisioning failed");
+
+                // Get the disconnect reason for detailed error reporting
+                network_prov_wifi_sta_fail_reason_t *reason = (network_prov_wifi_sta_fail_reason_t *)event_data;
+                if (reason != NULL) {
+                    switch (*reason) {
+                        case NETWORK_PROV_WIFI_STA_AUTH_ERROR:
+                            ESP_LOGE(TAG, "Authentication failed - Wrong password or security settings");
+                            break;
+                        case NETWORK_PROV_WIFI_STA_AP_NOT_FOUND:
+                            ESP_LOGE(TAG, "Access point not found - SSID not available");
+                            break;
+                        default:
+                            ESP_LOGE(TAG, "Connection failed - Unknown reason: %d", *reason);
+                            break;
+                    }
+                }
+                break;
+            }
+            case NETWORK_PROV_WIFI_CRED_SUCCESS:
+                ESP_LOGI(TAG, "Provisioning successful");
+                provisioning_retry_count = 0; // Reset on success
+                break;
+            case NETWORK_PROV_END:
+                ESP_LOGI(TAG, "Provisioning ended");
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Application callback for provisioning
+void wifi_prov_app_callback(void *user_data, network_prov_cb_event_t event, void *event_data)
+{
+    switch (event) {
+    case NETWORK_PROV_SET_WIFI_STA_CONFIG: {
+        wifi_config_t *wifi_config = (wifi_config_t *)event_data;
+        ESP_LOGI(TAG, "Setting WiFi SSID: %s", wifi_config->sta.ssid);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+const network_prov_event_handler_t wifi_prov_event_handler = {
+    .event_cb = wifi_prov_app_callback,
+    .user_data = NULL
+};
+
+// Check if WiFi credentials are already stored in NVS
+static bool wifi_credentials_available(void)
+{
+    wifi_config_t wifi_config;
+    esp_err_t ret = esp_wifi_get_config(WIFI_IF_STA, &wifi_config);
+
+    if (ret == ESP_OK && strlen((char*)wifi_config.sta.ssid) > 0) {
+        ESP_LOGI(TAG, "Found stored WiFi credentials for SSID: %s", wifi_config.sta.ssid);
+        return true;
+    }
+
+    ESP_LOGI(TAG, "No stored WiFi credentials found");
+    return false;
+}
+
+// Initialize WiFi and attempt connection with stored credentials
+static esp_err_t wifi_connect_with_stored_credentials(void)
+{
+    ESP_LOGI(TAG, "Connecting to stored WiFi credentials...");
+
+    // Get netif handle
+    esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    if (netif == NULL) {
+        ESP_LOGE(TAG, "WiFi netif not available");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Start WiFi
+    ESP_ERROR_CHECK(esp_wifi_start());
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+
+    // Wait for WiFi connection
+    ESP_LOGI(TAG, "Connecting to stored WiFi network...");
+    EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
+                                           WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
+                                           pdFALSE,
+                                           pdFALSE,
+                                           10000 / portTICK_PERIOD_MS); // 10 second timeout
+
+    if (bits & WIFI_CONNECTED_BIT) {
+        ESP_LOGI(TAG, "Successfully connected to stored WiFi network!");
+
+        // Get and display IP address
+        esp_netif_ip_info_t ip_info;
+        if (esp_netif_get_ip_info(netif, &ip_info) == ESP_OK) {
+            ESP_LOGI(TAG, "Device IP: " IPSTR, IP2STR(&ip_info.ip));
+            ESP_LOGI(TAG, "SSH available at: ssh esp32@" IPSTR, IP2STR(&ip_info.ip));
+        }
+
+        return ESP_OK;
+    } else if (bits & WIFI_FAIL_BIT) {
+        ESP_LOGW(TAG, "Failed to connect to stored WiFi network");
+        return ESP_FAIL;
+    } else {
+        ESP_LOGW(TAG, "WiFi connection timeout");
+        return ESP_ERR_TIMEOUT;
+    }
+}
+
+// Initialize WiFi and provisioning infrastructure (called once)
+static esp_err_t init_wifi_infrastructure(void)
+{
+    ESP_LOGI(TAG, "Initializing WiFi and provisioning infrastructure...");
+
+    // Initialize TCP/IP and event loop (only once)
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    wifi_event_group = xEventGroupCreate();
+
+    // Initialize WiFi netif
+    esp_netif_create_default_wifi_sta();
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+    // Register event handlers (only once)
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL));
+
+    return ESP_OK;
+}
+
+// Start WiFi provisioning session (can be called multiple times for retries)
+static esp_err_t start_provisioning_session(void)
+{
+    ESP_LOGI(TAG, "Starting WiFi provisioning (attempt %d/%d)...",
+             provisioning_retry_count + 1, MAX_PROVISIONING_RETRIES);
+
+    // Configure provisioning
+    const char *service_name = "PROV_ESP32";
+    const char *pop = "abcd1234"; // Proof of possession
+
+    ESP_LOGI(TAG, "Scan this QR code with the ESP Provisioning app:");
+    wifi_prov_print_qr(service_name, NULL, pop, "ble");
+
+    // Type QR code via USB keyboard for user convenience
+    ESP_LOGI(TAG, "Typing QR code via USB keyboard...");
+
+    // Type a header message
+    char header[] = "Scan this QR code with ESP Provisioning app:\n";
+    type_status(header);
+
+    // Type the provisioning info as text backup
+    char info_msg[] = "\nConnection Details:\nSSID: PROV_ESP32\nPassword: abcd1234\n";
+    type_status(info_msg);
+
+    // Configure provisioning manager
+    network_prov_mgr_config_t config = {
+        .scheme = network_prov_scheme_ble,
+        .scheme_event_handler = NETWORK_PROV_SCHEME_BLE_EVENT_HANDLER_FREE_BTDM
+    };
+
+    ESP_ERROR_CHECK(network_prov_mgr_init(config));
+
+    // Register provisioning event handler
+    ESP_ERROR_CHECK(esp_event_handler_register(NETWORK_PROV_EVENT, ESP_EVENT_ANY_ID, &prov_event_handler, NULL));
+
+    // Start provisioning
+    ESP_ERROR_CHECK(network_prov_mgr_start_provisioning(NETWORK_PROV_SECURITY_1, pop, service_name, NULL));
+
+    // Wait for WiFi connection with reasonable timeout
+    ESP_LOGI(TAG, "Waiting for WiFi connection...");
+    EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
+                                           WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
+                                           pdFALSE,
+                                           pdFALSE,
+                                           portMAX_DELAY); // Wait until provisioned
+
+    // Cleanup provisioning manager before returning
+    ESP_LOGI(TAG, "Cleaning up provisioning manager...");
+    network_prov_mgr_deinit();
+
+    // Unregister provisioning event handler
+    esp_event_handler_unregister(NETWORK_PROV_EVENT, ESP_EVENT_ANY_ID, &prov_event_handler);
+
+    if (bits & WIFI_CONNECTED_BIT) {
+        ESP_LOGI(TAG, "Connected to WiFi successfully!");
+
+        // Get and display IP address
+        esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+        esp_netif_ip_info_t ip_info;
+        if (esp_netif_get_ip_info(netif, &ip_info) == ESP_OK) {
+            ESP_LOGI(TAG, "Device IP: " IPSTR, IP2STR(&ip_info.ip));
+            ESP_LOGI(TAG, "SSH available at: ssh esp32@" IPSTR, IP2STR(&ip_info.ip));
+            ESP_LOGI(TAG, "Password: keyboard");
+        }
+
+        // Type minimal connection status - just indicate ready state
+        char ready_msg[] = "WiFi Ready - SSH Available\n";
+        type_status(ready_msg);
+
+        return ESP_OK;
+    } else if (bits & WIFI_FAIL_BIT) {
+        ESP_LOGE(TAG, "Provisioning attempt %d failed", provisioning_retry_count + 1);
+        provisioning_retry_count++;
+        return ESP_FAIL;
+    }
+
+    return ESP_ERR_TIMEOUT;
+}
+
+// WiFi provisioning function with retry logic
+static void wifi_provisioning(void)
+{
+    ESP_LOGI(TAG, "Starting WiFi connection process...");
+
+    // Initialize WiFi infrastructure (only once)
+    esp_err_t ret = init_wifi_infrastructure();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize WiFi infrastructure");
+        return;
+    }
+
+    // Check if we have stored WiFi credentials
+    if (wifi_credentials_available()) {
+        // Try to connect with stored credentials first
+        ret = wifi_connect_with_stored_credentials();
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG, "Connected using stored credentials - SSH server ready");
+            // No USB typing needed when already provisioned - just start SSH server
+            return;
+        } else {
+            ESP_LOGI(TAG, "Stored credentials failed, starting provisioning...");
+            // Invalidate stored credentials by clearing WiFi config
+            ESP_ERROR_CHECK(esp_wifi_restore());
+            provisioning_retry_count = 0;
+        }
+    }
+
+    ESP_LOGI(TAG, "Starting WiFi provisioning with retry logic...");
+
+    // Retry provisioning with exponential backoff
+    do {
+        ret = start_provisioning_session();
+
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG, "WiFi provisioning completed successfully");
+            provisioning_retry_count = 0;
+            return;
+        }
+
+        if (provisioning_retry_count < MAX_PROVISIONING_RETRIES) {
+            ESP_LOGW(TAG, "Retrying provisioning in %d seconds...",
+                     provisioning_retry_count * 5);
+
+            // Wait before retry with exponential backoff
+            vTaskDelay(pdMS_TO_TICKS(provisioning_retry_count * 5000));
+
+            // Type retry message via USB keyboard
+            char retry_msg[] = "WiFi provisioning failed. Retrying...\n";
+            type_status(retry_msg);
+        }
+    } while (provisioning_retry_count < MAX_PROVISIONING_RETRIES);
+
+    // If all retries failed
+    ESP_LOGE(TAG, "WiFi provisioning failed after %d attempts", MAX_PROVISIONING_RETRIES);
+    provisioning_retry_count = 0;
+
+    // Type failure message via USB keyboard
+    char fail_msg[] = "WiFi provisioning failed. Please reset device to retry.\n";
+    type_status(fail_msg);
+}
+
+// Provisioning completion demo task (disabled to avoid automatic typing)
+/*
+static void provisioning_complete_demo(void *pvParameters)
+{
+    const char *demo_messages[] = {
+        "ESP32-S3 WiFi Provisioned Keyboard Ready!\n",
+        "Features: USB HID + WiFi Provisioning + QR Code\n",
+        "Arrow keys, Tab, special keys supported\n",
+        "Remote keyboard control activated\n"
+    };
+
+    while (1) {
+        if (tud_mounted()) {
+            // Type demo messages
+            for (int i = 0; i < sizeof(demo_messages)/sizeof(demo_messages[0]); i++) {
+                for (int j = 0; demo_messages[i][j] != '\0'; j++) {
+                    send_key(demo_messages[i][j]);
+                    vTaskDelay(pdMS_TO_TICKS(60)); // Natural typing speed
+                }
+                vTaskDelay(pdMS_TO_TICKS(3000)); // Pause between messages
+            }
+
+            vTaskDelay(pdMS_TO_TICKS(45000)); // Wait 45 seconds
+        } else {
+            vTaskDelay(pdMS_TO_TICKS(1000));
+        }
+    }
+}
+*/
+
+// SSH Server Configuration
+#define SSH_PORT "22"
+#define SSH_USERNAME "admin"
+#define SSH_PASSWORD "esp32kbd"
+#define SSH_MAX_CLIENTS 3
+
+// Host key type, selected in menuconfig ("SSH Keyboard" menu). Each type is
+// stored under its own NVS key so switching types does not discard the others.
+#if CONFIG_SSH_HOST_KEY_ECDSA_P256
+#define SSH_HOST_KEY_TYPE SSH_KEYTYPE_ECDSA_P256
+#define SSH_HOST_KEY_BITS 256
+#define SSH_HOST_KEY_NAME "host_key_p256"
+#define SSH_HOST_KEY_ALGORITHMS "ecdsa-sha2-nistp256"
+#elif CONFIG_SSH_HOST_KEY_RSA
+#define SSH_HOST_KEY_TYPE SSH_KEYTYPE_RSA
+#define SSH_HOST_KEY_BITS CONFIG_SSH_HOST_KEY_RSA_BITS
+#define SSH_HOST_KEY_NAME "host_key_rsa"
+#define SSH_HOST_KEY_ALGORITHMS "rsa-sha2-512,rsa-sha2-256"
+#else
+#define SSH_HOST_KEY_TYPE SSH_KEYTYPE_ED25519
+#define SSH_HOST_KEY_BITS 0
+#define SSH_HOST_KEY_NAME "host_key"
+#define SSH_HOST_KEY_ALGORITHMS "ssh-ed25519"
+#endif
+
+// Minimal crypto profile (sdkconfig.crypto-min): offer only the suites that
+// the trimmed mbedTLS build still compiles in
+#if CONFIG_SSH_CRYPTO_MINIMAL
+#define SSH_CRYPTO_PROFILE "minimal"
+#define SSH_KEX_ALGORITHMS "curve25519-sha256,curve25519-sha256@libssh.org"
+#define SSH_HMACS "hmac-sha2-256-etm@openssh.com,hmac-sha2-256"
+#else
+#define SSH_CRYPTO_PROFILE "full"
+#endif
+
+// AES-GCM and AES-CTR run on the AES peripheral, chacha20-poly1305 runs in
+// software on the CPU. The client takes the first cipher of its own list that
+// the server offers, and OpenSSH lists chacha20-poly1305 first, so leaving it
+// out of the offer is what steers clients onto the hardware.
+#if CONFIG_SSH_CIPHERS_HW_ONLY
+#define SSH_CIPHERS "aes128-gcm@openssh.com,aes256-gcm@openssh.com,aes128-ctr,aes256-ctr"
+#elif CONFIG_SSH_CRYPTO_MINIMAL
+#define SSH_CIPHERS "aes128-gcm@openssh.com,aes256-gcm@openssh.com,aes128-ctr,aes256-ctr,chacha20-poly1305@openssh.com"
+#endif
+
+// Typing limits, enforced when input is queued for the keyboard.
+// keys_per_sec = 0 disables the token bucket, max_queued = 0 disables the queue cap.
+typedef struct {
+    uint32_t keys_per_sec;  // Sustained keystrokes per second
+    uint32_t burst;         // Bucket depth in keystrokes
+    uint32_t max_queued;    // Bytes allowed to wait in the input queue
+} rate_limit_t;
+
+typedef struct {
+    const char *username;
+    const char *password;
+    rate_limit_t user_limit;     // Shared by all sessions of this user
+    rate_limit_t session_limit;  // Applied to each session on its own
+} ssh_user_t;
+
+static const ssh_user_t ssh_users[] = {
+    { SSH_USERNAME, SSH_PASSWORD,            { 0, 0, 0 },      { 0, 0, 2048 } },
+#if CONFIG_SSH_BOT_USER
+    { "bot",        CONFIG_SSH_BOT_PASSWORD, { 20, 60, 512 },  { 15, 40, 256 } },
+#endif
+};
+#if CONFIG_SSH_BOT_USER
+_Static_assert(sizeof(CONFIG_SSH_BOT_PASSWORD) > 1, "set CONFIG_SSH_BOT_PASSWORD for the bot account");
+#endif
+#define SSH_USER_COUNT (sizeof(ssh_users) / sizeof(ssh_users[0]))
+
+static ssh_bind sshbind = NULL;
+static TaskHandle_t ssh_server_task_handle = NULL;
+
+// Input stage: every keystroke passes through input_queue to the HID typing task
+#define INPUT_QUEUE_LEN 1024
+
+typedef struct {
+    uint32_t tokens_milli;   // Available keystrokes scaled by 1000
+    int64_t last_refill_us;
+    uint32_t queued;         // Bytes currently waiting in input_queue
+} token_bucket_t;
+
+typedef struct {
+    char c;
+    int8_t user;       // Index into ssh_users, -1 for local (UART) input
+    int8_t slot;       // Session slot, -1 for local input
+    uint8_t gen;       // Slot generation, guards against reused slots
+    uint32_t at_ms;    // Arrival time, for auto-repeat detection
+    bool exact;        // Session speaks the kitty keyboard protocol
+    uint8_t probe;     // Latency probe the key ends, 0 for none
+} input_event_t;
+
+typedef struct {
+    token_bucket_t bucket;
+    uint32_t sessions;
+    uint32_t accepted;
+    uint32_t rejected;
+    uint32_t typed;
+} ssh_user_stats_t;
+
+typedef struct {
+    bool in_use;
+    uint8_t gen;
+    int user;
+    ssh_session session;
+    ssh_channel channel;
+    token_bucket_t bucket;
+    uint32_t accepted;
+    uint32_t rejected;
+    bool kitty;                 // Terminal sends exact key events (CSI u)
+    bool pty;                   // The client asked for a terminal (ssh -t)
+    uint16_t cols;              // Its width then, 0 if not given
+} ssh_client_t;
+
+static QueueHandle_t input_queue;
+static SemaphoreHandle_t input_lock;
+static ssh_user_stats_t ssh_user_stats[SSH_USER_COUNT];
+static ssh_client_t ssh_clients[SSH_MAX_CLIENTS];
+static uint32_t local_typed = 0;
+
+// Commands that change how everyone's keys are typed need a user without a typing limit
+static bool ssh_client_unlimited(const ssh_client_t *client)
+{
+    return ssh_users[client->user].user_limit.keys_per_sec == 0;
+}
+
+// Key exchange latency (includes the host key signature) and the heap each
+// handshake leaves allocated for the session's crypto state, guarded by input_lock
+typedef struct {
+    uint32_t count;
+    uint32_t failed;
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint64_t total_ms;
+    uint32_t max_heap;
+    uint64_t total_heap;
+} kex_stats_t;
+
+static kex_stats_t kex_stats;
+
+static void kex_stats_record(uint32_t ms, int32_t heap_used, bool ok)
+{
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    if (heap_used > 0) {
+        kex_stats.total_heap += heap_used;
+        if (heap_used > kex_stats.max_heap) {
+            kex_stats.max_heap = heap_used;
+        }
+    }
+    if (!ok) {
+        kex_stats.failed++;
+    } else {
+        if (kex_stats.count == 0 || ms < kex_stats.min_ms) {
+            kex_stats.min_ms = ms;
+        }
+        if (ms > kex_stats.max_ms) {
+            kex_stats.max_ms = ms;
+        }
+        kex_stats.total_ms += ms;
+        kex_stats.count++;
+    }
+    xSemaphoreGive(input_lock);
+}
+
+static void token_bucket_reset(token_bucket_t *b, const rate_limit_t *limit)
+{
+    b->tokens_milli = limit->burst * 1000;
+    b->last_refill_us = esp_timer_get_time();
+    b->queued = 0;
+}
+
+static void token_bucket_refill(token_bucket_t *b, const rate_limit_t *limit, int64_t now_us)
+{
+    int64_t elapsed_us = now_us - b->last_refill_us;
+    b->last_refill_us = now_us;
+    if (limit->keys_per_sec == 0 || elapsed_us <= 0) {
+        return;
+    }
+
+    // elapsed_us * keys_per_sec / 1e6 keystrokes, kept in milli-keystrokes
+    uint64_t tokens = b->tokens_milli + (uint64_t)elapsed_us * limit->keys_per_sec / 1000;
+    uint64_t cap = (uint64_t)limit->burst * 1000;
+    b->tokens_milli = tokens > cap ? cap : tokens;
+}
+
+// Returns NULL if one more byte fits, otherwise the reason it does not
+static const char *token_bucket_check(const token_bucket_t *b, const rate_limit_t *limit)
+{
+    if (limit->keys_per_sec != 0 && b->tokens_milli < 1000) {
+        return "rate limit";
+    }
+    if (limit->max_queued != 0 && b->queued >= limit->max_queued) {
+        return "queue limit";
+    }
+    return NULL;
+}
+
+static void token_bucket_charge(token_bucket_t *b, const rate_limit_t *limit)
+{
+    if (limit->keys_per_sec != 0) {
+        b->tokens_milli -= 1000;
+    }
+    b->queued++;
+}
+
+static int ssh_user_find(const char *user, const char *password)
+{
+    for (int i = 0; i < SSH_USER_COUNT; i++) {
+        if (strcmp(user, ssh_users[i].username) == 0 && strcmp(password, ssh_users[i].password) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int ssh_channel_printf(ssh_channel channel, const char *fmt, ...)
+{
+    char line[256];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        return len;
+    }
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    return ssh_channel_write(channel, line, len);
+}
+
+// Queue input from an SSH session, applying user and session limits per byte.
+// NUL bytes are skipped. Rejected bytes are dropped and reported back on the
+// session channel. The last byte queued carries `probe` (0 for none). Returns
+// the number of bytes rejected.
+static int input_enqueue_ssh(ssh_client_t *client, const char *data, int len, uint8_t probe)
+{
+    const ssh_user_t *user = &ssh_users[client->user];
+    ssh_user_stats_t *stats = &ssh_user_stats[client->user];
+    const char *reason = NULL;
+    int accepted = 0, wanted = 0, last = -1;
+    int64_t now = esp_timer_get_time();
+
+    for (int i = 0; i < len; i++) {
+        if (data[i] != '\0') {
+            wanted++;
+            last = i;
+        }
+    }
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    token_bucket_refill(&stats->bucket, &user->user_limit, now);
+    token_bucket_refill(&client->bucket, &user->session_limit, now);
+    if (estop.engaged) {
+        reason = "emergency stop";
+    }
+
+    for (int i = 0; i < len && !reason; i++) {
+        if (data[i] == '\0') {
+            continue;
+        }
+
+        reason = token_bucket_check(&stats->bucket, &user->user_limit);
+        if (!reason) {
+            reason = token_bucket_check(&client->bucket, &user->session_limit);
+        }
+        if (reason) {
+            break;
+        }
+
+        input_event_t ev = {
+            .c = data[i],
+            .user = client->user,
+            .slot = client - ssh_clients,
+            .gen = client->gen,
+            .at_ms = now / 1000,
+            .exact = client->kitty,
+            .probe = i == last ? probe : 0,
+        };
+        if (xQueueSend(input_queue, &ev, 0) != pdTRUE) {
+            reason = "input queue full";
+            break;
+        }
+
+        token_bucket_charge(&stats->bucket, &user->user_limit);
+        token_bucket_charge(&client->bucket, &user->session_limit);
+        accepted++;
+    }
+
+    int rejected = wanted - accepted;
+    trace(TRACE_ENQUEUE, client - ssh_clients, accepted);
+    if (rejected > 0) {
+        trace(TRACE_REJECT, client - ssh_clients, rejected);
+    }
+    stats->accepted += accepted;
+    stats->rejected += rejected;
+    client->accepted += accepted;
+    client->rejected += rejected;
+    xSemaphoreGive(input_lock);
+
+    if (rejected > 0) {
+        ESP_LOGW(TAG, "Rejected %d of %d bytes from %s: %s", rejected, wanted, user->username, reason);
+        ssh_channel_printf(client->channel, "\r\n[keyboard] %d of %d bytes rejected: %s\r\n",
+                           rejected, wanted, reason);
+    }
+    return rejected;
+}
+
+// Queue input from the local UART console (not rate limited)
+static void input_enqueue_local(const uint8_t *data, int len)
+{
+    if (estop.engaged) {
+        trace(TRACE_REJECT, TRACE_SRC_LOCAL, len);
+        return;
+    }
+    trace(TRACE_ENQUEUE, TRACE_SRC_LOCAL, len);
+    for (int i = 0; i < len; i++) {
+        if (data[i] == '\0') {
+            continue;
+        }
+        input_event_t ev = {
+            .c = data[i], .user = -1, .slot = -1, .gen = 0,
+            .at_ms = esp_timer_get_time() / 1000,
+        };
+        xQueueSend(input_queue, &ev, portMAX_DELAY);
+    }
+}
+
+// Return the queue accounting held by an event once it is typed, or dropped
+// by an emergency stop
+static void input_release(const input_event_t *ev, bool typed)
+{
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    if (ev->user >= 0) {
+        ssh_user_stats_t *stats = &ssh_user_stats[ev->user];
+        if (stats->bucket.queued > 0) {
+            stats->bucket.queued--;
+        }
+        stats->typed += typed;
+    } else {
+        local_typed += typed;
+    }
+    estop.dropped += !typed;
+    if (ev->slot >= 0) {
+        ssh_client_t *client = &ssh_clients[ev->slot];
+        if (client->in_use && client->gen == ev->gen && client->bucket.queued > 0) {
+            client->bucket.queued--;
+        }
+    }
+    xSemaphoreGive(input_lock);
+}
+
+// The spiffs partition holds the job spool and stored templates
+#define SPIFFS_BASE "/spiffs"
+
+static bool spiffs_ready = false;
+
+static void spiffs_init(void)
+{
+    esp_vfs_spiffs_conf_t conf = {
+        .base_path = SPIFFS_BASE,
+        .partition_label = "spiffs",
+        .max_files = 4,
+        .format_if_mount_failed = true,
+    };
+    esp_err_t ret = esp_vfs_spiffs_register(&conf);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mount spiffs: %s", esp_err_to_name(ret));
+        return;
+    }
+    spiffs_ready = true;
+}
+
+// Stored payloads (the job spool and templates) are LZSS streams when that
+// makes them smaller; see lzss.h. Counters cover what was packed since boot.
+// Guarded by input_lock.
+static uint32_t pack_count, pack_plain_bytes, pack_packed_bytes;
+static int64_t pack_us;
+
+#if CONFIG_SSH_PAYLOAD_COMPRESS
+// Compress `size` bytes. Returns a stream of *packed_size bytes for the
+// caller to free, or NULL when it would not be smaller or memory is short.
+static uint8_t *payload_pack(const void *data, uint32_t size, uint32_t *packed_size)
+{
+    lz_encoder_t *enc = malloc(sizeof(*enc));
+    uint8_t *out = enc && size > 1 ? malloc(size - 1) : NULL;
+    uint32_t len = 0;
+    if (out) {
+        int64_t start = esp_timer_get_time();
+        len = lz_compress(enc, data, size, out, size - 1);
+        int64_t us = esp_timer_get_time() - start;
+
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        pack_count++;
+        pack_plain_bytes += size;
+        pack_packed_bytes += len ? len : size;
+        pack_us += us;
+        xSemaphoreGive(input_lock);
+    }
+    free(enc);
+    if (!len) {
+        free(out);
+        return NULL;
+    }
+    uint8_t *shrunk = realloc(out, len);
+    *packed_size = len;
+    return shrunk ? shrunk : out;
+}
+#endif
+
+// Template rendering: a stored template plus the variable values captured
+// when it was triggered. Output is produced a character at a time on demand,
+// so a rendered job never exists as a whole in memory. Placeholders are
+// {{name}}; unknown names are typed literally.
+#define TPL_MAX_SIZE CONFIG_SSH_TEMPLATE_MAX_SIZE
+#define TPL_VALUE_MAX 40
+#define TPL_WINDOW 256              // Output kept behind the cursor; a power of two
+
+typedef enum {
+    TPL_VAR_ARG1 = 0,               // {{1}} .. {{9}}: trigger arguments
+    TPL_VAR_IP = 9,
+    TPL_VAR_MAC,
+    TPL_VAR_HOSTNAME,
+    TPL_VAR_UPTIME,
+    TPL_VAR_JOB,
+    TPL_VAR_COUNT,
+    TPL_VAR_USER,
+    TPL_VAR_COUNT_ALL,
+} tpl_var_t;
+
+static const char *const tpl_var_names[TPL_VAR_COUNT_ALL] = {
+    "1", "2", "3", "4", "5", "6", "7", "8", "9",
+    "ip", "mac", "hostname", "uptime", "job", "count", "user",
+};
+
+typedef struct {
+    char *text;                     // NUL-terminated template source
+    uint32_t len;
+    char values[TPL_VAR_COUNT_ALL][TPL_VALUE_MAX];
+    uint32_t src;                   // Cursor: position in text,
+    const char *sub;                // inside a substitution (or NULL),
+    uint32_t offset;                // and the output offset it stands at
+    char window[TPL_WINDOW];        // The last TPL_WINDOW characters before offset
+} tpl_render_t;
+
+// Produce the next output character, or -1 at the end
+static int tpl_next(tpl_render_t *r)
+{
+    while (1) {
+        if (r->sub) {
+            if (*r->sub) {
+                return r->window[r->offset++ & (TPL_WINDOW - 1)] = *r->sub++;
+            }
+            r->sub = NULL;
+        }
+        if (r->src >= r->len) {
+            return -1;
+        }
+
+        const char *p = r->text + r->src;
+        const char *end = p[0] == '{' && p[1] == '{' ? strstr(p + 2, "}}") : NULL;
+        for (int i = 0; end && i < TPL_VAR_COUNT_ALL; i++) {
+            size_t n = strlen(tpl_var_names[i]);
+            if ((size_t)(end - p - 2) == n && strncmp(p + 2, tpl_var_names[i], n) == 0) {
+                r->sub = r->values[i];
+                r->src = end + 2 - r->text;
+                break;
+            }
+        }
+        if (r->sub) {
+            continue;
+        }
+        r->src++;
+        return r->window[r->offset++ & (TPL_WINDOW - 1)] = *p;
+    }
+}
+
+// Output character at `offset`. Going forward, and looking back up to
+// TPL_WINDOW characters (the delivery ack checksums what was just typed),
+// is O(1) per character, as with the LZSS decoder; going back further (a
+// rewind after a NAK, or a resume) re-renders from the start.
+static char tpl_char_at(tpl_render_t *r, uint32_t offset)
+{
+    if (offset < r->offset && r->offset - offset <= TPL_WINDOW) {
+        return r->window[offset & (TPL_WINDOW - 1)];
+    }
+    if (offset < r->offset) {
+        r->src = 0;
+        r->sub = NULL;
+        r->offset = 0;
+    }
+    int c = 0;
+    while (r->offset <= offset && (c = tpl_next(r)) >= 0) {
+    }
+    return c < 0 ? 0 : c;
+}
+
+static uint32_t tpl_render_size(tpl_render_t *r)
+{
+    r->src = 0;
+    r->sub = NULL;
+    r->offset = 0;
+    while (tpl_next(r) >= 0) {
+    }
+    return r->offset;
+}
+
+static void tpl_render_free(tpl_render_t *r)
+{
+    if (r) {
+        free(r->text);
+        free(r);
+    }
+}
+
+// Target-application profiles. Editors and shells reinterpret typed text:
+// auto-indent, auto-closed brackets, completion on Tab or Enter. A profile
+// frames a job with guard keys that make the application take its input
+// literally (bracketed paste, vim's 'paste'), and normalizes what the guards
+// do not cover. Guarded profiles type at the fastest report rate unless
+// 'pacing' set an explicit rate for the host. Shared by jobs and the sweep.
+#define APP_NORM_CRLF    0x01    // Drop CR before LF; Enter once per line
+#define APP_NORM_INDENT  0x02    // Drop leading whitespace; the editor indents
+#define APP_NORM_DISMISS 0x04    // ESC before Enter and Tab closes completion popups
+#define APP_NORM_BLOCKS  0x08    // Line-by-line REPL: no blank lines inside a block, one after it
+#define APP_NORM_TABS    0x10    // Leading tabs as spaces, so they do not complete
+#define APP_TAB_WIDTH 8
+
+typedef struct {
+    const char *name;
+    const char *preamble;    // Typed before the job, and again when an interrupted job resumes
+    const char *postamble;   // Typed after the job's last byte
+    uint8_t normalize;       // APP_NORM_* flags
+    bool full_rate;          // The guards make the fastest rate safe
+    const char *help;
+} app_profile_t;
+
+static const app_profile_t app_profiles[] = {
+    { "raw",    "", "", 0, false, "bytes as they are (default)" },
+    { "shell",  "\x1b[200~", "\x1b[201~", APP_NORM_CRLF, true,
+      "bracketed paste: bash, zsh, fish, python 3.13+, ipython" },
+    { "vim",    "\x1b:set paste\ra", "\x1b:set nopaste\ra", APP_NORM_CRLF, true,
+      "'paste' on around the job; starts and ends in insert mode" },
+    { "nano",   "\x1b[200~", "\x1b[201~", APP_NORM_CRLF, true, "bracketed paste" },
+    { "python", "", "\n", APP_NORM_CRLF | APP_NORM_BLOCKS | APP_NORM_TABS, false,
+      "classic line-by-line REPL (python 3.12 and older)" },
+    { "vscode", "", "", APP_NORM_CRLF | APP_NORM_INDENT | APP_NORM_DISMISS, false,
+      "editor re-indents; popups dismissed before Enter and Tab" },
+};
+
+#define APP_PROFILE_COUNT (sizeof(app_profiles) / sizeof(app_profiles[0]))
+
+// One report interval down and one up: the fastest a key can go
+static const key_pacing_t app_pacing_full = {
+    "full", 1000 / (2 * HID_POLL_INTERVAL_MS), HID_POLL_INTERVAL_MS, HID_POLL_INTERVAL_MS,
+};
+
+static uint8_t app_default = 0;
+
+static int app_profile_find(const char *name, size_t len)
+{
+    for (int i = 0; i < APP_PROFILE_COUNT; i++) {
+        if (strlen(app_profiles[i].name) == len && strncmp(app_profiles[i].name, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Profile named by an "app=<name>" word in a command line, else the default
+static int app_profile_arg(const char *line)
+{
+    for (const char *p = strstr(line, "app="); p; p = strstr(p + 1, "app=")) {
+        if (p == line || p[-1] == ' ') {
+            return app_profile_find(p + 4, strcspn(p + 4, " \r\n"));
+        }
+    }
+    return app_default;
+}
+
+static const key_pacing_t *app_pacing(uint8_t app)
+{
+    return app_profiles[app].full_rate && key_pacing.cps == 0 ? &app_pacing_full : &key_pacing;
+}
+
+// Normalizer state across the bytes of one text
+typedef struct {
+    bool bol;                // Nothing of the current line consumed yet
+    bool lead;               // Still in the line's leading whitespace
+    bool indented;           // The current line starts with whitespace
+    bool prev_indented;      // So did the last line with content
+    uint8_t col;             // Column within the leading whitespace
+    uint8_t inserted;        // Keys inserted ahead of the current byte
+} app_norm_t;
+
+typedef enum {
+    APP_KEY_SKIP = 0,        // The byte types nothing
+    APP_KEY_TYPE,            // Type *key for the byte
+    APP_KEY_INSERT,          // Type *key, then ask again for the same byte
+} app_key_t;
+
+typedef char (*app_byte_fn)(void *src, uint32_t offset);
+
+typedef enum {
+    APP_FRAME_PRE = 0,       // Typing the preamble
+    APP_FRAME_BODY,
+    APP_FRAME_POST,          // Typing the postamble
+} app_frame_t;
+
+static bool app_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void app_norm_reset(app_norm_t *st, bool bol)
+{
+    *st = (app_norm_t){ .bol = bol, .lead = bol };
+}
+
+// Whitespace up to the end of the line or text
+static bool app_line_blank(app_byte_fn at, void *src, uint32_t offset, uint32_t size)
+{
+    for (; offset < size; offset++) {
+        char c = at(src, offset);
+        if (c == '\n') {
+            return true;
+        }
+        if (!app_space(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A top-level line that continues the compound statement before it
+static bool app_line_continues(app_byte_fn at, void *src, uint32_t offset, uint32_t size)
+{
+    static const char *const words[] = { "else", "elif", "except", "finally" };
+    for (int i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        uint32_t n = strlen(words[i]);
+        uint32_t j = 0;
+        while (j < n && offset + j < size && at(src, offset + j) == words[i][j]) {
+            j++;
+        }
+        char next = offset + n < size ? at(src, offset + n) : '\n';
+        if (j == n && !isalnum((unsigned char)next) && next != '_') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// What to type for the byte at `offset` of a text of `size` bytes
+static app_key_t app_normalize(uint8_t app, app_norm_t *st, app_byte_fn at, void *src,
+                               uint32_t offset, uint32_t size, char *key)
+{
+    uint8_t norm = app_profiles[app].normalize;
+    char c = at(src, offset);
+    *key = c;
+
+    if ((norm & APP_NORM_CRLF) && c == '\r' && offset + 1 < size && at(src, offset + 1) == '\n') {
+        return APP_KEY_SKIP;
+    }
+    if ((norm & APP_NORM_BLOCKS) && st->lead && app_line_blank(at, src, offset, size)) {
+        return APP_KEY_SKIP;
+    }
+    if ((norm & APP_NORM_BLOCKS) && st->bol) {
+        st->indented = app_space(c);
+        if (!st->indented && st->prev_indented && st->inserted == 0 &&
+            !app_line_continues(at, src, offset, size)) {
+            // Back at the top level: an empty line closes the open block
+            st->inserted++;
+            *key = '\n';
+            return APP_KEY_INSERT;
+        }
+    }
+    if ((norm & APP_NORM_INDENT) && st->lead && app_space(c)) {
+        return APP_KEY_SKIP;
+    }
+    if ((norm & APP_NORM_TABS) && st->lead && c == '\t') {
+        *key = ' ';
+        int width = APP_TAB_WIDTH - st->col % APP_TAB_WIDTH;
+        if (st->inserted + 1 < width) {
+            st->inserted++;
+            return APP_KEY_INSERT;
+        }
+        return APP_KEY_TYPE;
+    }
+    if ((norm & APP_NORM_DISMISS) && (c == '\n' || c == '\t') && st->inserted == 0) {
+        st->inserted++;
+        *key = '\x1b';
+        return APP_KEY_INSERT;
+    }
+    return APP_KEY_TYPE;
+}
+
+// Account for the byte at the current offset having been consumed
+static void app_norm_advance(app_norm_t *st, char c)
+{
+    if (c == '\n') {
+        if (!st->lead) {
+            st->prev_indented = st->indented;
+        }
+        st->bol = st->lead = true;
+        st->col = 0;
+    } else {
+        st->bol = false;
+        st->lead = st->lead && app_space(c);
+        st->col += c == '\t' ? APP_TAB_WIDTH - st->col % APP_TAB_WIDTH : 1;
+    }
+    st->inserted = 0;
+}
+
+// Jobs: bulk text uploaded in one piece and typed in FIFO order in the gaps
+// between interactive keystrokes. Guarded by input_lock.
+#define JOB_MAX 4
+#define JOB_MAX_SIZE CONFIG_SSH_JOB_MAX_SIZE
+#define JOB_IDLE_POLL_MS 20
+
+typedef enum {
+    JOB_FREE = 0,
+    JOB_UPLOADING,
+    JOB_QUEUED,
+    JOB_TYPING,
+    JOB_PAUSED,
+    JOB_INTERRUPTED,         // USB went away or the device reset; waits for resume
+    JOB_DONE,
+    JOB_ABORTED,
+} job_state_t;
+
+static const char *const job_state_names[] = {
+    "free", "uploading", "queued", "typing", "paused", "interrupted", "done", "aborted",
+};
+
+typedef struct {
+    uint32_t id;
+    job_state_t state;
+    int user;
+    char name[24];
+    char *data;
+    tpl_render_t *render;    // Rendered from a template instead of data
+    uint32_t packed_size;    // data is an LZSS stream of this size (0: plain text)
+    uint32_t size;
+    uint32_t typed;          // Delivered offset
+    uint8_t app;             // app_profiles[] index
+    uint8_t frame;           // app_frame_t
+    uint8_t frame_pos;       // Next key of the preamble or postamble
+    app_norm_t norm;
+    int64_t submitted_us;
+    int64_t started_us;
+    int64_t finished_us;
+    int64_t moved_us;        // Last key out or acknowledged
+    bool stalled;            // job-stalled sent, job-flowing not yet
+    uint8_t progress_pct;    // Last job-progress sent
+#if CONFIG_SSH_JOB_PERSIST
+    bool stored;             // Spooled to flash with an NVS record
+    uint32_t checkpoint;     // Offset last committed to NVS
+#endif
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+    bool ack_tracked;        // Typed while an ack agent was attached
+    uint32_t acked;          // Offset verified by the agent
+    uint32_t summed;         // End of the last chunk announced with SUM
+    int64_t rewind_us;       // Retype from `acked` at this time (0: no rewind)
+    int64_t hold_us;         // No keys before this time, so REWIND arrives first
+    int64_t ack_activity_us; // Last key, ack or rewind
+#endif
+} job_t;
+
+static job_t jobs[JOB_MAX];
+static uint32_t job_next_id = 1;
+
+// What the head job was last held up by, for job-stalled events. Written by
+// the typing task only.
+typedef enum {
+    JOB_WAIT_HOST = 0,       // A report waiting for the host to poll
+    JOB_WAIT_INPUT,          // Interactive input goes first
+    JOB_WAIT_RATE,           // Owner's keys_per_sec
+    JOB_WAIT_ACK,            // Ack window full
+    JOB_WAIT_SELFTEST,
+} job_wait_t;
+
+static const char *const job_wait_names[] = { "host", "input", "rate", "ack", "selftest" };
+static volatile uint8_t job_wait = JOB_WAIT_HOST;
+
+static bool job_is_pending(const job_t *job)
+{
+    return job->state == JOB_QUEUED || job->state == JOB_TYPING || job->state == JOB_PAUSED ||
+           job->state == JOB_INTERRUPTED;
+}
+
+// Offset known to have reached the host: acknowledged when an agent verifies
+// the job, otherwise everything typed
+static uint32_t job_confirmed(const job_t *job)
+{
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+    if (job->ack_tracked) {
+        return job->acked;
+    }
+#endif
+    return job->typed;
+}
+
+#if CONFIG_SSH_JOB_PERSIST
+// Job persistence: payloads are spooled to the spiffs partition before they
+// are queued. The confirmed offset is checkpointed to RTC memory on every key
+// (survives panics and software resets) and committed to NVS every
+// JOB_CHECKPOINT_BYTES by job_store_task, so a power cycle loses at most that
+// much progress. Jobs found at boot come back interrupted until resumed.
+#define JOB_SPOOL_BASE SPIFFS_BASE
+#define JOB_NVS_NAMESPACE "jobs"
+#define JOB_CHECKPOINT_BYTES CONFIG_SSH_JOB_CHECKPOINT_BYTES
+#define JOB_RTC_MAGIC 0x4A4F4231
+#define JOB_STORE_QUEUE_LEN 16
+
+typedef struct {
+    uint32_t id;
+    uint32_t size;
+    uint32_t offset;         // Last committed confirmed offset
+    int32_t user;
+    char name[24];
+    uint8_t app;             // app_profiles[] index
+    uint32_t packed_size;    // Spool file is an LZSS stream of this size (0: plain text)
+} job_record_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t offset;
+} job_rtc_checkpoint_t;
+
+typedef struct {
+    bool remove;             // Otherwise commit `offset`
+    uint32_t id;
+    uint32_t offset;
+} job_store_op_t;
+
+static RTC_NOINIT_ATTR job_rtc_checkpoint_t job_rtc[JOB_MAX];
+static QueueHandle_t job_store_queue;
+static bool job_store_ready = false;
+static uint32_t job_store_commits = 0;
+
+static void job_spool_path(uint32_t id, char *path, size_t size)
+{
+    snprintf(path, size, JOB_SPOOL_BASE "/job%lu.bin", (unsigned long)id);
+}
+
+static void job_record_key(uint32_t id, char *key, size_t size)
+{
+    snprintf(key, size, "job%lu", (unsigned long)id);
+}
+
+static esp_err_t job_record_write(const job_record_t *rec)
+{
+    nvs_handle_t nvs;
+    char key[16];
+    job_record_key(rec->id, key, sizeof(key));
+
+    esp_err_t ret = nvs_open(JOB_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_set_blob(nvs, key, rec, sizeof(*rec));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return ret;
+}
+
+// Spool a new job before it is queued, packed if the upload was. Called
+// without input_lock.
+static bool job_store_save(uint32_t id, int user, const char *name, uint8_t app, const char *data,
+                           uint32_t size, uint32_t packed_size)
+{
+    if (!job_store_ready) {
+        return false;
+    }
+
+    char path[32];
+    job_spool_path(id, path, sizeof(path));
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        ESP_LOGW(TAG, "Job %lu not persisted: cannot create %s", (unsigned long)id, path);
+        return false;
+    }
+    uint32_t stored = packed_size ? packed_size : size;
+    bool ok = fwrite(data, 1, stored, f) == stored;
+    ok = fclose(f) == 0 && ok;
+
+    if (ok) {
+        job_record_t rec = { .id = id, .size = size, .offset = 0, .user = user, .app = app,
+                             .packed_size = packed_size };
+        strlcpy(rec.name, name, sizeof(rec.name));
+        ok = job_record_write(&rec) == ESP_OK;
+    }
+    if (!ok) {
+        unlink(path);
+        ESP_LOGW(TAG, "Job %lu not persisted: spool full", (unsigned long)id);
+    }
+    return ok;
+}
+
+// Record progress; called with input_lock held whenever the confirmed offset moves
+static void job_checkpoint(job_t *job, bool commit)
+{
+    uint32_t offset = job_confirmed(job);
+    job_rtc_checkpoint_t *rtc = &job_rtc[job - jobs];
+    rtc->id = job->id;
+    rtc->offset = offset;
+    rtc->magic = JOB_RTC_MAGIC;
+
+    uint32_t moved = offset > job->checkpoint ? offset - job->checkpoint : job->checkpoint - offset;
+    if (job->stored && moved > 0 && (commit || moved >= JOB_CHECKPOINT_BYTES)) {
+        job_store_op_t op = { .remove = false, .id = job->id, .offset = offset };
+        if (xQueueSend(job_store_queue, &op, 0) == pdTRUE) {
+            job->checkpoint = offset;
+        }
+    }
+}
+
+// Forget a finished job; called with input_lock held
+static void job_store_remove(job_t *job)
+{
+    job_rtc[job - jobs].magic = 0;
+    if (job->stored) {
+        job_store_op_t op = { .remove = true, .id = job->id };
+        xQueueSend(job_store_queue, &op, portMAX_DELAY);
+        job->stored = false;
+    }
+}
+
+// Flash writes happen here, never in the typing path
+static void job_store_task(void *pvParameters)
+{
+    job_store_op_t op;
+
+    while (1) {
+        xQueueReceive(job_store_queue, &op, portMAX_DELAY);
+
+        char key[16];
+        nvs_handle_t nvs;
+        job_record_key(op.id, key, sizeof(key));
+        if (nvs_open(JOB_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+            continue;
+        }
+        if (op.remove) {
+            char path[32];
+            nvs_erase_key(nvs, key);
+            job_spool_path(op.id, path, sizeof(path));
+            unlink(path);
+        } else {
+            job_record_t rec;
+            size_t len = sizeof(rec);
+            if (nvs_get_blob(nvs, key, &rec, &len) == ESP_OK && len == sizeof(rec)) {
+                rec.offset = op.offset;
+                nvs_set_blob(nvs, key, &rec, sizeof(rec));
+                job_store_commits++;
+            }
+        }
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+// Bring one stored job back as interrupted, or drop its record if it can't be
+static void job_store_recover(const char *key, const job_rtc_checkpoint_t *rtc)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(JOB_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+
+    job_record_t rec;
+    size_t len = sizeof(rec);
+    char path[32] = "";
+    char *data = NULL;
+    bool ok = nvs_get_blob(nvs, key, &rec, &len) == ESP_OK && len == sizeof(rec) &&
+              rec.size > 0 && rec.size <= JOB_MAX_SIZE && rec.offset < rec.size &&
+              rec.packed_size < rec.size;
+    if (ok) {
+        uint32_t stored = rec.packed_size ? rec.packed_size : rec.size;
+        job_spool_path(rec.id, path, sizeof(path));
+        FILE *f = fopen(path, "rb");
+        data = f ? malloc(stored) : NULL;
+        ok = data && fread(data, 1, stored, f) == stored;
+        if (f) {
+            fclose(f);
+        }
+    }
+    if (ok && (rec.user < 0 || rec.user >= SSH_USER_COUNT)) {
+        // Spooled by an account this build does not have (e.g. bot, since
+        // turned off); handing it to another user would widen who can type it
+        ESP_LOGW(TAG, "Job %lu was spooled by user %ld, who no longer exists",
+                 (unsigned long)rec.id, (long)rec.user);
+        ok = false;
+    }
+    if (ok && rec.packed_size) {
+        // A damaged stream would type garbage; check it decodes to the full size
+        lz_decoder_t *scratch = malloc(sizeof(*scratch));
+        ok = scratch && lz_check((const uint8_t *)data, rec.packed_size, rec.size, scratch);
+        free(scratch);
+    }
+
+    // The RTC checkpoint is newer than NVS unless power was lost
+    uint32_t offset = ok ? rec.offset : 0;
+    for (int i = 0; ok && i < JOB_MAX; i++) {
+        if (rtc[i].magic == JOB_RTC_MAGIC && rtc[i].id == rec.id &&
+            rtc[i].offset > offset && rtc[i].offset < rec.size) {
+            offset = rtc[i].offset;
+        }
+    }
+
+    job_t *job = NULL;
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    for (int i = 0; ok && i < JOB_MAX && !job; i++) {
+        if (jobs[i].state == JOB_FREE) {
+            job = &jobs[i];
+        }
+    }
+    if (job) {
+        memset(job, 0, sizeof(*job));
+        job->id = rec.id;
+        job->state = JOB_INTERRUPTED;
+        job->user = rec.user;
+        strlcpy(job->name, rec.name, sizeof(job->name));
+        job->app = rec.app < APP_PROFILE_COUNT ? rec.app : 0;
+        job->data = data;
+        job->packed_size = rec.packed_size;
+        job->size = rec.size;
+        job->typed = offset;
+        job->submitted_us = esp_timer_get_time();
+        job->stored = true;
+        job->checkpoint = rec.offset;
+        job_checkpoint(job, false);
+        if (rec.id >= job_next_id) {
+            job_next_id = rec.id + 1;
+        }
+    }
+    xSemaphoreGive(input_lock);
+
+    if (job) {
+        ESP_LOGW(TAG, "Job %lu recovered at %lu/%lu bytes; 'job resume %lu' continues it",
+                 (unsigned long)rec.id, (unsigned long)offset, (unsigned long)rec.size, (unsigned long)rec.id);
+    } else {
+        ESP_LOGW(TAG, "Dropping stored job record %s", key);
+        free(data);
+        nvs_erase_key(nvs, key);
+        nvs_commit(nvs);
+        if (path[0]) {
+            unlink(path);
+        }
+    }
+    nvs_close(nvs);
+}
+
+// Recover jobs pending at the last reset. Needs NVS and the mounted spool.
+static void job_store_init(void)
+{
+    if (!spiffs_ready) {
+        ESP_LOGE(TAG, "Job spool not available");
+        return;
+    }
+
+    job_store_queue = xQueueCreate(JOB_STORE_QUEUE_LEN, sizeof(job_store_op_t));
+    assert(job_store_queue);
+
+    // Take the RTC checkpoints over before recovery rewrites them
+    job_rtc_checkpoint_t rtc[JOB_MAX];
+    memcpy(rtc, job_rtc, sizeof(rtc));
+    memset(job_rtc, 0, sizeof(job_rtc));
+
+    // Collect keys first; records are erased while recovering
+    char keys[2 * JOB_MAX][NVS_KEY_NAME_MAX_SIZE];
+    int key_count = 0;
+    nvs_iterator_t it = NULL;
+    esp_err_t ret = nvs_entry_find(NVS_DEFAULT_PART_NAME, JOB_NVS_NAMESPACE, NVS_TYPE_BLOB, &it);
+    while (ret == ESP_OK && key_count < 2 * JOB_MAX) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        strlcpy(keys[key_count++], info.key, NVS_KEY_NAME_MAX_SIZE);
+        ret = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+
+    for (int i = 0; i < key_count; i++) {
+        job_store_recover(keys[i], rtc);
+    }
+
+    xTaskCreate(job_store_task, "job_store", 3072, NULL, 4, NULL);
+    job_store_ready = true;
+}
+#endif
+
+static job_t *job_find(uint32_t id)
+{
+    for (int i = 0; i < JOB_MAX; i++) {
+        if (jobs[i].state != JOB_FREE && jobs[i].id == id) {
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+// Oldest pending job; a paused head blocks the jobs behind it
+static job_t *job_head(void)
+{
+    job_t *head = NULL;
+    for (int i = 0; i < JOB_MAX; i++) {
+        if (job_is_pending(&jobs[i]) && (!head || jobs[i].id < head->id)) {
+            head = &jobs[i];
+        }
+    }
+    return head;
+}
+
+static void job_finish(job_t *job, job_state_t state)
+{
+#if CONFIG_SSH_JOB_PERSIST
+    job_store_remove(job);
+#endif
+    job->state = state;
+    job->finished_us = esp_timer_get_time();
+    if (state == JOB_DONE) {
+        int64_t ms = (job->finished_us - job->started_us) / 1000;
+        event_emit(EVENT_JOB_DONE, job->id, "size=%lu ms=%lld wait_ms=%lld cps=%lu", (unsigned long)job->size,
+                   (long long)ms, (long long)((job->started_us - job->submitted_us) / 1000),
+                   (unsigned long)(ms > 0 ? job->size * 1000ULL / ms : 0));
+    } else {
+        event_emit(EVENT_JOB_ABORTED, job->id, "typed=%lu size=%lu", (unsigned long)job_confirmed(job),
+                   (unsigned long)job->size);
+    }
+    free(job->data);
+    job->data = NULL;
+    tpl_render_free(job->render);
+    job->render = NULL;
+}
+
+// Packed jobs decode through one shared decoder, so they cost a fixed
+// LZ_WINDOW_SIZE of RAM while typing however many are queued. Only the head
+// job types, and switching jobs decodes again from the start.
+static lz_decoder_t job_unpack;
+static uint32_t job_unpack_id;
+
+// Character at `offset` of a job's text; called with input_lock held
+static char job_byte(job_t *job, uint32_t offset)
+{
+    if (job->render) {
+        return tpl_char_at(job->render, offset);
+    }
+    if (job->packed_size) {
+        if (job_unpack_id != job->id) {
+            lz_decoder_init(&job_unpack, (const uint8_t *)job->data, job->packed_size, job->size);
+            job_unpack_id = job->id;
+        }
+        int c = lz_byte_at(&job_unpack, offset);
+        return c < 0 ? 0 : c;
+    }
+    return job->data[offset];
+}
+
+static char job_byte_at(void *job, uint32_t offset)
+{
+    return job_byte(job, offset);
+}
+
+// Arm the application guards when a job starts or resumes typing
+static void app_job_start(job_t *job)
+{
+    job->frame = APP_FRAME_PRE;
+    job->frame_pos = 0;
+    app_norm_reset(&job->norm, job->typed == 0 || job_byte(job, job->typed - 1) == '\n');
+}
+
+// Next key of a typing job under its application profile. Returns the key
+// (0: the byte types nothing) and whether it consumes the byte at `typed`.
+static char app_job_key(job_t *job, bool *consume)
+{
+    const app_profile_t *app = &app_profiles[job->app];
+    *consume = false;
+    if (job->frame == APP_FRAME_PRE && app->preamble[job->frame_pos]) {
+        return app->preamble[job->frame_pos];
+    }
+    if (job->frame == APP_FRAME_POST) {
+        return app->postamble[job->frame_pos];
+    }
+    job->frame = APP_FRAME_BODY;
+
+    char key;
+    app_key_t kind = app_normalize(job->app, &job->norm, job_byte_at, job, job->typed, job->size, &key);
+    *consume = kind != APP_KEY_INSERT;
+    return kind == APP_KEY_SKIP ? 0 : key;
+}
+
+// Account for a key app_job_key() chose having gone out. Returns true once
+// the job's last byte and its postamble are done.
+static bool app_job_advance(job_t *job, bool consume)
+{
+    const app_profile_t *app = &app_profiles[job->app];
+    if (job->frame != APP_FRAME_BODY) {
+        job->frame_pos++;
+        return job->frame == APP_FRAME_POST && !app->postamble[job->frame_pos];
+    }
+    if (!consume) {
+        return false;
+    }
+    app_norm_advance(&job->norm, job_byte(job, job->typed));
+    job->typed++;
+    if (job->typed < job->size) {
+        return false;
+    }
+    job->frame = APP_FRAME_POST;
+    job->frame_pos = 0;
+    return !app->postamble[0];
+}
+
+// Hold a queued or typing job where it is; called with input_lock held
+static void job_pause(job_t *job)
+{
+    job->state = JOB_PAUSED;
+    event_emit(EVENT_JOB_PAUSED, job->id, "typed=%lu size=%lu", (unsigned long)job_confirmed(job),
+               (unsigned long)job->size);
+#if CONFIG_SSH_JOB_PERSIST
+    job_checkpoint(job, true);
+#endif
+}
+
+// A key of the job went out or was acknowledged; called with input_lock held
+static void job_moved(job_t *job)
+{
+    int64_t now = esp_timer_get_time();
+    if (job->stalled) {
+        job->stalled = false;
+        event_emit(EVENT_JOB_FLOWING, job->id, "stalled_ms=%lld", (long long)((now - job->moved_us) / 1000));
+    }
+    job->moved_us = now;
+    if (!events_on()) {
+        return;
+    }
+    uint32_t confirmed = job_confirmed(job);
+    uint32_t pct = (uint64_t)confirmed * 100 / job->size;
+    if (pct < 100 && pct / EVENT_PROGRESS_PCT > job->progress_pct / EVENT_PROGRESS_PCT) {
+        job->progress_pct = pct;
+        int64_t ms = (now - job->started_us) / 1000;
+        event_emit(EVENT_JOB_PROGRESS, job->id, "pct=%lu typed=%lu size=%lu cps=%lu", (unsigned long)pct,
+                   (unsigned long)confirmed, (unsigned long)job->size,
+                   (unsigned long)(ms > 0 ? confirmed * 1000ULL / ms : 0));
+    }
+}
+
+static void job_complete(job_t *job)
+{
+    job_finish(job, JOB_DONE);
+    ESP_LOGI(TAG, "Job %lu done: %lu bytes in %lld ms", (unsigned long)job->id,
+             (unsigned long)job->size, (long long)((job->finished_us - job->started_us) / 1000));
+}
+
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+// Delivery acknowledgement over USB CDC-ACM. An optional agent on the target
+// host reads back what was typed and verifies it chunk by chunk:
+//   device -> agent: HELLO <chunk> <window>, JOB <id> <size>,
+//                    SUM <id> <offset> <len> <echo_len> <crc32>, REWIND <id> <offset>
+//   agent -> device: HELLO, ACK <id> <offset>, NAK <id> <offset>
+// Offsets count job bytes; the checksum covers what a raw-mode terminal on
+// the host reads back for them (see hid_echo_char).
+// A job typed while the agent is attached never runs more than ACK_WINDOW
+// bytes ahead of the verified offset. A NAK, or no ack within ACK_TIMEOUT_MS
+// of the last key, retypes from the verified offset only.
+#define ACK_CDC_ITF 0
+#define ACK_CHUNK 64
+#define ACK_WINDOW (2 * ACK_CHUNK)
+_Static_assert(ACK_WINDOW <= TPL_WINDOW, "checksums re-read template output from behind the cursor");
+#define ACK_TIMEOUT_MS 3000
+#define ACK_SETTLE_MS 100    // Quiet time on either side of a REWIND
+
+static SemaphoreHandle_t ack_write_lock;
+static bool ack_agent_ready = false;   // HELLO seen since the port was opened
+static uint32_t ack_count, nak_count, ack_timeouts, ack_retyped;
+
+static void ack_send(const char *fmt, ...)
+{
+    char line[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len <= 0 || !tud_cdc_n_connected(ACK_CDC_ITF)) {
+        return;
+    }
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+
+    xSemaphoreTake(ack_write_lock, portMAX_DELAY);
+    tud_cdc_n_write(ACK_CDC_ITF, line, len);
+    tud_cdc_n_write_flush(ACK_CDC_ITF);
+    xSemaphoreGive(ack_write_lock);
+}
+
+// What a raw terminal with a US layout reads back after send_key(c); 0 if
+// send_key() types nothing for c
+static char hid_echo_char(char c)
+{
+    if (c == '\n') {
+        return '\r';
+    }
+    if (c == '\b') {
+        return 0x7F;
+    }
+    return char_to_hid_keycode(c) ? c : 0;
+}
+
+static bool ack_agent_attached(void)
+{
+    return ack_agent_ready && tud_cdc_n_connected(ACK_CDC_ITF);
+}
+
+// Called with input_lock held
+static void ack_handle_line(const char *line)
+{
+    char verb[8];
+    unsigned long id = 0, offset = 0;
+    int fields = sscanf(line, "%7s %lu %lu", verb, &id, &offset);
+    if (fields < 1) {
+        return;
+    }
+
+    if (strcmp(verb, "HELLO") == 0) {
+        ack_agent_ready = true;
+        ack_send("HELLO %d %d\n", ACK_CHUNK, ACK_WINDOW);
+        ESP_LOGI(TAG, "Ack agent attached");
+        return;
+    }
+
+    job_t *job = fields == 3 ? job_find(id) : NULL;
+    if (!job || !job->ack_tracked || !job_is_pending(job)) {
+        return;
+    }
+
+    if (strcmp(verb, "ACK") == 0 && offset > job->acked && offset <= job->size) {
+        ack_count++;
+        job->acked = offset;
+        job->ack_activity_us = esp_timer_get_time();
+        job_moved(job);
+#if CONFIG_SSH_JOB_PERSIST
+        job_checkpoint(job, false);
+#endif
+        if (job->acked == job->size) {
+            job_complete(job);
+        }
+    } else if (strcmp(verb, "NAK") == 0 && offset == job->acked && job->rewind_us == 0) {
+        nak_count++;
+        job->rewind_us = esp_timer_get_time() + ACK_SETTLE_MS * 1000LL;
+    }
+}
+
+static void ack_task(void *pvParameters)
+{
+    char line[48];
+    size_t len = 0;
+    uint8_t buf[64];
+
+    while (1) {
+        if (!tud_cdc_n_connected(ACK_CDC_ITF)) {
+            ack_agent_ready = false;
+            len = 0;
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        uint32_t n = tud_cdc_n_available(ACK_CDC_ITF) ? tud_cdc_n_read(ACK_CDC_ITF, buf, sizeof(buf)) : 0;
+        if (n == 0) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (buf[i] != '\n' && buf[i] != '\r') {
+                if (len < sizeof(line) - 1) {
+                    line[len++] = buf[i];
+                }
+                continue;
+            }
+            if (len > 0) {
+                line[len] = '\0';
+                xSemaphoreTake(input_lock, portMAX_DELAY);
+                ack_handle_line(line);
+                xSemaphoreGive(input_lock);
+                len = 0;
+            }
+        }
+    }
+}
+
+// Jobs are verified only if the agent is attached when they start typing.
+// A resumed job starts again from its last confirmed offset.
+static void ack_job_start(job_t *job)
+{
+    job->typed = job_confirmed(job);
+    // The agent checks the job's own bytes, which only the raw profile types unchanged
+    job->ack_tracked = ack_agent_attached() && job->app == 0;
+    job->acked = job->typed;
+    job->summed = job->typed;
+    job->rewind_us = 0;
+    job->hold_us = 0;
+    job->ack_activity_us = esp_timer_get_time();
+    if (job->ack_tracked) {
+        ack_send("JOB %lu %lu %lu\n", (unsigned long)job->id, (unsigned long)job->size,
+                 (unsigned long)job->typed);
+        // Hold the first key until JOB has reached the agent; the REWIND to
+        // the start offset that follows marks where the job's keystrokes begin
+        job->rewind_us = job->ack_activity_us + ACK_SETTLE_MS * 1000LL;
+    }
+}
+
+// Ack bookkeeping for the head job before its next key, called with
+// input_lock held. Returns false while the job has to wait for the agent.
+static bool ack_job_ready(job_t *job)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (!job->ack_tracked) {
+        return true;
+    }
+
+    if (!ack_agent_attached()) {
+        // Agent went away: carry on unacknowledged
+        ESP_LOGW(TAG, "Ack agent lost, job %lu continues unverified", (unsigned long)job->id);
+        job->ack_tracked = false;
+        if (job->typed == job->size) {
+            job_complete(job);
+            return false;
+        }
+        return true;
+    }
+
+    if (job->rewind_us == 0 && job->typed > job->acked &&
+        now - job->ack_activity_us > ACK_TIMEOUT_MS * 1000LL) {
+        ack_timeouts++;
+        job->rewind_us = now + ACK_SETTLE_MS * 1000LL;
+    }
+    if (job->rewind_us != 0) {
+        if (now < job->rewind_us) {
+            return false;
+        }
+        if (job->typed > job->acked) {
+            ESP_LOGW(TAG, "Job %lu: retyping from %lu (%lu bytes unverified)", (unsigned long)job->id,
+                     (unsigned long)job->acked, (unsigned long)(job->typed - job->acked));
+        }
+        ack_retyped += job->typed - job->acked;
+        job->typed = job->acked;
+        job->summed = job->acked;
+        job->rewind_us = 0;
+        job->hold_us = now + ACK_SETTLE_MS * 1000LL;
+        job->ack_activity_us = now;
+        ack_send("REWIND %lu %lu\n", (unsigned long)job->id, (unsigned long)job->acked);
+    }
+
+    if (now < job->hold_us || job->typed == job->size || job->typed >= job->acked + ACK_WINDOW) {
+        return false;
+    }
+
+    if (job->typed == job->summed) {
+        uint8_t echo[ACK_CHUNK];
+        uint32_t len = job->size - job->typed < ACK_CHUNK ? job->size - job->typed : ACK_CHUNK;
+        uint32_t echo_len = 0;
+        for (uint32_t i = 0; i < len; i++) {
+            char e = hid_echo_char(job_byte(job, job->typed + i));
+            if (e) {
+                echo[echo_len++] = e;
+            }
+        }
+        ack_send("SUM %lu %lu %lu %lu %08lx\n", (unsigned long)job->id, (unsigned long)job->typed,
+                 (unsigned long)len, (unsigned long)echo_len,
+                 (unsigned long)esp_rom_crc32_le(0, echo, echo_len));
+        job->summed += len;
+    }
+    return true;
+}
+#endif
+
+#if CONFIG_SSH_KEYBOARD_MSC
+// USB payload drive: a read-only FAT volume on a mass-storage interface next
+// to the keyboard, generated from files uploaded with `drive put` (see
+// fat_volume.h). The host copies them at USB bulk speed instead of having
+// them typed; the keyboard stays usable for the commands that use them.
+// Files live in PSRAM when the module has it, otherwise on the spiffs
+// partition, where they survive a reset. They change only while the drive
+// is ejected: the USB task reads them under drive_lock while it is attached.
+#define DRIVE_LUN 0
+#define DRIVE_SECTORS (32 * 1024 * 1024 / FV_SECTOR_SIZE)   // What the host sees; files use a part
+#define DRIVE_MAX_SIZE (CONFIG_SSH_MSC_DRIVE_KB * 1024)
+#define DRIVE_CHUNK 4096
+#define DRIVE_PSRAM_STEP (256 * 1024)   // PSRAM buffer growth while a file uploads
+
+typedef struct {
+    char name[FV_NAME_MAX];
+    uint32_t size;
+    uint8_t *data;          // PSRAM copy, NULL when the file is on spiffs
+} drive_file_t;
+
+static struct {
+    drive_file_t files[FV_FILES_MAX];
+    int count;
+    bool psram;
+    volatile bool attached;
+    bool changed;           // Report a medium change at the host's next poll
+    FILE *open;             // spiffs file the host is reading
+    int open_index;
+    uint32_t attaches;
+    uint32_t ejects;
+    uint64_t read_bytes;
+    uint32_t read_errors;
+} drive;
+
+static fat_volume_t drive_volume;
+static SemaphoreHandle_t drive_lock;
+
+static void drive_path(const char *name, char *path, size_t size)
+{
+    snprintf(path, size, SPIFFS_BASE "/drv_%s", name);
+}
+
+static uint32_t drive_bytes(void)
+{
+    uint32_t total = 0;
+    for (int i = 0; i < drive.count; i++) {
+        total += drive.files[i].size;
+    }
+    return total;
+}
+
+// Index of the file the host would see under `name` (FAT names ignore case)
+static int drive_find(const char *name)
+{
+    uint8_t want[11], have[11], case_bits;
+    if (!fv_name(name, want, &case_bits)) {
+        return -1;
+    }
+    for (int i = 0; i < drive.count; i++) {
+        if (fv_name(drive.files[i].name, have, &case_bits) && memcmp(want, have, sizeof(want)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// fat_volume read callback, from the USB task with drive_lock held
+static bool drive_read_file(void *ctx, uint32_t offset, uint8_t *dst, uint32_t size)
+{
+    drive_file_t *f = ctx;
+    if (f->data) {
+        memcpy(dst, f->data + offset, size);
+        return true;
+    }
+    int index = f - drive.files;
+    if (!drive.open || drive.open_index != index) {
+        char path[40];
+        if (drive.open) {
+            fclose(drive.open);
+        }
+        drive_path(f->name, path, sizeof(path));
+        drive.open = fopen(path, "rb");
+        drive.open_index = index;
+    }
+    return drive.open && fseek(drive.open, offset, SEEK_SET) == 0 && fread(dst, 1, size, drive.open) == size;
+}
+
+static bool drive_attach(const char **error)
+{
+    if (estop.engaged) {
+        *error = "emergency stop";
+        return false;
+    }
+    xSemaphoreTake(drive_lock, portMAX_DELAY);
+    bool was = drive.attached;
+    if (!was) {
+        // A new serial each time, so the host does not trust what it cached
+        fv_init(&drive_volume, DRIVE_SECTORS, "KBDDRIVE", esp_random(), drive_read_file);
+        for (int i = 0; i < drive.count; i++) {
+            fv_add(&drive_volume, drive.files[i].name, drive.files[i].size, &drive.files[i]);
+        }
+        drive.changed = true;
+        drive.attached = true;
+        drive.attaches++;
+    }
+    int count = drive.count;
+    uint32_t bytes = drive_bytes();
+    xSemaphoreGive(drive_lock);
+
+    if (!was) {
+        event_emit(EVENT_DRIVE, 0, "state=attached files=%d bytes=%lu", count, (unsigned long)bytes);
+        ESP_LOGI(TAG, "Payload drive attached: %d files, %lu bytes", count, (unsigned long)bytes);
+    }
+    return true;
+}
+
+// `by` is ssh, host (it sent an eject) or estop
+static void drive_eject(const char *by)
+{
+    if (!drive.attached) {
+        return;
+    }
+    xSemaphoreTake(drive_lock, portMAX_DELAY);
+    bool was = drive.attached;
+    drive.attached = false;
+    if (drive.open) {
+        fclose(drive.open);
+        drive.open = NULL;
+    }
+    if (was) {
+        drive.ejects++;
+    }
+    xSemaphoreGive(drive_lock);
+
+    if (was) {
+        event_emit(EVENT_DRIVE, 0, "state=ejected by=%s", by);
+        ESP_LOGI(TAG, "Payload drive ejected by %s", by);
+    }
+}
+
+// Drop file i from the list and free its backing; drive_lock held, drive ejected
+static void drive_remove(int i)
+{
+    drive_file_t *f = &drive.files[i];
+    if (f->data) {
+        free(f->data);
+    } else if (!drive.psram) {
+        char path[40];
+        drive_path(f->name, path, sizeof(path));
+        unlink(path);
+    }
+    memmove(f, f + 1, (drive.count - i - 1) * sizeof(*f));
+    drive.count--;
+}
+
+// Pick the backing store and, on spiffs, pick up the files kept from before the reset
+static void drive_init(void)
+{
+    drive_lock = xSemaphoreCreateMutex();
+    drive.psram = heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0;
+    if (!drive.psram && spiffs_ready) {
+        DIR *dir = opendir(SPIFFS_BASE);
+        struct dirent *ent;
+        while (dir && (ent = readdir(dir)) != NULL && drive.count < FV_FILES_MAX) {
+            uint8_t entry[11], case_bits;
+            char path[40];
+            struct stat st;
+            if (strncmp(ent->d_name, "drv_", 4) != 0 || !fv_name(ent->d_name + 4, entry, &case_bits)) {
+                continue;
+            }
+            drive_path(ent->d_name + 4, path, sizeof(path));
+            if (stat(path, &st) == 0) {
+                drive_file_t *f = &drive.files[drive.count++];
+                strlcpy(f->name, ent->d_name + 4, sizeof(f->name));
+                f->size = st.st_size;
+            }
+        }
+        if (dir) {
+            closedir(dir);
+        }
+    }
+    ESP_LOGI(TAG, "Payload drive on %s: %d files, %lu bytes", drive.psram ? "PSRAM" : "spiffs", drive.count,
+             (unsigned long)drive_bytes());
+}
+
+// TinyUSB mass-storage callbacks, one read-only LUN
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
+{
+    memcpy(vendor_id, "ESP32-S3", 8);
+    memcpy(product_id, "Payload Drive   ", 16);
+    memcpy(product_rev, "1.0 ", 4);
+}
+
+bool tud_msc_test_unit_ready_cb(uint8_t lun)
+{
+    if (!drive.attached) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);          // Medium not present
+        return false;
+    }
+    if (drive.changed) {
+        // Once per attach, so the host rereads the volume
+        drive.changed = false;
+        tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION, 0x28, 0x00);     // Medium may have changed
+        return false;
+    }
+    return true;
+}
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size)
+{
+    *block_count = drive.attached ? DRIVE_SECTORS : 0;
+    *block_size = FV_SECTOR_SIZE;
+}
+
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
+{
+    if (load_eject && !start) {
+        drive_eject("host");
+    }
+    return true;
+}
+
+bool tud_msc_is_writable_cb(uint8_t lun)
+{
+    return false;
+}
+
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
+{
+    bool attached = drive.attached;
+    bool ok = false;
+    if (attached) {
+        xSemaphoreTake(drive_lock, portMAX_DELAY);
+        attached = drive.attached;
+        ok = attached && fv_read(&drive_volume, lba, offset, buffer, bufsize);
+        if (ok) {
+            drive.read_bytes += bufsize;
+        } else if (attached) {
+            drive.read_errors++;
+        }
+        xSemaphoreGive(drive_lock);
+    }
+    if (!ok) {
+        if (attached) {
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x11, 0x00);   // Unrecovered read error
+        } else {
+            tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);
+        }
+        return -1;
+    }
+    return bufsize;
+}
+
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize)
+{
+    tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00);           // Write protected
+    return -1;
+}
+
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize)
+{
+    if (scsi_cmd[0] == SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL) {
+        // Accepted, but `drive eject` still ejects: the device decides
+        return 0;
+    }
+    tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);        // Invalid command
+    return -1;
+}
+#endif
+
+// The host stopped listening mid-job: keep the job's place instead of
+// typing into nothing. Called with input_lock held.
+static void job_interrupt(job_t *job)
+{
+    job->typed = job_confirmed(job);
+    job->state = JOB_INTERRUPTED;
+    event_emit(EVENT_JOB_INTERRUPTED, job->id, "typed=%lu size=%lu", (unsigned long)job->typed,
+               (unsigned long)job->size);
+#if CONFIG_SSH_JOB_PERSIST
+    job_checkpoint(job, true);
+#endif
+    ESP_LOGW(TAG, "Job %lu interrupted at %lu/%lu bytes", (unsigned long)job->id,
+             (unsigned long)job->typed, (unsigned long)job->size);
+}
+
+// Type one character of the head job. Returns true if a key was sent.
+// Jobs are paced by their owner's user bucket rate, not its queue limit.
+static bool job_type_next(void)
+{
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    job_t *job = job_head();
+    if (!job || job->state == JOB_PAUSED || job->state == JOB_INTERRUPTED || estop.engaged) {
+        xSemaphoreGive(input_lock);
+        return false;
+    }
+
+    if (!tud_ready()) {
+        if (job->state == JOB_TYPING) {
+            job_interrupt(job);
+        }
+        xSemaphoreGive(input_lock);
+        return false;
+    }
+
+    if (job->state == JOB_QUEUED) {
+        job->state = JOB_TYPING;
+        trace(TRACE_JOB, 0, job->id);
+        if (!job->started_us) {
+            job->started_us = esp_timer_get_time();
+        }
+        job->moved_us = esp_timer_get_time();
+        event_emit(EVENT_JOB_STARTED, job->id, "typed=%lu size=%lu app=%s", (unsigned long)job->typed,
+                   (unsigned long)job->size, app_profiles[job->app].name);
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+        ack_job_start(job);
+#endif
+        app_job_start(job);
+    }
+
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+    if (!ack_job_ready(job)) {
+        job_wait = JOB_WAIT_ACK;
+        xSemaphoreGive(input_lock);
+        return false;
+    }
+#endif
+
+    const rate_limit_t *limit = &ssh_users[job->user].user_limit;
+    token_bucket_t *bucket = &ssh_user_stats[job->user].bucket;
+    if (limit->keys_per_sec != 0) {
+        token_bucket_refill(bucket, limit, esp_timer_get_time());
+        if (bucket->tokens_milli < 1000) {
+            job_wait = JOB_WAIT_RATE;
+            xSemaphoreGive(input_lock);
+            return false;
+        }
+        bucket->tokens_milli -= 1000;
+    }
+    job_wait = JOB_WAIT_HOST;
+
+    uint32_t id = job->id;
+    bool consume;
+    char c = app_job_key(job, &consume);
+    key_pacing_t pace = *app_pacing(job->app);
+    xSemaphoreGive(input_lock);
+
+    bool sent = !c || send_key_timed(c, pace.hold_ms, pace.gap_ms);
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    // The job may have been aborted while the key was being sent, or paused
+    // (by its owner or an emergency stop) after the key went out: a key that
+    // was sent counts either way, or resuming would type it twice. A key an
+    // emergency stop refused is typed again on resume.
+    if (job->id == id && job->state == JOB_TYPING && !sent && !estop.engaged) {
+        job_interrupt(job);
+    } else if (job->id == id && sent && (job->state == JOB_TYPING || job->state == JOB_PAUSED)) {
+        uint32_t typed = job->typed;
+        bool finished = app_job_advance(job, consume);
+        job_moved(job);
+        if (job->typed == typed) {
+            // A guard or inserted key: the job's offset has not moved
+            if (finished) {
+                job_complete(job);
+            }
+            xSemaphoreGive(input_lock);
+            return true;
+        }
+        ssh_user_stats[job->user].typed++;
+#if CONFIG_SSH_JOB_PERSIST
+        job_checkpoint(job, false);
+#endif
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+        job->ack_activity_us = esp_timer_get_time();
+        // Verified jobs complete on the agent's final ACK
+        if (job->ack_tracked) {
+            xSemaphoreGive(input_lock);
+            return true;
+        }
+#endif
+        if (finished) {
+            job_complete(job);
+        }
+    }
+    xSemaphoreGive(input_lock);
+    return true;
+}
+
+// Pacing profiles: how one character period at a given rate is split
+// between holding the key and the gap before the next one. A report stays
+// up for at least one HID poll interval, which caps the rate at PACING_MAX_CPS.
+#define PACING_MAX_CPS (1000 / (2 * HID_POLL_INTERVAL_MS))
+
+typedef enum {
+    PACING_HOLD = 0,         // Long hold, one poll interval of gap
+    PACING_EVEN,             // Half the period each
+    PACING_TAP,              // One poll interval of hold, long gap
+    PACING_PROFILE_COUNT,
+} pacing_profile_t;
+
+static const char *const pacing_profile_names[] = { "hold", "even", "tap" };
+
+static int pacing_profile_find(const char *name, size_t len)
+{
+    for (int i = 0; i < PACING_PROFILE_COUNT; i++) {
+        if (strlen(pacing_profile_names[i]) == len && strncmp(pacing_profile_names[i], name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static key_pacing_t pacing_for_rate(pacing_profile_t profile, uint16_t cps)
+{
+    uint32_t period = 1000 / cps;
+    uint32_t hold;
+    switch (profile) {
+        case PACING_HOLD: hold = period > 2 * HID_POLL_INTERVAL_MS ? period - HID_POLL_INTERVAL_MS : 0; break;
+        case PACING_EVEN: hold = period / 2; break;
+        default:          hold = HID_POLL_INTERVAL_MS; break;
+    }
+    if (hold < HID_POLL_INTERVAL_MS) {
+        hold = HID_POLL_INTERVAL_MS;
+    }
+    uint32_t gap = period >= hold + HID_POLL_INTERVAL_MS ? period - hold : HID_POLL_INTERVAL_MS;
+    return (key_pacing_t){ pacing_profile_names[profile], cps, hold, gap };
+}
+
+// Self-test sweep: types a deterministic pseudo-random corpus once per
+// profile and rate step. Each step is framed by markers typed at the default
+// pacing, so tools/sweep_check.py can find the step and count its errors.
+// Runs in hid_typing_task; jobs and interactive input wait until it ends.
+#define SWEEP_MAX_RATES 8
+#define SWEEP_MAX_STEPS (SWEEP_MAX_RATES * PACING_PROFILE_COUNT)
+#define SWEEP_MAX_LEN 4096
+
+typedef struct {
+    bool active;
+    bool abort;
+    uint32_t seed;
+    uint16_t len;
+    bool esc;                // Include ESC in the corpus (not for editors)
+    uint8_t app;             // Application profile framing each step
+    uint8_t profiles;        // Bit mask of pacing_profile_t
+    uint8_t rate_count;
+    uint16_t rates[SWEEP_MAX_RATES];
+    uint16_t step_count;
+    uint16_t steps_done;
+    uint16_t achieved_cps_x10[SWEEP_MAX_STEPS];
+} sweep_t;
+
+static sweep_t sweep;
+
+// Corpus generator, mirrored by tools/sweep_check.py: xorshift32 per step,
+// printable ASCII plus Enter, Tab and (optionally) ESC
+static uint32_t sweep_step_seed(uint32_t seed, uint32_t step)
+{
+    uint32_t x = seed * 2654435761u + step + 1;
+    return x ? x : 1;
+}
+
+static char sweep_corpus_char(uint32_t *x, bool esc)
+{
+    static const char extra[] = "\n\t\x1b";
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    uint32_t r = *x % (95 + (esc ? 3 : 2));
+    return r < 95 ? (char)(' ' + r) : extra[r - 95];
+}
+
+static bool sweep_aborted(void)
+{
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    bool aborted = sweep.abort;
+    xSemaphoreGive(input_lock);
+    return aborted;
+}
+
+static void sweep_type_marker(const char *fmt, ...)
+{
+    char marker[64];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(marker, sizeof(marker), fmt, ap);
+    va_end(ap);
+    for (const char *p = marker; *p; p++) {
+        send_key_timed(*p, key_pacing_default.hold_ms, key_pacing_default.gap_ms);
+    }
+}
+
+static char sweep_text_at(void *text, uint32_t offset)
+{
+    return ((const char *)text)[offset];
+}
+
+// Type one step; returns false if the sweep was aborted part way. With an
+// application profile the corpus is normalized and framed like a job, the
+// guards typed at the default pacing outside the timed part.
+static bool sweep_run_step(const sweep_t *cfg, uint32_t step, pacing_profile_t profile, uint16_t cps)
+{
+    const app_profile_t *app = &app_profiles[cfg->app];
+    key_pacing_t pace = pacing_for_rate(profile, cps);
+    char *text = malloc(cfg->len);
+    if (!text) {
+        ESP_LOGE(TAG, "Sweep: no memory for a %u byte step", cfg->len);
+        return false;
+    }
+    uint32_t x = sweep_step_seed(cfg->seed, step);
+    for (int i = 0; i < cfg->len; i++) {
+        text[i] = sweep_corpus_char(&x, cfg->esc);
+    }
+
+    sweep_type_marker("\n@@sweep %lu %s %u %lu %u %d%s%s\n", (unsigned long)step, pace.profile,
+                      pace.cps, (unsigned long)cfg->seed, cfg->len, cfg->esc,
+                      cfg->app ? " " : "", cfg->app ? app->name : "");
+    sweep_type_marker("%s", app->preamble);
+
+    app_norm_t norm;
+    app_norm_reset(&norm, true);
+    int64_t start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < cfg->len; ) {
+        if (sweep_aborted()) {
+            free(text);
+            return false;
+        }
+        char key;
+        app_key_t kind = app_normalize(cfg->app, &norm, sweep_text_at, text, i, cfg->len, &key);
+        if (kind != APP_KEY_SKIP) {
+            send_key_timed(key, pace.hold_ms, pace.gap_ms);
+        }
+        if (kind != APP_KEY_INSERT) {
+            app_norm_advance(&norm, text[i++]);
+        }
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    free(text);
+
+    sweep_type_marker("%s", app->postamble);
+    sweep_type_marker("\n@@end %lu\n", (unsigned long)step);
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    sweep.achieved_cps_x10[step] = elapsed_us > 0 ? (uint16_t)(cfg->len * 10000000LL / elapsed_us) : 0;
+    sweep.steps_done = step + 1;
+    xSemaphoreGive(input_lock);
+    return true;
+}
+
+static void sweep_run(void)
+{
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    sweep_t cfg = sweep;
+    xSemaphoreGive(input_lock);
+
+    ESP_LOGI(TAG, "Sweep: %u steps of %u chars, seed %lu", cfg.step_count, cfg.len, (unsigned long)cfg.seed);
+    uint32_t step = 0;
+    bool completed = true;
+    for (int p = 0; p < PACING_PROFILE_COUNT && completed; p++) {
+        if (!(cfg.profiles & (1 << p))) {
+            continue;
+        }
+        for (int r = 0; r < cfg.rate_count && completed; r++) {
+            completed = sweep_run_step(&cfg, step, p, cfg.rates[r]);
+            step += completed;
+        }
+    }
+    if (completed) {
+        sweep_type_marker("\n@@done\n");
+    }
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    sweep.active = false;
+    xSemaphoreGive(input_lock);
+    ESP_LOGI(TAG, "Sweep %s after %lu steps", completed ? "finished" : "aborted", (unsigned long)step);
+}
+
+static bool sweep_pending(void)
+{
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    bool active = sweep.active;
+    xSemaphoreGive(input_lock);
+    return active;
+}
+
+// Interactive input: terminal escape sequences from SSH sessions and the
+// UART console become special keys, and auto-repeat streams of editing keys
+// are held down on the HID side so the target's own typematic repeat moves
+// the cursor. Terminals that speak the kitty keyboard protocol send exact
+// press, repeat and release events, which are mirrored to the HID report as
+// they happen. The parser itself is in vt_input.c. Only hid_typing_task
+// touches this state.
+#define VT_SOURCES (SSH_MAX_CLIENTS + 1)
+
+static vt_parser_t vt_parsers[VT_SOURCES];
+
+// Auto-repeat coalescing. REPEAT_DETECT events of the same key, each within
+// the release time of the one before and further apart than a paste, make a
+// stream: the key is pressed and held, further events only extend the hold,
+// and it is released once they stop for the release time. "Lag" is the time
+// from the stream's last event arriving until the key stops reaching the
+// host: the release time when held, the queue backlog when typed one by one.
+// Once held, events closer together than a paste still extend the hold: on
+// a laggy link several repeats arrive in one read and share a timestamp.
+#define REPEAT_DETECT 3
+#define REPEAT_MIN_GAP_MS 8
+#define REPEAT_RELEASE_MS_DEFAULT 120
+
+typedef struct {
+    bool enabled;
+    uint16_t release_ms;            // Set with enabled by `repeat`, under input_lock
+    // Current run of identical events
+    int8_t source;
+    key_event_t key;
+    uint16_t count;
+    uint32_t last_at_ms;
+    uint32_t done_ms;               // When the run's last typed event finished
+    bool held;
+    // Totals, read by the `repeat` command under input_lock
+    uint32_t streams;
+    uint32_t coalesced;             // Events absorbed by a held key
+    uint32_t lag_last_ms;
+    uint32_t lag_max_ms;
+    uint64_t lag_total_ms;
+} key_repeat_t;
+
+static key_repeat_t key_repeat = {
+    .enabled = true,
+    .release_ms = REPEAT_RELEASE_MS_DEFAULT,
+    .source = -1,
+};
+
+// Key state mirrored from exact (kitty protocol) events: the report holds
+// what is held on the client's keyboard. The terminal repeats held keys, so
+// a held key with no press or repeat for MIRROR_KEEPALIVE_MS is released in
+// case the release got lost (focus change, terminal closed).
+#define MIRROR_KEEPALIVE_MS 1500
+
+typedef struct {
+    int8_t source;
+    uint8_t gen;
+    uint8_t keys[6];
+    uint8_t mod_keys;               // Modifier keys held down
+    uint8_t mods;                   // Modifiers reported with the last key
+    uint32_t last_ms;
+    // Totals, read by `stats` under input_lock
+    uint32_t events;
+    uint32_t expired;               // Keys released by the keep-alive
+} key_mirror_t;
+
+static key_mirror_t key_mirror = { .source = -1 };
+
+static bool key_mirror_held(void)
+{
+    return key_mirror.keys[0] != 0 || key_mirror.mod_keys != 0;
+}
+
+static void key_mirror_release(void)
+{
+    if (key_mirror_held()) {
+        memset(key_mirror.keys, 0, sizeof(key_mirror.keys));
+        key_mirror.mod_keys = 0;
+        key_mirror.mods = 0;
+        hid_keys_up();
+    }
+}
+
+static void key_mirror_event(const key_event_t *key, int source, uint8_t gen, uint32_t at_ms)
+{
+    key_mirror_t *m = &key_mirror;
+    if (m->source != source || m->gen != gen) {
+        key_mirror_release();
+        m->source = source;
+        m->gen = gen;
+    }
+
+    bool changed = true;
+    if (key->mod_key) {
+        if (key->type == KEY_RELEASE) {
+            m->mod_keys &= ~key->mod_key;
+        } else {
+            m->mod_keys |= key->mod_key;
+        }
+        m->mods = 0;
+    } else {
+        int held = -1, count = 0;
+        for (; count < sizeof(m->keys) && m->keys[count]; count++) {
+            if (m->keys[count] == key->keycode) {
+                held = count;
+            }
+        }
+        changed = m->mods != key->modifier;
+        m->mods = key->modifier;
+        if (key->type == KEY_RELEASE && held >= 0) {
+            memmove(&m->keys[held], &m->keys[held + 1], count - held - 1);
+            m->keys[count - 1] = 0;
+            changed = true;
+        } else if (key->type != KEY_RELEASE && held < 0 && count < sizeof(m->keys)) {
+            m->keys[count] = key->keycode;
+            changed = true;
+        }
+    }
+    if (key->type != KEY_RELEASE) {
+        m->last_ms = at_ms;
+    }
+    // Held keys are released by the keep-alive unless pressed again; held
+    // modifiers alone stay down until released
+    uint32_t hold_ms = m->keys[0] ? MIRROR_KEEPALIVE_MS : 0;
+    if (changed) {
+        hid_report(m->mod_keys | m->mods, m->keys, hold_ms);
+    } else if (key->type != KEY_RELEASE) {
+        hid_hold_plan(hold_ms);
+    }
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    m->events++;
+    xSemaphoreGive(input_lock);
+}
+
+// Release mirrored keys whose session ended or whose keep-alive ran out
+static void key_mirror_check(uint32_t now)
+{
+    key_mirror_t *m = &key_mirror;
+    if (!key_mirror_held()) {
+        return;
+    }
+    bool gone = false;
+    if (m->source > 0) {
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        const ssh_client_t *client = &ssh_clients[m->source - 1];
+        gone = !client->in_use || client->gen != m->gen;
+        xSemaphoreGive(input_lock);
+    }
+    bool expired = m->keys[0] && now - m->last_ms > MIRROR_KEEPALIVE_MS;
+    if (gone || expired) {
+        key_mirror_release();
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        m->expired += expired;
+        xSemaphoreGive(input_lock);
+    }
+}
+
+static uint32_t now_ms(void)
+{
+    return esp_timer_get_time() / 1000;
+}
+
+// Keys whose auto-repeat is worth coalescing: cursor movement and deletion
+static bool key_repeatable(const key_event_t *key)
+{
+    switch (key->keycode) {
+        case HID_KEY_ARROW_UP:
+        case HID_KEY_ARROW_DOWN:
+        case HID_KEY_ARROW_LEFT:
+        case HID_KEY_ARROW_RIGHT:
+        case HID_KEY_BACKSPACE:
+        case HID_KEY_DELETE:
+        case HID_KEY_PAGE_UP:
+        case HID_KEY_PAGE_DOWN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Close the current run, recording its lag if it was a stream
+static void repeat_end(key_repeat_t *r)
+{
+    uint32_t now = now_ms();
+    if (r->held) {
+        hid_keys_up();
+        r->held = false;
+        r->done_ms = now;
+    }
+    if (r->count >= REPEAT_DETECT) {
+        uint32_t lag = r->done_ms - r->last_at_ms;
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        r->streams++;
+        r->lag_last_ms = lag;
+        r->lag_total_ms += lag;
+        if (lag > r->lag_max_ms) {
+            r->lag_max_ms = lag;
+        }
+        xSemaphoreGive(input_lock);
+    }
+    r->count = 0;
+}
+
+// Type one interactive key, or fold it into a held auto-repeat stream
+static void interactive_key(const key_event_t *key, int source, uint32_t at_ms)
+{
+    key_repeat_t *r = &key_repeat;
+    key_mirror_release();
+    bool same = r->count > 0 && r->source == source && memcmp(&r->key, key, sizeof(*key)) == 0;
+    uint32_t gap = at_ms - r->last_at_ms;
+
+    if (same && gap <= r->release_ms && (gap >= REPEAT_MIN_GAP_MS || r->held)) {
+        r->count++;
+    } else {
+        repeat_end(r);
+        r->source = source;
+        r->key = *key;
+        r->count = key_repeatable(key) ? 1 : 0;
+    }
+    r->last_at_ms = at_ms;
+
+    if (r->held) {
+        // Each event of the stream pushes the key's release out again
+        hid_hold_plan(r->release_ms);
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        r->coalesced++;
+        xSemaphoreGive(input_lock);
+        return;
+    }
+    if (r->enabled && r->count >= REPEAT_DETECT && hid_key_down(key->keycode, key->modifier, r->release_ms)) {
+        r->held = true;
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        r->coalesced++;
+        xSemaphoreGive(input_lock);
+        return;
+    }
+
+    if (key->keycode) {
+        send_hid_key(key->keycode, key->modifier, key_pacing.hold_ms, key_pacing.gap_ms);
+    } else {
+        send_key(key->c);
+    }
+    r->done_ms = now_ms();
+}
+
+// Ticks hid_typing_task may sleep before a held key or a lone ESC times out
+static TickType_t interactive_wait(TickType_t wait)
+{
+    uint32_t now = now_ms();
+    uint32_t deadline = UINT32_MAX;
+    if (key_repeat.held || key_repeat.count >= REPEAT_DETECT) {
+        deadline = key_repeat.last_at_ms + key_repeat.release_ms;
+    }
+    if (key_mirror.keys[0] && key_mirror.last_ms + MIRROR_KEEPALIVE_MS < deadline) {
+        deadline = key_mirror.last_ms + MIRROR_KEEPALIVE_MS;
+    }
+    for (int i = 0; i < VT_SOURCES; i++) {
+        if (vt_parsers[i].state != VT_GROUND && vt_parsers[i].esc_ms + VT_ESC_TIMEOUT_MS < deadline) {
+            deadline = vt_parsers[i].esc_ms + VT_ESC_TIMEOUT_MS;
+        }
+    }
+    if (deadline == UINT32_MAX) {
+        return wait;
+    }
+    TickType_t ticks = deadline > now ? pdMS_TO_TICKS(deadline - now) + 1 : 0;
+    return ticks < wait ? ticks : wait;
+}
+
+// Input went quiet: release held keys that timed out and flush lone ESCs.
+// Returns true while a key is still held (jobs wait until it is released).
+static bool interactive_idle(void)
+{
+    uint32_t now = now_ms();
+    key_event_t keys[1];
+
+    for (int i = 0; i < VT_SOURCES; i++) {
+        if (vt_flush(&vt_parsers[i], now, keys)) {
+            interactive_key(&keys[0], i, now);
+        }
+    }
+    if (key_repeat.count > 0 && now - key_repeat.last_at_ms > key_repeat.release_ms) {
+        repeat_end(&key_repeat);
+    }
+    key_mirror_check(now);
+    return key_repeat.held || key_mirror_held();
+}
+
+static void interactive_input(const input_event_t *ev)
+{
+    int source = ev->slot + 1;
+    vt_parser_t *p = &vt_parsers[source];
+    key_event_t keys[VT_EVENTS_MAX];
+
+    if (p->gen != ev->gen) {
+        memset(p, 0, sizeof(*p));
+        p->gen = ev->gen;
+    }
+    p->exact = ev->exact;
+    int n = vt_feed(p, ev->c, ev->at_ms, keys);
+    for (int i = 0; i < n; i++) {
+        if (keys[i].type == KEY_TAP) {
+            interactive_key(&keys[i], source, ev->at_ms);
+        } else {
+            repeat_end(&key_repeat);
+            key_mirror_event(&keys[i], source, ev->gen, ev->at_ms);
+        }
+    }
+}
+
+// Emergency stop on the BOOT button (GPIO0). The ISR only timestamps the
+// press and wakes estop_task, which runs above every task that types: it
+// closes the report gate, queues an all-keys-up report, and pauses jobs, the
+// sweep and the boot key. The host reads the release at its next poll, one
+// report interval after the press (two if a report was already in flight).
+// hid_typing_task drops what is queued. Holding the button for
+// ESTOP_RESUME_MS while stopped lets input in again; paused jobs wait for
+// `job resume`.
+#define ESTOP_DEBOUNCE_MS 20
+#define ESTOP_RESUME_MS 2000
+
+static TaskHandle_t estop_task_handle;
+
+static void IRAM_ATTR estop_isr(void *arg)
+{
+    BaseType_t woken = pdFALSE;
+    if (!estop.press_us) {
+        estop.press_us = (uint32_t)esp_timer_get_time() | 1;
+    }
+    vTaskNotifyGiveFromISR(estop_task_handle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static void estop_engage(const char *by)
+{
+    static const uint8_t none[6] = { 0 };
+    // Under hid_lock, so no key down is between its check and its submission
+    xSemaphoreTake(hid_lock, portMAX_DELAY);
+    estop.engaged = true;
+    xSemaphoreGive(hid_lock);
+    hid_report(0, none, 0);
+    uint32_t press_us = estop.press_us;
+    uint32_t latency = press_us ? (uint32_t)esp_timer_get_time() - press_us : 0;
+    event_emit(EVENT_ESTOP, 0, "state=on by=%s", by);
+
+    int paused = 0;
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    for (int i = 0; i < JOB_MAX; i++) {
+        if (jobs[i].state == JOB_QUEUED || jobs[i].state == JOB_TYPING) {
+            job_pause(&jobs[i]);
+            paused++;
+        }
+    }
+    if (sweep.active) {
+        sweep.abort = true;
+    }
+    estop.count++;
+    if (press_us) {
+        estop.latency_us = latency;
+        if (latency > estop.latency_max_us) {
+            estop.latency_max_us = latency;
+        }
+    }
+    xSemaphoreGive(input_lock);
+    trace(TRACE_ESTOP, 0, 1);
+
+    xSemaphoreTake(boot_key_lock, portMAX_DELAY);
+    bool armed = boot_key.keycode != 0;
+    xSemaphoreGive(boot_key_lock);
+    if (armed) {
+        boot_key_config_t off = { 0 };
+        boot_key_set(&off, "estop");
+    }
+#if CONFIG_SSH_KEYBOARD_MSC
+    drive_eject("estop");
+#endif
+    if (press_us) {
+        ESP_LOGW(TAG, "Emergency stop (%s): keys released %lu us after the press, %d job(s) paused",
+                 by, (unsigned long)latency, paused);
+    } else {
+        ESP_LOGW(TAG, "Emergency stop (%s): keys released, %d job(s) paused", by, paused);
+    }
+}
+
+static void estop_resume(const char *by)
+{
+    estop.engaged = false;
+    trace(TRACE_ESTOP, 0, 0);
+    event_emit(EVENT_ESTOP, 0, "state=off by=%s", by);
+    ESP_LOGW(TAG, "Emergency stop cleared (%s): input accepted again, paused jobs wait for 'job resume'", by);
+}
+
+static void estop_task(void *pvParameters)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (gpio_get_level(APP_BUTTON) != 0) {
+            estop.press_us = 0;         // Bounce
+            continue;
+        }
+
+        // The press that stops never resumes, however long it is held
+        bool resume = estop.engaged;
+        if (!resume) {
+            estop_engage("button");
+        }
+        int64_t pressed_us = esp_timer_get_time();
+        while (gpio_get_level(APP_BUTTON) == 0) {
+            if (resume && esp_timer_get_time() - pressed_us >= ESTOP_RESUME_MS * 1000LL) {
+                estop_resume("button");
+                resume = false;
+            }
+            vTaskDelay(pdMS_TO_TICKS(ESTOP_DEBOUNCE_MS));
+        }
+        vTaskDelay(pdMS_TO_TICKS(ESTOP_DEBOUNCE_MS));
+        estop.press_us = 0;
+        ulTaskNotifyTake(pdTRUE, 0);    // Edges from the release bouncing
+    }
+}
+
+// Needs input_init() and boot_key_init()
+static void estop_init(void)
+{
+    xTaskCreate(estop_task, "estop", 3072, NULL, 15, &estop_task_handle);
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    ESP_ERROR_CHECK(gpio_isr_handler_add(APP_BUTTON, estop_isr, NULL));
+}
+
+// The typing task's part of a stop: forget held keys and half-read escape
+// sequences, and drop input queued before intake closed
+static void estop_drain(void)
+{
+    input_event_t ev;
+    repeat_end(&key_repeat);
+    key_mirror_release();
+    memset(vt_parsers, 0, sizeof(vt_parsers));
+    while (xQueueReceive(input_queue, &ev, pdMS_TO_TICKS(JOB_IDLE_POLL_MS))) {
+        input_release(&ev, false);
+    }
+}
+
+// HID typing task: the only consumer of input_queue and the only job typist.
+// Interactive input always goes first; jobs are typed when the queue is empty.
+static void hid_typing_task(void *pvParameters)
+{
+    input_event_t ev;
+    bool job_active = false;
+
+    while (1) {
+        if (estop.engaged) {
+            estop_drain();
+            job_active = false;
+            continue;
+        }
+        if (sweep_pending()) {
+            job_wait = JOB_WAIT_SELFTEST;
+            sweep_run();
+            continue;
+        }
+        TickType_t wait = interactive_wait(job_active ? 0 : pdMS_TO_TICKS(JOB_IDLE_POLL_MS));
+        if (xQueueReceive(input_queue, &ev, wait)) {
+            job_wait = JOB_WAIT_INPUT;
+            trace(TRACE_DEQUEUE, xPortGetCoreID(), uxQueueMessagesWaiting(input_queue));
+            lat_dequeued(ev.probe);
+            interactive_input(&ev);
+            lat_typed(ev.probe);
+            input_release(&ev, true);
+            continue;
+        }
+        if (interactive_idle()) {
+            job_wait = JOB_WAIT_INPUT;
+            job_active = false;
+            continue;
+        }
+        job_active = job_type_next();
+    }
+}
+
+static void input_init(void)
+{
+    input_queue = xQueueCreate(INPUT_QUEUE_LEN, sizeof(input_event_t));
+    input_lock = xSemaphoreCreateMutex();
+    event_task_lock = xSemaphoreCreateMutex();
+    assert(input_queue && input_lock && event_task_lock);
+
+    for (int i = 0; i < SSH_USER_COUNT; i++) {
+        token_bucket_reset(&ssh_user_stats[i].bucket, &ssh_users[i].user_limit);
+    }
+
+    hid_init();
+    kp_layout_us(&hid_layout);
+    xTaskCreate(hid_typing_task, "hid_typing", 4096, NULL, 11, NULL);
+
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+    ack_write_lock = xSemaphoreCreateMutex();
+    assert(ack_write_lock);
+    xTaskCreate(ack_task, "ack_cdc", 3072, NULL, 6, NULL);
+#endif
+}
+
+static ssh_client_t *ssh_client_alloc(void)
+{
+    ssh_client_t *client = NULL;
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    for (int i = 0; i < SSH_MAX_CLIENTS; i++) {
+        if (!ssh_clients[i].in_use) {
+            client = &ssh_clients[i];
+            uint8_t gen = client->gen + 1;
+            memset(client, 0, sizeof(*client));
+            client->in_use = true;
+            client->gen = gen;
+            client->user = -1;
+            break;
+        }
+    }
+    xSemaphoreGive(input_lock);
+    return client;
+}
+
+static void ssh_client_free(ssh_client_t *client)
+{
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    client->in_use = false;
+    client->session = NULL;
+    client->channel = NULL;
+    xSemaphoreGive(input_lock);
+}
+
+// Bind an authenticated user to a session and start its session bucket
+static void ssh_client_login(ssh_client_t *client, int user)
+{
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    client->user = user;
+    token_bucket_reset(&client->bucket, &ssh_users[user].session_limit);
+    ssh_user_stats[user].sessions++;
+    xSemaphoreGive(input_lock);
+}
+
+// `line` sessions, under input_lock. Every key the editor takes would have
+// been typed on the target without it; only the committed lines are.
+typedef struct {
+    uint32_t sessions;
+    uint32_t lines;
+    uint32_t keys;
+    uint32_t typed;         // Bytes of the committed lines, newlines included
+} line_stats_t;
+
+static line_stats_t line_stats;
+
+// Exec commands: `ssh admin@<ip> <command>` runs one of these instead of a shell
+typedef void (*ssh_command_fn)(ssh_client_t *client, const char *args);
+
+typedef struct {
+    const char *name;
+    const char *help;
+    ssh_command_fn fn;
+} ssh_command_t;
+
+static void cmd_stats(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+
+    // Copied under input_lock and printed once it is released, so a client
+    // that is slow to read cannot hold up typing
+    ssh_user_stats_t users[SSH_USER_COUNT];
+    struct {
+        int user;
+        uint32_t accepted;
+        uint32_t rejected;
+        uint32_t queued;
+        bool kitty;
+        char cipher[32];
+    } sessions[SSH_MAX_CLIENTS];
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    memcpy(users, ssh_user_stats, sizeof(users));
+    uint32_t uart_typed = local_typed;
+    kex_stats_t kex = kex_stats;
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+    uint32_t acks = ack_count, naks = nak_count, ack_timeout_count = ack_timeouts, retyped = ack_retyped;
+#endif
+#if CONFIG_SSH_JOB_PERSIST
+    uint32_t checkpoints = job_store_commits;
+#endif
+    uint32_t packs = pack_count, plain_bytes = pack_plain_bytes, packed_bytes = pack_packed_bytes;
+    int64_t packing_us = pack_us;
+    estop_t stop = estop;
+    line_stats_t lines = line_stats;
+    uint32_t mirror_events = key_mirror.events, mirror_expired = key_mirror.expired;
+    for (int i = 0; i < SSH_MAX_CLIENTS; i++) {
+        const ssh_client_t *c = &ssh_clients[i];
+        sessions[i].user = c->in_use ? c->user : -1;
+        if (sessions[i].user >= 0) {
+            sessions[i].accepted = c->accepted;
+            sessions[i].rejected = c->rejected;
+            sessions[i].queued = c->bucket.queued;
+            sessions[i].kitty = c->kitty;
+            const char *cipher = ssh_get_cipher_in(c->session);
+            strlcpy(sessions[i].cipher, cipher ? cipher : "-", sizeof(sessions[i].cipher));
+        }
+    }
+    xSemaphoreGive(input_lock);
+
+    ssh_channel_printf(ch, "input queue: %u/%u\r\n",
+                       (unsigned)uxQueueMessagesWaiting(input_queue), INPUT_QUEUE_LEN);
+    ssh_channel_printf(ch, "%-12s %8s %10s %10s %10s %8s\r\n",
+                       "user", "sessions", "accepted", "rejected", "typed", "queued");
+    for (int i = 0; i < SSH_USER_COUNT; i++) {
+        const ssh_user_stats_t *s = &users[i];
+        ssh_channel_printf(ch, "%-12s %8lu %10lu %10lu %10lu %8lu\r\n",
+                           ssh_users[i].username, (unsigned long)s->sessions,
+                           (unsigned long)s->accepted, (unsigned long)s->rejected,
+                           (unsigned long)s->typed, (unsigned long)s->bucket.queued);
+    }
+    ssh_channel_printf(ch, "%-12s %8s %10s %10s %10lu %8s\r\n",
+                       "(uart)", "-", "-", "-", (unsigned long)uart_typed, "-");
+
+    ssh_channel_printf(ch, "handshakes (%s, %s crypto): ok=%lu failed=%lu",
+                       SSH_HOST_KEY_ALGORITHMS, SSH_CRYPTO_PROFILE, (unsigned long)kex.count,
+                       (unsigned long)kex.failed);
+    if (kex.count > 0) {
+        ssh_channel_printf(ch, " min=%lums avg=%lums max=%lums heap avg=%lu max=%lu",
+                           (unsigned long)kex.min_ms,
+                           (unsigned long)(kex.total_ms / kex.count),
+                           (unsigned long)kex.max_ms,
+                           (unsigned long)(kex.total_heap / (kex.count + kex.failed)),
+                           (unsigned long)kex.max_heap);
+    }
+    ssh_channel_printf(ch, "\r\n");
+#if CONFIG_SSH_KEYBOARD_ACK_CDC
+    ssh_channel_printf(ch, "ack agent: %s acks=%lu naks=%lu timeouts=%lu retyped=%lu\r\n",
+                       ack_agent_attached() ? "attached" : "absent", (unsigned long)acks,
+                       (unsigned long)naks, (unsigned long)ack_timeout_count, (unsigned long)retyped);
+#endif
+#if CONFIG_SSH_JOB_PERSIST
+    ssh_channel_printf(ch, "job store: %s checkpoints=%lu\r\n",
+                       job_store_ready ? "mounted" : "unavailable", (unsigned long)checkpoints);
+#endif
+    if (packs > 0) {
+        uint32_t ratio = packed_bytes ? (uint64_t)plain_bytes * 100 / packed_bytes : 0;
+        ssh_channel_printf(ch, "payloads: packed=%lu %lu -> %lu bytes (%lu.%02lux) compress %lu KB/s\r\n",
+                           (unsigned long)packs, (unsigned long)plain_bytes,
+                           (unsigned long)packed_bytes, (unsigned long)(ratio / 100),
+                           (unsigned long)(ratio % 100),
+                           (unsigned long)((uint64_t)plain_bytes * 1000000 / 1024 / (packing_us > 0 ? packing_us : 1)));
+    }
+#if CONFIG_SSH_KEYBOARD_MSC
+    // Copied out: the USB task waits for drive_lock while this goes to the network
+    xSemaphoreTake(drive_lock, portMAX_DELAY);
+    uint64_t drive_read = drive.read_bytes;
+    uint32_t drive_read_errors = drive.read_errors;
+    uint32_t drive_used = drive_bytes();
+    xSemaphoreGive(drive_lock);
+    ssh_channel_printf(ch, "drive: %s backing=%s files=%d bytes=%lu attaches=%lu ejects=%lu host_read=%lluKB "
+                       "read_errors=%lu\r\n", drive.attached ? "attached" : "ejected",
+                       drive.psram ? "psram" : "spiffs", drive.count, (unsigned long)drive_used,
+                       (unsigned long)drive.attaches, (unsigned long)drive.ejects,
+                       (unsigned long long)(drive_read / 1024), (unsigned long)drive_read_errors);
+#endif
+    ssh_channel_printf(ch, "estop: %s stops=%lu dropped=%lu latency last=%luus max=%luus\r\n",
+                       stop.engaged ? "STOPPED" : "off", (unsigned long)stop.count,
+                       (unsigned long)stop.dropped, (unsigned long)stop.latency_us,
+                       (unsigned long)stop.latency_max_us);
+    portENTER_CRITICAL(&hid_acct_mux);
+    hid_acct_t acct = hid_acct;
+    portEXIT_CRITICAL(&hid_acct_mux);
+    ssh_channel_printf(ch, "reports: submitted=%lu completed=%lu in_flight=%lu retried=%lu dropped=%lu "
+                       "lost=%lu forced_releases=%lu\r\n", (unsigned long)acct.submitted,
+                       (unsigned long)acct.completed,
+                       (unsigned long)(acct.submitted - acct.completed - acct.lost),
+                       (unsigned long)acct.retried, (unsigned long)acct.dropped, (unsigned long)acct.lost,
+                       (unsigned long)acct.forced);
+    ssh_channel_printf(ch, "events: subscribers=%d emitted=%lu\r\n", event_subscribers,
+                       (unsigned long)event_count);
+    portENTER_CRITICAL(&lat_mux);
+    uint32_t lat_keys = lat_hist[LAT_TOTAL].count;
+    uint32_t lat_p50 = lat_percentile(&lat_hist[LAT_TOTAL], 50);
+    uint32_t lat_p99 = lat_percentile(&lat_hist[LAT_TOTAL], 99);
+    portEXIT_CRITICAL(&lat_mux);
+    if (lat_keys > 0) {
+        ssh_channel_printf(ch, "latency: keys=%lu client-to-host p50=%lu.%lums p99=%lu.%lums ('latency show')\r\n",
+                           (unsigned long)lat_keys, (unsigned long)(lat_p50 / 1000),
+                           (unsigned long)(lat_p50 % 1000 / 100), (unsigned long)(lat_p99 / 1000),
+                           (unsigned long)(lat_p99 % 1000 / 100));
+    }
+    if (lines.sessions > 0) {
+        ssh_channel_printf(ch, "line: sessions=%lu lines=%lu keys=%lu typed=%lu saved=%ld\r\n",
+                           (unsigned long)lines.sessions, (unsigned long)lines.lines,
+                           (unsigned long)lines.keys, (unsigned long)lines.typed,
+                           (long)lines.keys - (long)lines.typed);
+    }
+    ssh_channel_printf(ch, "exact keys: events=%lu expired=%lu\r\n",
+                       (unsigned long)mirror_events, (unsigned long)mirror_expired);
+    ssh_channel_printf(ch, "heap: free=%lu min_free=%lu\r\n",
+                       (unsigned long)esp_get_free_heap_size(),
+                       (unsigned long)esp_get_minimum_free_heap_size());
+    portENTER_CRITICAL(&mem_mux);
+    mem_gov_t gov = mem_gov;
+    portEXIT_CRITICAL(&mem_mux);
+    ssh_channel_printf(ch, "memory: level=%s internal_free=%luKB", mem_level_names[mem_level],
+                       (unsigned long)(heap_caps_get_free_size(MALLOC_CAP_INTERNAL) / 1024));
+#if CONFIG_SPIRAM
+    ssh_channel_printf(ch, " psram_free=%luKB", (unsigned long)(heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 1024));
+#endif
+    ssh_channel_printf(ch, " transitions=%lu throttled_reads=%lu paused_uploads=%lu refused_uploads=%lu "
+                       "refused_sessions=%lu evicted=%lu dropped_events=%lu\r\n",
+                       (unsigned long)gov.transitions, (unsigned long)gov.throttled_reads,
+                       (unsigned long)gov.paused_uploads, (unsigned long)gov.refused_uploads,
+                       (unsigned long)gov.refused_sessions, (unsigned long)gov.evicted_bytes,
+                       (unsigned long)gov.dropped_events);
+    uint32_t first = gov.transitions > MEM_HISTORY ? gov.transitions - MEM_HISTORY : 0;
+    for (uint32_t i = first; i < gov.transitions; i++) {
+        const mem_transition_t *t = &gov.history[i % MEM_HISTORY];
+        ssh_channel_printf(ch, "memory %lums: %s -> %s at %luKB\r\n", (unsigned long)t->at_ms,
+                           mem_level_names[t->from], mem_level_names[t->to], (unsigned long)t->free_kb);
+    }
+
+    for (int i = 0; i < SSH_MAX_CLIENTS; i++) {
+        if (sessions[i].user >= 0) {
+            ssh_channel_printf(ch, "session %d: user=%s accepted=%lu rejected=%lu queued=%lu keys=%s cipher=%s\r\n",
+                               i, ssh_users[sessions[i].user].username, (unsigned long)sessions[i].accepted,
+                               (unsigned long)sessions[i].rejected, (unsigned long)sessions[i].queued,
+                               sessions[i].kitty ? "exact" : "legacy", sessions[i].cipher);
+        }
+    }
+}
+
+// Buffered reader over a channel, so protocol lines and raw job data can be mixed
+typedef struct {
+    ssh_channel channel;
+    char buf[256];
+    int pos;
+    int len;
+} channel_reader_t;
+
+static int reader_fill(channel_reader_t *r)
+{
+    if (r->pos < r->len) {
+        return r->len - r->pos;
+    }
+    int n = ssh_channel_read(r->channel, r->buf, mem_bulk_read_size(sizeof(r->buf)), 0);
+    r->pos = 0;
+    r->len = n > 0 ? n : 0;
+    return n;
+}
+
+// Read one '\n'-terminated line (without the terminator). Returns false on EOF.
+static bool reader_getline(channel_reader_t *r, char *line, size_t size)
+{
+    size_t n = 0;
+    while (1) {
+        if (reader_fill(r) <= 0) {
+            line[n] = '\0';
+            return n > 0;
+        }
+        char c = r->buf[r->pos++];
+        if (c == '\n') {
+            break;
+        }
+        if (c != '\r' && n + 1 < size) {
+            line[n++] = c;
+        }
+    }
+    line[n] = '\0';
+    return true;
+}
+
+// Read and drop up to size bytes, to keep the protocol in step past a refused upload
+static void reader_skip(channel_reader_t *r, uint32_t size)
+{
+    uint32_t n = 0;
+    while (n < size && reader_fill(r) > 0) {
+        uint32_t chunk = r->len - r->pos;
+        if (chunk > size - n) {
+            chunk = size - n;
+        }
+        r->pos += chunk;
+        n += chunk;
+    }
+}
+
+// Read up to size bytes (exactly size unless EOF comes first)
+static uint32_t reader_read(channel_reader_t *r, char *dst, uint32_t size)
+{
+    uint32_t n = 0;
+    while (n < size && reader_fill(r) > 0) {
+        uint32_t chunk = r->len - r->pos;
+        if (chunk > size - n) {
+            chunk = size - n;
+        }
+        memcpy(dst + n, r->buf + r->pos, chunk);
+        r->pos += chunk;
+        n += chunk;
+    }
+    return n;
+}
+
+// Reserve a job slot, reusing the oldest finished one if needed
+static job_t *job_alloc(int user, const char *name)
+{
+    job_t *job = NULL;
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    for (int i = 0; i < JOB_MAX; i++) {
+        job_t *j = &jobs[i];
+        if (j->state == JOB_FREE) {
+            job = j;
+            break;
+        }
+        if ((j->state == JOB_DONE || j->state == JOB_ABORTED) && (!job || j->id < job->id)) {
+            job = j;
+        }
+    }
+    if (job) {
+        memset(job, 0, sizeof(*job));
+        job->id = job_next_id++;
+        job->state = JOB_UPLOADING;
+        job->user = user;
+        job->app = app_default;
+        strlcpy(job->name, name, sizeof(job->name));
+    }
+    xSemaphoreGive(input_lock);
+    return job;
+}
+
+// Receive job data (exactly `size` bytes, or until EOF when size is 0) and
+// queue it, or hold it paused when `staged` so several devices can start together
+static job_t *job_receive(ssh_client_t *client, channel_reader_t *reader, uint32_t size,
+                          const char *name, uint8_t app, bool staged, const char **error)
+{
+    uint32_t capacity = size ? size : JOB_MAX_SIZE;
+    if (capacity > JOB_MAX_SIZE) {
+        *error = "job too large";
+        return NULL;
+    }
+
+    job_t *job = job_alloc(client->user, name);
+    if (!job) {
+        *error = "no free job slot";
+        return NULL;
+    }
+    job->app = app;
+
+    // Bulk intake waits out low memory, leaving the upload unread meanwhile
+    bool refused = !mem_intake_wait();
+    char *data = refused ? NULL : malloc(capacity);
+    uint32_t received = 0;
+    uint32_t packed_size = 0;
+    if (data) {
+        received = reader_read(reader, data, capacity);
+    } else {
+        reader_skip(reader, capacity);
+    }
+    // An upload that runs to EOF and is still going past JOB_MAX_SIZE is
+    // refused whole, not cut short, and read to the end like any refusal
+    bool too_large = !size && reader_fill(reader) > 0;
+    if (too_large) {
+        reader_skip(reader, UINT32_MAX);
+    }
+    // Read the upload even when stopped, so a jobd session stays in step
+    bool stopped = estop.engaged;
+    if (stopped || too_large) {
+        free(data);
+        data = NULL;
+    }
+#if CONFIG_SSH_PAYLOAD_COMPRESS
+    // Keep the job packed in memory and in the spool; it decodes as it types
+    uint8_t *packed = data && received > 0 && (!size || received == size) ?
+                      payload_pack(data, received, &packed_size) : NULL;
+    if (packed) {
+        free(data);
+        data = (char *)packed;
+    }
+#endif
+#if CONFIG_SSH_JOB_PERSIST
+    // Spool before queueing so a reset from here on cannot lose the job
+    // Not when memory is critical: the spool file's buffers come from the heap
+    bool stored = data && received > 0 && (!size || received == size) && mem_level < MEM_CRITICAL &&
+                  job_store_save(job->id, client->user, name, app, data, received, packed_size);
+#endif
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    if (!data || received == 0 || (size && received != size)) {
+        *error = too_large ? "job too large" : stopped ? "emergency stop" : refused ? "low memory" :
+                 !data ? "out of memory" : "short upload";
+        free(data);
+        job->state = JOB_FREE;
+        job = NULL;
+    } else {
+        job->data = data;
+        job->packed_size = packed_size;
+        job->size = received;
+        job->submitted_us = esp_timer_get_time();
+#if CONFIG_SSH_JOB_PERSIST
+        job->stored = stored;
+#endif
+        job->state = staged ? JOB_PAUSED : JOB_QUEUED;
+    }
+    xSemaphoreGive(input_lock);
+
+    if (job) {
+        event_emit(EVENT_JOB_ACCEPTED, job->id, "size=%lu user=%s app=%s state=%s name=%s",
+                   (unsigned long)received, ssh_users[client->user].username, app_profiles[app].name,
+                   staged ? "staged" : "queued", name[0] ? name : "-");
+        ESP_LOGI(TAG, "Job %lu %s by %s: %lu bytes, %lu packed", (unsigned long)job->id,
+                 staged ? "staged" : "queued", ssh_users[client->user].username, (unsigned long)received,
+                 (unsigned long)(packed_size ? packed_size : received));
+    }
+    return job;
+}
+
+// A job's status line, copied under input_lock so it is printed without it
+typedef struct {
+    uint32_t id;
+    job_state_t state;
+    uint32_t typed;
+    uint32_t size;
+    int64_t elapsed_ms;
+    int user;
+    char name[24];
+} job_row_t;
+
+static void job_row(const job_t *job, job_row_t *row)
+{
+    int64_t end = job->finished_us ? job->finished_us : esp_timer_get_time();
+    row->id = job->id;
+    row->state = job->state;
+    row->typed = job->typed;
+    row->size = job->size;
+    row->elapsed_ms = job->started_us ? (end - job->started_us) / 1000 : 0;
+    row->user = job->user;
+    strlcpy(row->name, job->name, sizeof(row->name));
+}
+
+static void job_print(ssh_channel ch, const job_row_t *row, const char *prefix)
+{
+    ssh_channel_printf(ch, "%s%lu %s %lu %lu %lld %s %s\n", prefix, (unsigned long)row->id,
+                       job_state_names[row->state], (unsigned long)row->typed,
+                       (unsigned long)row->size, (long long)row->elapsed_ms,
+                       ssh_users[row->user].username, row->name[0] ? row->name : "-");
+}
+
+// Stored templates: spiffs files named tpl_<name>, with a run counter per
+// template in NVS. A trigger is "<name> [arg ...]", one word per argument.
+#define TPL_NAME_MAX 16
+#define TPL_ARG_MAX 9
+#define TPL_NVS_NAMESPACE "tpl"
+
+static bool tpl_name_valid(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len >= TPL_NAME_MAX) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tpl_path(const char *name, char *path, size_t size)
+{
+    snprintf(path, size, SPIFFS_BASE "/tpl_%s", name);
+}
+
+// True when a template stored as-is would read back as an LZSS stream
+static bool tpl_looks_packed(const char *text, uint32_t len)
+{
+    const uint32_t magic = LZ_MAGIC;
+    return len >= sizeof(magic) && memcmp(text, &magic, sizeof(magic)) == 0;
+}
+
+// Write a template's source, as a header and LZSS stream when that is smaller
+static bool tpl_write(FILE *f, const char *text, uint32_t len)
+{
+#if CONFIG_SSH_PAYLOAD_COMPRESS
+    uint32_t packed_size = 0;
+    uint8_t *packed = payload_pack(text, len, &packed_size);
+    if (packed && packed_size + sizeof(lz_header_t) < len) {
+        lz_header_t hdr = { .magic = LZ_MAGIC, .size = len };
+        bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(packed, 1, packed_size, f) == packed_size;
+        free(packed);
+        return ok;
+    }
+    free(packed);
+#endif
+    return fwrite(text, 1, len, f) == len;
+}
+
+// Decode a packed template into a NUL-terminated buffer; frees the stream
+static char *tpl_unpack(char *stream, uint32_t stream_size, uint32_t size)
+{
+    lz_decoder_t *d = malloc(sizeof(*d));
+    char *text = d ? malloc(size + 1) : NULL;
+    if (text) {
+        uint32_t n = 0;
+        int c;
+        lz_decoder_init(d, (const uint8_t *)stream, stream_size, size);
+        while (n < size && (c = lz_decode(d)) >= 0) {
+            text[n++] = c;
+        }
+        if (n != size) {
+            free(text);
+            text = NULL;
+        }
+    }
+    free(d);
+    free(stream);
+    return text;
+}
+
+// Read a template's source, NUL-terminated; the caller frees it
+static char *tpl_load(const char *name, uint32_t *len)
+{
+    char path[40];
+    tpl_path(name, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    lz_header_t hdr;
+    bool packed = size >= (long)sizeof(hdr) && fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == LZ_MAGIC;
+    if (packed) {
+        size -= sizeof(hdr);
+    } else {
+        fseek(f, 0, SEEK_SET);
+    }
+    char *text = size >= 0 && size <= TPL_MAX_SIZE && (!packed || hdr.size <= TPL_MAX_SIZE) ?
+                 malloc(size + 1) : NULL;
+    if (text && fread(text, 1, size, f) != (size_t)size) {
+        free(text);
+        text = NULL;
+    }
+    fclose(f);
+    if (text && packed) {
+        text = tpl_unpack(text, size, hdr.size);
+        size = hdr.size;
+    }
+    if (text) {
+        text[size] = '\0';
+        *len = size;
+    }
+    return text;
+}
+
+// Source size of a stored template, and what it takes on flash
+static long tpl_size(const char *path, long *stored)
+{
+    struct stat st;
+    lz_header_t hdr;
+    *stored = stat(path, &st) == 0 ? (long)st.st_size : -1L;
+    FILE *f = fopen(path, "rb");
+    bool packed = f && fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == LZ_MAGIC;
+    if (f) {
+        fclose(f);
+    }
+    return packed ? (long)hdr.size : *stored;
+}
+
+// The template's next run number, 1 on the first run; stored when `commit`
+static uint32_t tpl_count_next(const char *name, bool commit)
+{
+    nvs_handle_t nvs;
+    uint32_t count = 0;
+    if (nvs_open(TPL_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_get_u32(nvs, name, &count);
+        count++;
+        if (commit) {
+            nvs_set_u32(nvs, name, count);
+            nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    return count;
+}
+
+// Capture every variable now, so retyping any part renders the same text
+static void tpl_capture(tpl_render_t *r, const ssh_client_t *client, uint32_t job_id,
+                        const char *name, char *const *args, int argc, bool preview)
+{
+    for (int i = 0; i < argc && i < TPL_ARG_MAX; i++) {
+        strlcpy(r->values[TPL_VAR_ARG1 + i], args[i], TPL_VALUE_MAX);
+    }
+
+    esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+    esp_netif_ip_info_t ip_info;
+    const char *hostname = NULL;
+    if (netif && esp_netif_get_ip_info(netif, &ip_info) == ESP_OK) {
+        snprintf(r->values[TPL_VAR_IP], TPL_VALUE_MAX, IPSTR, IP2STR(&ip_info.ip));
+    }
+    if (netif && esp_netif_get_hostname(netif, &hostname) == ESP_OK && hostname) {
+        strlcpy(r->values[TPL_VAR_HOSTNAME], hostname, TPL_VALUE_MAX);
+    }
+
+    uint8_t mac[6];
+    if (esp_read_mac(mac, ESP_MAC_WIFI_STA) == ESP_OK) {
+        snprintf(r->values[TPL_VAR_MAC], TPL_VALUE_MAX, "%02x:%02x:%02x:%02x:%02x:%02x",
+                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    }
+    snprintf(r->values[TPL_VAR_UPTIME], TPL_VALUE_MAX, "%lld", (long long)(esp_timer_get_time() / 1000000));
+    snprintf(r->values[TPL_VAR_JOB], TPL_VALUE_MAX, "%lu", (unsigned long)job_id);
+    snprintf(r->values[TPL_VAR_COUNT], TPL_VALUE_MAX, "%lu", (unsigned long)tpl_count_next(name, !preview));
+    strlcpy(r->values[TPL_VAR_USER], ssh_users[client->user].username, TPL_VALUE_MAX);
+}
+
+// Prepare a renderer for "<name> [arg ...]"; job_id fills {{job}}. A preview
+// leaves the run counter alone.
+static tpl_render_t *tpl_open(const ssh_client_t *client, const char *trigger, uint32_t job_id,
+                              bool preview, char *name, const char **error)
+{
+    char buf[96];
+    char *args[TPL_ARG_MAX];
+    int argc = 0;
+    char *save = NULL;
+    strlcpy(buf, trigger, sizeof(buf));
+
+    char *tok = strtok_r(buf, " ", &save);
+    if (!tok || !tpl_name_valid(tok)) {
+        *error = "bad template name";
+        return NULL;
+    }
+    strlcpy(name, tok, TPL_NAME_MAX);
+    while ((tok = strtok_r(NULL, " ", &save)) != NULL) {
+        if (argc == TPL_ARG_MAX) {
+            *error = "too many arguments";
+            return NULL;
+        }
+        args[argc++] = tok;
+    }
+
+    tpl_render_t *r = calloc(1, sizeof(*r));
+    if (!r) {
+        *error = "out of memory";
+        return NULL;
+    }
+    r->text = tpl_load(name, &r->len);
+    if (!r->text) {
+        free(r);
+        *error = "no such template";
+        return NULL;
+    }
+    tpl_capture(r, client, job_id, name, args, argc, preview);
+    return r;
+}
+
+// Queue a job rendered from a template: only the trigger crosses the network
+static job_t *tpl_start(ssh_client_t *client, const char *trigger, const char **error)
+{
+    char name[TPL_NAME_MAX];
+    if (estop.engaged) {
+        *error = "emergency stop";
+        return NULL;
+    }
+    job_t *job = job_alloc(client->user, "");
+    if (!job) {
+        *error = "no free job slot";
+        return NULL;
+    }
+
+    tpl_render_t *r = tpl_open(client, trigger, job->id, false, name, error);
+    uint32_t size = r ? tpl_render_size(r) : 0;
+    if (r && size == 0) {
+        *error = "template renders empty";
+    }
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    if (size == 0) {
+        tpl_render_free(r);
+        job->state = JOB_FREE;
+        job = NULL;
+    } else {
+        strlcpy(job->name, name, sizeof(job->name));
+        job->render = r;
+        job->size = size;
+        job->submitted_us = esp_timer_get_time();
+        job->state = JOB_QUEUED;
+    }
+    xSemaphoreGive(input_lock);
+
+    if (job) {
+        event_emit(EVENT_JOB_ACCEPTED, job->id, "size=%lu user=%s app=%s state=queued name=%s",
+                   (unsigned long)size, ssh_users[client->user].username, app_profiles[job->app].name, name);
+        ESP_LOGI(TAG, "Job %lu queued from template %s by %s: %lu bytes", (unsigned long)job->id, name,
+                 ssh_users[client->user].username, (unsigned long)size);
+    }
+    return job;
+}
+
+// Queue text already in memory as a job. Not spooled: it is a line or so,
+// cheaper to type again than to write to flash.
+static job_t *job_submit_text(ssh_client_t *client, const char *text, uint32_t size, const char *name,
+                              uint8_t app, const char **error)
+{
+    if (estop.engaged) {
+        *error = "emergency stop";
+        return NULL;
+    }
+    job_t *job = job_alloc(client->user, name);
+    if (!job) {
+        *error = "no free job slot";
+        return NULL;
+    }
+    char *data = malloc(size);
+    if (data) {
+        memcpy(data, text, size);
+    }
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    if (!data) {
+        *error = "out of memory";
+        job->state = JOB_FREE;
+        job = NULL;
+    } else {
+        job->data = data;
+        job->size = size;
+        job->app = app;
+        job->submitted_us = esp_timer_get_time();
+        job->state = JOB_QUEUED;
+    }
+    xSemaphoreGive(input_lock);
+
+    if (job) {
+        event_emit(EVENT_JOB_ACCEPTED, job->id, "size=%lu user=%s app=%s state=queued name=%s",
+                   (unsigned long)size, ssh_users[client->user].username, app_profiles[app].name, name);
+        ESP_LOGI(TAG, "Job %lu queued from %s by %s: %lu bytes", (unsigned long)job->id, name,
+                 ssh_users[client->user].username, (unsigned long)size);
+    }
+    return job;
+}
+
+// Job subcommands shared by `job <cmd>` and the `jobd` protocol. Replies end
+// with a single "ok ..." or "err <reason>" line; `list` prints "job ..." lines first.
+// Job lines are: <id> <state> <typed> <size> <elapsed_ms> <user> <name>
+static void job_command(ssh_client_t *client, channel_reader_t *reader, const char *line)
+{
+    ssh_channel ch = client->channel;
+    char verb[12] = {0};
+    unsigned long arg = 0;
+    char name[24] = "";
+    int fields = sscanf(line, "%11s %lu %23s", verb, &arg, name);
+    if (strncmp(name, "app=", 4) == 0) {
+        name[0] = '\0';
+    }
+
+    // `stage` uploads like `submit` but leaves the job paused until `resume`
+    bool staged = strcmp(verb, "stage") == 0;
+    if (fields >= 1 && (staged || strcmp(verb, "submit") == 0)) {
+        // `submit <bytes> [name]` in jobd; one-shot `job submit` reads until EOF.
+        // Either takes app=<profile>.
+        const char *error = NULL;
+        int app = app_profile_arg(line);
+        job_t *job = NULL;
+        if (app < 0) {
+            error = "unknown app profile";
+        } else {
+            job = job_receive(client, reader, fields >= 2 ? arg : 0, name, app, staged, &error);
+        }
+        if (job) {
+            ssh_channel_printf(ch, "ok %lu\n", (unsigned long)job->id);
+        } else {
+            ssh_channel_printf(ch, "err %s\n", error);
+        }
+        return;
+    }
+
+    if (fields >= 1 && strcmp(verb, "run") == 0) {
+        // `run <template> [arg ...]` queues a job rendered on the device
+        const char *error = NULL;
+        job_t *job = tpl_start(client, strstr(line, "run") + 3, &error);
+        if (job) {
+            ssh_channel_printf(ch, "ok %lu\n", (unsigned long)job->id);
+        } else {
+            ssh_channel_printf(ch, "err %s\n", error);
+        }
+        return;
+    }
+
+    if (fields >= 1 && strcmp(verb, "list") == 0) {
+        job_row_t rows[JOB_MAX];
+        int count = 0;
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        for (int i = 0; i < JOB_MAX; i++) {
+            if (jobs[i].state != JOB_FREE && jobs[i].state != JOB_UPLOADING) {
+                job_row(&jobs[i], &rows[count++]);
+            }
+        }
+        xSemaphoreGive(input_lock);
+        for (int i = 0; i < count; i++) {
+            job_print(ch, &rows[i], "job ");
+        }
+        ssh_channel_printf(ch, "ok\n");
+        return;
+    }
+
+    if (fields < 2) {
+        ssh_channel_printf(ch, "err usage: submit|stage [bytes [name]] [app=<profile>] | run <template> [args] | list | status|pause|resume|abort <id>\n");
+        return;
+    }
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    job_t *job = job_find(arg);
+    const char *error = NULL;
+    bool owner = job && (job->user == client->user || ssh_client_unlimited(client));
+    if (!job || job->state == JOB_UPLOADING) {
+        error = "no such job";
+    } else if (!owner && strcmp(verb, "status") != 0) {
+        // Anyone may look; only the job's user or an unlimited one may change it
+        error = "not your job";
+    } else if (strcmp(verb, "pause") == 0) {
+        if (job->state == JOB_QUEUED || job->state == JOB_TYPING) {
+            job_pause(job);
+        } else if (!job_is_pending(job)) {
+            error = "job not pending";
+        }
+    } else if (strcmp(verb, "resume") == 0) {
+        if (estop.engaged && job_is_pending(job)) {
+            error = "emergency stop";
+        } else if (job->state == JOB_PAUSED || job->state == JOB_INTERRUPTED) {
+            // An interrupted job restarts from the confirmed offset,
+            // re-announcing it to the agent
+            job->state = job->state == JOB_PAUSED && job->typed ? JOB_TYPING : JOB_QUEUED;
+            job->moved_us = esp_timer_get_time();
+            event_emit(EVENT_JOB_RESUMED, job->id, "typed=%lu size=%lu", (unsigned long)job_confirmed(job),
+                       (unsigned long)job->size);
+        } else if (!job_is_pending(job)) {
+            error = "job not pending";
+        }
+    } else if (strcmp(verb, "abort") == 0) {
+        if (job_is_pending(job)) {
+            job_finish(job, JOB_ABORTED);
+        }
+    } else if (strcmp(verb, "status") != 0) {
+        error = "unknown job command";
+    }
+    // `status` and every change answer with the job's state
+    job_row_t row;
+    if (!error) {
+        job_row(job, &row);
+    }
+    xSemaphoreGive(input_lock);
+
+    if (error) {
+        ssh_channel_printf(ch, "err %s\n", error);
+    } else {
+        job_print(ch, &row, "ok ");
+    }
+}
+
+static void cmd_job(ssh_client_t *client, const char *args)
+{
+    channel_reader_t reader = { .channel = client->channel };
+    job_command(client, &reader, args);
+}
+
+// Persistent job protocol: one job command per line until the client sends EOF
+static void cmd_jobd(ssh_client_t *client, const char *args)
+{
+    channel_reader_t reader = { .channel = client->channel };
+    char line[96];
+
+    while (reader_getline(&reader, line, sizeof(line))) {
+        if (line[0] != '\0') {
+            job_command(client, &reader, line);
+        }
+    }
+}
+
+// Template store: tpl [list] | save <name> (stdin) | show|rm <name> | render <name> [args]
+static void cmd_tpl(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+    char verb[8] = "list";
+    char name[TPL_NAME_MAX] = "";
+    char path[40];
+    sscanf(args, "%7s %15s", verb, name);
+
+    if (!spiffs_ready) {
+        ssh_channel_printf(ch, "tpl: storage not available\r\n");
+        return;
+    }
+
+    if (strcmp(verb, "list") == 0) {
+        DIR *dir = opendir(SPIFFS_BASE);
+        struct dirent *ent;
+        while (dir && (ent = readdir(dir)) != NULL) {
+            long stored;
+            if (strncmp(ent->d_name, "tpl_", 4) != 0) {
+                continue;
+            }
+            tpl_path(ent->d_name + 4, path, sizeof(path));
+            long size = tpl_size(path, &stored);
+            ssh_channel_printf(ch, "%-16s %6ld bytes, %6ld stored\r\n", ent->d_name + 4, size, stored);
+        }
+        if (dir) {
+            closedir(dir);
+        }
+        return;
+    }
+
+    if (!tpl_name_valid(name)) {
+        ssh_channel_printf(ch, "usage: tpl [list] | save <name> < file | show|rm <name> | render <name> [args]\r\n"
+                           "names are up to %d of A-Z a-z 0-9 _ -\r\n", TPL_NAME_MAX - 1);
+        return;
+    }
+    tpl_path(name, path, sizeof(path));
+
+    if (strcmp(verb, "save") == 0) {
+        // One-shot upload until EOF, like `job submit`
+        channel_reader_t reader = { .channel = ch };
+        char *text = malloc(TPL_MAX_SIZE + 1);
+        uint32_t len = text ? reader_read(&reader, text, TPL_MAX_SIZE + 1) : 0;
+        FILE *f = NULL;
+        if (!text || len == 0 || len > TPL_MAX_SIZE) {
+            ssh_channel_printf(ch, "tpl: %s\r\n", !text ? "out of memory" : len ? "template too large" : "empty template");
+        } else if (tpl_looks_packed(text, len)) {
+            // Stored as-is it would load as a stream; checked before fopen() truncates the old one
+            ssh_channel_printf(ch, "tpl: a template cannot start with \"SLZ1\"\r\n");
+        } else if (!(f = fopen(path, "wb")) || !tpl_write(f, text, len)) {
+            ssh_channel_printf(ch, "tpl: cannot write %s\r\n", path);
+        } else {
+            ssh_channel_printf(ch, "tpl: saved %s (%lu bytes)\r\n", name, (unsigned long)len);
+        }
+        if (f) {
+            fclose(f);
+        }
+        free(text);
+    } else if (strcmp(verb, "rm") == 0) {
+        ssh_channel_printf(ch, unlink(path) == 0 ? "tpl: removed %s\r\n" : "tpl: no template %s\r\n", name);
+    } else if (strcmp(verb, "show") == 0) {
+        uint32_t len;
+        char *text = tpl_load(name, &len);
+        if (text) {
+            ssh_channel_write(ch, text, len);
+            free(text);
+        } else {
+            ssh_channel_printf(ch, "tpl: no template %s\r\n", name);
+        }
+    } else if (strcmp(verb, "render") == 0) {
+        // Preview with the variables a run would see now ({{job}} is 0)
+        const char *error = NULL;
+        char tpl_name[TPL_NAME_MAX];
+        tpl_render_t *r = tpl_open(client, strstr(args, name), 0, true, tpl_name, &error);
+        if (!r) {
+            ssh_channel_printf(ch, "tpl: %s\r\n", error);
+            return;
+        }
+        char out[64];
+        int c, n = 0;
+        while ((c = tpl_next(r)) >= 0) {
+            out[n++] = c;
+            if (n == sizeof(out)) {
+                ssh_channel_write(ch, out, n);
+                n = 0;
+            }
+        }
+        ssh_channel_write(ch, out, n);
+        tpl_render_free(r);
+    } else {
+        ssh_channel_printf(ch, "tpl: unknown subcommand %s\r\n", verb);
+    }
+}
+
+static void cmd_pacing(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+
+    if (*args) {
+        char name[8];
+        unsigned cps = 0;
+        int profile = -1;
+        if (!ssh_client_unlimited(client)) {
+            ssh_channel_printf(ch, "pacing: not allowed for rate-limited users\r\n");
+            return;
+        }
+        if (strcmp(args, "default") == 0) {
+            key_pacing = key_pacing_default;
+        } else if (sscanf(args, "%7s %u", name, &cps) == 2 &&
+                   (profile = pacing_profile_find(name, strlen(name))) >= 0 &&
+                   cps >= 1 && cps <= PACING_MAX_CPS) {
+            key_pacing = pacing_for_rate(profile, cps);
+        } else {
+            ssh_channel_printf(ch, "usage: pacing [default | hold|even|tap <1-%d cps>]\r\n", PACING_MAX_CPS);
+            return;
+        }
+        ESP_LOGI(TAG, "Pacing set to %s %u cps", key_pacing.profile, key_pacing.cps);
+    }
+
+    ssh_channel_printf(ch, "pacing: %s", key_pacing.profile);
+    if (key_pacing.cps) {
+        ssh_channel_printf(ch, " %u cps", key_pacing.cps);
+    }
+    ssh_channel_printf(ch, " (hold %u ms, gap %u ms)\r\n", key_pacing.hold_ms, key_pacing.gap_ms);
+}
+
+static void cmd_app(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+
+    if (*args) {
+        int app = app_profile_find(args, strcspn(args, " "));
+        if (!ssh_client_unlimited(client)) {
+            ssh_channel_printf(ch, "app: not allowed for rate-limited users\r\n");
+            return;
+        }
+        if (app < 0) {
+            ssh_channel_printf(ch, "usage: app [<profile>]\r\n");
+            return;
+        }
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        app_default = app;
+        xSemaphoreGive(input_lock);
+        ESP_LOGI(TAG, "Default app profile set to %s", app_profiles[app].name);
+    }
+
+    for (int i = 0; i < APP_PROFILE_COUNT; i++) {
+        ssh_channel_printf(ch, "%c %-7s %s%s\r\n", i == app_default ? '*' : ' ', app_profiles[i].name,
+                           app_profiles[i].help, app_profiles[i].full_rate ? " [full rate]" : "");
+    }
+    ssh_channel_printf(ch, "full rate: %u cps unless 'pacing' sets a rate\r\n", app_pacing_full.cps);
+}
+
+// Anyone may stop; letting input in again needs a user without a typing limit
+static void cmd_estop(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+
+    if (strcmp(args, "on") == 0) {
+        if (!estop.engaged) {
+            estop_engage("ssh");
+        }
+    } else if (strcmp(args, "off") == 0) {
+        if (!ssh_client_unlimited(client)) {
+            ssh_channel_printf(ch, "estop: not allowed for rate-limited users\r\n");
+            return;
+        }
+        if (estop.engaged) {
+            estop_resume("ssh");
+        }
+    } else if (*args) {
+        ssh_channel_printf(ch, "usage: estop [on|off]\r\n");
+        return;
+    }
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    estop_t stop = estop;
+    xSemaphoreGive(input_lock);
+    ssh_channel_printf(ch, "estop: %s stops=%lu dropped=%lu latency last=%luus max=%luus\r\n",
+                       stop.engaged ? "STOPPED" : "off", (unsigned long)stop.count,
+                       (unsigned long)stop.dropped, (unsigned long)stop.latency_us,
+                       (unsigned long)stop.latency_max_us);
+    ssh_channel_printf(ch, "BOOT button stops; hold it %d s while stopped to let input in again\r\n",
+                       ESTOP_RESUME_MS / 1000);
+}
+
+static void cmd_repeat(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+
+    if (*args) {
+        char mode[4] = "";
+        unsigned release = key_repeat.release_ms;
+        if (!ssh_client_unlimited(client)) {
+            ssh_channel_printf(ch, "repeat: not allowed for rate-limited users\r\n");
+            return;
+        }
+        int n = sscanf(args, "%3s release=%u", mode, &release);
+        if (n < 1 && sscanf(args, "release=%u", &release) == 1) {
+            n = 2;
+        } else if (n >= 1 && strcmp(mode, "on") != 0 && strcmp(mode, "off") != 0) {
+            n = 0;
+        }
+        if (n < 1 || release < 2 * REPEAT_MIN_GAP_MS || release > 1000) {
+            ssh_channel_printf(ch, "usage: repeat [on|off] [release=%d-1000]\r\n", 2 * REPEAT_MIN_GAP_MS);
+            return;
+        }
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        if (*mode) {
+            key_repeat.enabled = strcmp(mode, "on") == 0;
+        }
+        key_repeat.release_ms = release;
+        xSemaphoreGive(input_lock);
+        ESP_LOGI(TAG, "Repeat coalescing %s, release %u ms", key_repeat.enabled ? "on" : "off", release);
+    }
+
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    key_repeat_t r = key_repeat;
+    xSemaphoreGive(input_lock);
+
+    ssh_channel_printf(ch, "repeat: %s, release %u ms\r\n", r.enabled ? "held" : "typed", r.release_ms);
+    ssh_channel_printf(ch, "streams %lu, coalesced %lu keys, lag after last key: last %lu ms, avg %lu ms, max %lu ms\r\n",
+                       (unsigned long)r.streams, (unsigned long)r.coalesced, (unsigned long)r.lag_last_ms,
+                       (unsigned long)(r.streams ? r.lag_total_ms / r.streams : 0), (unsigned long)r.lag_max_ms);
+}
+
+// "<key> [every=ms] [timeout=s] [until=led|protocol|timeout]"
+static const char *bootkey_parse(const char *args, boot_key_config_t *cfg)
+{
+    char buf[96];
+    char *save = NULL;
+    strlcpy(buf, args, sizeof(buf));
+
+    char *tok = strtok_r(buf, " ", &save);
+    cfg->keycode = tok ? key_name_find(tok) : 0;
+    if (!cfg->keycode) {
+        return "unknown key (f1-f12, del, esc, enter, tab, space, arrows, ...)";
+    }
+
+    while ((tok = strtok_r(NULL, " ", &save)) != NULL) {
+        unsigned n;
+        char name[10];
+        if (sscanf(tok, "every=%u", &n) == 1) {
+            if (n < 2 * BOOT_KEY_HOLD_MS || n > 5000) {
+                return "every out of range";
+            }
+            cfg->every_ms = n;
+        } else if (sscanf(tok, "timeout=%u", &n) == 1) {
+            if (n < 1 || n > 600) {
+                return "timeout out of range";
+            }
+            cfg->timeout_s = n;
+        } else if (sscanf(tok, "until=%9s", name) == 1) {
+            int until = -1;
+            for (int i = 0; i < BOOT_KEY_UNTIL_COUNT; i++) {
+                if (strcmp(name, boot_key_until_names[i]) == 0) {
+                    until = i;
+                }
+            }
+            if (until < 0) {
+                return "until is led, protocol or timeout";
+            }
+            cfg->until = until;
+        } else {
+            return "unknown option";
+        }
+    }
+    return NULL;
+}
+
+static void cmd_bootkey(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+
+    if (*args) {
+        boot_key_config_t cfg = {
+            .until = BOOT_KEY_UNTIL_LED,
+            .every_ms = 100,
+            .timeout_s = 20,
+        };
+        if (!ssh_client_unlimited(client)) {
+            ssh_channel_printf(ch, "bootkey: not allowed for rate-limited users\r\n");
+            return;
+        }
+        if (strcmp(args, "off") == 0) {
+            memset(&cfg, 0, sizeof(cfg));
+            boot_key_set(&cfg, "off");
+            ESP_LOGI(TAG, "Boot key disarmed");
+        } else {
+            const char *error = bootkey_parse(args, &cfg);
+            if (error) {
+                ssh_channel_printf(ch, "bootkey: %s\r\n"
+                                   "usage: bootkey [off | <key> [every=ms] [timeout=s] [until=led|protocol|timeout]]\r\n",
+                                   error);
+                return;
+            }
+            boot_key_set(&cfg, "armed");
+            ESP_LOGI(TAG, "Boot key %s armed: every %ums for %us until %s", key_name_of(cfg.keycode),
+                     cfg.every_ms, cfg.timeout_s, boot_key_until_names[cfg.until]);
+        }
+    }
+
+    xSemaphoreTake(boot_key_lock, portMAX_DELAY);
+    boot_key_config_t cfg = boot_key;
+    const char *result = boot_key_result;
+    uint32_t fired = boot_key_fired;
+    bool waiting = cfg.keycode && boot_key_start_us == 0;
+    xSemaphoreGive(boot_key_lock);
+
+    ssh_channel_printf(ch, "bootkey: %s", result);
+    if (cfg.keycode) {
+        ssh_channel_printf(ch, " %s every %ums for %us until %s", key_name_of(cfg.keycode),
+                           cfg.every_ms, cfg.timeout_s, boot_key_until_names[cfg.until]);
+    }
+    ssh_channel_printf(ch, ", %lu presses, host leds 0x%02x protocol %s\r\n", (unsigned long)fired,
+                       hid_leds, tud_hid_get_protocol() == 0 ? "boot" : "report");
+    if (waiting && tud_mounted()) {
+        ssh_channel_printf(ch, "fires on the next enumeration: reboot or power-cycle the target now\r\n");
+    }
+}
+
+// "sweep [seed=N] [len=N] [rates=10,20] [profiles=hold,tap] [esc=0|1]"
+static const char *selftest_parse(const char *args, sweep_t *cfg)
+{
+    size_t len = strcspn(args, " ");
+    if (len != 5 || strncmp(args, "sweep", 5) != 0) {
+        return "usage: selftest sweep [seed=N] [len=N] [rates=a,b,..] [profiles=hold,even,tap] [esc=0|1] [app=]"
+               " | repeat [key= rate= count= mode=held|legacy|both]";
+    }
+
+    for (const char *p = args + len; *p; p += len) {
+        while (*p == ' ') {
+            p++;
+        }
+        len = strcspn(p, " ");
+        if (len == 0) {
+            break;
+        }
+        const char *eq = memchr(p, '=', len);
+        if (!eq) {
+            return "options are key=value";
+        }
+        size_t key_len = eq - p;
+        const char *val = eq + 1;
+        const char *end = p + len;
+
+        if (key_len == 4 && strncmp(p, "seed", 4) == 0) {
+            cfg->seed = strtoul(val, NULL, 10);
+        } else if (key_len == 3 && strncmp(p, "len", 3) == 0) {
+            unsigned long n = strtoul(val, NULL, 10);
+            if (n < 1 || n > SWEEP_MAX_LEN) {
+                return "len out of range";
+            }
+            cfg->len = n;
+        } else if (key_len == 3 && strncmp(p, "esc", 3) == 0) {
+            cfg->esc = *val == '1';
+        } else if (key_len == 3 && strncmp(p, "app", 3) == 0) {
+            int app = app_profile_find(val, end - val);
+            if (app < 0) {
+                return "unknown app profile";
+            }
+            cfg->app = app;
+        } else if (key_len == 5 && strncmp(p, "rates", 5) == 0) {
+            cfg->rate_count = 0;
+            for (const char *q = val; q < end; q += (*q == ',')) {
+                char *next;
+                unsigned long cps = strtoul(q, &next, 10);
+                if (next == q || cps < 1 || cps > PACING_MAX_CPS) {
+                    return "rate out of range";
+                }
+                if (cfg->rate_count == SWEEP_MAX_RATES) {
+                    return "too many rates";
+                }
+                cfg->rates[cfg->rate_count++] = cps;
+                q = next;
+            }
+        } else if (key_len == 8 && strncmp(p, "profiles", 8) == 0) {
+            cfg->profiles = 0;
+            for (const char *q = val; q < end; ) {
+                size_t name_len = strcspn(q, ", ");
+                int profile = pacing_profile_find(q, name_len);
+                if (profile < 0) {
+                    return "unknown pacing profile";
+                }
+                cfg->profiles |= 1 << profile;
+                q += name_len + (q[name_len] == ',');
+            }
+        } else {
+            return "unknown option";
+        }
+    }
 
-    // Wait for WiFi connection
-    ESP_LOGI(TAG, "Connecting to stored WiFi network...");
-    EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
-                                           WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-                                           pdFALSE,
-                                           pdFALSE,
-                                           10000 / portTICK_PERIOD_MS); // 10 second timeout
+    if (cfg->rate_count == 0 || cfg->profiles == 0) {
+        return "nothing to sweep";
+    }
+    return NULL;
+}
 
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "Successfully connected to stored WiFi network!");
+// Auto-repeat test: plays a terminal's repeat stream for one key into the
+// input queue, once with coalescing and once typed key by key, framed by
+// markers for tools/repeat_check.py. Reports the lag after the last key.
+static const struct {
+    const char *name;
+    const char *seq;
+} repeat_test_keys[] = {
+    { "right", "\x1b[C" }, { "left", "\x1b[D" }, { "up", "\x1b[A" }, { "down", "\x1b[B" },
+    { "bs", "\x7f" },
+};
 
-        // Get and display IP address
-        esp_netif_ip_info_t ip_info;
-        if (esp_netif_get_ip_info(netif, &ip_info) == ESP_OK) {
-            ESP_LOGI(TAG, "Device IP: " IPSTR, IP2STR(&ip_info.ip));
-            ESP_LOGI(TAG, "SSH available at: ssh esp32@" IPSTR, IP2STR(&ip_info.ip));
+static bool repeat_test_settle(ssh_channel ch)
+{
+    // Wait for the queue to drain and the stream to be released
+    for (int i = 0; i < 500; i++) {
+        if (!ssh_channel_is_open(ch)) {
+            return false;
         }
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        bool idle = uxQueueMessagesWaiting(input_queue) == 0 && key_repeat.count == 0;
+        xSemaphoreGive(input_lock);
+        if (idle) {
+            return true;
+        }
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+    return false;
+}
 
-        return ESP_OK;
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGW(TAG, "Failed to connect to stored WiFi network");
-        return ESP_FAIL;
-    } else {
-        ESP_LOGW(TAG, "WiFi connection timeout");
-        return ESP_ERR_TIMEOUT;
+static void selftest_repeat(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+    char key[8] = "right";
+    char mode[8] = "both";
+    unsigned rate = 30, count = 40;
+    char buf[96];
+    char *save = NULL;
+    strlcpy(buf, args, sizeof(buf));
+
+    for (char *tok = strtok_r(buf, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (sscanf(tok, "key=%7s", key) != 1 && sscanf(tok, "rate=%u", &rate) != 1 &&
+            sscanf(tok, "count=%u", &count) != 1 && sscanf(tok, "mode=%7s", mode) != 1) {
+            count = 0;
+        }
+    }
+    const char *seq = NULL;
+    for (int i = 0; i < sizeof(repeat_test_keys) / sizeof(repeat_test_keys[0]); i++) {
+        if (strcmp(key, repeat_test_keys[i].name) == 0) {
+            seq = repeat_test_keys[i].seq;
+        }
+    }
+    bool held = strcmp(mode, "held") == 0 || strcmp(mode, "both") == 0;
+    bool legacy = strcmp(mode, "legacy") == 0 || strcmp(mode, "both") == 0;
+    if (!seq || (!held && !legacy) || rate < 5 || rate > 100 || count < REPEAT_DETECT || count > 1000) {
+        ssh_channel_printf(ch, "usage: selftest repeat [key=right|left|up|down|bs] [rate=5-100] "
+                           "[count=%d-1000] [mode=held|legacy|both]\r\n", REPEAT_DETECT);
+        return;
+    }
+
+    bool saved = key_repeat.enabled;
+    for (int pass = 0; pass < 2; pass++) {
+        if (!(pass == 0 ? held : legacy)) {
+            continue;
+        }
+        const char *name = pass == 0 ? "held" : "legacy";
+        if (!repeat_test_settle(ch)) {
+            break;
+        }
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        key_repeat.enabled = pass == 0;
+        xSemaphoreGive(input_lock);
+        char marker[64];
+        int len = snprintf(marker, sizeof(marker), "\n@@repeat %s %s %u %u\n", name, key, rate, count);
+        input_enqueue_local((const uint8_t *)marker, len);
+        repeat_test_settle(ch);
+
+        TickType_t last = xTaskGetTickCount();
+        for (unsigned i = 0; i < count && ssh_channel_is_open(ch); i++) {
+            input_enqueue_local((const uint8_t *)seq, strlen(seq));
+            vTaskDelayUntil(&last, pdMS_TO_TICKS(1000 / rate));
+        }
+        bool settled = repeat_test_settle(ch);
+        input_enqueue_local((const uint8_t *)"\n@@end\n", 7);
+        if (!settled) {
+            break;
+        }
+
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        uint32_t lag = key_repeat.lag_last_ms;
+        xSemaphoreGive(input_lock);
+        ssh_channel_printf(ch, "%s: %u x %s at %u/s, last key to release %lu ms\r\n",
+                           name, count, key, rate, (unsigned long)lag);
     }
+    repeat_test_settle(ch);
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    key_repeat.enabled = saved;
+    xSemaphoreGive(input_lock);
 }
 
-// Initialize WiFi and provisioning infrastructure (called once)
-static esp_err_t init_wifi_infrastructure(void)
+// Crypto self-test: known answers and throughput for the primitives behind
+// the SSH ciphers, MAC and key exchange. Vectors: GCM spec test case 2,
+// RFC 8439 2.8.2, RFC 4231 test case 2 and RFC 7748 5.2.
+static const uint8_t kat_gcm_ct[16] = {
+    0x03, 0x88, 0xda, 0xce, 0x60, 0xb6, 0xa3, 0x92, 0xf3, 0x28, 0xc2, 0xb9, 0x71, 0xb2, 0xfe, 0x78,
+};
+static const uint8_t kat_gcm_tag[16] = {
+    0xab, 0x6e, 0x47, 0xd4, 0x2c, 0xec, 0x13, 0xbd, 0xf5, 0x3a, 0x67, 0xb2, 0x12, 0x57, 0xbd, 0xdf,
+};
+static const uint8_t kat_hmac_sha256[32] = {
+    0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+    0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43,
+};
+static const uint8_t kat_x25519_scalar[32] = {
+    0xa5, 0x46, 0xe3, 0x6b, 0xf0, 0x52, 0x7c, 0x9d, 0x3b, 0x16, 0x15, 0x4b, 0x82, 0x46, 0x5e, 0xdd,
+    0x62, 0x14, 0x4c, 0x0a, 0xc1, 0xfc, 0x5a, 0x18, 0x50, 0x6a, 0x22, 0x44, 0xba, 0x44, 0x9a, 0xc4,
+};
+static const uint8_t kat_x25519_u[32] = {
+    0xe6, 0xdb, 0x68, 0x67, 0x58, 0x30, 0x30, 0xdb, 0x35, 0x94, 0xc1, 0xa4, 0x24, 0xb1, 0x5f, 0x7c,
+    0x72, 0x66, 0x24, 0xec, 0x26, 0xb3, 0x35, 0x3b, 0x10, 0xa9, 0x03, 0xa6, 0xd0, 0xab, 0x1c, 0x4c,
+};
+static const uint8_t kat_x25519_out[32] = {
+    0xc3, 0xda, 0x55, 0x37, 0x9d, 0xe9, 0xc6, 0x90, 0x8e, 0x94, 0xea, 0x4d, 0xf2, 0x8d, 0x08, 0x4f,
+    0x32, 0xec, 0xcf, 0x03, 0x49, 0x1c, 0x71, 0xf7, 0x54, 0xb4, 0x07, 0x55, 0x77, 0xa2, 0x85, 0x52,
+};
+
+// Each primitive runs `rounds` packets of `len` bytes in place and leaves the
+// tag or MAC of the last one in tag
+static int crypto_gcm(unsigned bits, uint8_t *buf, size_t len, int rounds, uint8_t *tag)
 {
-    ESP_LOGI(TAG, "Initializing WiFi and provisioning infrastructure...");
+    static const uint8_t key[32], iv[12];
+    mbedtls_gcm_context gcm;
+    mbedtls_gcm_init(&gcm);
+    int rc = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, bits);
+    for (int i = 0; rc == 0 && i < rounds; i++) {
+        rc = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, len, iv, sizeof(iv), NULL, 0,
+                                       buf, buf, 16, tag);
+    }
+    mbedtls_gcm_free(&gcm);
+    return rc;
+}
 
-    // Initialize TCP/IP and event loop (only once)
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    wifi_event_group = xEventGroupCreate();
+static int crypto_aes128_gcm(uint8_t *buf, size_t len, int rounds, uint8_t *tag)
+{
+    return crypto_gcm(128, buf, len, rounds, tag);
+}
 
-    // Initialize WiFi netif
-    esp_netif_create_default_wifi_sta();
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+static int crypto_aes256_gcm(uint8_t *buf, size_t len, int rounds, uint8_t *tag)
+{
+    return crypto_gcm(256, buf, len, rounds, tag);
+}
 
-    // Register event handlers (only once)
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL));
+static int crypto_aes128_ctr(uint8_t *buf, size_t len, int rounds, uint8_t *tag)
+{
+    static const uint8_t key[16];
+    uint8_t counter[16] = { 0 }, stream[16];
+    size_t off = 0;
+    mbedtls_aes_context aes;
+    mbedtls_aes_init(&aes);
+    int rc = mbedtls_aes_setkey_enc(&aes, key, 128);
+    for (int i = 0; rc == 0 && i < rounds; i++) {
+        rc = mbedtls_aes_crypt_ctr(&aes, len, &off, counter, stream, buf, buf);
+    }
+    mbedtls_aes_free(&aes);
+    return rc;
+}
 
-    return ESP_OK;
+static int crypto_hmac_sha256(uint8_t *buf, size_t len, int rounds, uint8_t *tag)
+{
+    mbedtls_md_context_t md;
+    mbedtls_md_init(&md);
+    int rc = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+    if (rc == 0) {
+        rc = mbedtls_md_hmac_starts(&md, (const uint8_t *)"Jefe", 4);
+    }
+    for (int i = 0; rc == 0 && i < rounds; i++) {
+        if (i > 0) {
+            rc = mbedtls_md_hmac_reset(&md);
+        }
+        if (rc == 0) {
+            rc = mbedtls_md_hmac_update(&md, buf, len);
+        }
+        if (rc == 0) {
+            rc = mbedtls_md_hmac_finish(&md, tag);
+        }
+    }
+    mbedtls_md_free(&md);
+    return rc;
 }
 
-// Start WiFi provisioning session (can be called multiple times for retries)
-static esp_err_t start_provisioning_session(void)
+#ifdef MBEDTLS_CHACHAPOLY_C
+static const uint8_t kat_chachapoly_tag[16] = {
+    0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91,
+};
+
+static int crypto_chachapoly(uint8_t *buf, size_t len, int rounds, uint8_t *tag)
 {
-    ESP_LOGI(TAG, "Starting WiFi provisioning (attempt %d/%d)...",
-             provisioning_retry_count + 1, MAX_PROVISIONING_RETRIES);
+    static const uint8_t nonce[12] = { 0x07, 0, 0, 0, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47 };
+    static const uint8_t aad[12] = { 0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7 };
+    uint8_t key[32];
+    for (int i = 0; i < sizeof(key); i++) {
+        key[i] = 0x80 + i;
+    }
+    mbedtls_chachapoly_context ctx;
+    mbedtls_chachapoly_init(&ctx);
+    int rc = mbedtls_chachapoly_setkey(&ctx, key);
+    for (int i = 0; rc == 0 && i < rounds; i++) {
+        rc = mbedtls_chachapoly_encrypt_and_tag(&ctx, len, nonce, aad, sizeof(aad), buf, buf, tag);
+    }
+    mbedtls_chachapoly_free(&ctx);
+    return rc;
+}
+#endif
+
+typedef struct {
+    const char *name;           // SSH algorithm the primitive backs
+    int (*run)(uint8_t *buf, size_t len, int rounds, uint8_t *tag);
+    const char *kat_input;      // Known-answer input, NULL for zeros of kat_len
+    size_t kat_len;
+    const uint8_t *kat_tag;     // Expected tag or MAC, NULL when not checked
+    size_t tag_len;
+    const uint8_t *kat_ct;      // Expected first 16 bytes of output, NULL when not checked
+} crypto_test_t;
+
+static const crypto_test_t crypto_tests[] = {
+    { "aes128-gcm@openssh.com", crypto_aes128_gcm, NULL, 16, kat_gcm_tag, 16, kat_gcm_ct },
+    { "aes256-gcm@openssh.com", crypto_aes256_gcm, NULL, 0, NULL, 0, NULL },
+    { "aes128-ctr", crypto_aes128_ctr, NULL, 0, NULL, 0, NULL },
+#ifdef MBEDTLS_CHACHAPOLY_C
+    { "chacha20-poly1305", crypto_chachapoly,
+      "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, "
+      "sunscreen would be it.", 114, kat_chachapoly_tag, 16, NULL },
+#endif
+    { "hmac-sha2-256", crypto_hmac_sha256, "what do ya want for nothing?", 28, kat_hmac_sha256, 32, NULL },
+};
 
-    // Configure provisioning
-    const char *service_name = "PROV_ESP32";
-    const char *pop = "abcd1234"; // Proof of possession
+static int crypto_rng(void *ctx, unsigned char *buf, size_t len)
+{
+    esp_fill_random(buf, len);
+    return 0;
+}
 
-    ESP_LOGI(TAG, "Scan this QR code with the ESP Provisioning app:");
-    wifi_prov_print_qr(service_name, NULL, pop, "ble");
+// Scalar multiplication on Curve25519, the core of curve25519-sha256
+static int crypto_x25519(const uint8_t scalar[32], const uint8_t u[32], uint8_t out[32])
+{
+    uint8_t k[32];
+    memcpy(k, scalar, sizeof(k));
+    k[0] &= 248;
+    k[31] = (k[31] & 127) | 64;
+
+    mbedtls_ecp_group grp;
+    mbedtls_ecp_point p, r;
+    mbedtls_mpi d;
+    mbedtls_ecp_group_init(&grp);
+    mbedtls_ecp_point_init(&p);
+    mbedtls_ecp_point_init(&r);
+    mbedtls_mpi_init(&d);
+    size_t olen = 0;
+    int rc = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_CURVE25519);
+    if (rc == 0) {
+        rc = mbedtls_mpi_read_binary_le(&d, k, sizeof(k));
+    }
+    if (rc == 0) {
+        rc = mbedtls_ecp_point_read_binary(&grp, &p, u, 32);
+    }
+    if (rc == 0) {
+        rc = mbedtls_ecp_mul(&grp, &r, &d, &p, crypto_rng, NULL);
+    }
+    if (rc == 0) {
+        rc = mbedtls_ecp_point_write_binary(&grp, &r, MBEDTLS_ECP_PF_UNCOMPRESSED, &olen, out, 32);
+    }
+    mbedtls_mpi_free(&d);
+    mbedtls_ecp_point_free(&r);
+    mbedtls_ecp_point_free(&p);
+    mbedtls_ecp_group_free(&grp);
+    return rc;
+}
 
-    // Type QR code via USB keyboard for user convenience
-    ESP_LOGI(TAG, "Typing QR code via USB keyboard...");
+static void selftest_crypto(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+    unsigned kb = 256, packet = 16384, ops = 10;
+    char buf[64];
+    char *save = NULL;
+    strlcpy(buf, args, sizeof(buf));
+
+    for (char *tok = strtok_r(buf, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (sscanf(tok, "kb=%u", &kb) != 1 && sscanf(tok, "packet=%u", &packet) != 1 &&
+            sscanf(tok, "ops=%u", &ops) != 1) {
+            kb = 0;
+        }
+    }
+    if (kb < 16 || kb > 4096 || packet < 128 || packet > 32768 || ops < 1 || ops > 100) {
+        ssh_channel_printf(ch, "usage: selftest crypto [kb=16-4096] [packet=128-32768] [ops=1-100]\r\n");
+        return;
+    }
+    uint8_t *data = malloc(packet);
+    if (!data) {
+        ssh_channel_printf(ch, "selftest: out of memory\r\n");
+        return;
+    }
 
-    // Type a header message
-    char header[] = "Scan this QR code with ESP Provisioning app:\n";
-    for (int i = 0; header[i] != '\0'; i++) {
-        send_key(header[i]);
-        vTaskDelay(pdMS_TO_TICKS(50));
+    int rounds = ((size_t)kb * 1024 + packet - 1) / packet;
+    ssh_channel_printf(ch, "crypto: %d x %u byte packets per cipher\r\n", rounds, packet);
+    int failed = 0;
+    for (int i = 0; i < sizeof(crypto_tests) / sizeof(crypto_tests[0]); i++) {
+        const crypto_test_t *t = &crypto_tests[i];
+        uint8_t tag[32];
+        const char *kat = "-";
+        if (t->kat_tag || t->kat_ct) {
+            memset(data, 0, t->kat_len);
+            if (t->kat_input) {
+                memcpy(data, t->kat_input, t->kat_len);
+            }
+            bool ok = t->run(data, t->kat_len, 1, tag) == 0 &&
+                      (!t->kat_tag || memcmp(tag, t->kat_tag, t->tag_len) == 0) &&
+                      (!t->kat_ct || memcmp(data, t->kat_ct, 16) == 0);
+            kat = ok ? "ok" : "FAILED";
+            failed += !ok;
+        }
+
+        memset(data, 0xa5, packet);
+        int64_t start = esp_timer_get_time();
+        int rc = t->run(data, packet, rounds, tag);
+        int64_t us = esp_timer_get_time() - start;
+        if (rc != 0) {
+            ssh_channel_printf(ch, "%-24s kat %-6s error -0x%04x\r\n", t->name, kat, -rc);
+            failed++;
+            continue;
+        }
+        ssh_channel_printf(ch, "%-24s kat %-6s %6lu KB/s\r\n", t->name, kat,
+                           (unsigned long)((uint64_t)rounds * packet * 1000000 / 1024 / (us > 0 ? us : 1)));
     }
+#ifndef MBEDTLS_CHACHAPOLY_C
+    ssh_channel_printf(ch, "%-24s not in mbedTLS, libssh uses its built-in C version\r\n", "chacha20-poly1305");
+#endif
+
+    uint8_t out[32];
+    bool ok = crypto_x25519(kat_x25519_scalar, kat_x25519_u, out) == 0 &&
+              memcmp(out, kat_x25519_out, sizeof(out)) == 0;
+    failed += !ok;
+    int64_t start = esp_timer_get_time();
+    for (unsigned i = 0; i < ops; i++) {
+        crypto_x25519(kat_x25519_scalar, out, out);
+    }
+    int64_t us = esp_timer_get_time() - start;
+    ssh_channel_printf(ch, "%-24s kat %-6s %6lu ms/op\r\n", "x25519", ok ? "ok" : "FAILED",
+                       (unsigned long)(us / ops / 1000));
 
-    // Type the provisioning info as text backup
-    char info_msg[] = "\nConnection Details:\nSSID: PROV_ESP32\nPassword: abcd1234\n";
-    for (int i = 0; info_msg[i] != '\0'; i++) {
-        send_key(info_msg[i]);
-        vTaskDelay(pdMS_TO_TICKS(50));
+    free(data);
+    ssh_channel_printf(ch, "crypto: %s\r\n", failed ? "FAILED" : "ok");
+}
+
+// Text like what jobs carry, with hosts, addresses and numbers varying from line to line
+static const char *const lz_sample_lines[] = {
+    "sudo apt-get install -y nginx chrony jq\n",
+    "ssh-keygen -t ed25519 -f ~/.ssh/id_rack%u -N '' -C 'rack%u'\n",
+    "ip addr add 10.%u.%u.%u/24 dev eth0\n",
+    "echo 'server ntp%u.example.net iburst' >> /etc/chrony/chrony.conf\n",
+    "for i in $(seq 1 %u); do\n    curl -fsS http://10.0.%u.%u/health || exit 1\ndone\n",
+    "systemctl enable --now node-exporter@%u.service\n",
+    "    if [ -f /var/log/app-%u.log ]; then gzip -9 /var/log/app-%u.log; fi\n",
+    "export PATH=/opt/tools-%u/bin:$PATH\n",
+};
+
+static uint32_t lz_sample_next(uint32_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+static uint32_t lz_sample(char *out, uint32_t size)
+{
+    uint32_t x = 1, len = 0;
+    while (len + 128 < size) {
+        const char *fmt = lz_sample_lines[lz_sample_next(&x) % (sizeof(lz_sample_lines) / sizeof(lz_sample_lines[0]))];
+        unsigned a = lz_sample_next(&x) % 256, b = lz_sample_next(&x) % 256, c = lz_sample_next(&x) % 256;
+        len += snprintf(out + len, size - len, fmt, a, b, c);
     }
+    return len;
+}
 
-    // Configure provisioning manager
-    network_prov_mgr_config_t config = {
-        .scheme = network_prov_scheme_ble,
-        .scheme_event_handler = NETWORK_PROV_SCHEME_BLE_EVENT_HANDLER_FREE_BTDM
+// Compress and decode a sample payload: the ratio, both throughputs, and how
+// far decoding stays ahead of the fastest typing rate
+static void selftest_lz(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+    unsigned kb = 32;
+    if (*args && sscanf(args, " kb=%u", &kb) != 1) {
+        kb = 0;
+    }
+    if (kb < 1 || kb > JOB_MAX_SIZE / 1024) {
+        ssh_channel_printf(ch, "usage: selftest lz [kb=1-%u]\r\n", JOB_MAX_SIZE / 1024);
+        return;
+    }
+
+    uint32_t capacity = kb * 1024;
+    char *plain = malloc(capacity);
+    uint8_t *packed = malloc(capacity);
+    lz_encoder_t *enc = malloc(sizeof(*enc));
+    lz_decoder_t *dec = malloc(sizeof(*dec));
+    if (!plain || !packed || !enc || !dec) {
+        ssh_channel_printf(ch, "selftest: out of memory\r\n");
+        free(plain);
+        free(packed);
+        free(enc);
+        free(dec);
+        return;
+    }
+
+    uint32_t size = lz_sample(plain, capacity);
+    int64_t start = esp_timer_get_time();
+    uint32_t packed_size = lz_compress(enc, (const uint8_t *)plain, size, packed, capacity);
+    int64_t pack_time = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    lz_decoder_init(dec, packed, packed_size, size);
+    uint32_t n = 0;
+    int c;
+    bool ok = packed_size > 0;
+    while (ok && (c = lz_decode(dec)) >= 0) {
+        ok = plain[n++] == c;
+    }
+    int64_t unpack_time = esp_timer_get_time() - start;
+    ok = ok && n == size;
+
+    uint32_t ratio = packed_size ? (uint64_t)size * 100 / packed_size : 0;
+    uint64_t decode_bps = (uint64_t)size * 1000000 / (unpack_time > 0 ? unpack_time : 1);
+    ssh_channel_printf(ch, "lz: %lu -> %lu bytes (%lu.%02lux), window %u bytes\r\n",
+                       (unsigned long)size, (unsigned long)packed_size, (unsigned long)(ratio / 100),
+                       (unsigned long)(ratio % 100), LZ_WINDOW_SIZE);
+    ssh_channel_printf(ch, "lz: compress %lu KB/s, decode %lu KB/s (%lux the fastest typing rate)\r\n",
+                       (unsigned long)((uint64_t)size * 1000000 / 1024 / (pack_time > 0 ? pack_time : 1)),
+                       (unsigned long)(decode_bps / 1024),
+                       (unsigned long)(decode_bps / app_pacing_full.cps));
+    ssh_channel_printf(ch, "lz: %s\r\n", ok ? "ok" : "FAILED");
+
+    free(plain);
+    free(packed);
+    free(enc);
+    free(dec);
+}
+
+static void cmd_selftest(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+
+    if (!ssh_client_unlimited(client)) {
+        ssh_channel_printf(ch, "selftest: not allowed for rate-limited users\r\n");
+        return;
+    }
+    if (estop.engaged) {
+        ssh_channel_printf(ch, "selftest: emergency stop engaged\r\n");
+        return;
+    }
+    if (strncmp(args, "repeat", 6) == 0 && (args[6] == ' ' || args[6] == '\0')) {
+        selftest_repeat(client, args + 6);
+        return;
+    }
+    if (strncmp(args, "crypto", 6) == 0 && (args[6] == ' ' || args[6] == '\0')) {
+        selftest_crypto(client, args + 6);
+        return;
+    }
+    if (strncmp(args, "lz", 2) == 0 && (args[2] == ' ' || args[2] == '\0')) {
+        selftest_lz(client, args + 2);
+        return;
+    }
+
+    sweep_t cfg = {
+        .seed = 1,
+        .len = 400,
+        .esc = true,
+        .profiles = (1 << PACING_PROFILE_COUNT) - 1,
+        .rate_count = 5,
+        .rates = { 10, 20, 30, 40, 50 },
     };
+    const char *error = selftest_parse(args, &cfg);
+    if (error) {
+        ssh_channel_printf(ch, "selftest: %s\r\n", error);
+        return;
+    }
 
-    ESP_ERROR_CHECK(network_prov_mgr_init(config));
+    // Step order: every rate of the first enabled profile, then the next profile
+    uint8_t step_profile[SWEEP_MAX_STEPS];
+    for (int p = 0; p < PACING_PROFILE_COUNT; p++) {
+        for (int r = 0; (cfg.profiles & (1 << p)) && r < cfg.rate_count; r++) {
+            step_profile[cfg.step_count++] = p;
+        }
+    }
+    cfg.active = true;
 
-    // Register provisioning event handler
-    ESP_ERROR_CHECK(esp_event_handler_register(NETWORK_PROV_EVENT, ESP_EVENT_ANY_ID, &prov_event_handler, NULL));
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    bool busy = sweep.active;
+    if (!busy) {
+        sweep = cfg;
+    }
+    xSemaphoreGive(input_lock);
+    if (busy) {
+        ssh_channel_printf(ch, "selftest: a sweep is already running\r\n");
+        return;
+    }
 
-    // Start provisioning
-    ESP_ERROR_CHECK(network_prov_mgr_start_provisioning(NETWORK_PROV_SECURITY_1, pop, service_name, NULL));
+    ssh_channel_printf(ch, "sweep: seed=%lu len=%u esc=%d app=%s steps=%u\r\n",
+                       (unsigned long)cfg.seed, cfg.len, cfg.esc, app_profiles[cfg.app].name, cfg.step_count);
+
+    uint16_t reported = 0;
+    bool active = true;
+    while (active) {
+        int rc = ssh_channel_poll_timeout(ch, 500, 0);
+        if (rc == SSH_ERROR || !ssh_channel_is_open(ch)) {
+            // Client went away: stop typing the corpus
+            xSemaphoreTake(input_lock, portMAX_DELAY);
+            sweep.abort = true;
+            xSemaphoreGive(input_lock);
+            return;
+        }
+        if (rc > 0) {
+            char discard[64];
+            ssh_channel_read_nonblocking(ch, discard, sizeof(discard), 0);
+        } else if (rc == SSH_EOF) {
+            vTaskDelay(pdMS_TO_TICKS(500));
+        }
 
-    // Wait for WiFi connection with reasonable timeout
-    ESP_LOGI(TAG, "Waiting for WiFi connection...");
-    EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
-                                           WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-                                           pdFALSE,
-                                           pdFALSE,
-                                           portMAX_DELAY); // Wait until provisioned
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        active = sweep.active;
+        uint16_t done = sweep.steps_done;
+        uint16_t achieved[SWEEP_MAX_STEPS];
+        memcpy(achieved, sweep.achieved_cps_x10, sizeof(achieved));
+        xSemaphoreGive(input_lock);
+
+        for (; reported < done; reported++) {
+            ssh_channel_printf(ch, "step %u %s %u cps: achieved %u.%u cps\r\n", reported,
+                               pacing_profile_names[step_profile[reported]],
+                               cfg.rates[reported % cfg.rate_count],
+                               achieved[reported] / 10, achieved[reported] % 10);
+        }
+    }
+    ssh_channel_printf(ch, "sweep %s: %u/%u steps\r\n",
+                       reported == cfg.step_count ? "done" : "aborted", reported, cfg.step_count);
+}
 
-    // Cleanup provisioning manager before returning
-    ESP_LOGI(TAG, "Cleaning up provisioning manager...");
-    network_prov_mgr_deinit();
+// Read stdin to EOF without typing it, to measure how fast the device takes
+// in bulk data over the negotiated cipher
+static void cmd_sink(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+    char buf[512];
+    uint64_t total = 0;
+    int64_t start = 0;
+    int n;
+    while ((n = ssh_channel_read(ch, buf, mem_bulk_read_size(sizeof(buf)), 0)) > 0) {
+        if (total == 0) {
+            start = esp_timer_get_time();
+        }
+        total += n;
+    }
+    int64_t us = total ? esp_timer_get_time() - start : 0;
+    ssh_channel_printf(ch, "sink: %llu bytes in %lu ms, %lu KB/s (%s)\r\n",
+                       (unsigned long long)total, (unsigned long)(us / 1000),
+                       (unsigned long)(total * 1000000 / 1024 / (us > 0 ? us : 1)),
+                       ssh_get_cipher_in(client->session));
+}
 
-    // Unregister provisioning event handler
-    esp_event_handler_unregister(NETWORK_PROV_EVENT, ESP_EVENT_ANY_ID, &prov_event_handler);
+#if TRACE_EVENTS > 0
+static const struct {
+    const char *name;
+    const char *src;        // Label for src, NULL when unused
+    const char *arg;        // Label for arg, NULL when unused
+} trace_types[TRACE_TYPE_COUNT] = {
+    [TRACE_BOOT] =          { "boot",          NULL,   "reason" },
+    [TRACE_SESSION_OPEN] =  { "session-open",  "slot", "heap_kb" },
+    [TRACE_SESSION_CLOSE] = { "session-close", "slot", "heap_kb" },
+    [TRACE_RECEIVE] =       { "receive",       "slot", "bytes" },
+    [TRACE_ENQUEUE] =       { "enqueue",       "slot", "bytes" },
+    [TRACE_REJECT] =        { "reject",        "slot", "bytes" },
+    [TRACE_DEQUEUE] =       { "dequeue",       "core", "waiting" },
+    [TRACE_REPORT] =        { "report",        NULL,   "key" },
+    [TRACE_REPORT_FAIL] =   { "report-fail",   NULL,   "key" },
+    [TRACE_JOB] =           { "job",           NULL,   "id" },
+    [TRACE_HEAP_LOW] =      { "heap-low",      NULL,   "free_kb" },
+    [TRACE_ALLOC_FAIL] =    { "alloc-fail",    NULL,   "bytes" },
+    [TRACE_ESTOP] =         { "estop",         NULL,   "on" },
+    [TRACE_MEM_LEVEL] =     { "mem-level",     "level", "free_kb" },
+};
 
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "Connected to WiFi successfully!");
+static const char *const reset_reason_names[] = {
+    [ESP_RST_UNKNOWN] = "unknown", [ESP_RST_POWERON] = "power-on", [ESP_RST_EXT] = "external",
+    [ESP_RST_SW] = "software", [ESP_RST_PANIC] = "panic", [ESP_RST_INT_WDT] = "interrupt watchdog",
+    [ESP_RST_TASK_WDT] = "task watchdog", [ESP_RST_WDT] = "watchdog", [ESP_RST_DEEPSLEEP] = "deep sleep",
+    [ESP_RST_BROWNOUT] = "brownout", [ESP_RST_SDIO] = "sdio",
+};
 
-        // Get and display IP address
-        esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
-        esp_netif_ip_info_t ip_info;
-        if (esp_netif_get_ip_info(netif, &ip_info) == ESP_OK) {
-            ESP_LOGI(TAG, "Device IP: " IPSTR, IP2STR(&ip_info.ip));
-            ESP_LOGI(TAG, "SSH available at: ssh esp32@" IPSTR, IP2STR(&ip_info.ip));
-            ESP_LOGI(TAG, "Password: keyboard");
+static const char *reset_reason_name(uint32_t reason)
+{
+    if (reason < sizeof(reset_reason_names) / sizeof(reset_reason_names[0]) && reset_reason_names[reason]) {
+        return reset_reason_names[reason];
+    }
+    return "other";
+}
+
+// Print up to `count` of a ring's latest events, oldest first, timed back from the newest
+static void trace_print(ssh_channel ch, const trace_ring_t *ring, unsigned count)
+{
+    uint32_t newest = 0;
+    for (int i = 0; i < TRACE_EVENTS; i++) {
+        if (ring->events[i].seq > newest) {
+            newest = ring->events[i].seq;
+        }
+    }
+    if (newest == 0) {
+        ssh_channel_printf(ch, "trace: no events\r\n");
+        return;
+    }
+    if (count > TRACE_EVENTS) {
+        count = TRACE_EVENTS;
+    }
+    uint32_t first = newest >= count ? newest - count + 1 : 1;
+    uint32_t end_us = ring->events[newest % TRACE_EVENTS].at_us;
+
+    for (uint32_t seq = first; seq <= newest; seq++) {
+        const trace_event_t *e = &ring->events[seq % TRACE_EVENTS];
+        uint32_t word = e->word;
+        uint32_t ago_us = end_us - e->at_us;
+        unsigned type = word >> 24, src = (word >> 16) & 0xff, arg = word & 0xffff;
+        if (e->seq != seq || type == 0 || type >= TRACE_TYPE_COUNT) {
+            continue;       // Overwritten meanwhile, or torn by the reset
+        }
+
+        char line[96];
+        int len = snprintf(line, sizeof(line), "%7lu -%6lu.%03lu ms %-13s", (unsigned long)seq,
+                           (unsigned long)(ago_us / 1000), (unsigned long)(ago_us % 1000),
+                           trace_types[type].name);
+        if (trace_types[type].src && src == TRACE_SRC_LOCAL) {
+            len += snprintf(line + len, sizeof(line) - len, " %s=uart", trace_types[type].src);
+        } else if (trace_types[type].src) {
+            len += snprintf(line + len, sizeof(line) - len, " %s=%u", trace_types[type].src, src);
+        }
+        if (type == TRACE_BOOT) {
+            snprintf(line + len, sizeof(line) - len, " %s=%s", trace_types[type].arg, reset_reason_name(arg));
+        } else if (type == TRACE_REPORT || type == TRACE_REPORT_FAIL) {
+            snprintf(line + len, sizeof(line) - len, " mod=%02x %s=%02x", arg >> 8, trace_types[type].arg,
+                     arg & 0xff);
+        } else {
+            snprintf(line + len, sizeof(line) - len, " %s=%u", trace_types[type].arg, arg);
+        }
+        ssh_channel_printf(ch, "%s\r\n", line);
+    }
+}
+#endif
+
+// Keystrokes are in the trace, so only unlimited users may read it
+static void cmd_trace(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+
+    if (!ssh_client_unlimited(client)) {
+        ssh_channel_printf(ch, "trace: not allowed for rate-limited users\r\n");
+        return;
+    }
+#if TRACE_EVENTS > 0
+    bool live = false;
+    unsigned last = TRACE_EVENTS;
+    char buf[48];
+    char *save = NULL;
+    strlcpy(buf, args, sizeof(buf));
+    for (char *tok = strtok_r(buf, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (strcmp(tok, "live") == 0) {
+            live = true;
+        } else if (sscanf(tok, "last=%u", &last) != 1 || last == 0) {
+            ssh_channel_printf(ch, "usage: trace [live] [last=N]\r\n");
+            return;
+        }
+    }
+
+    // Hold the previous ring so the memory governor leaves it until printed
+    portENTER_CRITICAL(&trace_prev_mux);
+    const trace_ring_t *prev = live ? NULL : trace_prev;
+    if (prev) {
+        trace_prev_readers++;
+    }
+    portEXIT_CRITICAL(&trace_prev_mux);
+
+    if (live) {
+        trace_print(ch, &trace_rtc, last);
+    } else if (prev) {
+        ssh_channel_printf(ch, "events before the last reset (%s):\r\n", reset_reason_name(trace_prev_reason));
+        trace_print(ch, prev, last);
+        portENTER_CRITICAL(&trace_prev_mux);
+        trace_prev_readers--;
+        portEXIT_CRITICAL(&trace_prev_mux);
+    } else if (trace_prev_evicted) {
+        ssh_channel_printf(ch, "trace: events from before the last reset were freed under memory pressure; "
+                           "try 'trace live'\r\n");
+    } else {
+        ssh_channel_printf(ch, "trace: nothing kept from before the last reset (%s); try 'trace live'\r\n",
+                           reset_reason_name(esp_reset_reason()));
+    }
+#else
+    ssh_channel_printf(ch, "trace: disabled (CONFIG_SSH_TRACE_EVENTS=0)\r\n");
+#endif
+}
+
+// Called by event subscribers as they wake: report the head job once when it
+// has been typing for EVENT_STALL_MS without a key going out
+static void job_stall_check(void)
+{
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    job_t *job = job_head();
+    if (job && job->state == JOB_TYPING && !job->stalled &&
+        esp_timer_get_time() - job->moved_us > EVENT_STALL_MS * 1000LL) {
+        job->stalled = true;
+        event_emit(EVENT_JOB_STALLED, job->id, "on=%s typed=%lu size=%lu", job_wait_names[job_wait],
+                   (unsigned long)job_confirmed(job), (unsigned long)job->size);
+    }
+    xSemaphoreGive(input_lock);
+}
+
+// Stream events as "<seq> <ms> <type> [id=<job>] key=value ..." lines until
+// the client disconnects. The first line (seq 0) is the state at subscription.
+// With job=<id>, only that job's events, ending once it is done or aborted.
+static void cmd_events(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+    unsigned long only = 0;
+
+    if (args[0] && (sscanf(args, "job=%lu", &only) != 1 || only == 0)) {
+        ssh_channel_printf(ch, "usage: events [job=<id>]\n");
+        return;
+    }
+
+    uint32_t next;
+    int slot = event_subscribe(&next);
+    if (slot < 0) {
+        ssh_channel_printf(ch, "events: all %d subscriber slots taken\n", EVENT_SUBSCRIBERS);
+        return;
+    }
+
+    // Subscribed before the snapshot, so nothing falls between the two
+    unsigned long now_ms = (unsigned long)(esp_timer_get_time() / 1000);
+    bool finished = false;
+    if (only) {
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        job_t *job = job_find(only);
+        bool known = job != NULL;
+        job_state_t state = known ? job->state : JOB_FREE;
+        uint32_t confirmed = known ? job_confirmed(job) : 0;
+        uint32_t size = known ? job->size : 0;
+        xSemaphoreGive(input_lock);
+
+        if (known) {
+            ssh_channel_printf(ch, "0 %lu job-state id=%lu state=%s typed=%lu size=%lu\n", now_ms, only,
+                               job_state_names[state], (unsigned long)confirmed, (unsigned long)size);
+        } else {
+            ssh_channel_printf(ch, "0 %lu job-state id=%lu state=unknown\n", now_ms, only);
+        }
+        finished = !known || state == JOB_DONE || state == JOB_ABORTED;
+    } else {
+        uint8_t leds = hid_leds;
+        ssh_channel_printf(ch, "0 %lu state usb=%s num=%d caps=%d scroll=%d estop=%s\n", now_ms,
+                           tud_suspended() ? "suspended" : tud_mounted() ? "mounted" : "unmounted",
+                           !!(leds & KEYBOARD_LED_NUMLOCK), !!(leds & KEYBOARD_LED_CAPSLOCK),
+                           !!(leds & KEYBOARD_LED_SCROLLLOCK), estop.engaged ? "on" : "off");
+    }
+
+    uint32_t lost = 0;
+    while (!finished && ssh_channel_is_open(ch)) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(EVENT_POLL_MS));
+        job_stall_check();
+
+        event_record_t rec;
+        while (!finished && event_read(&next, &rec, &lost)) {
+            if (lost) {
+                ssh_channel_printf(ch, "%lu %lu lost count=%lu\n", (unsigned long)rec.seq,
+                                   (unsigned long)rec.at_ms, (unsigned long)lost);
+                lost = 0;
+            }
+            if (only && rec.job != only) {
+                continue;
+            }
+            int rc = rec.job ?
+                     ssh_channel_printf(ch, "%lu %lu %s id=%lu %s\n", (unsigned long)rec.seq, (unsigned long)rec.at_ms,
+                                        event_type_names[rec.type], (unsigned long)rec.job, rec.args) :
+                     ssh_channel_printf(ch, "%lu %lu %s %s\n", (unsigned long)rec.seq, (unsigned long)rec.at_ms,
+                                        event_type_names[rec.type], rec.args);
+            finished = rc == SSH_ERROR ||
+                       (only && (rec.type == EVENT_JOB_DONE || rec.type == EVENT_JOB_ABORTED));
         }
 
-        // Type minimal connection status - just indicate ready state
-        char ready_msg[] = "WiFi Ready - SSH Available\n";
-        for (int i = 0; ready_msg[i] != '\0'; i++) {
-            send_key(ready_msg[i]);
-            vTaskDelay(pdMS_TO_TICKS(80));
+        // Keep the session serviced; input is ignored and EOF from a client
+        // with nothing to send does not end the stream
+        int rc = ssh_channel_poll_timeout(ch, 0, 0);
+        if (rc == SSH_ERROR) {
+            break;
+        }
+        if (rc > 0) {
+            char discard[64];
+            ssh_channel_read_nonblocking(ch, discard, sizeof(discard), 0);
         }
+    }
+    event_unsubscribe(slot);
+}
 
-        return ESP_OK;
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGE(TAG, "Provisioning attempt %d failed", provisioning_retry_count + 1);
-        provisioning_retry_count++;
-        return ESP_FAIL;
+// One-way keystroke latency, for tools/kbdlat.py. Without arguments the
+// session runs a line protocol (times in microseconds):
+//   sync <t1>                  -> sync <t1> <t2> <t3>   t2, t3: device receive and send times
+//   clock <offset> <rtt>       -> clock ok              device time = client time + offset
+//   key <seq> <t> <hex bytes>  -> lat <seq> <total> <net> <queue> <usb>, or lat <seq> none
+//   report                     -> pct <stage> <n> <p50> <p90> <p99> <max> per stage, then end
+// The client works out the offset NTP-style from sync replies and sends
+// stamped keys, which are typed like any session input.
+#define LAT_POLL_MS 20
+#define LAT_PROBE_TIMEOUT_MS 2000
+#define LAT_KEY_BYTES 16
+
+static void lat_print(ssh_channel ch, bool machine)
+{
+    // count, p50, p90, p99, max per stage, taken together
+    uint32_t v[LAT_STAGE_COUNT][5];
+    portENTER_CRITICAL(&lat_mux);
+    for (int s = 0; s < LAT_STAGE_COUNT; s++) {
+        const lat_hist_t *h = &lat_hist[s];
+        v[s][0] = h->count;
+        v[s][1] = lat_percentile(h, 50);
+        v[s][2] = lat_percentile(h, 90);
+        v[s][3] = lat_percentile(h, 99);
+        v[s][4] = h->max_us;
+    }
+    uint32_t unmatched = lat_unmatched;
+    portEXIT_CRITICAL(&lat_mux);
+
+    for (int s = 0; s < LAT_STAGE_COUNT; s++) {
+        const uint32_t *p = v[s];
+        if (machine) {
+            ssh_channel_printf(ch, "pct %s %lu %lu %lu %lu %lu\n", lat_stage_names[s], (unsigned long)p[0],
+                               (unsigned long)p[1], (unsigned long)p[2], (unsigned long)p[3], (unsigned long)p[4]);
+        } else {
+            ssh_channel_printf(ch, "%-5s n=%lu p50=%lu.%lums p90=%lu.%lums p99=%lu.%lums max=%lu.%lums\r\n",
+                               lat_stage_names[s], (unsigned long)p[0],
+                               (unsigned long)(p[1] / 1000), (unsigned long)(p[1] % 1000 / 100),
+                               (unsigned long)(p[2] / 1000), (unsigned long)(p[2] % 1000 / 100),
+                               (unsigned long)(p[3] / 1000), (unsigned long)(p[3] % 1000 / 100),
+                               (unsigned long)(p[4] / 1000), (unsigned long)(p[4] % 1000 / 100));
+        }
     }
+    ssh_channel_printf(ch, machine ? "end unmatched=%lu\n" : "unmatched=%lu (no report, or timed out)\r\n",
+                       (unsigned long)unmatched);
+}
 
-    return ESP_ERR_TIMEOUT;
+// One protocol line, read at at_us
+static void lat_command(ssh_client_t *client, const char *line, int64_t at_us, int64_t *offset_us, bool *synced)
+{
+    ssh_channel ch = client->channel;
+    long long t1, offset, rtt;
+    unsigned long seq;
+    char hex[2 * LAT_KEY_BYTES + 1];
+
+    if (sscanf(line, "sync %lld", &t1) == 1) {
+        ssh_channel_printf(ch, "sync %lld %lld %lld\n", t1, (long long)at_us, (long long)esp_timer_get_time());
+    } else if (sscanf(line, "clock %lld %lld", &offset, &rtt) == 2) {
+        *offset_us = offset;
+        *synced = true;
+        ESP_LOGI(TAG, "Latency clock offset %lld us, round trip %lld us", offset, rtt);
+        ssh_channel_printf(ch, "clock ok\n");
+    } else if (sscanf(line, "key %lu %lld %32s", &seq, &t1, hex) == 3) {
+        char bytes[LAT_KEY_BYTES];
+        int n = 0;
+        unsigned int b;
+        while (n < LAT_KEY_BYTES && sscanf(hex + 2 * n, "%2x", &b) == 1) {
+            bytes[n++] = b;
+        }
+        if (!*synced) {
+            ssh_channel_printf(ch, "error clock not synced\n");
+            return;
+        }
+        uint8_t probe = n > 0 ? lat_probe_start(seq, t1 + *offset_us, at_us) : 0;
+        if (n > 0 && input_enqueue_ssh(client, bytes, n, probe) > 0 && probe) {
+            lat_probe_end(probe, 0);
+        }
+        if (!probe) {
+            // Typed, but not measured
+            ssh_channel_printf(ch, "lat %lu none\n", seq);
+        }
+    } else if (strcmp(line, "report") == 0) {
+        lat_print(ch, true);
+    } else {
+        ssh_channel_printf(ch, "error unknown command\n");
+    }
 }
 
-// WiFi provisioning function with retry logic
-static void wifi_provisioning(void)
+static void cmd_latency(ssh_client_t *client, const char *args)
 {
-    ESP_LOGI(TAG, "Starting WiFi connection process...");
+    ssh_channel ch = client->channel;
 
-    // Initialize NVS
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
+    if (strcmp(args, "show") == 0) {
+        lat_print(ch, false);
+        return;
     }
-    ESP_ERROR_CHECK(ret);
-
-    // Initialize WiFi infrastructure (only once)
-    ret = init_wifi_infrastructure();
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to initialize WiFi infrastructure");
+    if (strcmp(args, "reset") == 0) {
+        if (!ssh_client_unlimited(client)) {
+            ssh_channel_printf(ch, "latency: not allowed for rate-limited users\r\n");
+            return;
+        }
+        portENTER_CRITICAL(&lat_mux);
+        memset(lat_hist, 0, sizeof(lat_hist));
+        lat_unmatched = 0;
+        portEXIT_CRITICAL(&lat_mux);
+        ssh_channel_printf(ch, "latency: cleared\r\n");
+        return;
+    }
+    if (args[0]) {
+        ssh_channel_printf(ch, "usage: latency [show|reset]\r\n");
         return;
     }
 
-    // Check if we have stored WiFi credentials
-    if (wifi_credentials_available()) {
-        // Try to connect with stored credentials first
-        ret = wifi_connect_with_stored_credentials();
-        if (ret == ESP_OK) {
-            ESP_LOGI(TAG, "Connected using stored credentials - SSH server ready");
-            // No USB typing needed when already provisioned - just start SSH server
-            return;
-        } else {
-            ESP_LOGI(TAG, "Stored credentials failed, starting provisioning...");
-            // Invalidate stored credentials by clearing WiFi config
-            ESP_ERROR_CHECK(esp_wifi_restore());
-            provisioning_retry_count = 0;
+    char buf[128];
+    char line[96];
+    size_t len = 0;
+    int64_t offset_us = 0;
+    bool synced = false;
+    while (ssh_channel_is_open(ch) && !ssh_channel_is_eof(ch)) {
+        int n = ssh_channel_read_timeout(ch, buf, sizeof(buf), 0, LAT_POLL_MS);
+        int64_t at_us = esp_timer_get_time();
+        if (n == SSH_ERROR) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                line[len] = '\0';
+                lat_command(client, line, at_us, &offset_us, &synced);
+                len = 0;
+            } else if (buf[i] != '\r' && len + 1 < sizeof(line)) {
+                line[len++] = buf[i];
+            }
+        }
+
+        lat_probe_t p;
+        while (lat_probe_collect(LAT_PROBE_TIMEOUT_MS * 1000LL, &p)) {
+            if (p.read_us) {
+                ssh_channel_printf(ch, "lat %lu %lld %lld %lld %lld\n", (unsigned long)p.seq,
+                                   (long long)(p.read_us - p.sent_us), (long long)(p.arrived_us - p.sent_us),
+                                   (long long)(p.dequeued_us - p.arrived_us), (long long)(p.read_us - p.dequeued_us));
+            } else {
+                ssh_channel_printf(ch, "lat %lu none\n", (unsigned long)p.seq);
+            }
         }
     }
+    lat_probe_release_all();
+}
 
-    ESP_LOGI(TAG, "Starting WiFi provisioning with retry logic...");
+// Line edit mode: the line is edited and echoed here and only typed on the
+// target, as a job, once Enter commits it. Needs a terminal: `ssh -t`.
+#define LINE_IDLE_MS 1000
 
-    // Retry provisioning with exponential backoff
-    do {
-        ret = start_provisioning_session();
+static void cmd_line(ssh_client_t *client, const char *args)
+{
+    ssh_channel ch = client->channel;
+    int app = app_profile_arg(args);
 
-        if (ret == ESP_OK) {
-            ESP_LOGI(TAG, "WiFi provisioning completed successfully");
-            provisioning_retry_count = 0;
-            return;
+    if (!client->pty) {
+        ssh_channel_printf(ch, "line: needs a terminal, use ssh -t\r\n");
+        return;
+    }
+    if (app < 0) {
+        ssh_channel_printf(ch, "line: unknown app profile\r\n");
+        return;
+    }
+    line_edit_t *le = malloc(sizeof(*le));
+    if (!le) {
+        ssh_channel_printf(ch, "line: out of memory\r\n");
+        return;
+    }
+
+    static const char prompt[] = "line> ";
+    char out[LE_OUT_MAX];
+    char buf[64];
+    char text[LE_LINE_MAX + 1];
+    vt_parser_t parser = { 0 };
+    key_event_t keys[VT_EVENTS_MAX];
+    uint32_t lines = 0, typed = 0;
+    le_result_t result = LE_EDITING;
+
+    le_init(le, prompt, client->cols);
+    ssh_channel_printf(ch, "line mode (app=%s): Enter types the line, Ctrl-C drops it, "
+                       "Ctrl-D on an empty line ends\r\n", app_profiles[app].name);
+    ssh_channel_write(ch, out, le_start(le, out));
+    while (result != LE_EOF && ssh_channel_is_open(ch) && !ssh_channel_is_eof(ch)) {
+        // Wake in time to turn a lone ESC into the Escape key
+        int wait_ms = parser.state == VT_GROUND ? LINE_IDLE_MS : VT_ESC_TIMEOUT_MS + 1;
+        int n = ssh_channel_read_timeout(ch, buf, sizeof(buf), 0, wait_ms);
+        if (n == SSH_ERROR) {
+            break;
+        }
+        for (int i = 0; i <= n && result != LE_EOF; i++) {
+            int count = i < n ? vt_feed(&parser, buf[i], now_ms(), keys) : vt_flush(&parser, now_ms(), keys);
+            for (int k = 0; k < count && result != LE_EOF; k++) {
+                if (keys[k].type == KEY_RELEASE || keys[k].mod_key) {
+                    continue;
+                }
+                size_t out_len;
+                result = le_key(le, &keys[k], out, &out_len);
+                ssh_channel_write(ch, out, out_len);
+                if (result == LE_COMMIT) {
+                    const char *error = NULL;
+                    int size = snprintf(text, sizeof(text), "%s\n", le->line);
+                    if (job_submit_text(client, text, size, "line", app, &error)) {
+                        lines++;
+                        typed += size;
+                    } else {
+                        ssh_channel_printf(ch, "[line] not typed: %s\r\n", error);
+                    }
+                }
+                if (result == LE_COMMIT || result == LE_CANCEL) {
+                    ssh_channel_write(ch, out, le_start(le, out));
+                }
+            }
         }
+    }
 
-        if (provisioning_retry_count < MAX_PROVISIONING_RETRIES) {
-            ESP_LOGW(TAG, "Retrying provisioning in %d seconds...",
-                     provisioning_retry_count * 5);
+    xSemaphoreTake(input_lock, portMAX_DELAY);
+    line_stats.sessions++;
+    line_stats.lines += lines;
+    line_stats.keys += le->keys;
+    line_stats.typed += typed;
+    xSemaphoreGive(input_lock);
+    ssh_channel_printf(ch, "line: %lu lines typed, %lu keys pressed, %lu sent to the target "
+                       "(%ld saved), %lu edits\r\n", (unsigned long)lines, (unsigned long)le->keys,
+                       (unsigned long)typed, (long)le->keys - (long)typed, (unsigned long)le->edits);
+    ESP_LOGI(TAG, "Line session by %s: %lu lines, %lu keys, %lu typed", ssh_users[client->user].username,
+             (unsigned long)lines, (unsigned long)le->keys, (unsigned long)typed);
+    free(le);
+}
 
-            // Wait before retry with exponential backoff
-            vTaskDelay(pdMS_TO_TICKS(provisioning_retry_count * 5000));
+#if CONFIG_SSH_KEYBOARD_MSC
+// Upload `name` until EOF and add it to the drive, replacing a file the host
+// would see under the same name. Returns NULL, or why it was not added.
+static const char *drive_put(ssh_client_t *client, const char *name, uint32_t *size_out)
+{
+    channel_reader_t reader = { .channel = client->channel };
+    char tmp[40], path[40];
+
+    xSemaphoreTake(drive_lock, portMAX_DELAY);
+    int existing = drive_find(name);
+    uint32_t room = DRIVE_MAX_SIZE - drive_bytes() + (existing >= 0 ? drive.files[existing].size : 0);
+    bool full = existing < 0 && drive.count == FV_FILES_MAX;
+    bool attached = drive.attached;
+    xSemaphoreGive(drive_lock);
+    if (attached) {
+        return "eject the drive first";
+    }
+    if (full) {
+        return "too many files";
+    }
+    if (!mem_intake_wait()) {
+        return "low memory";
+    }
 
-            // Type retry message via USB keyboard
-            char retry_msg[] = "WiFi provisioning failed. Retrying...\n";
-            for (int i = 0; retry_msg[i] != '\0'; i++) {
-                send_key(retry_msg[i]);
-                vTaskDelay(pdMS_TO_TICKS(80));
+    const char *error = NULL;
+    uint8_t *data = NULL;
+    uint32_t size = 0;
+    snprintf(tmp, sizeof(tmp), SPIFFS_BASE "/drv.%d", (int)(client - ssh_clients));
+    if (drive.psram) {
+        // Grow in steps; one byte past the free space means it does not fit
+        uint32_t capacity = 0;
+        while (1) {
+            if (size == capacity) {
+                uint32_t grow = capacity + DRIVE_PSRAM_STEP > room + 1 ? room + 1 : capacity + DRIVE_PSRAM_STEP;
+                uint8_t *bigger = capacity > room ? NULL : heap_caps_realloc(data, grow, MALLOC_CAP_SPIRAM);
+                if (!bigger) {
+                    error = capacity > room ? "larger than the free space" : "out of PSRAM";
+                    break;
+                }
+                data = bigger;
+                capacity = grow;
+            }
+            uint32_t n = reader_read(&reader, (char *)data + size, capacity - size);
+            size += n;
+            if (n == 0 || size < capacity) {
+                break;
             }
         }
-    } while (provisioning_retry_count < MAX_PROVISIONING_RETRIES);
+        if (!error && size == 0) {
+            free(data);
+            data = NULL;
+        } else if (!error && size < capacity) {
+            uint8_t *fit = heap_caps_realloc(data, size, MALLOC_CAP_SPIRAM);
+            data = fit ? fit : data;
+        }
+    } else {
+        char *chunk = malloc(DRIVE_CHUNK);
+        FILE *f = chunk && spiffs_ready ? fopen(tmp, "wb") : NULL;
+        if (!f) {
+            error = !spiffs_ready ? "storage not available" : !chunk ? "out of memory" : "cannot write to storage";
+        }
+        while (!error) {
+            uint32_t n = reader_read(&reader, chunk, DRIVE_CHUNK);
+            if (n == 0) {
+                break;
+            }
+            if (size + n > room) {
+                error = "larger than the free space";
+            } else if (fwrite(chunk, 1, n, f) != n) {
+                error = "storage full";
+            }
+            size += n;
+        }
+        if (f) {
+            fclose(f);
+        }
+        free(chunk);
+    }
 
-    // If all retries failed
-    ESP_LOGE(TAG, "WiFi provisioning failed after %d attempts", MAX_PROVISIONING_RETRIES);
-    provisioning_retry_count = 0;
+    xSemaphoreTake(drive_lock, portMAX_DELAY);
+    int i = drive_find(name);
+    if (!error && drive.attached) {
+        error = "drive attached during the upload";
+    } else if (!error && i < 0 && drive.count == FV_FILES_MAX) {
+        error = "too many files";
+    }
+    if (!error) {
+        if (i >= 0) {
+            drive_remove(i);
+        }
+        drive_path(name, path, sizeof(path));
+        if (!drive.psram && rename(tmp, path) != 0) {
+            error = "cannot write to storage";
+        } else {
+            drive_file_t *f = &drive.files[drive.count++];
+            strlcpy(f->name, name, sizeof(f->name));
+            f->size = size;
+            f->data = data;
+            data = NULL;
+        }
+    }
+    xSemaphoreGive(drive_lock);
 
-    // Type failure message via USB keyboard
-    char fail_msg[] = "WiFi provisioning failed. Please reset device to retry.\n";
-    for (int i = 0; fail_msg[i] != '\0'; i++) {
-        send_key(fail_msg[i]);
-        vTaskDelay(pdMS_TO_TICKS(80));
+    free(data);
+    if (!drive.psram) {
+        unlink(tmp);
     }
+    *size_out = size;
+    return error;
 }
 
-// Provisioning completion demo task (disabled to avoid automatic typing)
-/*
-static void provisioning_complete_demo(void *pvParameters)
+// Payload drive: drive [list] | put <name> (stdin) | rm <name> | attach | eject
+static void cmd_drive(ssh_client_t *client, const char *args)
 {
-    const char *demo_messages[] = {
-        "ESP32-S3 WiFi Provisioned Keyboard Ready!\n",
-        "Features: USB HID + WiFi Provisioning + QR Code\n",
-        "Arrow keys, Tab, special keys supported\n",
-        "Remote keyboard control activated\n"
-    };
+    ssh_channel ch = client->channel;
+    char verb[8] = "list";
+    char name[FV_NAME_MAX + 1] = "";
+    uint8_t entry[11], case_bits;
+    sscanf(args, "%7s %13s", verb, name);
+
+    if (strcmp(verb, "list") == 0) {
+        xSemaphoreTake(drive_lock, portMAX_DELAY);
+        drive_file_t files[FV_FILES_MAX];
+        int count = drive.count;
+        memcpy(files, drive.files, sizeof(files));
+        uint32_t used = drive_bytes();
+        xSemaphoreGive(drive_lock);
+        ssh_channel_printf(ch, "drive: %s, %s, %d files, %lu of %lu bytes used\r\n",
+                           drive.attached ? "attached" : "ejected", drive.psram ? "PSRAM" : "spiffs", count,
+                           (unsigned long)used, (unsigned long)DRIVE_MAX_SIZE);
+        for (int i = 0; i < count; i++) {
+            ssh_channel_printf(ch, "%-12s %10lu\r\n", files[i].name, (unsigned long)files[i].size);
+        }
+        return;
+    }
 
-    while (1) {
-        if (tud_mounted()) {
-            // Type demo messages
-            for (int i = 0; i < sizeof(demo_messages)/sizeof(demo_messages[0]); i++) {
-                for (int j = 0; demo_messages[i][j] != '\0'; j++) {
-                    send_key(demo_messages[i][j]);
-                    vTaskDelay(pdMS_TO_TICKS(60)); // Natural typing speed
-                }
-                vTaskDelay(pdMS_TO_TICKS(3000)); // Pause between messages
-            }
+    if (!ssh_client_unlimited(client)) {
+        ssh_channel_printf(ch, "drive: not allowed for rate-limited users\r\n");
+        return;
+    }
+    if (strcmp(verb, "attach") == 0) {
+        const char *error = NULL;
+        if (drive_attach(&error)) {
+            ssh_channel_printf(ch, "drive: attached\r\n");
+        } else {
+            ssh_channel_printf(ch, "drive: %s\r\n", error);
+        }
+        return;
+    }
+    if (strcmp(verb, "eject") == 0) {
+        drive_eject("ssh");
+        ssh_channel_printf(ch, "drive: ejected\r\n");
+        return;
+    }
 
-            vTaskDelay(pdMS_TO_TICKS(45000)); // Wait 45 seconds
+    bool put = strcmp(verb, "put") == 0;
+    if ((!put && strcmp(verb, "rm") != 0) || !fv_name(name, entry, &case_bits)) {
+        ssh_channel_printf(ch, "usage: drive [list] | put <name> < file | rm <name> | attach | eject\r\n"
+                           "names are 8.3: up to 8 of A-Z a-z 0-9 _ -, an optional extension of up to 3\r\n");
+        return;
+    }
+    if (put) {
+        uint32_t size = 0;
+        const char *error = drive_put(client, name, &size);
+        if (error) {
+            ssh_channel_printf(ch, "drive: %s not added: %s\r\n", name, error);
         } else {
-            vTaskDelay(pdMS_TO_TICKS(1000));
+            ssh_channel_printf(ch, "drive: added %s (%lu bytes)\r\n", name, (unsigned long)size);
         }
+        return;
+    }
+
+    xSemaphoreTake(drive_lock, portMAX_DELAY);
+    int i = drive.attached ? -1 : drive_find(name);
+    if (i >= 0) {
+        drive_remove(i);
+    }
+    bool attached = drive.attached;
+    xSemaphoreGive(drive_lock);
+    if (attached) {
+        ssh_channel_printf(ch, "drive: eject the drive first\r\n");
+    } else {
+        ssh_channel_printf(ch, i >= 0 ? "drive: removed %s\r\n" : "drive: no file %s\r\n", name);
     }
 }
-*/
+#endif
+
+static void cmd_help(ssh_client_t *client, const char *args);
+
+static const ssh_command_t ssh_commands[] = {
+    { "help",  "list commands",                         cmd_help },
+    { "stats", "input queue and per-user typing counters", cmd_stats },
+    { "job",   "submit [app=] (stdin)|list|status|pause|resume|abort <id>", cmd_job },
+    { "jobd",  "line-based job protocol for tools/kbdjob.py", cmd_jobd },
+    { "latency", "one-way keystroke latency: [show|reset]; bare for tools/kbdlat.py", cmd_latency },
+    { "line",  "edit lines locally, type each on Enter (ssh -t): [app=<profile>]", cmd_line },
+    { "pacing", "show or set key timing: default | hold|even|tap <cps>", cmd_pacing },
+    { "app",   "application profiles; set the default for new jobs: [<profile>]", cmd_app },
+    { "estop", "emergency stop status; stop or let input in again: [on|off]", cmd_estop },
+    { "tpl",   "templates: list | save <name> (stdin) | show|rm <name> | render <name> [args]", cmd_tpl },
+    { "repeat", "auto-repeat coalescing: [on|off] [release=ms], with lag stats", cmd_repeat },
+    { "bootkey", "hit a key from USB enumeration on: <key> [every= timeout= until=] | off", cmd_bootkey },
+    { "selftest", "sweep [seed= len= rates= profiles= esc=] | repeat [key= rate= count= mode=] | crypto [kb= packet= ops=] | lz [kb=]", cmd_selftest },
+    { "sink",  "read stdin to EOF and report receive throughput", cmd_sink },
+    { "trace", "pipeline events before the last reset: [live] [last=N]", cmd_trace },
+    { "events", "stream job, USB, LED and stop events until disconnected: [job=<id>]", cmd_events },
+#if CONFIG_SSH_KEYBOARD_MSC
+    { "drive", "USB payload drive: [list] | put <name> (stdin) | rm <name> | attach | eject", cmd_drive },
+#endif
+};
 
-// SSH Server Configuration
-#define SSH_PORT "22"
-#define SSH_USERNAME "admin"
-#define SSH_PASSWORD "esp32kbd"
+static void cmd_help(ssh_client_t *client, const char *args)
+{
+    for (int i = 0; i < sizeof(ssh_commands) / sizeof(ssh_commands[0]); i++) {
+        ssh_channel_printf(client->channel, "%-10s %s\r\n", ssh_commands[i].name, ssh_commands[i].help);
+    }
+}
 
-static ssh_bind sshbind = NULL;
-static TaskHandle_t ssh_server_task_handle = NULL;
+// Run an exec request and return its exit status
+static int ssh_exec_command(ssh_client_t *client, const char *command)
+{
+    while (*command == ' ') {
+        command++;
+    }
+    size_t name_len = strcspn(command, " ");
+    const char *args = command + name_len;
+    while (*args == ' ') {
+        args++;
+    }
+
+    for (int i = 0; i < sizeof(ssh_commands) / sizeof(ssh_commands[0]); i++) {
+        if (strlen(ssh_commands[i].name) == name_len &&
+            strncmp(ssh_commands[i].name, command, name_len) == 0) {
+            ESP_LOGI(TAG, "SSH exec: %s", command);
+            ssh_commands[i].fn(client, args);
+            return 0;
+        }
+    }
+
+    ssh_channel_printf(client->channel, "unknown command: %.*s (try 'help')\r\n", (int)name_len, command);
+    return 1;
+}
 
 // NVS storage for SSH keys
 #define SSH_NVS_NAMESPACE "ssh_keys"
-#define SSH_HOST_KEY_NAME "host_key"
 
 // Function to save SSH host key to custom NVS partition
 static esp_err_t save_ssh_host_key(ssh_key key) {
@@ -677,9 +6918,17 @@ static ssh_key load_ssh_host_key(void) {
         return NULL;
     }
 
-    ESP_LOGI(TAG, "SSH host key loaded from NVS");
     free(b64_key);
     nvs_close(nvs_handle);
+
+    if (ssh_key_type(key) != SSH_HOST_KEY_TYPE) {
+        ESP_LOGW(TAG, "Stored SSH host key has unexpected type %s, will generate new key",
+                 ssh_key_type_to_char(ssh_key_type(key)));
+        ssh_key_free(key);
+        return NULL;
+    }
+
+    ESP_LOGI(TAG, "SSH host key loaded from NVS");
     return key;
 }
 
@@ -689,42 +6938,109 @@ static ssh_key load_ssh_host_key(void) {
 // which requires the deprecated function for password access.
 
 
+// Kitty keyboard protocol: ask the terminal for its progressive enhancement
+// flags (CSI ? u), fenced by a device attributes query (CSI c) that every
+// terminal answers. A terminal that answers the first gets flags pushed for
+// the session: disambiguate (1), event types (2) and all keys as escape
+// codes (8), so every key arrives as exact press, repeat and release events.
+// Rate-limited users stay on legacy input, since each key costs them several
+// bytes of their budget in this encoding.
+#define KITTY_FLAGS "11"
+#define KITTY_PROBE_MS 500
+
+// Remove complete CSI ? ... replies from buf; returns the remaining length
+static int kitty_strip_replies(char *buf, int len, bool *supported, bool *answered)
+{
+    int out = 0;
+    for (int i = 0; i < len; ) {
+        if (len - i >= 3 && memcmp(&buf[i], "\x1b[?", 3) == 0) {
+            int end = i + 3;
+            while (end < len && (buf[end] < 0x40 || buf[end] > 0x7E)) {
+                end++;
+            }
+            if (end < len) {
+                *supported |= buf[end] == 'u';
+                *answered |= buf[end] == 'c';
+                i = end + 1;
+                continue;
+            }
+        }
+        buf[out++] = buf[i++];
+    }
+    return out;
+}
+
+static void kitty_negotiate(ssh_client_t *client)
+{
+    static const char probe[] = "\x1b[?u\x1b[c";
+    ssh_channel channel = client->channel;
+    bool supported = false, answered = false;
+    char buf[64];
+    int len = 0;
+
+    // Without a pty there is no terminal to answer, only a script's stdout
+    if (!client->pty || !ssh_client_unlimited(client)) {
+        return;
+    }
+    ssh_channel_write(channel, probe, strlen(probe));
+    int64_t deadline = esp_timer_get_time() + KITTY_PROBE_MS * 1000;
+    while (!answered && len < sizeof(buf)) {
+        int remaining_ms = (deadline - esp_timer_get_time()) / 1000;
+        if (remaining_ms <= 0) {
+            break;
+        }
+        int n = ssh_channel_read_timeout(channel, buf + len, sizeof(buf) - len, 0, remaining_ms);
+        if (n <= 0) {
+            break;
+        }
+        len = kitty_strip_replies(buf, len + n, &supported, &answered);
+    }
+
+    // Keys typed while the terminal was answering are still legacy input
+    if (len > 0) {
+        input_enqueue_ssh(client, buf, len, 0);
+    }
+    if (supported) {
+        ssh_channel_write(channel, "\x1b[>" KITTY_FLAGS "u", strlen("\x1b[>" KITTY_FLAGS "u"));
+        xSemaphoreTake(input_lock, portMAX_DELAY);
+        client->kitty = true;
+        xSemaphoreGive(input_lock);
+    }
+    ESP_LOGI(TAG, "Terminal keyboard protocol: %s", supported ? "kitty (exact key events)" :
+             answered ? "legacy" : "legacy (no reply)");
+}
+
 // SSH Keyboard input handler
-static void ssh_keyboard_task(void *arg) {
-    ssh_channel channel = (ssh_channel)arg;
+static void ssh_keyboard_loop(ssh_client_t *client) {
+    ssh_channel channel = client->channel;
     char buffer[256];
     int bytes_read;
 
     ESP_LOGI(TAG, "SSH keyboard input handler started");
 
-    while (1) {
-        bytes_read = ssh_channel_read(channel, buffer, sizeof(buffer) - 1, 0);
+    while (ssh_channel_is_open(channel) && !ssh_channel_is_eof(channel)) {
+        bytes_read = ssh_channel_read_timeout(channel, buffer, sizeof(buffer) - 1, 0, 1000);
         if (bytes_read > 0) {
             buffer[bytes_read] = '\0';
+            trace(TRACE_RECEIVE, client - ssh_clients, bytes_read);
             ESP_LOGI(TAG, "SSH received: %.*s", bytes_read, buffer);
 
-            // Convert SSH input to USB keyboard input (same as UART)
-            for (int i = 0; i < bytes_read; i++) {
-                if (buffer[i] != '\0') {
-                    send_key(buffer[i]);
-                    vTaskDelay(pdMS_TO_TICKS(10)); // Small delay between keystrokes
-                }
-            }
+            // Queue SSH input for the USB keyboard (same path as UART)
+            input_enqueue_ssh(client, buffer, bytes_read, 0);
         } else if (bytes_read == SSH_ERROR) {
             ESP_LOGI(TAG, "SSH channel read error, disconnecting");
             break;
         } else {
-            // No data available, wait a bit
-            vTaskDelay(pdMS_TO_TICKS(50));
+            trace_heap_check();
         }
     }
 
     ESP_LOGI(TAG, "SSH keyboard input handler ended");
-    vTaskDelete(NULL);
 }
 
 // SSH Session handler - simple message-based approach for compatibility
-static void handle_ssh_session(ssh_session session) {
+static void handle_ssh_session(ssh_client_t *client) {
+    ssh_session session = client->session;
     ssh_message msg = NULL;
     ssh_channel channel = NULL;
     int auth_success = 0;
@@ -732,12 +7048,21 @@ static void handle_ssh_session(ssh_session session) {
     ESP_LOGI(TAG, "Starting SSH session handler");
 
     // Handle key exchange
-    if (ssh_handle_key_exchange(session) != SSH_OK) {
+    uint32_t heap_before = esp_get_free_heap_size();
+    int64_t kex_start = esp_timer_get_time();
+    int kex_rc = ssh_handle_key_exchange(session);
+    uint32_t kex_ms = (esp_timer_get_time() - kex_start) / 1000;
+    int32_t kex_heap = (int32_t)(heap_before - esp_get_free_heap_size());
+    kex_stats_record(kex_ms, kex_heap, kex_rc == SSH_OK);
+
+    if (kex_rc != SSH_OK) {
         ESP_LOGE(TAG, "SSH key exchange failed: %s", ssh_get_error(session));
         return;
     }
 
-    ESP_LOGI(TAG, "SSH key exchange completed");
+    ESP_LOGI(TAG, "SSH key exchange completed in %lu ms (%s, %s/%s), session heap %ld bytes",
+             (unsigned long)kex_ms, SSH_HOST_KEY_ALGORITHMS, ssh_get_kex_algo(session),
+             ssh_get_cipher_in(session), (long)kex_heap);
 
     // Set authentication methods
     ssh_set_auth_methods(session, SSH_AUTH_METHOD_PASSWORD);
@@ -754,9 +7079,11 @@ static void handle_ssh_session(ssh_session session) {
 
                 ESP_LOGI(TAG, "SSH password auth for user: %s", user);
 
-                if (user && password && strcmp(user, SSH_USERNAME) == 0 && strcmp(password, SSH_PASSWORD) == 0) {
+                int user_idx = (user && password) ? ssh_user_find(user, password) : -1;
+                if (user_idx >= 0) {
                     ESP_LOGI(TAG, "SSH authentication successful");
                     ssh_message_auth_reply_success(msg, 0);
+                    ssh_client_login(client, user_idx);
                     auth_success = 1;
                     ssh_message_free(msg);
                     break;
@@ -805,20 +7132,38 @@ static void handle_ssh_session(ssh_session session) {
         ESP_LOGW(TAG, "No SSH channel received");
         return;
     }
+    client->channel = channel;
 
     ESP_LOGI(TAG, "Waiting for shell request");
 
-    // Wait for shell request
+    // Wait for shell or exec request
+    bool shell = false;
     while ((msg = ssh_message_get(session))) {
         if (ssh_message_type(msg) == SSH_REQUEST_CHANNEL) {
             if (ssh_message_subtype(msg) == SSH_CHANNEL_REQUEST_SHELL) {
                 ssh_message_channel_request_reply_success(msg);
                 ESP_LOGI(TAG, "SSH shell session started");
                 ssh_message_free(msg);
+                shell = true;
+                break;
+            } else if (ssh_message_subtype(msg) == SSH_CHANNEL_REQUEST_EXEC) {
+                const char *requested = ssh_message_channel_request_command(msg);
+                char command[128];
+                strlcpy(command, requested ? requested : "", sizeof(command));
+                ssh_message_channel_request_reply_success(msg);
+                ssh_message_free(msg);
+
+                int status = ssh_exec_command(client, command);
+                ssh_channel_request_send_exit_status(channel, status);
+                ssh_channel_send_eof(channel);
+                ssh_channel_close(channel);
                 break;
             } else if (ssh_message_subtype(msg) == SSH_CHANNEL_REQUEST_PTY) {
                 // Accept PTY request for better terminal handling
+                int cols = ssh_message_channel_request_pty_width(msg);
                 ssh_message_channel_request_reply_success(msg);
+                client->pty = true;
+                client->cols = cols > 0 && cols <= UINT16_MAX ? cols : 0;
                 ESP_LOGI(TAG, "SSH PTY request accepted");
                 ssh_message_free(msg);
                 continue;
@@ -828,35 +7173,57 @@ static void handle_ssh_session(ssh_session session) {
         ssh_message_free(msg);
     }
 
-    // Configure terminal for immediate character processing
-    if (channel) {
+    if (shell) {
+        // Configure terminal for immediate character processing
         const char *terminal_config = "stty -icanon -echo; clear\n";
         ssh_channel_write(channel, terminal_config, strlen(terminal_config));
         ESP_LOGI(TAG, "Configured terminal for immediate character input");
-    }
 
-    // Start keyboard input handler task
-    TaskHandle_t keyboard_task;
-    xTaskCreate(ssh_keyboard_task, "ssh_keyboard", 4096, channel, 10, &keyboard_task);
+        kitty_negotiate(client);
 
-    // Keep the session alive
-    while (ssh_channel_is_open(channel)) {
-        vTaskDelay(pdMS_TO_TICKS(1000));
-        // Check if channel is still open
-        if (ssh_channel_is_eof(channel)) {
-            break;
+        // Read keyboard input until the client goes away
+        ssh_keyboard_loop(client);
+
+        if (client->kitty && ssh_channel_is_open(channel)) {
+            // Pop our flags so the client's terminal is left as it was
+            const char *pop = "\x1b[<u";
+            ssh_channel_write(channel, pop, strlen(pop));
         }
     }
 
     ESP_LOGI(TAG, "SSH session ending");
 
     // Clean up
-    if (keyboard_task) {
-        vTaskDelete(keyboard_task);
-    }
-    if (channel) {
-        ssh_channel_free(channel);
+    ssh_channel_free(channel);
+}
+
+// Per-connection task, one per occupied client slot
+static void ssh_session_task(void *pvParameters) {
+    ssh_client_t *client = (ssh_client_t *)pvParameters;
+    uint8_t slot = client - ssh_clients;
+
+    trace(TRACE_SESSION_OPEN, slot, esp_get_free_heap_size() / 1024);
+    trace_heap_check();
+    handle_ssh_session(client);
+
+    ssh_disconnect(client->session);
+    ssh_free(client->session);
+    ssh_client_free(client);
+    trace(TRACE_SESSION_CLOSE, slot, esp_get_free_heap_size() / 1024);
+    vTaskDelete(NULL);
+}
+
+// Turn a connection away before the key exchange needs memory we do not have.
+// RFC 4253 lets a server send text lines ahead of its version string; `ssh -v`
+// prints them, and the client then sees the connection closed.
+static void mem_refuse_session(ssh_session session)
+{
+    static const char notice[] = "esp32-keyboard: low on memory, try again later\r\n";
+    if (write(ssh_get_fd(session), notice, sizeof(notice) - 1) < 0) {
+        ESP_LOGD(TAG, "Refusal notice not sent");
     }
+    mem_count(&mem_gov.refused_sessions, 1);
+    ESP_LOGW(TAG, "SSH connection refused: memory %s", mem_level_names[mem_level]);
 }
 
 // SSH Server task
@@ -864,23 +7231,39 @@ static void ssh_server_task(void *pvParameters) {
     ESP_LOGI(TAG, "SSH server task started");
 
     while (1) {
+        ssh_client_t *client = ssh_client_alloc();
+        if (!client) {
+            // All slots busy; leave new connections in the listen backlog
+            vTaskDelay(pdMS_TO_TICKS(500));
+            continue;
+        }
+
         ESP_LOGI(TAG, "Waiting for SSH connection on port %s", SSH_PORT);
         ssh_session session = ssh_new();
 
         if (!session) {
             ESP_LOGE(TAG, "Failed to create SSH session");
+            ssh_client_free(client);
             vTaskDelay(pdMS_TO_TICKS(1000));
             continue;
         }
 
-        if (ssh_bind_accept(sshbind, session) == SSH_OK) {
-            ESP_LOGI(TAG, "SSH connection accepted");
-            handle_ssh_session(session);
+        int rc = ssh_bind_accept(sshbind, session);
+        if (rc == SSH_OK && mem_level >= MEM_CRITICAL) {
+            mem_refuse_session(session);
+        } else if (rc == SSH_OK) {
+            ESP_LOGI(TAG, "SSH connection accepted on slot %d", (int)(client - ssh_clients));
+            client->session = session;
+            if (xTaskCreate(ssh_session_task, "ssh_session", 8192, client, 5, NULL) == pdPASS) {
+                continue;
+            }
+            ESP_LOGE(TAG, "Failed to create SSH session task");
         } else {
             ESP_LOGW(TAG, "SSH bind accept failed: %s", ssh_get_error(sshbind));
         }
 
         ssh_free(session);
+        ssh_client_free(client);
         vTaskDelay(pdMS_TO_TICKS(100));
     }
 }
@@ -903,6 +7286,16 @@ static void ssh_server_init(void) {
     ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_BINDADDR, "0.0.0.0");
     ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_BINDPORT_STR, SSH_PORT);
     ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LOG_VERBOSITY_STR, "1");
+    ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_HOSTKEY_ALGORITHMS, SSH_HOST_KEY_ALGORITHMS);
+#if CONFIG_SSH_CRYPTO_MINIMAL
+    ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_KEY_EXCHANGE, SSH_KEX_ALGORITHMS);
+    ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_HMAC_C_S, SSH_HMACS);
+    ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_HMAC_S_C, SSH_HMACS);
+#endif
+#ifdef SSH_CIPHERS
+    ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_CIPHERS_C_S, SSH_CIPHERS);
+    ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_CIPHERS_S_C, SSH_CIPHERS);
+#endif
 
     // Try to load existing SSH host key from NVS, or generate a new one
     ssh_key key = load_ssh_host_key();
@@ -910,7 +7303,7 @@ static void ssh_server_init(void) {
 
     if (!key) {
         ESP_LOGI(TAG, "No existing SSH host key found, generating new one...");
-        if (ssh_pki_generate(SSH_KEYTYPE_ED25519, 0, &key) == SSH_OK) {
+        if (ssh_pki_generate(SSH_HOST_KEY_TYPE, SSH_HOST_KEY_BITS, &key) == SSH_OK) {
             new_key_generated = true;
             ESP_LOGI(TAG, "Generated new SSH host key");
 
@@ -973,7 +7366,9 @@ static void ssh_server_init(void) {
     }
 
     ESP_LOGI(TAG, "SSH server listening on 0.0.0.0:%s", SSH_PORT);
-    ESP_LOGI(TAG, "SSH credentials: %s/%s", SSH_USERNAME, SSH_PASSWORD);
+    for (int i = 0; i < SSH_USER_COUNT; i++) {
+        ESP_LOGI(TAG, "SSH credentials: %s/%s", ssh_users[i].username, ssh_users[i].password);
+    }
     if (new_key_generated) {
         ESP_LOGI(TAG, "New SSH host key generated and persisted");
     } else {
@@ -998,13 +7393,10 @@ static void uart_event_task(void *pvParameters)
             case UART_DATA:
                 int len = uart_read_bytes(EX_UART_NUM, dtmp, event.size, portMAX_DELAY);
                 if (len > 0) {
+                    trace(TRACE_RECEIVE, TRACE_SRC_LOCAL, len);
                     ESP_LOGI(TAG, "UART received: %.*s", len, dtmp);
 
-                    for (int i = 0; i < len; i++) {
-                        if (dtmp[i] != '\0') {
-                            send_key(dtmp[i]);
-                        }
-                    }
+                    input_enqueue_local(dtmp, len);
                 }
                 break;
 
@@ -1028,16 +7420,39 @@ void app_main(void)
 {
     ESP_LOGI(TAG, "Starting ESP32-S3 WiFi Provisioned USB Keyboard");
 
+    // Before anything traces: keep the previous boot's events for 'trace'
+    trace_init();
+
     // Initialize button
     const gpio_config_t boot_button_config = {
         .pin_bit_mask = BIT64(APP_BUTTON),
         .mode = GPIO_MODE_INPUT,
-        .intr_type = GPIO_INTR_DISABLE,
+        .intr_type = GPIO_INTR_NEGEDGE,
         .pull_up_en = GPIO_PULLUP_ENABLE,
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
     };
     ESP_ERROR_CHECK(gpio_config(&boot_button_config));
 
+    // Initialize NVS
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+
+    // Input queue and HID typing task (UART and SSH input both feed it)
+    input_init();
+
+    // Load shedding as free memory runs short
+    mem_gov_init();
+
+    // A boot key armed before a power cycle must be ready before USB enumerates
+    boot_key_init();
+
+    // BOOT button as emergency stop
+    estop_init();
+
     // Configure UART
     uart_config_t uart_config = {
         .baud_rate = 115200,
@@ -1063,6 +7478,7 @@ void app_main(void)
     tusb_cfg.descriptor.full_speed_config = hid_configuration_descriptor;
     tusb_cfg.descriptor.string = hid_string_descriptor;
     tusb_cfg.descriptor.string_count = sizeof(hid_string_descriptor) / sizeof(hid_string_descriptor[0]);
+    tusb_cfg.event_cb = usb_event_cb;
 #if (TUD_OPT_HIGH_SPEED)
     tusb_cfg.descriptor.high_speed_config = hid_configuration_descriptor;
 #endif // TUD_OPT_HIGH_SPEED
@@ -1070,6 +7486,15 @@ void app_main(void)
     ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
     ESP_LOGI(TAG, "USB initialization DONE");
 
+    // Stored templates and jobs left over from before the last reset
+    spiffs_init();
+#if CONFIG_SSH_JOB_PERSIST
+    job_store_init();
+#endif
+#if CONFIG_SSH_KEYBOARD_MSC
+    drive_init();
+#endif
+
     // Start WiFi provisioning
     wifi_provisioning();
 
@@ -346,6 +346,23 @@ static void ssh_server_task(void *pvParameters)
     }
 }
 
+// Wait for the endpoint and retry: a dropped release leaves the key held down
+#define HID_REPORT_TRIES 3
+#define HID_REPORT_WAIT_MS 20
+
+static bool hid_send_report(uint8_t modifier, uint8_t *keycode_array)
+{
+    for (int attempt = 0; attempt < HID_REPORT_TRIES && tud_mounted(); attempt++) {
+        for (int waited = 0; waited < HID_REPORT_WAIT_MS && !tud_hid_ready(); waited++) {
+            vTaskDelay(pdMS_TO_TICKS(1));
+        }
+        if (tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, modifier, keycode_array)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 // Helper functions (same as before)
 void send_keycode(uint8_t keycode)
 {
@@ -353,9 +370,9 @@ void send_keycode(uint8_t keycode)
         uint8_t keycode_array[6] = {0};
         keycode_array[0] = keycode;
 
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, keycode_array);
+        hid_send_report(0, keycode_array);
         vTaskDelay(pdMS_TO_TICKS(50));
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, NULL);
+        hid_send_report(0, NULL);
         vTaskDelay(pdMS_TO_TICKS(10));
     }
 }
@@ -387,9 +404,9 @@ void send_key(char c)
         if (prev_char == '[') {
             uint8_t keycode_array[6] = {0};
             keycode_array[0] = char_to_hid_keycode('[');
-            tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, keycode_array);
+            hid_send_report(0, keycode_array);
             vTaskDelay(pdMS_TO_TICKS(50));
-            tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, NULL);
+            hid_send_report(0, NULL);
             vTaskDelay(pdMS_TO_TICKS(10));
             prev_char = 0;
         }
@@ -410,9 +427,9 @@ void send_key(char c)
             modifier = KEYBOARD_MODIFIER_LEFTSHIFT;
         }
 
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, modifier, keycode_array);
+        hid_send_report(modifier, keycode_array);
         vTaskDelay(pdMS_TO_TICKS(50));
-        tud_hid_keyboard_report(HID_ITF_PROTOCOL_KEYBOARD, 0, NULL);
+        hid_send_report(0, NULL);
         vTaskDelay(pdMS_TO_TICKS(10));
     }
 }
@@ -0,0 +1,382 @@
+/*
+ * Terminal input parser, see vt_input.h.
+ *
+ * Covers what xterm, tmux, screen, PuTTY, Windows Terminal, iTerm2, kitty
+ * and the Linux console send for keys: CSI and SS3 cursor and function keys
+ * with xterm modifier parameters, CSI <n> ~ editing and function keys, the
+ * Linux console's ESC [ [ A-E, Alt as an ESC prefix, control characters as
+ * Ctrl+letter, and the kitty keyboard protocol's CSI u with event types.
+ * Bracketed paste markers (CSI 200~ / 201~) are dropped and the pasted text
+ * is typed as it is. tools/vt_check runs the corpus of captured sequences.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#ifdef ESP_PLATFORM
+#include "tinyusb.h"
+#include "class/hid/hid.h"
+#else
+#include "hid_usage.h"
+#endif
+#include "vt_input.h"
+
+uint8_t char_to_hid_keycode(char c)
+{
+    if (c >= 'a' && c <= 'z') {
+        return HID_KEY_A + (c - 'a');
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return HID_KEY_A + (c - 'A');
+    }
+    if (c >= '1' && c <= '9') {
+        return HID_KEY_1 + (c - '1');
+    }
+    if (c == '0') {
+        return HID_KEY_0;
+    }
+
+    switch (c) {
+        case ' ': return HID_KEY_SPACE;
+        case '\r':
+        case '\n': return HID_KEY_ENTER;
+        case '\t': return HID_KEY_TAB;
+        case '\b':
+        case 0x7F: return HID_KEY_BACKSPACE;
+        case 0x1B: return HID_KEY_ESCAPE;
+        case '!': return HID_KEY_1;
+        case '@': return HID_KEY_2;
+        case '#': return HID_KEY_3;
+        case '$': return HID_KEY_4;
+        case '%': return HID_KEY_5;
+        case '^': return HID_KEY_6;
+        case '&': return HID_KEY_7;
+        case '*': return HID_KEY_8;
+        case '(': return HID_KEY_9;
+        case ')': return HID_KEY_0;
+        case '-':
+        case '_': return HID_KEY_MINUS;
+        case '=':
+        case '+': return HID_KEY_EQUAL;
+        case '[':
+        case '{': return HID_KEY_BRACKET_LEFT;
+        case ']':
+        case '}': return HID_KEY_BRACKET_RIGHT;
+        case '\\':
+        case '|': return HID_KEY_BACKSLASH;
+        case ';':
+        case ':': return HID_KEY_SEMICOLON;
+        case '\'':
+        case '"': return HID_KEY_APOSTROPHE;
+        case '`':
+        case '~': return HID_KEY_GRAVE;
+        case ',':
+        case '<': return HID_KEY_COMMA;
+        case '.':
+        case '>': return HID_KEY_PERIOD;
+        case '/':
+        case '?': return HID_KEY_SLASH;
+        default: return 0;
+    }
+}
+
+// US layout: upper case letters and the symbols above the unshifted keys
+bool char_needs_shift(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c != '\0' && strchr("!@#$%^&*()_+{}|:\"~<>?", c) != NULL);
+}
+
+// CSI <n> ~ keys, indexed by n
+static const uint8_t vt_tilde_keys[25] = {
+    [1] = HID_KEY_HOME, [2] = HID_KEY_INSERT, [3] = HID_KEY_DELETE, [4] = HID_KEY_END,
+    [5] = HID_KEY_PAGE_UP, [6] = HID_KEY_PAGE_DOWN, [7] = HID_KEY_HOME, [8] = HID_KEY_END,
+    [11] = HID_KEY_F1, [12] = HID_KEY_F2, [13] = HID_KEY_F3, [14] = HID_KEY_F4, [15] = HID_KEY_F5,
+    [17] = HID_KEY_F6, [18] = HID_KEY_F7, [19] = HID_KEY_F8, [20] = HID_KEY_F9, [21] = HID_KEY_F10,
+    [23] = HID_KEY_F11, [24] = HID_KEY_F12,
+};
+
+// Final byte of CSI/SS3 cursor and function keys
+static uint8_t vt_final_key(char final)
+{
+    switch (final) {
+        case 'A': return HID_KEY_ARROW_UP;
+        case 'B': return HID_KEY_ARROW_DOWN;
+        case 'C': return HID_KEY_ARROW_RIGHT;
+        case 'D': return HID_KEY_ARROW_LEFT;
+        case 'H': return HID_KEY_HOME;
+        case 'F': return HID_KEY_END;
+        case 'P': return HID_KEY_F1;
+        case 'Q': return HID_KEY_F2;
+        case 'R': return HID_KEY_F3;
+        case 'S': return HID_KEY_F4;
+        default: return 0;
+    }
+}
+
+// SS3 keys: cursor and F1-F4 as for CSI, plus the application keypad
+static uint8_t vt_ss3_key(char final)
+{
+    static const uint8_t keypad_digits[10] = {
+        HID_KEY_KEYPAD_0, HID_KEY_KEYPAD_1, HID_KEY_KEYPAD_2, HID_KEY_KEYPAD_3, HID_KEY_KEYPAD_4,
+        HID_KEY_KEYPAD_5, HID_KEY_KEYPAD_6, HID_KEY_KEYPAD_7, HID_KEY_KEYPAD_8, HID_KEY_KEYPAD_9,
+    };
+    if (final >= 'p' && final <= 'y') {
+        return keypad_digits[final - 'p'];
+    }
+    switch (final) {
+        case 'M': return HID_KEY_KEYPAD_ENTER;
+        case 'X': return HID_KEY_KEYPAD_EQUAL;
+        case 'j': return HID_KEY_KEYPAD_MULTIPLY;
+        case 'k': return HID_KEY_KEYPAD_ADD;
+        case 'm': return HID_KEY_KEYPAD_SUBTRACT;
+        case 'n': return HID_KEY_KEYPAD_DECIMAL;
+        case 'o': return HID_KEY_KEYPAD_DIVIDE;
+        default: return vt_final_key(final);
+    }
+}
+
+// xterm modifier parameter: 1 + (shift 1 | alt 2 | ctrl 4 | meta 8)
+static uint8_t vt_modifier(unsigned m)
+{
+    uint8_t mod = 0;
+    m = m > 1 ? m - 1 : 0;
+    if (m & 1) {
+        mod |= KEYBOARD_MODIFIER_LEFTSHIFT;
+    }
+    if (m & 2) {
+        mod |= KEYBOARD_MODIFIER_LEFTALT;
+    }
+    if (m & 4) {
+        mod |= KEYBOARD_MODIFIER_LEFTCTRL;
+    }
+    if (m & 8) {
+        mod |= KEYBOARD_MODIFIER_LEFTGUI;
+    }
+    return mod;
+}
+
+// Key codes of the kitty keyboard protocol (CSI <code> u) that are not
+// plain characters, from its private-use functional key range
+#define KITTY_KEY_CAPS_LOCK 57358
+#define KITTY_KEY_F13 57376
+#define KITTY_KEY_KP_0 57399
+#define KITTY_KEY_LEFT_SHIFT 57441
+
+static const uint8_t kitty_lock_keys[] = {
+    HID_KEY_CAPS_LOCK, HID_KEY_SCROLL_LOCK, HID_KEY_NUM_LOCK, HID_KEY_PRINT_SCREEN,
+    HID_KEY_PAUSE, HID_KEY_APPLICATION,
+};
+static const uint8_t kitty_keypad_keys[] = {
+    HID_KEY_KEYPAD_0, HID_KEY_KEYPAD_1, HID_KEY_KEYPAD_2, HID_KEY_KEYPAD_3, HID_KEY_KEYPAD_4,
+    HID_KEY_KEYPAD_5, HID_KEY_KEYPAD_6, HID_KEY_KEYPAD_7, HID_KEY_KEYPAD_8, HID_KEY_KEYPAD_9,
+    HID_KEY_KEYPAD_DECIMAL, HID_KEY_KEYPAD_DIVIDE, HID_KEY_KEYPAD_MULTIPLY,
+    HID_KEY_KEYPAD_SUBTRACT, HID_KEY_KEYPAD_ADD, HID_KEY_KEYPAD_ENTER, HID_KEY_KEYPAD_EQUAL,
+};
+// Left shift, ctrl, alt, super, hyper, meta, then the same on the right
+static const uint8_t kitty_modifier_keys[12] = {
+    KEYBOARD_MODIFIER_LEFTSHIFT, KEYBOARD_MODIFIER_LEFTCTRL, KEYBOARD_MODIFIER_LEFTALT,
+    KEYBOARD_MODIFIER_LEFTGUI, 0, 0,
+    KEYBOARD_MODIFIER_RIGHTSHIFT, KEYBOARD_MODIFIER_RIGHTCTRL, KEYBOARD_MODIFIER_RIGHTALT,
+    KEYBOARD_MODIFIER_RIGHTGUI, 0, 0,
+};
+
+static bool kitty_key(unsigned code, key_event_t *key)
+{
+    if (code == 27) {
+        key->keycode = HID_KEY_ESCAPE;
+    } else if (code == 13) {
+        key->keycode = HID_KEY_ENTER;
+    } else if (code == 9) {
+        key->keycode = HID_KEY_TAB;
+    } else if (code == 127 || code == 8) {
+        key->keycode = HID_KEY_BACKSPACE;
+    } else if (code >= 0x20 && code < 0x7F) {
+        // Base (unshifted) key of the US layout; shift comes with the modifiers
+        key->keycode = char_to_hid_keycode((char)code);
+    } else if (code >= KITTY_KEY_CAPS_LOCK && code < KITTY_KEY_CAPS_LOCK + sizeof(kitty_lock_keys)) {
+        key->keycode = kitty_lock_keys[code - KITTY_KEY_CAPS_LOCK];
+    } else if (code >= KITTY_KEY_F13 && code < KITTY_KEY_F13 + 12) {
+        key->keycode = HID_KEY_F13 + (code - KITTY_KEY_F13);
+    } else if (code >= KITTY_KEY_KP_0 && code < KITTY_KEY_KP_0 + sizeof(kitty_keypad_keys)) {
+        key->keycode = kitty_keypad_keys[code - KITTY_KEY_KP_0];
+    } else if (code >= KITTY_KEY_LEFT_SHIFT && code < KITTY_KEY_LEFT_SHIFT + sizeof(kitty_modifier_keys)) {
+        key->mod_key = kitty_modifier_keys[code - KITTY_KEY_LEFT_SHIFT];
+    }
+    return key->keycode != 0 || key->mod_key != 0;
+}
+
+// Complete CSI sequence; returns false for sequences with no key (dropped).
+// Parameters are "<key>[:alt];<modifiers>[:event]", the kitty form adding the
+// sub-parameters and the 'u' final.
+static bool vt_csi_key(const vt_parser_t *p, char final, key_event_t *key)
+{
+    unsigned field[2][2] = { { 1, 0 }, { 1, 1 } };
+    unsigned f = 0, sub = 0;
+    bool digits = false;
+    for (int i = 0; i < p->len; i++) {
+        char c = p->params[i];
+        if (c >= '0' && c <= '9') {
+            if (f < 2 && sub < 2) {
+                field[f][sub] = (digits ? field[f][sub] * 10 : 0) + (c - '0');
+            }
+            digits = true;
+        } else if (c == ':' || c == ';') {
+            sub = c == ':' ? sub + 1 : 0;
+            f += c == ';';
+            digits = false;
+        } else {
+            return false;           // Private parameters ('?', '>'): not a key
+        }
+    }
+    unsigned n = field[0][0], m = field[1][0], event = field[1][1];
+
+    memset(key, 0, sizeof(*key));
+    if (final == 'u') {
+        if (!kitty_key(n, key)) {
+            return false;
+        }
+    } else if (final == '~') {
+        key->keycode = n < sizeof(vt_tilde_keys) ? vt_tilde_keys[n] : 0;
+    } else if (final == 'Z') {
+        key->keycode = HID_KEY_TAB;
+        m = 2;                      // Back-tab is Shift+Tab
+    } else {
+        key->keycode = vt_final_key(final);
+    }
+    key->modifier = vt_modifier(m);
+    if (p->exact || final == 'u') {
+        key->type = event >= 1 && event <= 3 ? KEY_PRESS + event - 1 : KEY_PRESS;
+    }
+    return key->keycode != 0 || key->mod_key != 0;
+}
+
+static int vt_key(key_event_t *key, uint8_t keycode, uint8_t modifier)
+{
+    memset(key, 0, sizeof(*key));
+    key->keycode = keycode;
+    key->modifier = modifier;
+    return keycode ? 1 : 0;
+}
+
+// Alt+<c> as sent with the ESC prefix (xterm metaSendsEscape, PuTTY, iTerm2
+// "Esc+"); returns 0 for bytes that are not a key on their own
+static int vt_alt_key(char c, key_event_t *key)
+{
+    if (c == 0x7F || c == '\b') {
+        return vt_key(key, HID_KEY_BACKSPACE, KEYBOARD_MODIFIER_LEFTALT);
+    }
+    if ((c < 0x20 && c != '\r' && c != '\t') || c >= 0x7F) {
+        return 0;
+    }
+    uint8_t shift = char_needs_shift(c) ? KEYBOARD_MODIFIER_LEFTSHIFT : 0;
+    return vt_key(key, char_to_hid_keycode(c), KEYBOARD_MODIFIER_LEFTALT | shift);
+}
+
+int vt_feed(vt_parser_t *p, char c, uint32_t at_ms, key_event_t *out)
+{
+    if ((p->state == VT_ESC || p->state == VT_SS3) && at_ms - p->esc_ms >= VT_ESC_TIMEOUT_MS) {
+        // The ESC went quiet before this byte: it means what vt_flush() would
+        // have made of it, whether or not a flush ran while input was queued
+        int n = vt_flush(p, at_ms, out);
+        return n + vt_feed(p, c, at_ms, &out[n]);
+    }
+
+    switch (p->state) {
+    case VT_GROUND:
+        if (c == 0x1B) {
+            p->state = VT_ESC;
+            p->esc_ms = at_ms;
+            return 0;
+        }
+        if (c == 0x7F || c == '\b') {
+            return vt_key(out, HID_KEY_BACKSPACE, 0);
+        }
+        if (c >= 0x01 && c <= 0x1A && c != '\t' && c != '\n' && c != '\r') {
+            return vt_key(out, HID_KEY_A + (c - 0x01), KEYBOARD_MODIFIER_LEFTCTRL);
+        }
+        if (c == 0x1C || c == 0x1D) {
+            return vt_key(out, c == 0x1C ? HID_KEY_BACKSLASH : HID_KEY_BRACKET_RIGHT, KEYBOARD_MODIFIER_LEFTCTRL);
+        }
+        memset(out, 0, sizeof(*out));
+        out->c = c;
+        return 1;
+
+    case VT_ESC:
+        if (c == '[' || c == 'O') {
+            p->state = c == '[' ? VT_CSI : VT_SS3;
+            p->len = 0;
+            return 0;
+        }
+        if (c == 0x1B) {
+            // Two ESCs: the first was the Escape key, the second may start a sequence
+            p->esc_ms = at_ms;
+            return vt_key(out, HID_KEY_ESCAPE, 0);
+        }
+        p->state = VT_GROUND;
+        if (vt_alt_key(c, out)) {
+            return 1;
+        }
+        // ESC and a byte with no Alt form: the Escape key, then that byte
+        vt_key(&out[0], HID_KEY_ESCAPE, 0);
+        return 1 + vt_feed(p, c, at_ms, &out[1]);
+
+    case VT_CSI:
+        if (c == '[' && p->len == 0) {
+            p->state = VT_LINUX_FN;
+            return 0;
+        }
+        if (c >= 0x20 && c <= 0x3F) {
+            if (p->len < VT_SEQ_MAX) {
+                p->params[p->len++] = c;
+            } else {
+                p->params[0] = '?'; // Too long for any key: the final byte drops it
+            }
+            return 0;
+        }
+        p->state = VT_GROUND;
+        return c >= 0x40 && c <= 0x7E && vt_csi_key(p, c, out) ? 1 : 0;
+
+    case VT_LINUX_FN:
+        p->state = VT_GROUND;
+        return c >= 'A' && c <= 'E' ? vt_key(out, HID_KEY_F1 + (c - 'A'), 0) : 0;
+
+    case VT_SS3:
+    default:
+        if (c >= '0' && c <= '9' && p->len < 2) {
+            p->params[p->len++] = c;    // Old xterm and screen modifier form: ESC O 5 C
+            return 0;
+        }
+        p->state = VT_GROUND;
+        if (!vt_ss3_key(c) && p->len == 0 && !p->exact) {
+            // Not a key: ESC O was Alt+Shift+O, and the byte is typed on its own
+            int n = vt_alt_key('O', out);
+            return n + vt_feed(p, c, at_ms, &out[n]);
+        }
+        unsigned m = 0;
+        for (int i = 0; i < p->len; i++) {
+            m = m * 10 + (p->params[i] - '0');
+        }
+        return vt_key(out, vt_ss3_key(c), vt_modifier(m));
+    }
+}
+
+// A lone ESC with nothing after it for VT_ESC_TIMEOUT_MS is the Escape key,
+// and ESC [ or ESC O on their own are Alt+[ and Alt+Shift+O. Anything else
+// unfinished is dropped. Kitty protocol terminals send the Escape key as
+// CSI 27 u, so from them a stalled sequence is only ever dropped.
+int vt_flush(vt_parser_t *p, uint32_t now_ms, key_event_t *out)
+{
+    if (p->state == VT_GROUND || now_ms - p->esc_ms < VT_ESC_TIMEOUT_MS) {
+        return 0;
+    }
+    vt_state_t state = p->state;
+    p->state = VT_GROUND;
+    if (p->exact) {
+        return 0;
+    }
+    switch (state) {
+        case VT_ESC: return vt_key(out, HID_KEY_ESCAPE, 0);
+        case VT_SS3: return vt_alt_key('O', out);
+        case VT_CSI: return p->len == 0 ? vt_alt_key('[', out) : 0;
+        default:     return 0;
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * Terminal input parser: turns the bytes a terminal sends for key presses
+ * (plain text, VT100/xterm escape sequences, the Linux console's function
+ * keys and the kitty keyboard protocol) into HID key events.
+ *
+ * Plain C with no ESP-IDF dependencies, so tools/vt_check can run it on the
+ * host against the terminal corpus.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    KEY_TAP = 0,                    // Legacy input: press and release
+    KEY_PRESS,
+    KEY_REPEAT,
+    KEY_RELEASE,
+} key_event_type_t;
+
+typedef struct {
+    uint8_t keycode;                // HID key, 0 for a plain character
+    uint8_t modifier;
+    char c;                         // Character to type when keycode is 0
+    uint8_t type;                   // key_event_type_t
+    uint8_t mod_key;                // Modifier bit when the key is a modifier itself
+} key_event_t;
+
+#define VT_SEQ_MAX 16
+#define VT_ESC_TIMEOUT_MS 25        // A lone ESC this old is the Escape key
+#define VT_EVENTS_MAX 2             // Most events one byte can complete
+
+typedef enum {
+    VT_GROUND = 0,
+    VT_ESC,
+    VT_CSI,
+    VT_SS3,
+    VT_LINUX_FN,                    // ESC [ [ <A-E>: Linux console F1-F5
+} vt_state_t;
+
+typedef struct {
+    vt_state_t state;
+    uint8_t gen;                    // Session generation the state belongs to
+    bool exact;                     // ESC always starts a sequence (kitty protocol)
+    uint8_t len;
+    char params[VT_SEQ_MAX];
+    uint32_t esc_ms;
+} vt_parser_t;
+
+// Feed one input byte that arrived at at_ms; writes up to VT_EVENTS_MAX events
+// to out, returns the count. A byte arriving VT_ESC_TIMEOUT_MS or more after a
+// pending ESC or ESC O first completes it as vt_flush() would.
+int vt_feed(vt_parser_t *p, char c, uint32_t at_ms, key_event_t *out);
+
+// Called when input goes quiet: completes or drops a sequence older than
+// VT_ESC_TIMEOUT_MS. Returns the number of events written to out (0 or 1).
+int vt_flush(vt_parser_t *p, uint32_t now_ms, key_event_t *out);
+
+// US layout
+uint8_t char_to_hid_keycode(char c);
+bool char_needs_shift(char c);
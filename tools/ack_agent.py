@@ -0,0 +1,335 @@
+#!/usr/bin/env python3
+"""
+Verify typed jobs on the target host and acknowledge them over USB.
+
+Run this in a terminal on the machine the keyboard is plugged into and keep
+that terminal focused. It reads the keystrokes back in raw mode and checks
+them against the checksums the device sends on its CDC-ACM port (firmware
+built with CONFIG_SSH_KEYBOARD_ACK_CDC). Each verified 64-byte chunk is
+acknowledged. A chunk that arrives damaged or incomplete is NAKed, and the
+device retypes only that span. Verified text is written to --output.
+
+    tools/ack_agent.py /dev/ttyACM0 -o received.txt
+    tools/ack_agent.py --self-test --drop 0.01
+
+--self-test needs no hardware. It runs the agent against a stand-in device
+that types over a pty pair and drops keys at random, then checks that the
+output matches the job exactly. Press Ctrl-C in the agent terminal to quit.
+"""
+
+import argparse
+import os
+import random
+import select
+import socket
+import sys
+import termios
+import threading
+import time
+import tty
+import zlib
+
+CTRL_C = 0x03
+
+
+def hid_echo(data):
+    """What a raw terminal reads back for data typed by the keyboard.
+
+    Mirrors hid_echo_char() in the firmware: Enter arrives as CR, Backspace
+    as DEL, and bytes without a key on the US layout are not typed at all.
+    """
+    out = bytearray()
+    for b in data:
+        if b == 0x0a:
+            out.append(0x0d)
+        elif b == 0x08:
+            out.append(0x7f)
+        elif 0x20 <= b <= 0x7e or b in (0x09, 0x0d, 0x1b, 0x7f):
+            out.append(b)
+    return bytes(out)
+
+
+class AckAgent:
+    """Host side of the delivery acknowledgement protocol."""
+
+    def __init__(self, send, output, idle_timeout=1.5, log=None):
+        self.send = send
+        self.output = output
+        self.idle_timeout = idle_timeout
+        self.log = log or (lambda msg: None)
+        self.job = None
+        self.naks = 0
+        self.completed = []
+
+    def hello(self):
+        self.send("HELLO")
+
+    def _start(self, job_id, size, offset=0):
+        # A resumed job (after an unplug or device reset) restarts at offset
+        old = self.job
+        if old and old["verified"] < old["size"] and old["id"] != job_id:
+            self.log("job %d abandoned at %d/%d" % (old["id"], old["verified"], old["size"]))
+        self.job = {"id": job_id, "size": size, "verified": offset, "verified_echo": 0,
+                    "received": bytearray(), "sums": {}, "rewinding": False,
+                    "last_key": time.monotonic()}
+        if offset:
+            self.log("job %d: resuming at %d/%d" % (job_id, offset, size))
+        else:
+            self.log("job %d: %d bytes" % (job_id, size))
+
+    def on_line(self, line):
+        fields = line.split()
+        if not fields:
+            return
+        verb, args = fields[0], [int(f, 16) if i == 4 else int(f) for i, f in enumerate(fields[1:])]
+        if verb == "HELLO":
+            self.log("device attached: chunk=%d window=%d" % tuple(args[:2]))
+        elif verb == "JOB":
+            self._start(*args[:3])
+        elif self.job is None or args[0] != self.job["id"]:
+            return
+        elif verb == "SUM":
+            # SUM <id> <offset> <len> <echo_len> <crc32>
+            self.job["sums"][args[1]] = (args[2], args[3], args[4])
+            self._check()
+        elif verb == "REWIND":
+            job = self.job
+            if args[1] == job["verified"]:
+                del job["received"][job["verified_echo"]:]
+                job["rewinding"] = False
+                job["last_key"] = time.monotonic()
+
+    def on_keys(self, data):
+        job = self.job
+        if job is None or job["rewinding"] or job["verified"] == job["size"]:
+            return
+        job["received"] += data.replace(b"\x08", b"\x7f")
+        job["last_key"] = time.monotonic()
+        self._check()
+
+    def _nak(self, reason):
+        job = self.job
+        self.naks += 1
+        job["rewinding"] = True
+        self.log("job %d: %s at %d, requesting retype" % (job["id"], reason, job["verified"]))
+        self.send("NAK %d %d" % (job["id"], job["verified"]))
+
+    def _check(self):
+        job = self.job
+        while not job["rewinding"] and job["verified"] in job["sums"]:
+            length, echo_len, crc = job["sums"][job["verified"]]
+            start = job["verified_echo"]
+            if len(job["received"]) < start + echo_len:
+                return
+            chunk = bytes(job["received"][start:start + echo_len])
+            if zlib.crc32(chunk) != crc:
+                self._nak("checksum mismatch")
+                return
+            self.output.write(chunk.replace(b"\r", b"\n"))
+            self.output.flush()
+            job["verified"] += length
+            job["verified_echo"] += echo_len
+            self.send("ACK %d %d" % (job["id"], job["verified"]))
+            if job["verified"] == job["size"]:
+                self.log("job %d verified" % job["id"])
+                self.completed.append(job["id"])
+                return
+
+    def tick(self):
+        """NAK a chunk that stopped arriving part way through."""
+        job = self.job
+        if job is None or job["rewinding"] or job["verified"] not in job["sums"]:
+            return
+        if len(job["received"]) > job["verified_echo"] and \
+                time.monotonic() - job["last_key"] > self.idle_timeout:
+            self._nak("incomplete chunk")
+
+
+def serve(agent, key_fd, port_fd, stop):
+    """Pump keystrokes from key_fd and protocol lines from port_fd into agent."""
+    pending = b""
+    agent.hello()
+    while not stop():
+        ready, _, _ = select.select([key_fd, port_fd], [], [], 0.1)
+        if key_fd in ready:
+            data = os.read(key_fd, 1024)
+            if not data or CTRL_C in data:
+                return
+            agent.on_keys(data)
+        if port_fd in ready:
+            data = os.read(port_fd, 1024)
+            if not data:
+                raise OSError("device port closed")
+            pending += data
+            while b"\n" in pending:
+                line, pending = pending.split(b"\n", 1)
+                agent.on_line(line.decode(errors="replace"))
+        agent.tick()
+
+
+class StandInDevice(threading.Thread):
+    """Firmware side of the protocol, typing into a pty and losing keys."""
+
+    CHUNK = 64
+    WINDOW = 2 * CHUNK
+
+    def __init__(self, cdc, key_fd, data, drop, key_delay, ack_timeout):
+        super().__init__(daemon=True)
+        self.cdc = cdc
+        self.key_fd = key_fd
+        self.data = data
+        self.drop = drop
+        self.key_delay = key_delay
+        self.ack_timeout = ack_timeout
+        self.done = threading.Event()
+        self.retyped = 0
+        self.dropped = 0
+
+    def _send(self, line):
+        self.cdc.sendall(line.encode() + b"\n")
+
+    def _lines(self, wait):
+        ready, _, _ = select.select([self.cdc], [], [], wait)
+        if not ready:
+            return []
+        self._buf += self.cdc.recv(4096)
+        lines = self._buf.split(b"\n")
+        self._buf = lines.pop()
+        return [line.decode().split() for line in lines if line]
+
+    def run(self):
+        self._buf = b""
+        while not any(f[0] == "HELLO" for f in self._lines(1.0)):
+            pass
+        self._send("HELLO %d %d" % (self.CHUNK, self.WINDOW))
+        self._send("JOB 1 %d 0" % len(self.data))
+
+        size = len(self.data)
+        typed = acked = summed = 0
+        rewind_at = time.monotonic() + 0.05   # REWIND 1 0 marks the start of the job
+        hold_until = 0
+        activity = time.monotonic()
+        while acked < size:
+            for fields in self._lines(0):
+                offset = int(fields[2])
+                if fields[0] == "ACK" and acked < offset <= size:
+                    acked = offset
+                    activity = time.monotonic()
+                elif fields[0] == "NAK" and offset == acked and rewind_at is None:
+                    rewind_at = time.monotonic() + 0.05
+            now = time.monotonic()
+            if rewind_at is None and typed > acked and now - activity > self.ack_timeout:
+                rewind_at = now + 0.05
+            if rewind_at is not None:
+                if now < rewind_at:
+                    time.sleep(0.01)
+                    continue
+                self.retyped += typed - acked
+                typed = summed = acked
+                rewind_at = None
+                hold_until = now + 0.05
+                activity = now
+                self._send("REWIND 1 %d" % acked)
+            if now < hold_until or typed == size or typed >= acked + self.WINDOW:
+                time.sleep(0.01)
+                continue
+            if typed == summed:
+                chunk = self.data[typed:typed + self.CHUNK]
+                echo = hid_echo(chunk)
+                self._send("SUM 1 %d %d %d %08x" % (typed, len(chunk), len(echo), zlib.crc32(echo)))
+                summed += len(chunk)
+            echo = hid_echo(self.data[typed:typed + 1])
+            if random.random() < self.drop:
+                self.dropped += 1
+            elif echo:
+                os.write(self.key_fd, echo)
+            typed += 1
+            activity = time.monotonic()
+            time.sleep(self.key_delay)
+        self.done.set()
+
+
+def self_test(args):
+    rng = random.Random(args.seed)
+    random.seed(args.seed)
+    alphabet = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJ0123456789-=[];',./!@#{}|:<>?~\n\t"
+    data = "".join(rng.choice(alphabet) for _ in range(args.size)).encode()
+
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    device_end, agent_end = socket.socketpair()
+
+    class Collect:
+        def __init__(self):
+            self.data = bytearray()
+
+        def write(self, b):
+            self.data += b
+
+        def flush(self):
+            pass
+
+    output = Collect()
+    agent = AckAgent(lambda line: agent_end.sendall(line.encode() + b"\n"), output,
+                     idle_timeout=0.2, log=lambda msg: args.verbose and print(msg, file=sys.stderr))
+    device = StandInDevice(device_end, master, data, args.drop, key_delay=0.0005, ack_timeout=0.5)
+    device.start()
+
+    deadline = time.monotonic() + args.timeout
+    serve(agent, slave, agent_end.fileno(),
+          lambda: device.done.is_set() or time.monotonic() > deadline)
+
+    expected = hid_echo(data).replace(b"\r", b"\n")
+    ok = device.done.is_set() and bytes(output.data) == expected
+    print("%s: %d bytes, %d keys dropped, %d naks, %d bytes retyped (%.1f%% overhead)" % (
+        "PASS" if ok else "FAIL", len(data), device.dropped, agent.naks, device.retyped,
+        100.0 * device.retyped / len(data)))
+    return 0 if ok else 1
+
+
+def open_port(path):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    return fd
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("port", nargs="?", help="CDC-ACM device of the keyboard, e.g. /dev/ttyACM0")
+    parser.add_argument("-o", "--output", help="append verified text here (default: discard)")
+    parser.add_argument("--idle-timeout", type=float, default=1.5,
+                        help="NAK a chunk after this many idle seconds (default 1.5)")
+    parser.add_argument("--self-test", action="store_true", help="run against a simulated device")
+    parser.add_argument("--drop", type=float, default=0.005, help="self-test key loss rate (default 0.005)")
+    parser.add_argument("--size", type=int, default=4000, help="self-test job size")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--timeout", type=float, default=60.0, help="self-test time limit")
+    parser.add_argument("-v", "--verbose", action="store_true")
+    args = parser.parse_args()
+
+    if args.self_test:
+        return self_test(args)
+    if not args.port:
+        parser.error("port is required unless --self-test is given")
+
+    port_fd = open_port(args.port)
+    output = open(args.output, "ab") if args.output else open(os.devnull, "wb")
+    agent = AckAgent(lambda line: os.write(port_fd, line.encode() + b"\n"), output,
+                     idle_timeout=args.idle_timeout,
+                     log=lambda msg: sys.stderr.write(msg + "\r\n"))
+
+    key_fd = sys.stdin.fileno()
+    saved = termios.tcgetattr(key_fd)
+    tty.setraw(key_fd)
+    try:
+        serve(agent, key_fd, port_fd, lambda: False)
+    finally:
+        termios.tcsetattr(key_fd, termios.TCSADRAIN, saved)
+        output.close()
+        os.close(port_fd)
+    print("%d job(s) verified, %d naks" % (len(agent.completed), agent.naks))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,210 @@
+/*
+ * Check main/fat_volume.c on the host: build a volume the way the payload
+ * drive does, read every sector through fv_read() in the odd-sized pieces
+ * USB transfers use, then walk the image as a FAT driver would (boot
+ * sector, FAT chains, root directory) and compare each file's bytes.
+ * -o <file> also writes the image, so fsck.fat or mtools can look at it.
+ *
+ *     tools/fat_check/run.sh
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fat_volume.h"
+
+#define VOLUME_SECTORS 65536            // 32 MB, as the firmware uses
+
+static int failed = 0;
+static int checked = 0;
+
+typedef struct {
+    uint32_t seed;
+    bool broken;                        // Reads fail, like a spiffs error
+} pattern_t;
+
+static uint8_t pattern_byte(const pattern_t *p, uint32_t at)
+{
+    return (uint8_t)(at * 31 + (at >> 8) + p->seed);
+}
+
+static bool pattern_read(void *ctx, uint32_t offset, uint8_t *dst, uint32_t size)
+{
+    const pattern_t *p = ctx;
+    for (uint32_t i = 0; i < size; i++) {
+        dst[i] = pattern_byte(p, offset + i);
+    }
+    return !p->broken;
+}
+
+static void check(const char *name, bool ok)
+{
+    checked++;
+    if (!ok) {
+        printf("FAIL %s\n", name);
+        failed++;
+    }
+}
+
+static uint32_t get16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | get16(p + 2) << 16;
+}
+
+static const struct {
+    const char *name;
+    uint32_t size;
+    const char *entry;                  // Directory entry form
+    uint8_t case_bits;
+} files[] = {
+    { "setup.sh", 10000, "SETUP   SH ", 0x18 },
+    { "README", 4096, "README     ", 0 },
+    { "empty.txt", 0, "EMPTY   TXT", 0x18 },
+    { "big.bin", 1024 * 1024 + 1, "BIG     BIN", 0x18 },
+    { "Mixed.cfg", 1, "MIXED   CFG", 0x10 },
+};
+#define FILE_COUNT (sizeof(files) / sizeof(files[0]))
+
+// Walk the image like a FAT driver and compare it with what was added
+static void check_image(const uint8_t *img, uint32_t sectors, const pattern_t *patterns)
+{
+    const uint8_t *boot = img;
+    uint32_t sector_size = get16(boot + 11);
+    uint32_t spc = boot[13];
+    uint32_t reserved = get16(boot + 14);
+    uint32_t fats = boot[16];
+    uint32_t root_entries = get16(boot + 17);
+    uint32_t total = get16(boot + 19) ? get16(boot + 19) : get32(boot + 32);
+    uint32_t fat_size = get16(boot + 22);
+    uint32_t root_sectors = root_entries * 32 / sector_size;
+    uint32_t data_start = reserved + fats * fat_size + root_sectors;
+    uint32_t clusters = (total - data_start) / spc;
+
+    check("boot: signature", boot[510] == 0x55 && boot[511] == 0xAA);
+    check("boot: sector size", sector_size == FV_SECTOR_SIZE);
+    check("boot: total sectors", total == sectors);
+    check("boot: FAT16 by cluster count", clusters >= 4085 && clusters < 65525);
+    check("boot: FATs fit the clusters", fat_size * sector_size / 2 >= clusters + 2);
+    check("boot: type string", memcmp(boot + 54, "FAT16   ", 8) == 0);
+    check("boot: label", memcmp(boot + 43, "KBDDRIVE   ", 11) == 0);
+
+    const uint8_t *fat = img + reserved * sector_size;
+    check("fat: copies agree", memcmp(fat, fat + fat_size * sector_size, fat_size * sector_size) == 0);
+    check("fat: media entry", get16(fat) == 0xFFF8 && get16(fat + 2) == 0xFFFF);
+
+    const uint8_t *root = img + (reserved + fats * fat_size) * sector_size;
+    check("root: volume label first", root[11] == 0x08 && memcmp(root, "KBDDRIVE   ", 11) == 0);
+
+    uint32_t used = 0;
+    for (int i = 0; i < FILE_COUNT; i++) {
+        const uint8_t *e = root + (i + 1) * 32;
+        char what[64];
+        snprintf(what, sizeof(what), "root: %s entry", files[i].name);
+        check(what, memcmp(e, files[i].entry, 11) == 0 && e[12] == files[i].case_bits &&
+              get32(e + 28) == files[i].size && (e[11] & 0x01));
+
+        // Follow the chain, comparing a cluster at a time
+        uint32_t cluster = get16(e + 26);
+        uint32_t at = 0, links = 0;
+        bool same = (cluster == 0) == (files[i].size == 0);
+        while (same && cluster >= 2 && cluster < 0xFFF8 && links <= clusters) {
+            const uint8_t *data = img + (data_start + (cluster - 2) * spc) * sector_size;
+            for (uint32_t b = 0; b < spc * sector_size && at < files[i].size; b++, at++) {
+                same &= data[b] == pattern_byte(&patterns[i], at);
+            }
+            cluster = get16(fat + cluster * 2);
+            links++;
+        }
+        snprintf(what, sizeof(what), "data: %s", files[i].name);
+        check(what, same && at == files[i].size && (files[i].size == 0 || cluster >= 0xFFF8));
+        used += links;
+    }
+    check("root: nothing after the files", root[(FILE_COUNT + 1) * 32] == 0);
+
+    uint32_t allocated = 0;
+    for (uint32_t c = 2; c < clusters + 2; c++) {
+        allocated += get16(fat + c * 2) != 0;
+    }
+    check("fat: only the files' clusters in use", allocated == used);
+}
+
+int main(int argc, char **argv)
+{
+    static fat_volume_t v;
+    static pattern_t patterns[FILE_COUNT];
+    const char *out = argc == 3 && strcmp(argv[1], "-o") == 0 ? argv[2] : NULL;
+
+    check("init: 8 MB is too small for FAT16", !fv_init(&v, 16384, "X", 1, pattern_read));
+    check("init: 32 MB", fv_init(&v, VOLUME_SECTORS, "kbddrive", 0x1234abcd, pattern_read));
+    for (int i = 0; i < FILE_COUNT; i++) {
+        patterns[i].seed = i * 7;
+        check(files[i].name, fv_add(&v, files[i].name, files[i].size, &patterns[i]) == FV_OK);
+    }
+    check("add: duplicate in other case", fv_add(&v, "SETUP.SH", 1, NULL) == FV_DUPLICATE);
+
+    static const char *const bad[] = { "", ".sh", "a.", "toolongname", "a.long", "a.b.c", "sp ace", "a/b" };
+    for (int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        char what[32];
+        snprintf(what, sizeof(what), "name: \"%s\" refused", bad[i]);
+        check(what, fv_add(&v, bad[i], 1, NULL) == FV_BAD_NAME);
+    }
+    check("used: whole clusters", fv_used(&v) == (3 + 1 + 0 + 257 + 1) * 4096);
+
+    // Read it all in pieces that straddle sectors, as USB transfers may
+    uint8_t *img = calloc(VOLUME_SECTORS, FV_SECTOR_SIZE);
+    uint64_t bytes = (uint64_t)VOLUME_SECTORS * FV_SECTOR_SIZE;
+    bool ok = img != NULL;
+    for (uint64_t at = 0, step = 0; ok && at < bytes; step++) {
+        uint32_t n = step % 3 == 0 ? 4096 : step % 3 == 1 ? 700 : 64;
+        if (n > bytes - at) {
+            n = bytes - at;
+        }
+        ok = fv_read(&v, at / FV_SECTOR_SIZE, at % FV_SECTOR_SIZE, img + at, n);
+        at += n;
+    }
+    check("read: whole volume", ok);
+    if (ok) {
+        check_image(img, VOLUME_SECTORS, patterns);
+    }
+    check("read: past the end fails", !fv_read(&v, VOLUME_SECTORS, 0, (uint8_t[4]){ 0 }, 4));
+    patterns[0].broken = true;
+    check("read: file error reported", !fv_read(&v, v.data_start, 0, (uint8_t[16]){ 0 }, 16));
+    patterns[0].broken = false;
+
+    fv_init(&v, VOLUME_SECTORS, "kbddrive", 1, pattern_read);
+    for (int i = 0; i < FV_FILES_MAX; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%d", i);
+        fv_add(&v, name, 1, &patterns[0]);
+    }
+    check("add: too many", fv_add(&v, "more", 1, NULL) == FV_TOO_MANY);
+    fv_init(&v, VOLUME_SECTORS, "kbddrive", 1, pattern_read);
+    check("add: larger than the volume", fv_add(&v, "huge", v.clusters * 4096 + 1, NULL) == FV_FULL);
+    check("add: exactly the volume", fv_add(&v, "huge", v.clusters * 4096, NULL) == FV_OK);
+
+    if (out && img) {
+        // The first volume again, for fsck.fat -n or mdir -i
+        fv_init(&v, VOLUME_SECTORS, "kbddrive", 0x1234abcd, pattern_read);
+        for (int i = 0; i < FILE_COUNT; i++) {
+            fv_add(&v, files[i].name, files[i].size, &patterns[i]);
+        }
+        fv_read(&v, 0, 0, img, VOLUME_SECTORS * FV_SECTOR_SIZE);
+        FILE *f = fopen(out, "wb");
+        if (!f || fwrite(img, FV_SECTOR_SIZE, VOLUME_SECTORS, f) != VOLUME_SECTORS) {
+            printf("cannot write %s\n", out);
+            failed++;
+        }
+        if (f) {
+            fclose(f);
+        }
+    }
+    free(img);
+
+    printf("%d of %d checks passed\n", checked - failed, checked);
+    return failed ? 1 : 0;
+}
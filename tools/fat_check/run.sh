@@ -0,0 +1,18 @@
+#!/bin/sh
+# Build the payload drive volume checker for the host and run it. The image
+# it builds is left in build-host/fat_check.img; when dosfstools is
+# installed, fsck.fat checks it as well.
+#
+#   tools/fat_check/run.sh
+set -e
+
+cd "$(dirname "$0")/../.."
+
+mkdir -p build-host
+${CC:-cc} -O2 -std=c11 -D_POSIX_C_SOURCE=200809L -Wall -Wextra -Wno-sign-compare \
+    -I main \
+    main/fat_volume.c tools/fat_check/fat_check.c -o build-host/fat_check
+build-host/fat_check -o build-host/fat_check.img
+if command -v fsck.fat >/dev/null 2>&1; then
+    fsck.fat -n build-host/fat_check.img
+fi
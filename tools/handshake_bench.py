@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""
+Measure SSH handshake latency and bulk throughput against the keyboard.
+
+Opens N fresh connections (no connection sharing) and runs a trivial
+command on each. Prints client-side wall time, then the device's own key
+exchange timing from 'stats'. Flash each host key type from menuconfig
+("SSH Keyboard" -> "SSH host key type") and run this tool once per type
+to compare them.
+
+With --ciphers the run repeats once per cipher, forcing each one on the
+client side, and --bulk additionally streams that many KB into the device's
+'sink' command to time how fast it receives and decrypts:
+
+    tools/handshake_bench.py 192.168.1.50 -n 20
+    tools/handshake_bench.py 192.168.1.50 -n 10 --bulk 512 \\
+        --ciphers aes128-gcm@openssh.com,aes128-ctr,chacha20-poly1305@openssh.com
+
+'ssh admin@<device_ip> selftest crypto' times the same primitives on the
+device alone, without the network in the way.
+"""
+
+import argparse
+import os
+import re
+import statistics
+import sys
+import time
+
+from kbdssh import Device, add_device_arguments
+
+SINK = re.compile(r"sink: (\d+) bytes in (\d+) ms, (\d+) KB/s \((.*)\)")
+
+
+def percentile(samples, p):
+    ordered = sorted(samples)
+    return ordered[min(len(ordered) - 1, int(round(p / 100.0 * (len(ordered) - 1))))]
+
+
+def handshakes(dev, count, options):
+    """Time `count` fresh connections; returns (samples in ms, failures)."""
+    samples = []
+    failures = 0
+    for i in range(count):
+        start = time.monotonic()
+        status, _ = dev.run("help", timeout=60, multiplex=False, options=options)
+        elapsed_ms = (time.monotonic() - start) * 1000.0
+        if status != 0:
+            failures += 1
+            print("connection %d failed (exit %d)" % (i + 1, status), file=sys.stderr)
+            continue
+        samples.append(elapsed_ms)
+        print("connection %d: %.0f ms" % (i + 1, elapsed_ms))
+    return samples, failures
+
+
+def bulk(dev, kb, options):
+    """Stream kb KB into 'sink'; returns the device's (KB/s, cipher) or None."""
+    status, out = dev.run("sink", data=os.urandom(kb * 1024), timeout=120 + kb // 10,
+                          multiplex=False, options=options)
+    m = SINK.search(out)
+    if status != 0 or not m:
+        print("bulk transfer failed (exit %d)" % status, file=sys.stderr)
+        return None
+    return int(m.group(3)), m.group(4)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    add_device_arguments(parser)
+    parser.add_argument("-n", "--count", type=int, default=10, help="connections to open")
+    parser.add_argument("--ciphers", help="comma-separated ciphers to run one by one")
+    parser.add_argument("--bulk", type=int, default=0, metavar="KB",
+                        help="also stream this many KB into 'sink' per cipher")
+    args = parser.parse_args()
+
+    dev = Device.from_args(args)
+    ciphers = args.ciphers.split(",") if args.ciphers else [None]
+    results = []
+    try:
+        for cipher in ciphers:
+            options = ["Ciphers=%s" % cipher] if cipher else []
+            if cipher:
+                print("\n%s:" % cipher)
+            samples, failures = handshakes(dev, args.count, options)
+            received = bulk(dev, args.bulk, options) if args.bulk and samples else None
+            results.append((cipher or "default", samples, failures, received))
+
+        print()
+        for cipher, samples, failures, received in results:
+            line = "client %s: n=%d failed=%d" % (cipher, len(samples), failures)
+            if samples:
+                line += " min=%.0f median=%.0f p90=%.0f max=%.0f ms" % (
+                    min(samples), statistics.median(samples),
+                    percentile(samples, 90), max(samples))
+            if received:
+                line += ", bulk %d KB/s (device negotiated %s)" % received
+            print(line)
+
+        status, out = dev.run("stats", timeout=30, multiplex=False)
+        for line in out.splitlines():
+            if line.startswith("handshakes"):
+                print("device: " + line)
+    finally:
+        dev.close()
+
+    return 0 if all(r[1] for r in results) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,377 @@
+#!/usr/bin/env python3
+"""
+Type one job on many SSH keyboards at once.
+
+Opens one persistent `jobd` session per device and uploads the job to every
+device before any of them types. Firmware that knows `stage` holds each
+upload paused until the coordinator resumes them all together. On older
+firmware a device starts typing as soon as its own upload completes.
+Progress is shown per device. The exit status is 0 only if every device
+reports the job as fully typed.
+
+    tools/kbdfleet.py setup.sh 10.0.0.11 10.0.0.12 10.0.0.13
+    tools/kbdfleet.py setup.sh --hosts-file rack4.txt --require-all
+    tools/kbdfleet.py setup.sh --simulate 8 --sim-fail 1
+
+--simulate needs no hardware. Each simulated device is a separate process
+running a stand-in for the device's jobd protocol at its own typing speed.
+--sim-fail makes that many of them lose USB half way through the job.
+Ctrl-C aborts the job on every device.
+"""
+
+import argparse
+import os
+import random
+import signal
+import subprocess
+import sys
+import threading
+import time
+
+from kbdjob import JobError, JobSession, JobStatus, format_duration
+from kbdssh import DEFAULT_PASSWORD, DEFAULT_USER, Device
+
+POLL_INTERVAL = 0.5
+USAGE = "usage: submit|stage [bytes [name]] | list | status|pause|resume|abort <id>"
+
+
+class FleetMember(threading.Thread):
+    """One device's session: upload, wait for the common start, follow the job."""
+
+    def __init__(self, label, device, data, name, go, abort):
+        super().__init__(daemon=True)
+        self.label = label
+        self.device = device
+        self.data = data
+        self.name = name
+        self.go = go
+        self.abort = abort
+        self.uploaded = threading.Event()
+        self.state = "connecting"
+        self.staged = False
+        self.job = None
+        self.error = None
+        self.started_at = None
+
+    @property
+    def ok(self):
+        return self.job is not None and self.job.state == "done"
+
+    def run(self):
+        session = None
+        try:
+            session = JobSession(self.device)
+            self._run(session)
+        except (JobError, OSError, subprocess.SubprocessError) as e:
+            self.error = str(e)
+            self.state = "failed"
+        finally:
+            self.uploaded.set()
+            if session:
+                try:
+                    session.close()
+                except (OSError, subprocess.SubprocessError):
+                    pass
+            self.device.close()
+
+    def _run(self, session):
+        self.staged = session.can_stage()
+        self.state = "uploading"
+        job_id = session.submit(self.data, self.name, staged=self.staged)
+        if not self.staged:
+            self.started_at = time.monotonic()
+        self.job = session.status(job_id)
+        self.state = self.job.state
+        self.uploaded.set()
+
+        self.go.wait()
+        if self.abort.is_set():
+            self.job = JobStatus(session.command("abort %d" % job_id)[0])
+            self.state = self.job.state
+            return
+        if self.staged:
+            self.job = session.resume(job_id)
+            self.started_at = time.monotonic()
+
+        while True:
+            self.job = session.status(job_id)
+            self.state = self.job.state
+            if self.job.finished or self.job.state == "interrupted":
+                return
+            if self.abort.is_set():
+                session.command("abort %d" % job_id)
+                continue
+            time.sleep(POLL_INTERVAL)
+
+
+def format_member(member, width):
+    job = member.job
+    if member.error:
+        detail = member.error
+    elif job is None:
+        detail = ""
+    else:
+        percent = 100.0 * job.typed / job.size if job.size else 100.0
+        detail = "%6.1f%%  %d/%d  %5.1f cps  ETA %s" % (
+            percent, job.typed, job.size, job.rate(), format_duration(job.eta()))
+    return "%-*s %-11s %s" % (width, member.label, member.state, detail)
+
+
+class Progress:
+    """Per-device status block, redrawn in place on a terminal."""
+
+    def __init__(self, members):
+        self.members = members
+        self.width = max(len(m.label) for m in members)
+        self.tty = sys.stderr.isatty()
+        self.drawn = 0
+        self.last = {}
+
+    def update(self):
+        lines = [format_member(m, self.width) for m in self.members]
+        if self.tty:
+            if self.drawn:
+                sys.stderr.write("\033[%dA" % self.drawn)
+            for line in lines:
+                sys.stderr.write("\r\033[K%s\n" % line)
+            self.drawn = len(lines)
+        else:
+            # Log only state changes when not on a terminal
+            for m, line in zip(self.members, lines):
+                if self.last.get(m.label) != m.state:
+                    self.last[m.label] = m.state
+                    sys.stderr.write(line + "\n")
+        sys.stderr.flush()
+
+
+def read_hosts(args):
+    hosts = list(args.hosts)
+    if args.hosts_file:
+        with open(args.hosts_file) as f:
+            hosts += [line.split("#")[0].strip() for line in f]
+    return [h for h in hosts if h]
+
+
+def make_device(host, args):
+    """host or host:port, with the shared --user/--password/--port options."""
+    name, _, port = host.partition(":")
+    return Device(name, args.user, args.password, int(port) if port else args.port)
+
+
+def coordinate(members, progress, require_all):
+    go = members[0].go
+    abort = members[0].abort
+    for m in members:
+        m.start()
+
+    # Common start: nobody types until every upload has finished or failed
+    while not all(m.uploaded.is_set() for m in members):
+        progress.update()
+        time.sleep(0.1)
+    failed = [m for m in members if m.error]
+    if failed and require_all:
+        sys.stderr.write("%d device(s) failed before the start; aborting all\n" % len(failed))
+        abort.set()
+    go.set()
+
+    while any(m.is_alive() for m in members):
+        progress.update()
+        time.sleep(POLL_INTERVAL)
+    progress.update()
+
+
+def report(members):
+    started = [m.started_at for m in members if m.started_at is not None]
+    skew = (max(started) - min(started)) * 1000 if started else 0
+    done = sum(1 for m in members if m.ok)
+    unstaged = [m.label for m in members if m.job is not None and not m.staged]
+    sys.stderr.write("%d/%d device(s) done, start skew %.0f ms\n" % (done, len(members), skew))
+    if unstaged:
+        sys.stderr.write("no staging support (started on upload): %s\n" % " ".join(unstaged))
+    for m in members:
+        if m.ok:
+            continue
+        if m.error:
+            sys.stderr.write("  %s: %s\n" % (m.label, m.error))
+        elif m.job is not None:
+            hint = ""
+            if m.job.state == "interrupted":
+                hint = "; resume with: kbdjob.py %s resume %d" % (m.label, m.job.id)
+            sys.stderr.write("  %s: job %d %s at %d/%d%s\n" % (
+                m.label, m.job.id, m.job.state, m.job.typed, m.job.size, hint))
+    return 0 if done == len(members) else 1
+
+
+class SimDevice:
+    """Stands in for kbdssh.Device: each popen() starts a stand-in jobd process."""
+
+    def __init__(self, cps, fail_at=None, staging=True):
+        self.cps = cps
+        self.fail_at = fail_at
+        self.staging = staging
+
+    def popen(self, command, **kwargs):
+        args = [sys.executable, os.path.abspath(__file__), "--sim-jobd", "--cps", str(self.cps)]
+        if self.fail_at is not None:
+            args += ["--fail-at", str(self.fail_at)]
+        if not self.staging:
+            args.append("--no-stage")
+        return subprocess.Popen(args, **kwargs)
+
+    def close(self):
+        pass
+
+
+def sim_jobd(cps, fail_at, staging):
+    """Serve the device's jobd protocol on stdin/stdout, typing at cps.
+
+    Jobs type one at a time in submission order, like the firmware. A job
+    that reaches fail_at bytes becomes interrupted, as if USB went away.
+    """
+    jobs = []
+    next_id = [1]
+    clock = [time.monotonic()]
+    out = sys.stdout.buffer
+    inp = sys.stdin.buffer
+
+    def advance():
+        now = time.monotonic()
+        elapsed, clock[0] = now - clock[0], now
+        for job in jobs:
+            if job["state"] in ("queued", "typing"):
+                if job["state"] == "queued":
+                    job["state"] = "typing"
+                    job["started"] = job["started"] or now
+                limit = min(job["size"], fail_at) if fail_at is not None else job["size"]
+                job["typed"] = min(limit, job["typed"] + elapsed * cps)
+                if job["typed"] >= job["size"]:
+                    job["state"] = "done"
+                elif job["typed"] >= limit:
+                    job["state"] = "interrupted"
+                break
+            if job["state"] in ("paused", "interrupted"):
+                break
+
+    def line(job):
+        ms = int((time.monotonic() - job["started"]) * 1000) if job["started"] else 0
+        return "%d %s %d %d %d admin %s" % (job["id"], job["state"], int(job["typed"]),
+                                           job["size"], ms, job["name"])
+
+    def reply(text):
+        out.write(text.encode() + b"\n")
+        out.flush()
+
+    while True:
+        raw = inp.readline()
+        if not raw:
+            return 0
+        fields = raw.decode().split()
+        if not fields:
+            continue
+        advance()
+        verb = fields[0]
+        if verb in ("submit", "stage") and len(fields) >= 2 and (staging or verb == "submit"):
+            size = int(fields[1])
+            data = inp.read(size)
+            if len(data) != size:
+                reply("err short upload")
+                continue
+            jobs.append({"id": next_id[0], "state": "paused" if verb == "stage" else "queued",
+                         "typed": 0.0, "size": size, "started": None,
+                         "name": fields[2] if len(fields) > 2 else "-"})
+            next_id[0] += 1
+            reply("ok %d" % jobs[-1]["id"])
+            continue
+        if verb == "list":
+            for job in jobs:
+                reply("job " + line(job))
+            reply("ok")
+            continue
+        if len(fields) < 2:
+            reply("err " + (USAGE if staging else USAGE.replace("submit|stage", "submit")))
+            continue
+        job = next((j for j in jobs if j["id"] == int(fields[1])), None)
+        if job is None:
+            reply("err no such job")
+            continue
+        pending = job["state"] in ("queued", "typing", "paused", "interrupted")
+        if verb == "resume" and job["state"] in ("paused", "interrupted"):
+            job["state"] = "queued"
+        elif verb == "pause" and job["state"] in ("queued", "typing"):
+            job["state"] = "paused"
+        elif verb == "abort" and pending:
+            job["state"] = "aborted"
+        elif verb not in ("status", "resume", "pause", "abort"):
+            reply("err unknown job command")
+            continue
+        reply("ok " + line(job))
+
+
+def sim_jobd_main(argv):
+    parser = argparse.ArgumentParser(prog="kbdfleet.py --sim-jobd")
+    parser.add_argument("--cps", type=float, default=40.0)
+    parser.add_argument("--fail-at", type=int)
+    parser.add_argument("--no-stage", action="store_true")
+    args = parser.parse_args(argv)
+    return sim_jobd(args.cps, args.fail_at, not args.no_stage)
+
+
+def main():
+    if sys.argv[1:2] == ["--sim-jobd"]:
+        return sim_jobd_main(sys.argv[2:])
+
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("file", help="text to type on every device (- for stdin)")
+    parser.add_argument("hosts", nargs="*", help="device addresses, host or host:port")
+    parser.add_argument("--hosts-file", help="file with one device address per line")
+    parser.add_argument("-u", "--user", default=DEFAULT_USER)
+    parser.add_argument("-p", "--password",
+                        default=os.environ.get("KBD_PASSWORD", DEFAULT_PASSWORD),
+                        help="SSH password (default: $KBD_PASSWORD or %s)" % DEFAULT_PASSWORD)
+    parser.add_argument("--port", type=int, default=22)
+    parser.add_argument("--name", help="job name shown on the devices (default: file name)")
+    parser.add_argument("--require-all", action="store_true",
+                        help="abort everywhere if any device fails before the start")
+    parser.add_argument("--simulate", type=int, metavar="N", help="use N simulated devices")
+    parser.add_argument("--sim-cps", type=float, default=40.0,
+                        help="simulated typing rate, varied +-20%% per device (default 40)")
+    parser.add_argument("--sim-fail", type=int, default=0, metavar="K",
+                        help="K simulated devices lose USB half way")
+    parser.add_argument("--sim-unstaged", type=int, default=0, metavar="K",
+                        help="K simulated devices run firmware without `stage`")
+    args = parser.parse_args()
+
+    if args.file == "-":
+        data = sys.stdin.buffer.read()
+        name = args.name or "stdin"
+    else:
+        with open(args.file, "rb") as f:
+            data = f.read()
+        name = args.name or os.path.basename(args.file)
+    if not data:
+        parser.error("nothing to type")
+    name = name.replace(" ", "_")
+
+    go = threading.Event()
+    abort = threading.Event()
+    if args.simulate:
+        rng = random.Random(1)
+        devices = []
+        for i in range(args.simulate):
+            fail_at = len(data) // 2 if i >= args.simulate - args.sim_fail else None
+            devices.append(("sim%d" % (i + 1), SimDevice(
+                args.sim_cps * rng.uniform(0.8, 1.2), fail_at, staging=i >= args.sim_unstaged)))
+    else:
+        hosts = read_hosts(args)
+        if not hosts:
+            parser.error("no devices given")
+        devices = [(host, make_device(host, args)) for host in hosts]
+
+    members = [FleetMember(label, device, data, name, go, abort) for label, device in devices]
+    signal.signal(signal.SIGINT, lambda *_: (abort.set(), go.set()))
+    coordinate(members, Progress(members), args.require_all)
+    return report(members)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
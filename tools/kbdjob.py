@@ -0,0 +1,292 @@
+#!/usr/bin/env python3
+"""
+Submit text to the ESP32-S3 SSH keyboard as jobs and follow them until typed.
+
+All work goes over one persistent SSH channel running the device's `jobd`
+protocol. While one job types, the next one is already uploaded, so the
+keyboard never waits for the network between jobs.
+
+    tools/kbdjob.py 192.168.1.50 submit setup.sh notes.txt
+    generate-config | tools/kbdjob.py 192.168.1.50 submit -
+    tools/kbdjob.py 192.168.1.50 list
+    tools/kbdjob.py 192.168.1.50 pause 7
+    tools/kbdjob.py 192.168.1.50 submit --app vim notes.txt
+    tools/kbdjob.py 192.168.1.50 events --job 7
+
+While `submit` is running, Ctrl-C aborts every job it submitted and
+Ctrl-\\ pauses or resumes the job that is typing. A job the device reports
+as interrupted (keyboard unplugged, or the device reset mid-job) stops
+`submit`; resume it with `kbdjob.py <host> resume <id>`. The exit status is 0
+only when the device reports every job as fully typed.
+
+`events` prints the device's event stream (job progress, stalls, USB and
+LED changes) as it arrives. With --job it follows one job and exits 0 once
+that job is done, 1 if it is aborted.
+"""
+
+import argparse
+import os
+import signal
+import subprocess
+import sys
+import time
+
+from kbdssh import Device, add_device_arguments
+
+POLL_INTERVAL = 0.5
+PIPELINE_DEPTH = 2  # jobs on the device at once: one typing, one uploaded
+
+
+class JobError(Exception):
+    pass
+
+
+class JobStatus:
+    """One job line: <id> <state> <typed> <size> <elapsed_ms> <user> <name>"""
+
+    def __init__(self, fields):
+        self.id = int(fields[0])
+        self.state = fields[1]
+        self.typed = int(fields[2])
+        self.size = int(fields[3])
+        self.elapsed_ms = int(fields[4])
+        self.user = fields[5]
+        self.name = fields[6] if len(fields) > 6 else "-"
+
+    @property
+    def finished(self):
+        return self.state in ("done", "aborted")
+
+    def rate(self):
+        """Characters per second since the job started typing."""
+        if self.elapsed_ms <= 0:
+            return 0.0
+        return self.typed * 1000.0 / self.elapsed_ms
+
+    def eta(self):
+        rate = self.rate()
+        if rate <= 0:
+            return None
+        return (self.size - self.typed) / rate
+
+
+class JobSession:
+    """Client side of the device's line-based `jobd` protocol."""
+
+    def __init__(self, device):
+        self.device = device
+        self.proc = device.popen("jobd", stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def _reply(self):
+        lines = []
+        while True:
+            raw = self.proc.stdout.readline()
+            if not raw:
+                raise JobError("connection closed by device")
+            line = raw.decode(errors="replace").strip()
+            if line.startswith("ok"):
+                return line[2:].split(), lines
+            if line.startswith("err"):
+                raise JobError(line[4:])
+            if line:
+                lines.append(line)
+
+    def command(self, line, payload=None):
+        self.proc.stdin.write(line.encode() + b"\n")
+        if payload is not None:
+            self.proc.stdin.write(payload)
+        self.proc.stdin.flush()
+        return self._reply()
+
+    def submit(self, data, name, staged=False, app=None):
+        """Upload a job. A staged job waits paused until resume(); app names
+        the device's application profile (see `app` on the device)."""
+        line = "%s %d %s" % ("stage" if staged else "submit", len(data), name)
+        if app:
+            line += " app=" + app
+        fields, _ = self.command(line, data)
+        return int(fields[0])
+
+    def can_stage(self):
+        """True if the device firmware accepts `stage` (its usage line lists it)."""
+        try:
+            self.command("status")
+        except JobError as e:
+            return "stage" in str(e)
+        return False
+
+    def resume(self, job_id):
+        fields, _ = self.command("resume %d" % job_id)
+        return JobStatus(fields)
+
+    def status(self, job_id):
+        fields, _ = self.command("status %d" % job_id)
+        return JobStatus(fields)
+
+    def list(self):
+        _, lines = self.command("list")
+        return [JobStatus(line.split()[1:]) for line in lines if line.startswith("job ")]
+
+    def close(self):
+        try:
+            self.proc.stdin.close()
+        except OSError:
+            pass
+        self.proc.wait(timeout=10)
+
+
+def format_duration(seconds):
+    if seconds is None:
+        return "--:--"
+    seconds = int(seconds)
+    return "%d:%02d:%02d" % (seconds // 3600, seconds // 60 % 60, seconds % 60)
+
+
+def print_progress(job, label, done_bytes, total_bytes):
+    percent = 100.0 * job.typed / job.size if job.size else 100.0
+    line = "\r%-20s %-7s %6.1f%%  %d/%d  %5.1f cps  ETA %s  [total %d/%d]" % (
+        label[:20], job.state, percent, job.typed, job.size, job.rate(),
+        format_duration(job.eta()), done_bytes + job.typed, total_bytes)
+    sys.stderr.write(line.ljust(96))
+    sys.stderr.flush()
+
+
+def read_inputs(paths):
+    inputs = []
+    for path in paths:
+        if path == "-":
+            inputs.append(("stdin", sys.stdin.buffer.read()))
+        else:
+            with open(path, "rb") as f:
+                inputs.append((os.path.basename(path), f.read()))
+    return inputs
+
+
+def cmd_submit(session, args):
+    inputs = [(name, data) for name, data in read_inputs(args.files) if data]
+    total_bytes = sum(len(data) for _, data in inputs)
+    pending = list(inputs)
+    active = []          # (job id, label, size) in submission order
+    done_bytes = 0
+    failed = False
+    interrupted = {"abort": False, "toggle": False}
+
+    signal.signal(signal.SIGINT, lambda *_: interrupted.__setitem__("abort", True))
+    signal.signal(signal.SIGQUIT, lambda *_: interrupted.__setitem__("toggle", True))
+
+    while pending or active:
+        # Keep the pipeline full: upload the next job while the current one types
+        while pending and len(active) < PIPELINE_DEPTH and not interrupted["abort"]:
+            name, data = pending.pop(0)
+            job_id = session.submit(data, name.replace(" ", "_"), app=args.app)
+            active.append((job_id, name, len(data)))
+
+        if interrupted["abort"]:
+            for job_id, _, _ in active:
+                session.command("abort %d" % job_id)
+            sys.stderr.write("\naborted %d job(s), %d not submitted\n" % (len(active), len(pending)))
+            return 130
+
+        job_id, label, size = active[0]
+        job = session.status(job_id)
+
+        if interrupted["toggle"]:
+            interrupted["toggle"] = False
+            session.command(("resume %d" if job.state == "paused" else "pause %d") % job_id)
+            job = session.status(job_id)
+
+        print_progress(job, label, done_bytes, total_bytes)
+
+        if job.state == "interrupted":
+            sys.stderr.write("\njob %d (%s) interrupted at %d/%d; resume with: %s %s resume %d\n" % (
+                job.id, label, job.typed, job.size, os.path.basename(sys.argv[0]), args.host, job.id))
+            return 1
+
+        if job.finished:
+            sys.stderr.write("\n")
+            active.pop(0)
+            done_bytes += size
+            if job.state != "done":
+                failed = True
+                sys.stderr.write("job %d (%s) %s at %d/%d\n" % (job.id, label, job.state, job.typed, job.size))
+            continue
+
+        time.sleep(POLL_INTERVAL)
+
+    if not args.quiet:
+        sys.stderr.write("delivered %d bytes in %d job(s)\n" % (done_bytes, len(inputs)))
+    return 1 if failed else 0
+
+
+def cmd_list(session, args):
+    for job in session.list():
+        print("%4d %-11s %8d/%-8d %6.1f cps  %-8s %s" % (
+            job.id, job.state, job.typed, job.size, job.rate(), job.user, job.name))
+    return 0
+
+
+def cmd_control(session, args):
+    fields, _ = session.command("%s %d" % (args.action, args.job))
+    job = JobStatus(fields)
+    print("job %d %s (%d/%d)" % (job.id, job.state, job.typed, job.size))
+    return 0
+
+
+def cmd_events(session, args):
+    command = "events job=%d" % args.job if args.job else "events"
+    proc = session.device.popen(command, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    done = False
+    try:
+        for raw in proc.stdout:
+            line = raw.decode(errors="replace").rstrip()
+            print(line, flush=True)
+            fields = line.split()
+            # "<seq> <ms> <type> ...": the stream ends after the job's last event
+            done = fields[2:3] == ["job-done"] or (fields[2:3] == ["job-state"] and "state=done" in fields)
+    except KeyboardInterrupt:
+        return 130
+    finally:
+        proc.terminate()
+        proc.wait(timeout=10)
+    return 0 if not args.job or done else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    add_device_arguments(parser)
+    sub = parser.add_subparsers(dest="action", required=True)
+
+    p = sub.add_parser("submit", help="type files (or - for stdin) as jobs")
+    p.add_argument("files", nargs="+")
+    p.add_argument("-q", "--quiet", action="store_true")
+    p.add_argument("--app", metavar="PROFILE",
+                   help="application profile for the jobs, e.g. shell, vim, python")
+    p.set_defaults(fn=cmd_submit)
+
+    p = sub.add_parser("list", help="show jobs on the device")
+    p.set_defaults(fn=cmd_list)
+
+    for action in ("status", "pause", "resume", "abort"):
+        p = sub.add_parser(action, help="%s one job" % action)
+        p.add_argument("job", type=int)
+        p.set_defaults(fn=cmd_control)
+
+    p = sub.add_parser("events", help="print the device's event stream")
+    p.add_argument("--job", type=int, help="follow one job until it is done or aborted")
+    p.set_defaults(fn=cmd_events)
+
+    args = parser.parse_args()
+    device = Device.from_args(args)
+    session = JobSession(device)
+    try:
+        return args.fn(session, args)
+    except JobError as e:
+        sys.stderr.write("\nerror: %s\n" % e)
+        return 2
+    finally:
+        session.close()
+        device.close()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,222 @@
+#!/usr/bin/env python3
+"""
+Measure one-way keystroke latency to the ESP32-S3 SSH keyboard while typing.
+
+Keys typed into this terminal go to the device's `latency` session stamped
+with this host's clock, and are typed on the target like any SSH input. The
+device learns the offset between the two clocks NTP-style from a burst of
+sync exchanges, repeated every --sync seconds. It times each key from the
+keypress here to the target host reading the key-down report, split into
+network, input queue and USB stages. The bottom line shows the device's
+percentiles, refreshed every second.
+
+    tools/kbdlat.py 192.168.1.50
+    tools/kbdlat.py 192.168.1.50 --log keys.csv
+
+Ctrl-] quits; every other key, Ctrl-C included, goes to the target. The
+offset is only as good as the network is symmetric: its error is at most
+half the best round trip, shown as +-.
+"""
+
+import argparse
+import os
+import queue
+import select
+import subprocess
+import sys
+import termios
+import threading
+import time
+import tty
+
+from kbdssh import Device, add_device_arguments
+
+QUIT_KEY = b"\x1d"          # Ctrl-]
+SYNC_SAMPLES = 8
+SYNC_TIMEOUT = 2.0
+REPORT_INTERVAL = 1.0
+KEY_BYTES = 16              # Most bytes the device takes per key line
+STAGES = ("total", "net", "queue", "usb")
+
+
+def now_us():
+    return time.monotonic_ns() // 1000
+
+
+def ms(us):
+    return "%.1f" % (us / 1000.0)
+
+
+class LatencySession:
+    """The device's `latency` line protocol over one SSH channel."""
+
+    def __init__(self, device, log=None):
+        self.proc = device.popen("latency", stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                  bufsize=0)
+        self.log = log
+        self.syncs = queue.Queue()
+        self.report = {}
+        self.unmatched = 0
+        self.measured = 0
+        self.error = None
+        self.rtt_us = None
+        self._pending = {}
+        self._reader = threading.Thread(target=self._read, daemon=True)
+        self._reader.start()
+
+    def _send(self, line):
+        self.proc.stdin.write((line + "\n").encode())
+        self.proc.stdin.flush()
+
+    def _read(self):
+        for raw in self.proc.stdout:
+            fields = raw.decode(errors="replace").split()
+            if not fields:
+                continue
+            if fields[0] == "sync" and len(fields) == 4:
+                self.syncs.put([int(f) for f in fields[1:]] + [now_us()])
+            elif fields[0] == "lat" and len(fields) == 6:
+                self.measured += 1
+                if self.log:
+                    self.log.write(",".join(fields[1:]) + "\n")
+            elif fields[0] == "pct" and len(fields) == 7:
+                self._pending[fields[1]] = [int(f) for f in fields[2:]]
+            elif fields[0] == "end":
+                self.report, self._pending = self._pending, {}
+                self.unmatched = int(fields[1].split("=")[1])
+            elif fields[0] == "error":
+                self.error = " ".join(fields[1:])
+
+    def sync(self):
+        """Measure the clock offset and hand it to the device.
+
+        Of SYNC_SAMPLES exchanges the one with the shortest round trip is
+        kept: it is the one least skewed by queueing on either path.
+        """
+        best = None
+        for _ in range(SYNC_SAMPLES):
+            self._send("sync %d" % now_us())
+            try:
+                t1, t2, t3, t4 = self.syncs.get(timeout=SYNC_TIMEOUT)
+            except queue.Empty:
+                continue
+            rtt = (t4 - t1) - (t3 - t2)
+            offset = ((t2 - t1) + (t3 - t4)) // 2
+            if best is None or rtt < best[1]:
+                best = (offset, rtt)
+        if best is None:
+            raise RuntimeError("device did not answer sync")
+        self._send("clock %d %d" % best)
+        self.rtt_us = best[1]
+
+    def key(self, seq, stamp_us, data):
+        self._send("key %d %d %s" % (seq, stamp_us, data.hex()))
+
+    def request_report(self):
+        self._send("report")
+
+    def close(self):
+        try:
+            self.proc.stdin.close()
+        except OSError:
+            pass
+        self.proc.terminate()
+        self.proc.wait(timeout=10)
+
+
+def status_line(session):
+    total = session.report.get("total")
+    if not total or not total[0]:
+        text = "measured %d keys" % session.measured
+    else:
+        parts = ["keys %d" % total[0],
+                 "total p50 %s p90 %s p99 %s ms" % (ms(total[1]), ms(total[2]), ms(total[3]))]
+        for stage in STAGES[1:]:
+            v = session.report.get(stage)
+            if v:
+                parts.append("%s %s/%s" % (stage, ms(v[1]), ms(v[3])))
+        text = " | ".join(parts)
+    if session.rtt_us is not None:
+        text += " | clock +-%s ms" % ms(session.rtt_us / 2)
+    if session.error:
+        text += " | device: %s" % session.error
+    return text
+
+
+def run(session, sync_interval):
+    fd = sys.stdin.fileno()
+    saved = termios.tcgetattr(fd)
+    tty.setraw(fd)
+    seq = 0
+    next_sync = time.monotonic() + sync_interval
+    next_report = time.monotonic()
+    try:
+        while True:
+            ready, _, _ = select.select([fd], [], [], 0.1)
+            if ready:
+                stamp = now_us()
+                data = os.read(fd, 64)
+                if not data or QUIT_KEY in data:
+                    break
+                # One read is one keypress, or several typed faster than we read
+                for i in range(0, len(data), KEY_BYTES):
+                    seq += 1
+                    session.key(seq, stamp, data[i:i + KEY_BYTES])
+            now = time.monotonic()
+            if now >= next_sync:
+                session.sync()
+                next_sync = now + sync_interval
+            if now >= next_report:
+                session.request_report()
+                sys.stderr.write("\r\x1b[K" + status_line(session))
+                sys.stderr.flush()
+                next_report = now + REPORT_INTERVAL
+    finally:
+        termios.tcsetattr(fd, termios.TCSADRAIN, saved)
+        sys.stderr.write("\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    add_device_arguments(parser)
+    parser.add_argument("--sync", type=float, default=10.0, metavar="SECONDS",
+                        help="how often to measure the clock offset again (default 10)")
+    parser.add_argument("--log", metavar="CSV",
+                        help="write seq,total_us,net_us,queue_us,usb_us for every key")
+    args = parser.parse_args()
+
+    if not sys.stdin.isatty():
+        sys.stderr.write("kbdlat: stdin must be a terminal\n")
+        return 2
+
+    device = Device.from_args(args)
+    log = open(args.log, "w") if args.log else None
+    if log:
+        log.write("seq,total_us,net_us,queue_us,usb_us\n")
+    session = LatencySession(device, log)
+    try:
+        session.sync()
+        sys.stderr.write("clock offset measured, round trip %s ms; type away, Ctrl-] quits\n"
+                         % ms(session.rtt_us))
+        run(session, args.sync)
+        session.request_report()
+        time.sleep(0.5)
+        for stage in STAGES:
+            v = session.report.get(stage)
+            if v:
+                print("%-5s n=%d p50=%s p90=%s p99=%s max=%s ms"
+                      % (stage, v[0], ms(v[1]), ms(v[2]), ms(v[3]), ms(v[4])))
+        print("unmatched=%d" % session.unmatched)
+        return 0
+    except RuntimeError as e:
+        sys.stderr.write("error: %s\n" % e)
+        return 1
+    finally:
+        session.close()
+        device.close()
+        if log:
+            log.close()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
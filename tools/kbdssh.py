@@ -0,0 +1,91 @@
+"""
+Helpers for driving the ESP32-S3 SSH keyboard from a Linux host.
+
+Uses the system OpenSSH client. The password is handed over through
+SSH_ASKPASS so no extra Python packages are needed. Pass control_path
+to reuse one authenticated connection for many commands (ControlMaster).
+"""
+
+import os
+import stat
+import subprocess
+import tempfile
+
+DEFAULT_USER = "admin"
+DEFAULT_PASSWORD = "esp32kbd"
+
+
+def add_device_arguments(parser):
+    """Add the host/user/password options shared by all tools."""
+    parser.add_argument("host", help="device IP address or hostname")
+    parser.add_argument("-u", "--user", default=DEFAULT_USER)
+    parser.add_argument("-p", "--password",
+                        default=os.environ.get("KBD_PASSWORD", DEFAULT_PASSWORD),
+                        help="SSH password (default: $KBD_PASSWORD or %s)" % DEFAULT_PASSWORD)
+    parser.add_argument("--port", type=int, default=22)
+
+
+class Device:
+    def __init__(self, host, user=DEFAULT_USER, password=DEFAULT_PASSWORD, port=22,
+                 control_path=None):
+        self.host = host
+        self.user = user
+        self.password = password
+        self.port = port
+        self.control_path = control_path
+        self._askpass_dir = tempfile.TemporaryDirectory(prefix="kbdssh-")
+        self._askpass = os.path.join(self._askpass_dir.name, "askpass")
+        with open(self._askpass, "w") as f:
+            f.write("#!/bin/sh\nprintf '%s\\n' \"$KBD_ASKPASS_SECRET\"\n")
+        os.chmod(self._askpass, stat.S_IRWXU)
+
+    @classmethod
+    def from_args(cls, args, control_path=None):
+        return cls(args.host, args.user, args.password, args.port, control_path)
+
+    def _env(self):
+        env = dict(os.environ)
+        env["SSH_ASKPASS"] = self._askpass
+        env["SSH_ASKPASS_REQUIRE"] = "force"
+        env["KBD_ASKPASS_SECRET"] = self.password
+        env.setdefault("DISPLAY", ":0")
+        return env
+
+    def ssh_args(self, *command, multiplex=True, options=()):
+        args = ["ssh", "-p", str(self.port),
+                "-o", "StrictHostKeyChecking=accept-new",
+                "-o", "PreferredAuthentications=password",
+                "-o", "NumberOfPasswordPrompts=1"]
+        for option in options:
+            args += ["-o", option]
+        if multiplex and self.control_path:
+            args += ["-o", "ControlMaster=auto",
+                     "-o", "ControlPath=%s" % self.control_path,
+                     "-o", "ControlPersist=60"]
+        else:
+            args += ["-o", "ControlMaster=no", "-o", "ControlPath=none"]
+        args.append("%s@%s" % (self.user, self.host))
+        args.extend(command)
+        return args
+
+    def run(self, command, data=None, timeout=None, multiplex=True, options=()):
+        """Run one device command and return (exit status, stdout text).
+
+        options are extra ssh_config settings ("Ciphers=aes128-ctr").
+        """
+        proc = subprocess.run(self.ssh_args(command, multiplex=multiplex, options=options),
+                              input=data, stdout=subprocess.PIPE,
+                              stderr=subprocess.PIPE, env=self._env(),
+                              timeout=timeout)
+        return proc.returncode, proc.stdout.decode(errors="replace").replace("\r\n", "\n")
+
+    def popen(self, command, multiplex=True, **kwargs):
+        return subprocess.Popen(self.ssh_args(command, multiplex=multiplex),
+                                env=self._env(), **kwargs)
+
+    def close(self):
+        if self.control_path:
+            subprocess.run(["ssh", "-O", "exit", "-o", "ControlPath=%s" % self.control_path,
+                            "%s@%s" % (self.user, self.host)],
+                           stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self._askpass_dir.cleanup()
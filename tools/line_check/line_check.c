@@ -0,0 +1,294 @@
+/*
+ * Check main/line_edit.c on the host: each case types the bytes a terminal
+ * sends through the terminal input parser and the line editor, then compares
+ * the line committed (or the outcome when it is not committed) and the key
+ * counts that `line` sessions report as saved keystrokes. Lines wider than
+ * the terminal are also drawn on a small terminal model and the screen
+ * compared.
+ *
+ *     tools/line_check/run.sh
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hid_usage.h"
+#include "line_edit.h"
+
+static const char *const result_names[] = { "editing", "commit", "cancel", "eof" };
+
+static int failed = 0;
+static int checked = 0;
+
+// Just enough of a terminal for what the editor sends: printable characters
+// with the usual deferred wrap at the last column, CR, LF, BS, BEL, and CSI
+// A B C D H J K. LF on the bottom row scrolls.
+#define TERM_ROWS 8
+#define TERM_COLS_MAX 40
+
+typedef struct {
+    int cols;
+    int row;
+    int col;
+    bool wrap;                          // Last column written, wrap on the next character
+    char cell[TERM_ROWS][TERM_COLS_MAX + 1];
+} term_t;
+
+static void term_init(term_t *t, int cols)
+{
+    memset(t, 0, sizeof(*t));
+    t->cols = cols;
+    memset(t->cell, ' ', sizeof(t->cell));
+}
+
+static void term_clear(term_t *t, int row, int col)
+{
+    for (; row < TERM_ROWS; row++, col = 0) {
+        memset(&t->cell[row][col], ' ', t->cols - col);
+    }
+}
+
+static void term_down(term_t *t)
+{
+    if (t->row < TERM_ROWS - 1) {
+        t->row++;
+        return;
+    }
+    memmove(t->cell[0], t->cell[1], sizeof(t->cell[0]) * (TERM_ROWS - 1));
+    memset(t->cell[TERM_ROWS - 1], ' ', sizeof(t->cell[0]));
+}
+
+static void term_write(term_t *t, const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == 0x1b && i + 1 < len && s[i + 1] == '[') {
+            char *end;
+            long n = strtol(&s[i + 2], &end, 10);
+            int arg = end == &s[i + 2] ? 1 : (int)n;
+            i = end - s;
+            switch (s[i]) {
+                case 'A': t->row = t->row > arg ? t->row - arg : 0; break;
+                case 'B': t->row = t->row + arg < TERM_ROWS ? t->row + arg : TERM_ROWS - 1; break;
+                case 'C': t->col = t->col + arg < t->cols ? t->col + arg : t->cols - 1; break;
+                case 'D': t->col = t->col > arg ? t->col - arg : 0; break;
+                case 'H': t->row = t->col = 0; break;
+                case 'J': term_clear(t, n == 2 ? 0 : t->row, n == 2 ? 0 : t->col); break;
+                case 'K': memset(&t->cell[t->row][t->col], ' ', t->cols - t->col); break;
+            }
+            t->wrap = false;
+        } else if (c == '\r') {
+            t->col = 0;
+            t->wrap = false;
+        } else if (c == '\n') {
+            term_down(t);
+            t->wrap = false;
+        } else if (c == '\b') {
+            t->col -= t->col > 0;
+            t->wrap = false;
+        } else if (c >= 0x20 && c < 0x7f) {
+            if (t->wrap) {
+                t->col = 0;
+                term_down(t);
+                t->wrap = false;
+            }
+            t->cell[t->row][t->col] = c;
+            if (t->col == t->cols - 1) {
+                t->wrap = true;
+            } else {
+                t->col++;
+            }
+        }
+    }
+}
+
+// The screen as rows joined by '|', trailing blanks and empty rows dropped
+static void term_text(const term_t *t, char *out)
+{
+    size_t n = 0, keep = 0;
+    for (int row = 0; row < TERM_ROWS; row++) {
+        int len = t->cols;
+        while (len > 0 && t->cell[row][len - 1] == ' ') {
+            len--;
+        }
+        if (row > 0) {
+            out[n++] = '|';
+        }
+        memcpy(out + n, t->cell[row], len);
+        n += len;
+        keep = len ? n : keep;
+    }
+    out[keep] = '\0';
+}
+
+// Type `in` (terminal bytes) into le; returns the last result and the line
+// it left. Stops at the first commit, cancel or EOF. With a terminal, all
+// the output is drawn on it.
+static le_result_t type_on(line_edit_t *le, const char *in, char *line, size_t size, term_t *term)
+{
+    static char out[LE_OUT_MAX];
+    vt_parser_t p = { 0 };
+    key_event_t keys[VT_EVENTS_MAX];
+    le_result_t r = LE_EDITING;
+    uint32_t at_ms = 0;
+    size_t out_len;
+
+    out_len = le_start(le, out);
+    if (term) {
+        term_write(term, out, out_len);
+    }
+    for (const char *c = in; *c && r == LE_EDITING; c++) {
+        int n = vt_feed(&p, *c, at_ms, keys);
+        for (int i = 0; i < n && r == LE_EDITING; i++) {
+            r = le_key(le, &keys[i], out, &out_len);
+            if (out_len > LE_OUT_MAX) {
+                printf("FAIL %-28s output overflow: %zu bytes\n", in, out_len);
+                failed++;
+            }
+            if (term) {
+                term_write(term, out, out_len);
+            }
+        }
+    }
+    // A lone ESC at the end goes out once input is quiet
+    int n = vt_flush(&p, at_ms + VT_ESC_TIMEOUT_MS + 1, keys);
+    if (n && r == LE_EDITING) {
+        r = le_key(le, &keys[0], out, &out_len);
+    }
+    snprintf(line, size, "%s", le->line);
+    return r;
+}
+
+static le_result_t type(line_edit_t *le, const char *in, char *line, size_t size)
+{
+    return type_on(le, in, line, size, NULL);
+}
+
+static void check(const char *name, line_edit_t *le, const char *in, le_result_t want, const char *want_line)
+{
+    char line[LE_LINE_MAX];
+    le_result_t r = type(le, in, line, sizeof(line));
+    checked++;
+    if (r != want || (want == LE_COMMIT && strcmp(line, want_line) != 0)) {
+        printf("FAIL %-28s got %s \"%s\", want %s \"%s\"\n", name, result_names[r], line,
+               result_names[want], want_line);
+        failed++;
+    }
+}
+
+// Type `in` on a fresh `cols`-wide terminal and compare the screen and cursor
+static void check_screen(const char *name, line_edit_t *le, int cols, const char *in, const char *want,
+                         int want_row, int want_col)
+{
+    static term_t term;
+    char line[LE_LINE_MAX], screen[TERM_ROWS * (TERM_COLS_MAX + 1) + 1];
+    term_init(&term, cols);
+    type_on(le, in, line, sizeof(line), &term);
+    term_text(&term, screen);
+    checked++;
+    if (strcmp(screen, want) != 0 || term.row != want_row || term.col != want_col) {
+        printf("FAIL %-28s got \"%s\" at %d,%d, want \"%s\" at %d,%d\n", name, screen, term.row,
+               term.col, want, want_row, want_col);
+        failed++;
+    }
+}
+
+static void check_count(const char *name, uint32_t got, uint32_t want)
+{
+    checked++;
+    if (got != want) {
+        printf("FAIL %-28s got %u, want %u\n", name, (unsigned)got, (unsigned)want);
+        failed++;
+    }
+}
+
+int main(void)
+{
+    static line_edit_t le;
+
+    le_init(&le, "> ", 0);
+    check("plain", &le, "ls -l\r", LE_COMMIT, "ls -l");
+    check_count("plain: keys", le.keys, 6);
+    check_count("plain: edits", le.edits, 0);
+
+    le_init(&le, "> ", 0);
+    check("backspace", &le, "lss\x7f -l\r", LE_COMMIT, "ls -l");
+    check("insert after left", &le, "helo\x1b[Dl\r", LE_COMMIT, "hello");
+    check("home and end", &le, "cho hi\x1b[He\x1b[F!\r", LE_COMMIT, "echo hi!");
+    check("ctrl-a, ctrl-e", &le, "b\x01" "a\x05" "c\r", LE_COMMIT, "abc");
+    check("delete", &le, "abXc\x1b[D\x1b[D\x1b[3~\r", LE_COMMIT, "abc");
+    check("ctrl-w", &le, "rm -rf build\x17" "dist\r", LE_COMMIT, "rm -rf dist");
+    check("ctrl-u then ctrl-y", &le, "wrong\x15right \x19\r", LE_COMMIT, "right wrong");
+    check("ctrl-k", &le, "keep drop\x1b" "b\x0b\r", LE_COMMIT, "keep ");
+    check("alt-f", &le, "one two\x01\x1b" "f!\r", LE_COMMIT, "one! two");
+    check("cr", &le, "x\r", LE_COMMIT, "x");
+    check("lf of crlf is no line", &le, "\ny\r", LE_COMMIT, "y");
+
+    le_init(&le, "> ", 0);
+    check("first", &le, "make\r", LE_COMMIT, "make");
+    check("second", &le, "make flash\r", LE_COMMIT, "make flash");
+    check("up recalls", &le, "\x1b[A\r", LE_COMMIT, "make flash");
+    check_count("repeat not kept twice", le.committed, 2);
+    check("up twice", &le, "\x1b[A\x1b[A\r", LE_COMMIT, "make");
+    check("down restores draft", &le, "dra\x1b[A\x1b[Bft\r", LE_COMMIT, "draft");
+    check("up stops at oldest", &le, "\x1b[A\x1b[A\x1b[A\x1b[A\x1b[A\r", LE_COMMIT, "make");
+    check("recall then edit", &le, "\x1b[A monitor\r", LE_COMMIT, "make monitor");
+
+    le_init(&le, "> ", 0);
+    check("ctrl-c drops", &le, "oops\x03", LE_CANCEL, "");
+    check("ctrl-d on empty", &le, "\x04", LE_EOF, "");
+    check("ctrl-d deletes", &le, "ab\x1b[D\x04\r", LE_COMMIT, "a");
+    check("tab ignored", &le, "a\tb\r", LE_COMMIT, "ab");
+    check("lone esc ignored", &le, "ab\x1b", LE_EDITING, "");
+
+    le_init(&le, "> ", 0);
+    char longer[LE_LINE_MAX + 16];
+    memset(longer, 'x', sizeof(longer) - 2);
+    longer[sizeof(longer) - 2] = '\r';
+    longer[sizeof(longer) - 1] = '\0';
+    char want[LE_LINE_MAX];
+    memset(want, 'x', LE_LINE_MAX - 1);
+    want[LE_LINE_MAX - 1] = '\0';
+    check("full line stops", &le, longer, LE_COMMIT, want);
+
+    le_init(&le, "> ", 0);
+    for (int i = 0; i < LE_HISTORY + 4; i++) {
+        char in[16];
+        snprintf(in, sizeof(in), "cmd%d\r", i);
+        type(&le, in, (char[LE_LINE_MAX]){ 0 }, LE_LINE_MAX);
+    }
+    char oldest[16];
+    snprintf(oldest, sizeof(oldest), "cmd%d", 4);
+    char ups[4 * (LE_HISTORY + 4) + 2] = "";
+    for (int i = 0; i < LE_HISTORY + 4; i++) {
+        strcat(ups, "\x1b[A");
+    }
+    strcat(ups, "\r");
+    check("history keeps the last 16", &le, ups, LE_COMMIT, oldest);
+
+    // 10 columns: the prompt and 8 characters fill the first row
+    static const char alpha[] = "abcdefghijklmnopqrstuvwxy";
+    char in[64];
+    le_init(&le, "> ", 10);
+    check_screen("wrap: typed", &le, 10, alpha, "> abcdefgh|ijklmnopqr|stuvwxy", 2, 7);
+    check_screen("wrap: row filled exactly", &le, 10, "abcdefgh", "> abcdefgh", 1, 0);
+    check_screen("wrap: backspace over a row", &le, 10, "abcdefghi\x7f\x7f", "> abcdefg", 0, 9);
+    check_screen("wrap: left over a row", &le, 10, "abcdefghij\x1b[D\x1b[D\x1b[DZ", "> abcdefgZ|hij", 1, 0);
+    snprintf(in, sizeof(in), "%s\x01X", alpha);
+    check_screen("wrap: insert at home", &le, 10, in, "> Xabcdefg|hijklmnopq|rstuvwxy", 0, 3);
+    snprintf(in, sizeof(in), "%s\x15", alpha);
+    check_screen("wrap: cut to one row", &le, 10, in, ">", 0, 2);
+    snprintf(in, sizeof(in), "%s\x1b[H\x1b" "f", alpha);
+    check_screen("wrap: end of word", &le, 10, in, "> abcdefgh|ijklmnopqr|stuvwxy", 2, 7);
+    snprintf(in, sizeof(in), "%s\x01\r", alpha);
+    check_screen("wrap: enter from home", &le, 10, in, "> abcdefgh|ijklmnopqr|stuvwxy", 3, 0);
+    check_screen("wrap: recall over short", &le, 10, "x\x1b[A", "> abcdefgh|ijklmnopqr|stuvwxy", 2, 7);
+    check_screen("wrap: recall back", &le, 10, "xy\x1b[A\x1b[B", "> xy", 0, 4);
+    snprintf(in, sizeof(in), "%s\x01\x03", alpha);
+    check_screen("wrap: ctrl-c from home", &le, 10, in, "> abcdefgh|ijklmnopqr|stuvwxy^C", 3, 0);
+    snprintf(in, sizeof(in), "%s\x0c", alpha);
+    check_screen("wrap: ctrl-l", &le, 10, in, "> abcdefgh|ijklmnopqr|stuvwxy", 2, 7);
+
+    printf("%d of %d checks passed\n", checked - failed, checked);
+    return failed ? 1 : 0;
+}
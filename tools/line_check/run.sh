@@ -0,0 +1,13 @@
+#!/bin/sh
+# Build the line editor checker for the host and run it.
+#
+#   tools/line_check/run.sh
+set -e
+
+cd "$(dirname "$0")/../.."
+
+mkdir -p build-host
+${CC:-cc} -O2 -std=c11 -D_POSIX_C_SOURCE=200809L -Wall -Wextra -Wno-sign-compare \
+    -I tools/vt_check -I main \
+    main/vt_input.c main/line_edit.c tools/line_check/line_check.c -o build-host/line_check
+exec build-host/line_check "$@"
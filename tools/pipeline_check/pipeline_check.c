@@ -0,0 +1,389 @@
+/*
+ * Check each stage of main/key_pipeline.c on the host, then time them.
+ *
+ * Every case feeds one stage a batch and compares what comes out, written in
+ * the same short form the failure messages use:
+ *
+ *     event    c'x'  k04  k04+02  m02:press     character, keycode+modifier, modifier key
+ *     stroke   tap04+02  press04  release:02
+ *     report   D02[04]  U00[]  C00[04 05]        Down, Up or Change, modifier, keys
+ *
+ * With -b, the benchmark pushes that many MB of mixed text and escape
+ * sequences through every stage in 4 KB batches and reports each stage's
+ * throughput on its own, then the whole pipeline's.
+ *
+ *     tools/pipeline_check/run.sh           # check every stage
+ *     tools/pipeline_check/run.sh -b 64     # and time 64 MB through them
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hid_usage.h"
+#include "key_pipeline.h"
+
+#define BATCH 4096
+#define OUT_MAX 64
+
+static const char *const action_names[] = { "tap", "press", "release" };
+static const char report_kinds[] = "DUC";
+
+static int failed = 0;
+static int checked = 0;
+
+static void format_events(const key_event_t *ev, size_t n, char *out, size_t size)
+{
+    static const char *const types[] = { "", ":press", ":repeat", ":release" };
+    size_t len = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i < n && len < size; i++) {
+        if (ev[i].mod_key) {
+            len += snprintf(out + len, size - len, " m%02x%s", ev[i].mod_key, types[ev[i].type]);
+        } else if (ev[i].keycode) {
+            len += snprintf(out + len, size - len, " k%02x", ev[i].keycode);
+            if (ev[i].modifier && len < size) {
+                len += snprintf(out + len, size - len, "+%02x", ev[i].modifier);
+            }
+            if (len < size) {
+                len += snprintf(out + len, size - len, "%s", types[ev[i].type]);
+            }
+        } else {
+            len += snprintf(out + len, size - len, " c'%c'", ev[i].c);
+        }
+    }
+}
+
+static void format_strokes(const kp_stroke_t *s, size_t n, char *out, size_t size)
+{
+    size_t len = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i < n && len < size; i++) {
+        if (s[i].keycode) {
+            len += snprintf(out + len, size - len, " %s%02x", action_names[s[i].action], s[i].keycode);
+            if (s[i].modifier && len < size) {
+                len += snprintf(out + len, size - len, "+%02x", s[i].modifier);
+            }
+        } else {
+            len += snprintf(out + len, size - len, " %s:%02x", action_names[s[i].action], s[i].modifier);
+        }
+    }
+}
+
+static void format_reports(const kp_report_t *r, size_t n, bool delays, char *out, size_t size)
+{
+    size_t len = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i < n && len < size; i++) {
+        len += snprintf(out + len, size - len, " %c%02x[", report_kinds[r[i].kind], r[i].modifier);
+        for (int k = 0; k < 6 && r[i].keys[k] && len < size; k++) {
+            len += snprintf(out + len, size - len, k ? " %02x" : "%02x", r[i].keys[k]);
+        }
+        if (len < size) {
+            len += snprintf(out + len, size - len, "]");
+        }
+        if (delays && len < size) {
+            len += snprintf(out + len, size - len, "%u", r[i].delay_ms);
+        }
+    }
+}
+
+static void expect(const char *stage, const char *name, const char *got, const char *want)
+{
+    checked++;
+    // Formatters start every item with a space
+    if (strcmp(got[0] ? got + 1 : got, want) != 0) {
+        failed++;
+        printf("%s: %s\n    expected: %s\n    got:      %s\n", stage, name, want, got[0] ? got + 1 : got);
+    }
+}
+
+static key_event_t ch(char c)
+{
+    return (key_event_t){ .c = c };
+}
+
+static key_event_t key(uint8_t keycode, uint8_t modifier, uint8_t type)
+{
+    return (key_event_t){ .keycode = keycode, .modifier = modifier, .type = type };
+}
+
+static key_event_t mod(uint8_t mod_key, uint8_t type)
+{
+    return (key_event_t){ .mod_key = mod_key, .type = type };
+}
+
+static void check_decode(void)
+{
+    static const struct {
+        const char *input;
+        const char *want;
+    } cases[] = {
+        { "ab", "c'a' c'b'" },
+        { "\x1b[A", "k52" },
+        { "\x1b[1;5C", "k4f+01" },
+        { "\x03", "k06+01" },
+        { "\x1b[97;1:3u", "k04:release" },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        vt_parser_t parser = { .exact = i == 4 };
+        key_event_t out[OUT_MAX];
+        char got[256];
+        size_t n = kp_decode(&parser, cases[i].input, strlen(cases[i].input), 0, out);
+        format_events(out, n, got, sizeof(got));
+        expect("decode", cases[i].want, got, cases[i].want);
+    }
+}
+
+static void check_normalize(void)
+{
+    key_event_t in[] = { ch('\r'), ch('\n'), ch('\t'), ch(0x7f), ch('\b'), ch(0x1b), ch(0x1c), ch('x'),
+                         key(HID_KEY_F1, 0, KEY_TAP) };
+    key_event_t out[OUT_MAX];
+    char got[256];
+    size_t n = kp_normalize(in, sizeof(in) / sizeof(in[0]), out);
+    format_events(out, n, got, sizeof(got));
+    expect("normalize", "control characters", got, "k28 k28 k2b k2a k2a k29 c'x' k3a");
+}
+
+static void check_map(void)
+{
+    kp_layout_t us;
+    kp_layout_us(&us);
+    key_event_t in[] = { ch('a'), ch('A'), ch('~'), ch('`'), ch(' '), ch('1'), ch('!'), ch((char)0xe9),
+                         key(HID_KEY_ARROW_UP, KEYBOARD_MODIFIER_LEFTCTRL, KEY_TAP), mod(0x02, KEY_PRESS) };
+    key_event_t out[OUT_MAX];
+    char got[256];
+    size_t n = kp_map(&us, in, sizeof(in) / sizeof(in[0]), out);
+    format_events(out, n, got, sizeof(got));
+    expect("map", "us layout", got, "k04 k04+02 k35+02 k35 k2c k1e k1e+02 k52+01 m02:press");
+
+    // In place, as the firmware calls it
+    n = kp_map(&us, in, sizeof(in) / sizeof(in[0]), in);
+    format_events(in, n, got, sizeof(got));
+    expect("map", "in place", got, "k04 k04+02 k35+02 k35 k2c k1e k1e+02 k52+01 m02:press");
+}
+
+static void check_plan(void)
+{
+    key_event_t in[] = { key(HID_KEY_A, 0x02, KEY_TAP), key((HID_KEY_A + 1), 0, KEY_PRESS), key((HID_KEY_A + 1), 0, KEY_REPEAT),
+                         key((HID_KEY_A + 1), 0, KEY_RELEASE), mod(0x01, KEY_PRESS), mod(0x01, KEY_RELEASE), ch('z') };
+    kp_stroke_t out[OUT_MAX];
+    char got[256];
+    size_t n = kp_plan(in, sizeof(in) / sizeof(in[0]), out);
+    format_strokes(out, n, got, sizeof(got));
+    expect("plan", "taps, presses, modifiers", got, "tap04+02 press05 press05 release05 press:01 release:01");
+}
+
+static void check_pack(void)
+{
+    static const struct {
+        const char *name;
+        kp_stroke_t strokes[8];
+        size_t count;
+        const char *want;
+    } cases[] = {
+        { "tap", { { HID_KEY_A, 0x02, KP_TAP } }, 1, "D02[04] U00[]" },
+        { "repeat folds into the press",
+          { { (HID_KEY_A + 1), 0, KP_PRESS }, { (HID_KEY_A + 1), 0, KP_PRESS }, { (HID_KEY_A + 1), 0, KP_RELEASE } }, 3,
+          "C00[05] C00[]" },
+        { "chord over a held modifier",
+          { { 0, 0x01, KP_PRESS }, { (HID_KEY_A + 2), 0, KP_TAP }, { 0, 0x01, KP_RELEASE } }, 3,
+          "C01[] D01[06] U01[] C00[]" },
+        { "rollover",
+          { { HID_KEY_A, 0, KP_PRESS }, { (HID_KEY_A + 1), 0, KP_PRESS }, { HID_KEY_A, 0, KP_RELEASE },
+            { (HID_KEY_A + 1), 0, KP_RELEASE } }, 4,
+          "C00[04] C00[04 05] C00[05] C00[]" },
+        { "release of a key not held", { { HID_KEY_A, 0, KP_RELEASE } }, 1, "" },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        kp_packer_t packer = { 0 };
+        kp_report_t out[OUT_MAX];
+        char got[256];
+        size_t n = kp_pack(&packer, cases[i].strokes, cases[i].count, out);
+        format_reports(out, n, false, got, sizeof(got));
+        expect("pack", cases[i].name, got, cases[i].want);
+    }
+}
+
+static void check_schedule(void)
+{
+    kp_report_t in[] = { { .kind = KP_REPORT_DOWN, .keys = { HID_KEY_A } }, { .kind = KP_REPORT_UP },
+                         { .kind = KP_REPORT_CHANGE, .modifier = 0x02 } };
+    const kp_timing_t timing = { 30, 20 };
+    kp_report_t out[OUT_MAX];
+    char got[256];
+    size_t n = kp_schedule(&timing, in, 3, out);
+    format_reports(out, n, true, got, sizeof(got));
+    expect("schedule", "hold, gap, none", got, "D00[04]30 U00[]20 C02[]0");
+}
+
+// Everything after decode, as the firmware runs it for typed text
+static size_t run_stages(const kp_layout_t *layout, const kp_timing_t *timing, key_event_t *events, size_t n,
+                         kp_stroke_t *strokes, kp_report_t *reports)
+{
+    kp_packer_t packer = { 0 };
+    n = kp_normalize(events, n, events);
+    n = kp_map(layout, events, n, events);
+    n = kp_plan(events, n, strokes);
+    n = kp_pack(&packer, strokes, n, reports);
+    return kp_schedule(timing, reports, n, reports);
+}
+
+static void check_pipeline(void)
+{
+    kp_layout_t us;
+    kp_layout_us(&us);
+    const kp_timing_t timing = { 50, 10 };
+    const char *input = "Hi\r\x1b[B";
+    vt_parser_t parser = { 0 };
+    key_event_t events[OUT_MAX];
+    kp_stroke_t strokes[OUT_MAX];
+    kp_report_t reports[OUT_MAX * KP_REPORTS_PER_STROKE];
+    char got[512];
+
+    size_t n = kp_decode(&parser, input, strlen(input), 0, events);
+    n = run_stages(&us, &timing, events, n, strokes, reports);
+    format_reports(reports, n, true, got, sizeof(got));
+    expect("pipeline", "Hi, Enter, Down", got, "D02[0b]50 U00[]10 D00[0c]50 U00[]10 D00[28]50 U00[]10 D00[51]50 U00[]10");
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Source text with the cursor and editing keys a session sends between lines
+static size_t bench_input(char *buf, size_t size)
+{
+    static const char *const lines[] = {
+        "for (int i = 0; i < count; i++) {\r",
+        "\tsum += values[i] * 2; // Running total\r",
+        "}\r",
+        "\x1b[A\x1b[1;5C\x7f\x7f",
+        "echo \"Build OK: $(date +%H:%M)\" >> ~/log.txt\r",
+        "\x1b[3~\x1bOH",
+    };
+    size_t len = 0;
+    for (int i = 0; len < size; i = (i + 1) % 6) {
+        size_t line = strlen(lines[i]);
+        if (line > size - len) {
+            line = size - len;
+        }
+        memcpy(buf + len, lines[i], line);
+        len += line;
+    }
+    return len;
+}
+
+static void bench_report(const char *stage, size_t items, const char *unit, size_t bytes, double elapsed)
+{
+    printf("bench: %-10s %7.1f MB/s of input, %7.1f M %s/s, %6.2f ns/byte\n", stage,
+           bytes / elapsed / (1024 * 1024), items / elapsed / 1e6, unit, elapsed * 1e9 / bytes);
+}
+
+static void bench(double megabytes)
+{
+    size_t total = (size_t)(megabytes * 1024 * 1024);
+    size_t rounds = total / BATCH ? total / BATCH : 1;
+    char *input = malloc(BATCH);
+    key_event_t *decoded = malloc(BATCH * VT_EVENTS_MAX * sizeof(key_event_t));
+    key_event_t *events = malloc(BATCH * VT_EVENTS_MAX * sizeof(key_event_t));
+    kp_stroke_t *strokes = malloc(BATCH * VT_EVENTS_MAX * sizeof(kp_stroke_t));
+    kp_report_t *packed = malloc(BATCH * VT_EVENTS_MAX * KP_REPORTS_PER_STROKE * sizeof(kp_report_t));
+    kp_report_t *reports = malloc(BATCH * VT_EVENTS_MAX * KP_REPORTS_PER_STROKE * sizeof(kp_report_t));
+    kp_layout_t us;
+    kp_layout_us(&us);
+    const kp_timing_t timing = { 50, 10 };
+    size_t len = bench_input(input, BATCH);
+    size_t bytes = rounds * len;
+
+    // Each stage runs over the previous stage's output for one batch, so it
+    // is timed on its own
+    vt_parser_t parser = { 0 };
+    size_t n_decoded = 0, n_normal = 0, n_mapped = 0, n_strokes = 0, n_packed = 0, items = 0;
+    double start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        items += n_decoded = kp_decode(&parser, input, len, 0, decoded);
+    }
+    bench_report("decode", items, "events", bytes, now_s() - start);
+
+    items = 0;
+    start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        items += n_normal = kp_normalize(decoded, n_decoded, events);
+    }
+    bench_report("normalize", items, "events", bytes, now_s() - start);
+
+    items = 0;
+    start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        // Into decoded, which is done with, so every round maps the same input
+        items += n_mapped = kp_map(&us, events, n_normal, decoded);
+    }
+    bench_report("map", items, "events", bytes, now_s() - start);
+
+    items = 0;
+    start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        items += n_strokes = kp_plan(decoded, n_mapped, strokes);
+    }
+    bench_report("plan", items, "strokes", bytes, now_s() - start);
+
+    items = 0;
+    start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        kp_packer_t packer = { 0 };
+        items += n_packed = kp_pack(&packer, strokes, n_strokes, packed);
+    }
+    bench_report("pack", items, "reports", bytes, now_s() - start);
+
+    items = 0;
+    start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        items += kp_schedule(&timing, packed, n_packed, reports);
+    }
+    bench_report("schedule", items, "reports", bytes, now_s() - start);
+
+    items = 0;
+    start = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        size_t n = kp_decode(&parser, input, len, 0, events);
+        items += run_stages(&us, &timing, events, n, strokes, reports);
+    }
+    bench_report("pipeline", items, "reports", bytes, now_s() - start);
+
+    free(input);
+    free(decoded);
+    free(events);
+    free(strokes);
+    free(packed);
+    free(reports);
+}
+
+int main(int argc, char **argv)
+{
+    double bench_mb = 0;
+    if (argc == 3 && strcmp(argv[1], "-b") == 0) {
+        bench_mb = atof(argv[2]);
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-b megabytes]\n", argv[0]);
+        return 2;
+    }
+
+    check_decode();
+    check_normalize();
+    check_map();
+    check_plan();
+    check_pack();
+    check_schedule();
+    check_pipeline();
+    printf("%d checks, %d failed\n", checked, failed);
+
+    if (bench_mb > 0) {
+        bench(bench_mb);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Build the report pipeline checker for the host and run it. Arguments are
+# passed on, e.g. -b 64 to also time 64 MB through each stage.
+#
+#   tools/pipeline_check/run.sh
+#   tools/pipeline_check/run.sh -b 64
+set -e
+
+cd "$(dirname "$0")/../.."
+
+mkdir -p build-host
+${CC:-cc} -O2 -std=c11 -D_POSIX_C_SOURCE=200809L -Wall -Wextra -Wno-sign-compare \
+    -I tools/vt_check -I main \
+    main/vt_input.c main/key_pipeline.c tools/pipeline_check/pipeline_check.c -o build-host/pipeline_check
+exec build-host/pipeline_check "$@"
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""
+Measure how far an auto-repeated key overshoots after the repeat stops.
+
+The device plays a terminal's auto-repeat stream for one key ('selftest
+repeat' over SSH), once held down so the target host's own typematic repeat
+does the work, and once typed key by key. This tool captures the keys in a
+focused raw terminal on the target host, timestamps each one, and reports per
+pass how many keys arrived beyond the ones sent and how long after the last
+expected key the stream kept going.
+
+    tools/repeat_check.py
+    ssh admin@<device_ip> selftest repeat key=right rate=30 count=40
+
+A held key overshoots by the host's repeat rate times the device's release
+time. A stream typed key by key arrives exactly, but late: the keys queue up
+behind the device's own pacing.
+"""
+
+import argparse
+import os
+import re
+import select
+import sys
+import termios
+import time
+import tty
+
+CTRL_C = b"\x03"
+
+HEADER = re.compile(rb"@@repeat (\w+) (\w+) (\d+) (\d+)\r")
+END = b"\r@@end\r"
+ECHO = {
+    "right": (b"\x1b[C", b"\x1bOC"),
+    "left": (b"\x1b[D", b"\x1bOD"),
+    "up": (b"\x1b[A", b"\x1bOA"),
+    "down": (b"\x1b[B", b"\x1bOB"),
+    "bs": (b"\x7f", b"\x08"),
+}
+
+
+def capture(fd, quiet, passes):
+    """Read keys until Ctrl-C or `passes` passes ended; (byte, time) pairs."""
+    keys = []
+    ended = 0
+    while ended < passes:
+        ready, _, _ = select.select([fd], [], [], 0.5)
+        if not ready:
+            continue
+        data = os.read(fd, 1024)
+        now = time.monotonic()
+        if not data or CTRL_C in data:
+            break
+        keys += [(b, now) for b in data]
+        if END in data or bytes(k[0] for k in keys[-len(END):]) == END:
+            ended += 1
+            if not quiet:
+                sys.stderr.write("pass %d captured\r\n" % ended)
+    return keys
+
+
+def analyse(keys):
+    """Find each pass in the capture and measure its key echoes."""
+    data = bytes(k[0] for k in keys)
+    results = []
+    for m in HEADER.finditer(data):
+        mode, key, rate, count = m.group(1).decode(), m.group(2).decode(), int(m.group(3)), int(m.group(4))
+        end = data.find(END, m.end())
+        if end < 0:
+            end = len(data)
+        times = []
+        pos = m.end()
+        while pos < end:
+            echo = next((e for e in ECHO.get(key, ()) if data.startswith(e, pos)), None)
+            if echo:
+                times.append(keys[pos][1])
+                pos += len(echo)
+            else:
+                pos += 1
+        expected_ms = (count - 1) * 1000.0 / rate
+        span_ms = (times[-1] - times[0]) * 1000.0 if len(times) > 1 else 0.0
+        results.append({
+            "mode": mode, "key": key, "rate": rate, "count": count,
+            "received": len(times), "overshoot": len(times) - count,
+            "tail_ms": span_ms - expected_ms, "complete": end < len(data),
+        })
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--passes", type=int, default=2,
+                        help="stop after this many passes (default 2, for mode=both)")
+    parser.add_argument("-q", "--quiet", action="store_true")
+    args = parser.parse_args()
+
+    fd = sys.stdin.fileno()
+    saved = termios.tcgetattr(fd)
+    tty.setraw(fd)
+    try:
+        if not args.quiet:
+            sys.stderr.write("capturing; start 'selftest repeat' on the device (Ctrl-C to stop)\r\n")
+        keys = capture(fd, args.quiet, args.passes)
+    finally:
+        termios.tcsetattr(fd, termios.TCSADRAIN, saved)
+
+    results = analyse(keys)
+    if not results:
+        print("no '@@repeat' marker captured")
+        return 1
+    print("%-7s %-6s %5s %5s %8s %9s %9s" % ("mode", "key", "rate", "sent", "received", "overshoot", "tail ms"))
+    for r in results:
+        print("%-7s %-6s %5d %5d %8d %+9d %9.0f%s" % (
+            r["mode"], r["key"], r["rate"], r["count"], r["received"], r["overshoot"], r["tail_ms"],
+            "" if r["complete"] else "  (incomplete)"))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
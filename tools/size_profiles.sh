@@ -0,0 +1,30 @@
+#!/bin/sh
+# Build every crypto profile into its own build directory and print the
+# flash / static RAM summary of each. Per-handshake heap is reported by the
+# running device: `ssh admin@<ip> stats` ("handshakes ... heap avg/max").
+#
+#   tools/size_profiles.sh            # full and minimal
+#   tools/size_profiles.sh minimal
+set -e
+
+cd "$(dirname "$0")/.."
+
+profiles="${*:-full minimal}"
+
+for profile in $profiles; do
+    case "$profile" in
+        full)    defaults="sdkconfig.defaults" ;;
+        minimal) defaults="sdkconfig.defaults;sdkconfig.crypto-min" ;;
+        *) echo "unknown profile: $profile" >&2; exit 1 ;;
+    esac
+
+    build_dir="build-crypto-$profile"
+    echo "=== $profile ($defaults) ==="
+    idf.py -B "$build_dir" -D SDKCONFIG="$build_dir/sdkconfig" \
+        -D SDKCONFIG_DEFAULTS="$defaults" build > "$build_dir.log" 2>&1 ||
+        { echo "build failed, see $build_dir.log" >&2; exit 1; }
+    idf.py -B "$build_dir" -D SDKCONFIG="$build_dir/sdkconfig" size
+    idf.py -B "$build_dir" -D SDKCONFIG="$build_dir/sdkconfig" size-components |
+        grep -E "mbedtls|libssh|Archive" || true
+    echo
+done
@@ -0,0 +1,426 @@
+#!/usr/bin/env python3
+"""
+Measure typing accuracy per rate and pacing profile from a self-test sweep.
+
+The device types a deterministic pseudo-random corpus once per pacing
+profile and rate ('selftest sweep' over SSH). This tool captures what
+arrived on the target host, regenerates the same corpus, and reports the
+error rate of every step plus the highest rate each profile typed cleanly.
+
+Capture in a focused terminal on the target host, then start the sweep:
+
+    tools/sweep_check.py --host-class thinkpad-x1 --table pacing.tsv
+    ssh admin@<device_ip> selftest sweep rates=10,20,30,40,50
+
+Or analyse text an editor saved (use esc=0 on the device for editors):
+
+    tools/sweep_check.py --input captured.txt
+
+A sweep run with app=<profile> is checked against the corpus as that
+profile normalizes it, with the profile's guard keys stripped.
+
+--uinput runs the same sweep locally through a virtual keyboard
+(/dev/uinput, needs root). It measures the host's own input path with no
+device attached.
+"""
+
+import argparse
+import datetime
+import difflib
+import fcntl
+import os
+import re
+import struct
+import sys
+import termios
+import threading
+import time
+import tty
+
+HID_POLL_INTERVAL_MS = 10
+PACING_MAX_CPS = 1000 // (2 * HID_POLL_INTERVAL_MS)
+PROFILES = ("hold", "even", "tap")
+DEFAULT_HOLD_MS, DEFAULT_GAP_MS = 50, 10
+CTRL_C = "\x03"
+
+HEADER = re.compile(r"@@sweep (\d+) (\w+) (\d+) (\d+) (\d+) ([01])(?: (\w+))?\n")
+
+# Application profiles; mirrors app_profiles[] in the firmware
+NORM_CRLF, NORM_INDENT, NORM_DISMISS, NORM_BLOCKS, NORM_TABS = 0x01, 0x02, 0x04, 0x08, 0x10
+TAB_WIDTH = 8
+APPS = {
+    "raw": ("", "", 0),
+    "shell": ("\x1b[200~", "\x1b[201~", NORM_CRLF),
+    "vim": ("\x1b:set paste\ra", "\x1b:set nopaste\ra", NORM_CRLF),
+    "nano": ("\x1b[200~", "\x1b[201~", NORM_CRLF),
+    "python": ("", "\n", NORM_CRLF | NORM_BLOCKS | NORM_TABS),
+    "vscode": ("", "", NORM_CRLF | NORM_INDENT | NORM_DISMISS),
+}
+CONTINUES = re.compile(r"(else|elif|except|finally)(?![A-Za-z0-9_])")
+
+
+def step_seed(seed, step):
+    x = (seed * 2654435761 + step + 1) & 0xffffffff
+    return x or 1
+
+
+def corpus(seed, step, length, esc=True):
+    """The text of one step; mirrors sweep_corpus_char() in the firmware."""
+    extra = "\n\t\x1b"
+    count = 95 + (3 if esc else 2)
+    x = step_seed(seed, step)
+    out = []
+    for _ in range(length):
+        x ^= (x << 13) & 0xffffffff
+        x ^= x >> 17
+        x ^= (x << 5) & 0xffffffff
+        r = x % count
+        out.append(chr(0x20 + r) if r < 95 else extra[r - 95])
+    return "".join(out)
+
+
+def is_space(c):
+    return c in " \t\r"
+
+
+def normalize(app, text):
+    """The keys a profile types for text; mirrors app_normalize() in the firmware."""
+    norm = APPS[app][2]
+    out = []
+    bol = lead = True
+    indented = prev_indented = False
+    col = 0
+    i = 0
+    while i < len(text):
+        c = text[i]
+        line_end = text.find("\n", i)
+        rest = text[i:line_end if line_end >= 0 else len(text)]
+        inserted = 0
+        keys = []
+        skip = False
+        if norm & NORM_CRLF and c == "\r" and text[i + 1:i + 2] == "\n":
+            skip = True
+        elif norm & NORM_BLOCKS and lead and all(is_space(r) for r in rest):
+            skip = True
+        else:
+            if norm & NORM_BLOCKS and bol:
+                indented = is_space(c)
+                if not indented and prev_indented and not CONTINUES.match(text, i):
+                    keys.append("\n")
+                    inserted = 1
+            if norm & NORM_INDENT and lead and is_space(c):
+                skip = True
+            elif norm & NORM_TABS and lead and c == "\t":
+                keys.extend(" " * (TAB_WIDTH - col % TAB_WIDTH))
+                c = None
+            elif norm & NORM_DISMISS and c in "\n\t" and not inserted:
+                keys.append("\x1b")
+        if not skip and c is not None:
+            keys.append(c)
+        out.extend(keys)
+
+        c = text[i]
+        if c == "\n":
+            if not lead:
+                prev_indented = indented
+            bol = lead = True
+            col = 0
+        else:
+            bol = False
+            lead = lead and is_space(c)
+            col += TAB_WIDTH - col % TAB_WIDTH if c == "\t" else 1
+        i += 1
+    return "".join(out)
+
+
+def pacing_for_rate(profile, cps):
+    """(hold_ms, gap_ms); mirrors pacing_for_rate() in the firmware."""
+    period = 1000 // cps
+    poll = HID_POLL_INTERVAL_MS
+    if profile == "hold":
+        hold = period - poll if period > 2 * poll else 0
+    elif profile == "even":
+        hold = period // 2
+    else:
+        hold = poll
+    hold = max(hold, poll)
+    gap = period - hold if period >= hold + poll else poll
+    return hold, gap
+
+
+def count_errors(expected, got):
+    """Edit operations needed to turn expected into got."""
+    matcher = difflib.SequenceMatcher(None, expected, got, autojunk=False)
+    return sum(max(i2 - i1, j2 - j1) for op, i1, i2, j1, j2 in matcher.get_opcodes() if op != "equal")
+
+
+class Step:
+    def __init__(self, match, body, end_found):
+        self.index = int(match.group(1))
+        self.profile = match.group(2)
+        self.cps = int(match.group(3))
+        self.seed = int(match.group(4))
+        self.length = int(match.group(5))
+        self.esc = match.group(6) == "1"
+        self.app = match.group(7) or "raw"
+        self.body = body
+        self.end_found = end_found
+        self.errors = None
+
+    def check(self):
+        expected = corpus(self.seed, self.index, self.length, self.esc)
+        body = self.body
+        if self.app in APPS:
+            preamble, postamble, norm = APPS[self.app]
+            expected = normalize(self.app, expected)
+            preamble, postamble = (g.replace("\r", "\n") for g in (preamble, postamble))
+            if preamble and body.startswith(preamble):
+                body = body[len(preamble):]
+            if postamble and body.endswith(postamble):
+                body = body[:-len(postamble)]
+            if norm & NORM_DISMISS:
+                expected, body = expected.replace("\x1b", ""), body.replace("\x1b", "")
+        self.errors = count_errors(expected, body)
+        if not self.end_found:
+            self.errors = max(self.errors, 1)
+
+    @property
+    def error_rate(self):
+        return self.errors / float(self.length)
+
+
+def parse_capture(text):
+    """Split a capture into steps. CR from Enter is read as LF."""
+    text = text.replace("\r\n", "\n").replace("\r", "\n")
+    headers = list(HEADER.finditer(text))
+    steps = []
+    for i, match in enumerate(headers):
+        limit = headers[i + 1].start() if i + 1 < len(headers) else len(text)
+        done = text.find("\n@@done", match.end(), limit)
+        limit = done if done >= 0 else limit
+        end_marker = "\n@@end %s\n" % match.group(1)
+        end = text.find(end_marker, match.end(), limit + len(end_marker))
+        body = text[match.end():end if end >= 0 else limit]
+        steps.append(Step(match, body, end >= 0))
+    return steps
+
+
+def max_safe_rates(steps, threshold):
+    """Highest rate per profile at which it and every slower step stayed within threshold."""
+    result = {}
+    for profile in PROFILES:
+        safe = 0
+        for step in sorted((s for s in steps if s.profile == profile), key=lambda s: s.cps):
+            if step.error_rate > threshold:
+                break
+            safe = step.cps
+        if any(s.profile == profile for s in steps):
+            result[profile] = safe
+    return result
+
+
+def report(steps, threshold):
+    rates = sorted({s.cps for s in steps})
+    print("%-6s" % "cps" + "".join("%9d" % r for r in rates))
+    for profile in PROFILES:
+        row = {s.cps: s for s in steps if s.profile == profile}
+        if not row:
+            continue
+        cells = []
+        for r in rates:
+            step = row.get(r)
+            cells.append("%8.2f%%" % (100.0 * step.error_rate) if step else "%9s" % "-")
+        print("%-6s" % profile + "".join(cells))
+    for step in steps:
+        if not step.end_found:
+            print("step %d (%s %d cps): end marker lost" % (step.index, step.profile, step.cps))
+
+    safe = max_safe_rates(steps, threshold)
+    print("\nmax safe rate (error rate <= %.2f%%):" % (100.0 * threshold))
+    for profile, cps in safe.items():
+        print("  %-5s %s" % (profile, "%d cps" % cps if cps else "none"))
+    return safe
+
+
+def update_table(path, host_class, safe, steps):
+    """Replace this host class's rows in a TSV table of max safe rates."""
+    rows = []
+    if os.path.exists(path):
+        with open(path) as f:
+            rows = [line.rstrip("\n").split("\t") for line in f if line.strip() and not line.startswith("#")]
+    rows = [row for row in rows if row[0] != host_class]
+    today = datetime.date.today().isoformat()
+    length = steps[0].length if steps else 0
+    for profile, cps in safe.items():
+        rows.append([host_class, profile, str(cps), str(length), today])
+    with open(path, "w") as f:
+        f.write("# host_class\tprofile\tmax_safe_cps\tstep_length\tmeasured\n")
+        for row in sorted(rows):
+            f.write("\t".join(row) + "\n")
+
+
+def capture_terminal(stop_event=None, save=None):
+    """Read keystrokes from this terminal in raw mode until @@done or Ctrl-C."""
+    fd = sys.stdin.fileno()
+    saved = termios.tcgetattr(fd)
+    tty.setraw(fd)
+    data = []
+    seen = 0
+    try:
+        sys.stderr.write("capturing; start the sweep now (Ctrl-C to stop)\r\n")
+        while True:
+            chunk = os.read(fd, 4096).decode("latin-1")
+            if CTRL_C in chunk:
+                data.append(chunk.split(CTRL_C)[0])
+                break
+            data.append(chunk)
+            text = "".join(data)
+            steps = text.count("@@end ")
+            if steps != seen:
+                seen = steps
+                sys.stderr.write("\r%d step(s) captured" % steps)
+            if "@@done" in text:
+                break
+    finally:
+        termios.tcsetattr(fd, termios.TCSADRAIN, saved)
+        sys.stderr.write("\n")
+        if stop_event:
+            stop_event.set()
+    text = "".join(data)
+    if save:
+        with open(save, "w", encoding="latin-1") as f:
+            f.write(text)
+    return text
+
+
+class UinputKeyboard:
+    """Minimal virtual US keyboard on /dev/uinput (legacy setup interface)."""
+
+    UI_SET_EVBIT = 0x40045564
+    UI_SET_KEYBIT = 0x40045565
+    UI_DEV_CREATE = 0x5501
+    UI_DEV_DESTROY = 0x5502
+    EV_SYN, EV_KEY = 0, 1
+    KEY_LEFTSHIFT = 42
+
+    ROWS = [("1234567890-=", 2), ("qwertyuiop[]", 16), ("asdfghjkl;'`", 30), ("\\zxcvbnm,./", 43)]
+    SHIFTED = dict(zip('!@#$%^&*()_+{}|:"~<>?', "1234567890-=[]\\;'`,./"))
+    SPECIAL = {"\x1b": 1, "\t": 15, "\n": 28, " ": 57, "\x7f": 14}
+
+    def __init__(self):
+        self.keys = dict(self.SPECIAL)
+        for chars, first in self.ROWS:
+            for i, c in enumerate(chars):
+                self.keys[c] = first + i
+        self.fd = os.open("/dev/uinput", os.O_WRONLY | os.O_NONBLOCK)
+        fcntl.ioctl(self.fd, self.UI_SET_EVBIT, self.EV_KEY)
+        for code in set(self.keys.values()) | {self.KEY_LEFTSHIFT}:
+            fcntl.ioctl(self.fd, self.UI_SET_KEYBIT, code)
+        os.write(self.fd, struct.pack("80sHHHHi256i", b"sweep-check loopback", 0x03, 0x303a, 0x4004, 1, 0,
+                                      *([0] * 256)))
+        fcntl.ioctl(self.fd, self.UI_DEV_CREATE)
+        time.sleep(1.0)   # let the desktop pick up the new device
+
+    def _emit(self, code, value):
+        now = time.time()
+        sec, usec = int(now), int((now % 1) * 1e6)
+        os.write(self.fd, struct.pack("llHHi", sec, usec, self.EV_KEY, code, value) +
+                 struct.pack("llHHi", sec, usec, self.EV_SYN, 0, 0))
+
+    def type(self, c, hold_ms, gap_ms):
+        shift = c.isupper() or c in self.SHIFTED
+        code = self.keys.get(self.SHIFTED.get(c, c.lower()))
+        if code is None:
+            return
+        if shift:
+            self._emit(self.KEY_LEFTSHIFT, 1)
+        self._emit(code, 1)
+        time.sleep(hold_ms / 1000.0)
+        self._emit(code, 0)
+        if shift:
+            self._emit(self.KEY_LEFTSHIFT, 0)
+        time.sleep(gap_ms / 1000.0)
+
+    def close(self):
+        fcntl.ioctl(self.fd, self.UI_DEV_DESTROY)
+        os.close(self.fd)
+
+
+def uinput_sweep(args, stop_event):
+    """Type the sweep into the focused window, as the firmware would."""
+    kbd = UinputKeyboard()
+    try:
+        def marker(text):
+            for c in text:
+                kbd.type(c, DEFAULT_HOLD_MS, DEFAULT_GAP_MS)
+
+        step = 0
+        for profile in args.profiles:
+            for cps in args.rates:
+                hold, gap = pacing_for_rate(profile, cps)
+                marker("\n@@sweep %d %s %d %d %d %d\n" % (step, profile, cps, args.seed, args.len, args.esc))
+                for c in corpus(args.seed, step, args.len, args.esc):
+                    if stop_event.is_set():
+                        return
+                    kbd.type(c, hold, gap)
+                marker("\n@@end %d\n" % step)
+                step += 1
+        marker("\n@@done\n")
+    finally:
+        kbd.close()
+
+
+def comma_list(kind):
+    return lambda text: [kind(v) for v in text.split(",") if v]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--input", help="analyse a saved capture instead of reading this terminal")
+    parser.add_argument("--save", help="also write the raw capture here")
+    parser.add_argument("--threshold", type=float, default=0.0,
+                        help="highest error rate still counted as safe, e.g. 0.001 (default 0)")
+    parser.add_argument("--host-class", help="label for this target host in the table")
+    parser.add_argument("--table", help="TSV table of max safe rates per host class to update")
+    parser.add_argument("--uinput", action="store_true", help="type the sweep locally through /dev/uinput")
+    parser.add_argument("--seed", type=int, default=1, help="uinput sweep seed")
+    parser.add_argument("--len", type=int, default=400, help="uinput sweep step length")
+    parser.add_argument("--rates", type=comma_list(int), default=[10, 20, 30, 40, 50])
+    parser.add_argument("--profiles", type=comma_list(str), default=list(PROFILES))
+    parser.add_argument("--no-esc", dest="esc", action="store_false", help="uinput corpus without ESC")
+    args = parser.parse_args()
+
+    if args.table and not args.host_class:
+        parser.error("--table needs --host-class")
+
+    if args.input:
+        with open(args.input, encoding="latin-1") as f:
+            text = f.read()
+    elif args.uinput:
+        stop = threading.Event()
+        typist = threading.Thread(target=uinput_sweep, args=(args, stop), daemon=True)
+        typist.start()
+        text = capture_terminal(stop, args.save)
+        typist.join(timeout=5)
+    else:
+        text = capture_terminal(save=args.save)
+
+    steps = parse_capture(text)
+    if not steps:
+        print("no sweep steps found in the capture", file=sys.stderr)
+        return 1
+    for step in steps:
+        step.check()
+
+    safe = report(steps, args.threshold)
+    if args.table:
+        update_table(args.table, args.host_class, safe, steps)
+        print("updated %s for %s" % (args.table, args.host_class))
+    if safe and max(safe.values()):
+        profile = max(safe, key=lambda p: (safe[p], -PROFILES.index(p)))
+        print("\nto use it: ssh admin@<device_ip> pacing %s %d" % (profile, safe[profile]))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
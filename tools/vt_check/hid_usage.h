@@ -0,0 +1,89 @@
+/*
+ * Host stand-in for TinyUSB's class/hid/hid.h: the keyboard usages and
+ * modifier bits main/vt_input.c uses, with TinyUSB's names and the values
+ * of the USB HID Usage Tables (keyboard page 0x07).
+ */
+#pragma once
+
+#define KEYBOARD_MODIFIER_LEFTCTRL   0x01
+#define KEYBOARD_MODIFIER_LEFTSHIFT  0x02
+#define KEYBOARD_MODIFIER_LEFTALT    0x04
+#define KEYBOARD_MODIFIER_LEFTGUI    0x08
+#define KEYBOARD_MODIFIER_RIGHTCTRL  0x10
+#define KEYBOARD_MODIFIER_RIGHTSHIFT 0x20
+#define KEYBOARD_MODIFIER_RIGHTALT   0x40
+#define KEYBOARD_MODIFIER_RIGHTGUI   0x80
+
+#define HID_KEY_A                 0x04
+#define HID_KEY_1                 0x1E
+#define HID_KEY_2                 0x1F
+#define HID_KEY_3                 0x20
+#define HID_KEY_4                 0x21
+#define HID_KEY_5                 0x22
+#define HID_KEY_6                 0x23
+#define HID_KEY_7                 0x24
+#define HID_KEY_8                 0x25
+#define HID_KEY_9                 0x26
+#define HID_KEY_0                 0x27
+#define HID_KEY_ENTER             0x28
+#define HID_KEY_ESCAPE            0x29
+#define HID_KEY_BACKSPACE         0x2A
+#define HID_KEY_TAB               0x2B
+#define HID_KEY_SPACE             0x2C
+#define HID_KEY_MINUS             0x2D
+#define HID_KEY_EQUAL             0x2E
+#define HID_KEY_BRACKET_LEFT      0x2F
+#define HID_KEY_BRACKET_RIGHT     0x30
+#define HID_KEY_BACKSLASH         0x31
+#define HID_KEY_SEMICOLON         0x33
+#define HID_KEY_APOSTROPHE        0x34
+#define HID_KEY_GRAVE             0x35
+#define HID_KEY_COMMA             0x36
+#define HID_KEY_PERIOD            0x37
+#define HID_KEY_SLASH             0x38
+#define HID_KEY_CAPS_LOCK         0x39
+#define HID_KEY_F1                0x3A
+#define HID_KEY_F2                0x3B
+#define HID_KEY_F3                0x3C
+#define HID_KEY_F4                0x3D
+#define HID_KEY_F5                0x3E
+#define HID_KEY_F6                0x3F
+#define HID_KEY_F7                0x40
+#define HID_KEY_F8                0x41
+#define HID_KEY_F9                0x42
+#define HID_KEY_F10               0x43
+#define HID_KEY_F11               0x44
+#define HID_KEY_F12               0x45
+#define HID_KEY_PRINT_SCREEN      0x46
+#define HID_KEY_SCROLL_LOCK       0x47
+#define HID_KEY_PAUSE             0x48
+#define HID_KEY_INSERT            0x49
+#define HID_KEY_HOME              0x4A
+#define HID_KEY_PAGE_UP           0x4B
+#define HID_KEY_DELETE            0x4C
+#define HID_KEY_END               0x4D
+#define HID_KEY_PAGE_DOWN         0x4E
+#define HID_KEY_ARROW_RIGHT       0x4F
+#define HID_KEY_ARROW_LEFT        0x50
+#define HID_KEY_ARROW_DOWN        0x51
+#define HID_KEY_ARROW_UP          0x52
+#define HID_KEY_NUM_LOCK          0x53
+#define HID_KEY_KEYPAD_DIVIDE     0x54
+#define HID_KEY_KEYPAD_MULTIPLY   0x55
+#define HID_KEY_KEYPAD_SUBTRACT   0x56
+#define HID_KEY_KEYPAD_ADD        0x57
+#define HID_KEY_KEYPAD_ENTER      0x58
+#define HID_KEY_KEYPAD_1          0x59
+#define HID_KEY_KEYPAD_2          0x5A
+#define HID_KEY_KEYPAD_3          0x5B
+#define HID_KEY_KEYPAD_4          0x5C
+#define HID_KEY_KEYPAD_5          0x5D
+#define HID_KEY_KEYPAD_6          0x5E
+#define HID_KEY_KEYPAD_7          0x5F
+#define HID_KEY_KEYPAD_8          0x60
+#define HID_KEY_KEYPAD_9          0x61
+#define HID_KEY_KEYPAD_0          0x62
+#define HID_KEY_KEYPAD_DECIMAL    0x63
+#define HID_KEY_APPLICATION       0x65
+#define HID_KEY_KEYPAD_EQUAL      0x67
+#define HID_KEY_F13               0x68
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Build the terminal input checker for the host and run it over the corpus.
+# Arguments are passed on, e.g. -b 64 to also time 64 MB through the parser.
+#
+#   tools/vt_check/run.sh
+#   tools/vt_check/run.sh -b 64
+set -e
+
+cd "$(dirname "$0")/../.."
+
+mkdir -p build-host
+${CC:-cc} -O2 -std=c11 -D_POSIX_C_SOURCE=200809L -Wall -Wextra -Wno-sign-compare \
+    -I tools/vt_check -I main \
+    main/vt_input.c tools/vt_check/vt_check.c -o build-host/vt_check
+exec build-host/vt_check "$@" tools/vt_check/corpus/*.txt
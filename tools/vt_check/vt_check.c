@@ -0,0 +1,377 @@
+/*
+ * Run the terminal input corpus against main/vt_input.c on the host, and
+ * measure its throughput.
+ *
+ * Each corpus line is the bytes a terminal sends, as a quoted string with C
+ * escapes (\e is ESC), followed by the key events the parser must produce:
+ *
+ *     "\e[1;5C"        C-Right
+ *     "\e[200~ls\r\e[201~"   "ls\r"
+ *     "\e[97;1:3u"     a:release
+ *
+ * Keys are named as in key_names[] below, with C- S- A- G- modifier prefixes
+ * and a :press, :repeat or :release suffix for exact (kitty) events. Quoted
+ * strings stand for one typed character each. A line that ends in a stalled
+ * sequence is flushed as if the input went quiet. In an input string, \p
+ * is a pause: the bytes after it arrive PAUSE_MS later, with no flush in
+ * between, as when input queues up behind a busy keyboard. '!exact' on its
+ * own line switches the rest of the file to a kitty protocol session.
+ *
+ *     tools/vt_check/run.sh                 # check every corpus file
+ *     tools/vt_check/run.sh -b 64           # and time 64 MB through the parser
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hid_usage.h"
+#include "vt_input.h"
+
+#define LINE_MAX_LEN 512
+#define EVENTS_MAX 128
+#define PAUSE_MS 200
+
+static const struct {
+    uint8_t keycode;
+    const char *name;
+} key_names[] = {
+    { HID_KEY_ENTER, "Enter" }, { HID_KEY_ESCAPE, "Esc" }, { HID_KEY_BACKSPACE, "Bs" },
+    { HID_KEY_TAB, "Tab" }, { HID_KEY_SPACE, "Space" }, { HID_KEY_MINUS, "-" },
+    { HID_KEY_EQUAL, "=" }, { HID_KEY_BRACKET_LEFT, "[" }, { HID_KEY_BRACKET_RIGHT, "]" },
+    { HID_KEY_BACKSLASH, "\\" }, { HID_KEY_SEMICOLON, ";" }, { HID_KEY_APOSTROPHE, "'" },
+    { HID_KEY_GRAVE, "`" }, { HID_KEY_COMMA, "," }, { HID_KEY_PERIOD, "." }, { HID_KEY_SLASH, "/" },
+    { HID_KEY_CAPS_LOCK, "CapsLock" }, { HID_KEY_PRINT_SCREEN, "PrintScreen" },
+    { HID_KEY_SCROLL_LOCK, "ScrollLock" }, { HID_KEY_PAUSE, "Pause" }, { HID_KEY_INSERT, "Insert" },
+    { HID_KEY_HOME, "Home" }, { HID_KEY_PAGE_UP, "PgUp" }, { HID_KEY_DELETE, "Delete" },
+    { HID_KEY_END, "End" }, { HID_KEY_PAGE_DOWN, "PgDn" }, { HID_KEY_ARROW_RIGHT, "Right" },
+    { HID_KEY_ARROW_LEFT, "Left" }, { HID_KEY_ARROW_DOWN, "Down" }, { HID_KEY_ARROW_UP, "Up" },
+    { HID_KEY_NUM_LOCK, "NumLock" }, { HID_KEY_KEYPAD_DIVIDE, "KP/" }, { HID_KEY_KEYPAD_MULTIPLY, "KP*" },
+    { HID_KEY_KEYPAD_SUBTRACT, "KP-" }, { HID_KEY_KEYPAD_ADD, "KP+" }, { HID_KEY_KEYPAD_ENTER, "KPEnter" },
+    { HID_KEY_KEYPAD_DECIMAL, "KP." }, { HID_KEY_APPLICATION, "Menu" }, { HID_KEY_KEYPAD_EQUAL, "KP=" },
+};
+
+static const char *mod_key_names[8] = { "LCtrl", "LShift", "LAlt", "LGui", "RCtrl", "RShift", "RAlt", "RGui" };
+static const char mod_prefixes[] = "CSAG";
+static const char *event_suffixes[4] = { "", ":press", ":repeat", ":release" };
+
+static void key_name(uint8_t keycode, char *out, size_t size)
+{
+    if (keycode >= HID_KEY_A && keycode < HID_KEY_A + 26) {
+        snprintf(out, size, "%c", 'a' + keycode - HID_KEY_A);
+    } else if (keycode >= HID_KEY_1 && keycode <= HID_KEY_0) {
+        snprintf(out, size, "%c", keycode == HID_KEY_0 ? '0' : '1' + keycode - HID_KEY_1);
+    } else if (keycode >= HID_KEY_F1 && keycode <= HID_KEY_F12) {
+        snprintf(out, size, "F%d", 1 + keycode - HID_KEY_F1);
+    } else if (keycode >= HID_KEY_F13 && keycode < HID_KEY_F13 + 12) {
+        snprintf(out, size, "F%d", 13 + keycode - HID_KEY_F13);
+    } else if (keycode >= HID_KEY_KEYPAD_1 && keycode <= HID_KEY_KEYPAD_0) {
+        snprintf(out, size, "KP%c", keycode == HID_KEY_KEYPAD_0 ? '0' : '1' + keycode - HID_KEY_KEYPAD_1);
+    } else {
+        snprintf(out, size, "0x%02x", keycode);
+        for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+            if (key_names[i].keycode == keycode) {
+                snprintf(out, size, "%s", key_names[i].name);
+            }
+        }
+    }
+}
+
+static uint8_t key_find(const char *name)
+{
+    char buf[16];
+    for (int keycode = 1; keycode < 0x80; keycode++) {
+        key_name(keycode, buf, sizeof(buf));
+        if (strcmp(buf, name) == 0) {
+            return keycode;
+        }
+    }
+    return 0;
+}
+
+// Canonical text of one event, the form corpus expectations are compared in
+static void event_format(const key_event_t *ev, char *out, size_t size)
+{
+    char name[16];
+    int len = 0;
+
+    if (!ev->keycode && !ev->mod_key) {
+        unsigned char c = ev->c;
+        if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\') {
+            snprintf(out, size, "\"%c\"", c);
+        } else {
+            snprintf(out, size, "\"\\x%02x\"", c);
+        }
+        return;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (ev->modifier & (1 << i)) {
+            len += snprintf(out + len, size - len, "%c-", mod_prefixes[i]);
+        }
+    }
+    if (ev->mod_key) {
+        for (int i = 0; i < 8; i++) {
+            if (ev->mod_key == (1 << i)) {
+                snprintf(name, sizeof(name), "%s", mod_key_names[i]);
+            }
+        }
+    } else {
+        key_name(ev->keycode, name, sizeof(name));
+    }
+    snprintf(out + len, size - len, "%s%s", name, event_suffixes[ev->type & 3]);
+}
+
+// Unescape a quoted corpus string starting at *p; returns its length or -1.
+// With `at`, \p pauses are allowed and at[i] is when byte i arrives.
+static int parse_string(const char **p, char *out, uint32_t *at, int size)
+{
+    const char *s = *p;
+    int len = 0;
+    uint32_t now = 0;
+    if (*s++ != '"') {
+        return -1;
+    }
+    while (*s && *s != '"' && len < size) {
+        char c = *s++;
+        if (c == '\\' && *s == 'p' && at) {
+            s++;
+            now += PAUSE_MS;
+            continue;
+        }
+        if (c == '\\') {
+            c = *s++;
+            switch (c) {
+                case 'e': c = 0x1B; break;
+                case 'r': c = '\r'; break;
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'b': c = '\b'; break;
+                case 'x': c = (char)strtol((char[]){ s[0], s[1], 0 }, NULL, 16); s += 2; break;
+                case '\\': case '"': break;
+                default: return -1;
+            }
+        }
+        if (at) {
+            at[len] = now;
+        }
+        out[len++] = c;
+    }
+    if (*s != '"') {
+        return -1;
+    }
+    *p = s + 1;
+    return len;
+}
+
+// One expected token: a key with prefixes and suffix; returns false if unknown
+static bool parse_key(const char *tok, key_event_t *ev)
+{
+    char name[32];
+    memset(ev, 0, sizeof(*ev));
+    while (strlen(tok) > 2 && tok[1] == '-' && strchr(mod_prefixes, tok[0])) {
+        ev->modifier |= 1 << (strchr(mod_prefixes, tok[0]) - mod_prefixes);
+        tok += 2;
+    }
+    snprintf(name, sizeof(name), "%s", tok);
+    char *colon = strrchr(name, ':');
+    if (colon && colon != name) {
+        for (int i = 1; i < 4; i++) {
+            if (strcmp(colon, event_suffixes[i]) == 0) {
+                ev->type = i;
+                *colon = '\0';
+            }
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        if (strcmp(name, mod_key_names[i]) == 0) {
+            ev->mod_key = 1 << i;
+            return true;
+        }
+    }
+    ev->keycode = key_find(name);
+    return ev->keycode != 0;
+}
+
+// Everything the parser makes of input, including a final flush
+static int run_parser(const char *input, const uint32_t *at, int len, bool exact, key_event_t *events)
+{
+    vt_parser_t parser = { .exact = exact };
+    int n = 0;
+    for (int i = 0; i < len; i++) {
+        key_event_t out[VT_EVENTS_MAX];
+        int count = vt_feed(&parser, input[i], at[i], out);
+        for (int j = 0; j < count && n < EVENTS_MAX; j++) {
+            events[n++] = out[j];
+        }
+    }
+    if (n < EVENTS_MAX) {
+        n += vt_flush(&parser, (len ? at[len - 1] : 0) + VT_ESC_TIMEOUT_MS, &events[n]);
+    }
+    return n;
+}
+
+typedef struct {
+    int lines;
+    int failed;
+    char *bench;            // All corpus inputs, for the benchmark
+    size_t bench_len;
+    size_t bench_cap;
+} corpus_t;
+
+static void bench_append(corpus_t *corpus, const char *input, int len)
+{
+    if (corpus->bench_len + len > corpus->bench_cap) {
+        corpus->bench_cap = (corpus->bench_cap + len) * 2;
+        corpus->bench = realloc(corpus->bench, corpus->bench_cap);
+    }
+    memcpy(corpus->bench + corpus->bench_len, input, len);
+    corpus->bench_len += len;
+}
+
+static bool check_line(corpus_t *corpus, const char *path, int lineno, const char *line, bool exact)
+{
+    char input[LINE_MAX_LEN];
+    uint32_t at[LINE_MAX_LEN];
+    const char *p = line;
+    int len = parse_string(&p, input, at, sizeof(input));
+    if (len < 0) {
+        fprintf(stderr, "%s:%d: bad input string\n", path, lineno);
+        return false;
+    }
+
+    // Expected events, in canonical form
+    char expected[LINE_MAX_LEN * 2] = "";
+    while (*p) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (!*p || *p == '#') {
+            break;
+        }
+        char text[LINE_MAX_LEN], formatted[48];
+        key_event_t ev;
+        if (*p == '"') {
+            int text_len = parse_string(&p, text, NULL, sizeof(text));
+            if (text_len < 0) {
+                fprintf(stderr, "%s:%d: bad expected string\n", path, lineno);
+                return false;
+            }
+            for (int i = 0; i < text_len; i++) {
+                memset(&ev, 0, sizeof(ev));
+                ev.c = text[i];
+                event_format(&ev, formatted, sizeof(formatted));
+                strcat(strcat(expected, " "), formatted);
+            }
+            continue;
+        }
+        size_t tok_len = strcspn(p, " \t");
+        snprintf(text, sizeof(text), "%.*s", (int)tok_len, p);
+        p += tok_len;
+        if (!parse_key(text, &ev)) {
+            fprintf(stderr, "%s:%d: unknown key '%s'\n", path, lineno, text);
+            return false;
+        }
+        event_format(&ev, formatted, sizeof(formatted));
+        strcat(strcat(expected, " "), formatted);
+    }
+
+    key_event_t events[EVENTS_MAX];
+    int n = run_parser(input, at, len, exact, events);
+    char got[LINE_MAX_LEN * 2] = "";
+    for (int i = 0; i < n; i++) {
+        char formatted[48];
+        event_format(&events[i], formatted, sizeof(formatted));
+        strcat(strcat(got, " "), formatted);
+    }
+
+    corpus->lines++;
+    bench_append(corpus, input, len);
+    if (strcmp(expected, got) != 0) {
+        corpus->failed++;
+        printf("%s:%d: %s\n    expected:%s\n    got:     %s\n", path, lineno, line, expected, got);
+        return false;
+    }
+    return true;
+}
+
+static int check_file(corpus_t *corpus, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char line[LINE_MAX_LEN];
+    int lineno = 0, failed = corpus->failed, lines = corpus->lines;
+    bool exact = false;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *p = line + strspn(line, " \t");
+        if (strcmp(p, "!exact") == 0) {
+            exact = true;
+        } else if (*p == '"') {
+            check_line(corpus, path, lineno, p, exact);
+        } else if (*p && *p != '#') {
+            fprintf(stderr, "%s:%d: expected a quoted input string\n", path, lineno);
+            corpus->failed++;
+        }
+    }
+    fclose(f);
+    printf("%-44s %4d sequences, %d failed\n", path, corpus->lines - lines, corpus->failed - failed);
+    return 0;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Feed the whole corpus through one parser until `megabytes` have gone through
+static void bench(const corpus_t *corpus, double megabytes)
+{
+    size_t total = (size_t)(megabytes * 1024 * 1024);
+    size_t fed = 0, events = 0;
+    vt_parser_t parser = { 0 };
+    key_event_t out[VT_EVENTS_MAX];
+
+    double start = now_s();
+    while (fed < total) {
+        for (size_t i = 0; i < corpus->bench_len; i++) {
+            events += vt_feed(&parser, corpus->bench[i], 0, out);
+        }
+        fed += corpus->bench_len;
+    }
+    double elapsed = now_s() - start;
+    printf("bench: %zu bytes in %.3f s: %.1f MB/s, %.1f ns/byte, %.1f M events/s\n",
+           fed, elapsed, fed / elapsed / (1024 * 1024), elapsed * 1e9 / fed, events / elapsed / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    corpus_t corpus = { 0 };
+    double bench_mb = 0;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-b") == 0) {
+        bench_mb = atof(argv[2]);
+        first = 3;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: %s [-b megabytes] corpus.txt...\n", argv[0]);
+        return 2;
+    }
+    for (int i = first; i < argc; i++) {
+        if (check_file(&corpus, argv[i]) < 0) {
+            return 2;
+        }
+    }
+    printf("%d sequences, %d failed\n", corpus.lines, corpus.failed);
+    if (bench_mb > 0 && corpus.bench_len > 0) {
+        bench(&corpus, bench_mb);
+    }
+    free(corpus.bench);
+    return corpus.failed ? 1 : 0;
+}